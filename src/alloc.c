@@ -0,0 +1,510 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdalign.h>
+#include <threads.h>
+#include "alloc.h"
+#include "error.h"
+
+/// Round `size` up to the next multiple of the strictest fundamental
+/// alignment, so that headers never misalign the memory that follows them.
+static uptr align_up(uptr size) {
+    uptr a = alignof(max_align_t);
+    return (size + a - 1) & ~(a - 1);
+}
+
+// System allocator
+
+static void *system_allocate(Allocator *self, uptr size, const char *site) {
+    (void) self;
+    void *ptr = calloc(1, size ? size : 1);
+    if (ptr == NULL) {
+        error("out of memory allocating %lu bytes at %s\n", size, site);
+    }
+    return ptr;
+}
+
+static void *system_reallocate(Allocator *self, void *ptr, uptr size,
+                               const char *site) {
+    (void) self;
+    void *new_ptr = realloc(ptr, size ? size : 1);
+    if (new_ptr == NULL) {
+        error("out of memory allocating %lu bytes at %s\n", size, site);
+    }
+    return new_ptr;
+}
+
+static void system_deallocate(Allocator *self, void *ptr, const char *site) {
+    (void) self;
+    (void) site;
+    free(ptr);
+}
+
+Allocator *system_allocator = &(Allocator) {
+    .name = "system",
+    .phase = NULL,
+    .allocate = system_allocate,
+    .reallocate = system_reallocate,
+    .deallocate = system_deallocate,
+    .destroy = NULL,
+};
+
+const char *Allocator_set_phase(Allocator *self, const char *phase) {
+    const char *previous = self->phase;
+    self->phase = phase;
+    return previous;
+}
+
+void *Allocator_grow(Allocator *self, void *items, uptr count, uptr *capacity,
+                     uptr size, const char *site) {
+    if (count < *capacity) {
+        return items;
+    }
+    uptr old_capacity = *capacity;
+    *capacity = old_capacity ? old_capacity * 2 : 16;
+    items = Allocator_realloc(self, items, *capacity * size, site);
+    memset((u8 *) items + old_capacity * size, 0,
+           (*capacity - old_capacity) * size);
+    return items;
+}
+
+void Allocator_destroy(Allocator *self) {
+    if (self->destroy) {
+        self->destroy(self);
+    }
+}
+
+// Arena allocator
+
+/// The default size of an arena block.
+static const uptr ARENA_BLOCK_SIZE = 64 * 1024;
+
+typedef struct ArenaBlock ArenaBlock;
+/// A block of memory that arena allocations are carved from.
+struct ArenaBlock {
+    /// The previously filled block, if any.
+    ArenaBlock *prev;
+    /// The number of usable bytes in the block.
+    uptr capacity;
+    /// The number of bytes already handed out.
+    uptr used;
+    /// The usable memory.
+    alignas(max_align_t) unsigned char data[];
+};
+
+/// Every arena allocation is preceded by its size, so that it can be resized.
+typedef struct ArenaHeader {
+    alignas(max_align_t) uptr size;
+} ArenaHeader;
+
+typedef struct ArenaAllocator {
+    Allocator base;
+    /// The allocator that blocks are requested from.
+    Allocator *parent;
+    /// The block currently being filled.
+    ArenaBlock *current;
+    /// The default block size.
+    uptr block_size;
+} ArenaAllocator;
+
+static ArenaBlock *arena_new_block(ArenaAllocator *arena, uptr at_least,
+                                   const char *site) {
+    uptr capacity = arena->block_size;
+    if (capacity < at_least) {
+        capacity = at_least;
+    }
+    ArenaBlock *block = Allocator_alloc(arena->parent,
+                                        sizeof(ArenaBlock) + capacity, site);
+    block->prev = arena->current;
+    block->capacity = capacity;
+    block->used = 0;
+    arena->current = block;
+    return block;
+}
+
+static void *arena_allocate(Allocator *self, uptr size, const char *site) {
+    ArenaAllocator *arena = (ArenaAllocator *) self;
+    uptr needed = sizeof(ArenaHeader) + align_up(size);
+    ArenaBlock *block = arena->current;
+    if (block == NULL || block->capacity - block->used < needed) {
+        block = arena_new_block(arena, needed, site);
+    }
+
+    ArenaHeader *header = (ArenaHeader *) &block->data[block->used];
+    block->used += needed;
+    header->size = size;
+    // Blocks are zeroed when they are created, and memory is never reused.
+    return header + 1;
+}
+
+static void *arena_reallocate(Allocator *self, void *ptr, uptr size,
+                              const char *site) {
+    if (ptr == NULL) {
+        return arena_allocate(self, size, site);
+    }
+
+    ArenaAllocator *arena = (ArenaAllocator *) self;
+    ArenaHeader *header = (ArenaHeader *) ptr - 1;
+    ArenaBlock *block = arena->current;
+    uptr old_size = header->size;
+
+    // The most recent allocation can be grown or shrunk in place.
+    unsigned char *end = (unsigned char *) ptr + align_up(old_size);
+    if (end == &block->data[block->used]) {
+        uptr start = (unsigned char *) ptr - block->data;
+        if (start + align_up(size) <= block->capacity) {
+            block->used = start + align_up(size);
+            if (size > old_size) {
+                memset((unsigned char *) ptr + old_size, 0, size - old_size);
+            }
+            header->size = size;
+            return ptr;
+        }
+    }
+
+    if (size <= old_size) {
+        header->size = size;
+        return ptr;
+    }
+
+    void *new_ptr = arena_allocate(self, size, site);
+    memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+static void arena_deallocate(Allocator *self, void *ptr, const char *site) {
+    (void) self;
+    (void) ptr;
+    (void) site;
+    // Arena memory is only released when the whole arena is destroyed.
+}
+
+static void arena_destroy(Allocator *self) {
+    ArenaAllocator *arena = (ArenaAllocator *) self;
+    ArenaBlock *block = arena->current;
+    while (block != NULL) {
+        ArenaBlock *prev = block->prev;
+        FREE(arena->parent, block);
+        block = prev;
+    }
+    FREE(arena->parent, arena);
+}
+
+Allocator *ArenaAllocator_new(Allocator *parent, uptr block_size) {
+    ArenaAllocator *arena = ALLOC(parent, sizeof(ArenaAllocator));
+    arena->base = (Allocator) {
+        .name = "arena",
+        .phase = NULL,
+        .allocate = arena_allocate,
+        .reallocate = arena_reallocate,
+        .deallocate = arena_deallocate,
+        .destroy = arena_destroy,
+    };
+    arena->parent = parent;
+    arena->current = NULL;
+    arena->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+    return &arena->base;
+}
+
+// Debug allocator
+
+/// Marks a live debug allocation, to catch double and foreign frees.
+static const u64 DEBUG_LIVE = 0x4c494d424f4c4956;
+/// Marks a freed debug allocation.
+static const u64 DEBUG_DEAD = 0x4c494d424f444544;
+
+/// Accounting for a single call-site within a single phase.
+typedef struct SiteStats {
+    /// The call-site, or `NULL` if this slot is empty.
+    const char *site;
+    /// The phase that was current when the allocations were made.
+    const char *phase;
+    /// The number of allocations and reallocations.
+    uptr calls;
+    /// The total number of bytes requested.
+    uptr bytes;
+    /// The number of frees.
+    uptr frees;
+} SiteStats;
+
+typedef struct DebugHeader DebugHeader;
+/// Every debug allocation is preceded by a header that links it into the
+/// list of live allocations.
+struct DebugHeader {
+    DebugHeader *prev, *next;
+    u64 magic;
+    uptr size;
+    const char *site;
+    const char *phase;
+};
+
+typedef struct DebugAllocator {
+    Allocator base;
+    /// The allocator that allocations are forwarded to.
+    Allocator *parent;
+    /// Guards everything below.
+    mtx_t lock;
+    /// Sentinel of the circular list of live allocations.
+    DebugHeader live;
+    /// Open-addressing table of per call-site accounting.
+    SiteStats *stats;
+    uptr stats_capacity;
+    uptr stats_count;
+    /// Totals across all call-sites.
+    uptr total_calls, total_bytes, live_bytes, peak_bytes;
+} DebugAllocator;
+
+static uptr hash_site(const char *site, const char *phase) {
+    // Call-sites and phases are string literals, so their addresses are
+    // stable and can be hashed directly.
+    uptr h = (uptr) site * 0x9e3779b97f4a7c15u;
+    h ^= (uptr) phase + 0x7f4a7c15u + (h << 6) + (h >> 2);
+    return h;
+}
+
+static SiteStats *debug_find_stats(DebugAllocator *debug, const char *site,
+                                   const char *phase);
+
+static void debug_grow_stats(DebugAllocator *debug) {
+    SiteStats *old = debug->stats;
+    uptr old_capacity = debug->stats_capacity;
+
+    debug->stats_capacity = old_capacity ? old_capacity * 2 : 64;
+    debug->stats = ALLOC(debug->parent,
+                         debug->stats_capacity * sizeof(SiteStats));
+    debug->stats_count = 0;
+
+    for (uptr i = 0; i < old_capacity; i++) {
+        if (old[i].site) {
+            *debug_find_stats(debug, old[i].site, old[i].phase) = old[i];
+        }
+    }
+    FREE(debug->parent, old);
+}
+
+static SiteStats *debug_find_stats(DebugAllocator *debug, const char *site,
+                                   const char *phase) {
+    if ((debug->stats_count + 1) * 4 > debug->stats_capacity * 3) {
+        debug_grow_stats(debug);
+    }
+
+    uptr mask = debug->stats_capacity - 1;
+    uptr i = hash_site(site, phase) & mask;
+    while (debug->stats[i].site != NULL) {
+        if (debug->stats[i].site == site && debug->stats[i].phase == phase) {
+            return &debug->stats[i];
+        }
+        i = (i + 1) & mask;
+    }
+
+    debug->stats_count++;
+    debug->stats[i].site = site;
+    debug->stats[i].phase = phase;
+    return &debug->stats[i];
+}
+
+static void debug_link(DebugAllocator *debug, DebugHeader *header) {
+    header->prev = &debug->live;
+    header->next = debug->live.next;
+    debug->live.next->prev = header;
+    debug->live.next = header;
+}
+
+static void debug_unlink(DebugHeader *header) {
+    header->prev->next = header->next;
+    header->next->prev = header->prev;
+}
+
+static DebugHeader *debug_header(void *ptr, const char *site) {
+    DebugHeader *header = (DebugHeader *)
+            ((unsigned char *) ptr - align_up(sizeof(DebugHeader)));
+    if (header->magic == DEBUG_DEAD) {
+        error("double free at %s of memory allocated at %s\n",
+              site, header->site);
+    }
+    if (header->magic != DEBUG_LIVE) {
+        error("free at %s of memory not allocated by the debug allocator\n",
+              site);
+    }
+    return header;
+}
+
+static void debug_account(DebugAllocator *debug, DebugHeader *header,
+                          uptr size, const char *site) {
+    SiteStats *stats = debug_find_stats(debug, site, debug->base.phase);
+    stats->calls++;
+    stats->bytes += size;
+
+    debug->total_calls++;
+    debug->total_bytes += size;
+    debug->live_bytes += size;
+    if (debug->live_bytes > debug->peak_bytes) {
+        debug->peak_bytes = debug->live_bytes;
+    }
+
+    header->magic = DEBUG_LIVE;
+    header->size = size;
+    header->site = site;
+    header->phase = debug->base.phase;
+}
+
+static void *debug_allocate(Allocator *self, uptr size, const char *site) {
+    DebugAllocator *debug = (DebugAllocator *) self;
+    DebugHeader *header = Allocator_alloc(
+            debug->parent, align_up(sizeof(DebugHeader)) + size, site);
+
+    mtx_lock(&debug->lock);
+    debug_account(debug, header, size, site);
+    debug_link(debug, header);
+    mtx_unlock(&debug->lock);
+
+    return (unsigned char *) header + align_up(sizeof(DebugHeader));
+}
+
+static void *debug_reallocate(Allocator *self, void *ptr, uptr size,
+                              const char *site) {
+    if (ptr == NULL) {
+        return debug_allocate(self, size, site);
+    }
+
+    DebugAllocator *debug = (DebugAllocator *) self;
+    DebugHeader *header = debug_header(ptr, site);
+
+    mtx_lock(&debug->lock);
+    debug_unlink(header);
+    debug->live_bytes -= header->size;
+    mtx_unlock(&debug->lock);
+
+    header = Allocator_realloc(debug->parent, header,
+                               align_up(sizeof(DebugHeader)) + size, site);
+
+    mtx_lock(&debug->lock);
+    debug_account(debug, header, size, site);
+    debug_link(debug, header);
+    mtx_unlock(&debug->lock);
+
+    return (unsigned char *) header + align_up(sizeof(DebugHeader));
+}
+
+static void debug_deallocate(Allocator *self, void *ptr, const char *site) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    DebugAllocator *debug = (DebugAllocator *) self;
+    DebugHeader *header = debug_header(ptr, site);
+
+    mtx_lock(&debug->lock);
+    debug_unlink(header);
+    debug->live_bytes -= header->size;
+    debug_find_stats(debug, header->site, header->phase)->frees++;
+    header->magic = DEBUG_DEAD;
+    mtx_unlock(&debug->lock);
+
+    Allocator_free(debug->parent, header, site);
+}
+
+static void debug_destroy(Allocator *self) {
+    DebugAllocator *debug = (DebugAllocator *) self;
+    // Leaked allocations are released along with the allocator, so that
+    // reporting a leak does not also leak from the parent.
+    DebugHeader *header = debug->live.next;
+    while (header != &debug->live) {
+        DebugHeader *next = header->next;
+        FREE(debug->parent, header);
+        header = next;
+    }
+    mtx_destroy(&debug->lock);
+    FREE(debug->parent, debug->stats);
+    FREE(debug->parent, debug);
+}
+
+Allocator *DebugAllocator_new(Allocator *parent) {
+    DebugAllocator *debug = ALLOC(parent, sizeof(DebugAllocator));
+    debug->base = (Allocator) {
+        .name = "debug",
+        .phase = NULL,
+        .allocate = debug_allocate,
+        .reallocate = debug_reallocate,
+        .deallocate = debug_deallocate,
+        .destroy = debug_destroy,
+    };
+    debug->parent = parent;
+    if (mtx_init(&debug->lock, mtx_plain) != thrd_success) {
+        error("internal compiler error: could not create debug allocator lock\n");
+    }
+    debug->live.prev = debug->live.next = &debug->live;
+    return &debug->base;
+}
+
+/// Strip the directory from a call-site, to keep reports readable.
+static const char *site_basename(const char *site) {
+    const char *slash = strrchr(site, '/');
+    return slash ? slash + 1 : site;
+}
+
+/// Order site statistics by phase, then by bytes requested.
+static int compare_stats(const void *a, const void *b) {
+    const SiteStats *x = a, *y = b;
+    const char *px = x->phase ? x->phase : "", *py = y->phase ? y->phase : "";
+    int by_phase = strcmp(px, py);
+    if (by_phase != 0) {
+        return by_phase;
+    }
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+uptr DebugAllocator_report(Allocator *self, FILE *out) {
+    DebugAllocator *debug = (DebugAllocator *) self;
+    mtx_lock(&debug->lock);
+
+    // Compact the table so it can be sorted.
+    SiteStats *sorted = ALLOC(debug->parent,
+                              (debug->stats_count + 1) * sizeof(SiteStats));
+    uptr n = 0;
+    for (uptr i = 0; i < debug->stats_capacity; i++) {
+        if (debug->stats[i].site) {
+            sorted[n++] = debug->stats[i];
+        }
+    }
+    qsort(sorted, n, sizeof(SiteStats), compare_stats);
+
+    fprintf(out, "%-10s %-20s %10s %12s %10s\n",
+            "phase", "site", "calls", "bytes", "frees");
+    for (uptr i = 0; i < n; i++) {
+        fprintf(out, "%-10s %-20s %10lu %12lu %10lu\n",
+                sorted[i].phase ? sorted[i].phase : "-",
+                site_basename(sorted[i].site),
+                sorted[i].calls, sorted[i].bytes, sorted[i].frees);
+    }
+    fprintf(out, "total: %lu calls, %lu bytes, peak %lu bytes live\n",
+            debug->total_calls, debug->total_bytes, debug->peak_bytes);
+    FREE(debug->parent, sorted);
+
+    uptr leaks = 0;
+    for (DebugHeader *h = debug->live.next; h != &debug->live; h = h->next) {
+        fprintf(out, "leak: %lu bytes allocated at %s (phase %s)\n",
+                h->size, site_basename(h->site), h->phase ? h->phase : "-");
+        leaks++;
+    }
+    if (leaks) {
+        fprintf(out, "%lu allocations (%lu bytes) leaked\n",
+                leaks, debug->live_bytes);
+    }
+
+    mtx_unlock(&debug->lock);
+    return leaks;
+}
+
+Allocator *Allocator_from_name(const char *name) {
+    if (strcmp(name, "system") == 0) {
+        return system_allocator;
+    }
+    if (strcmp(name, "arena") == 0) {
+        return ArenaAllocator_new(system_allocator, 0);
+    }
+    if (strcmp(name, "debug") == 0) {
+        return DebugAllocator_new(system_allocator);
+    }
+    return NULL;
+}
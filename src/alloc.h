@@ -0,0 +1,127 @@
+#ifndef LIMBO_ALLOC_H
+#define LIMBO_ALLOC_H
+
+#include <stdio.h>
+#include "num.h"
+
+#define ALLOC_STRINGIFY_(x) #x
+#define ALLOC_STRINGIFY(x) ALLOC_STRINGIFY_(x)
+
+/// The call-site string attached to every allocation made through the
+/// `ALLOC`, `REALLOC` and `FREE` macros.
+#define ALLOC_SITE __FILE__ ":" ALLOC_STRINGIFY(__LINE__)
+
+/// Allocate `size` zeroed bytes from the allocator `a`.
+#define ALLOC(a, size) Allocator_alloc((a), (size), ALLOC_SITE)
+/// Resize the allocation `ptr` made by the allocator `a` to `size` bytes.
+#define REALLOC(a, ptr, size) Allocator_realloc((a), (ptr), (size), ALLOC_SITE)
+/// Release the allocation `ptr` made by the allocator `a`.
+#define FREE(a, ptr) Allocator_free((a), (ptr), ALLOC_SITE)
+/// Make room for one more element at index `count` of the growable array
+/// `items`, whose capacity is the lvalue `capacity`.
+#define GROW(a, items, count, capacity) \
+    ((items) = Allocator_grow((a), (items), (count), &(capacity), \
+                              sizeof(*(items)), ALLOC_SITE))
+
+typedef struct Allocator Allocator;
+
+/// The interface implemented by every allocator backend.
+/// Backends embed this struct as their first member, so a pointer to the
+/// backend can be used wherever an `Allocator *` is expected.
+struct Allocator {
+    /// The name of the backend, e.g. `"system"`.
+    const char *name;
+    /// The compiler phase that allocations are currently attributed to.
+    /// \see Allocator_set_phase
+    const char *phase;
+    /// Allocate `size` zeroed bytes.
+    /// \remark Backends exit the program if the allocation cannot be made.
+    void *(*allocate)(Allocator *self, uptr size, const char *site);
+    /// Resize an allocation, preserving its contents.
+    /// \remark If `ptr` is `NULL`, then this behaves like `allocate`.
+    void *(*reallocate)(Allocator *self, void *ptr, uptr size,
+                        const char *site);
+    /// Release an allocation.
+    /// \remark If `ptr` is `NULL`, then this does nothing.
+    void (*deallocate)(Allocator *self, void *ptr, const char *site);
+    /// Release the allocator itself, and anything it still owns.
+    /// \remark May be `NULL` for allocators with static lifetime.
+    void (*destroy)(Allocator *self);
+};
+
+/// The allocator backed by the C library `calloc`, `realloc` and `free`.
+/// \remark This allocator is safe to use from multiple threads.
+extern Allocator *system_allocator;
+
+static inline void *Allocator_alloc(Allocator *self, uptr size,
+                                    const char *site) {
+    return self->allocate(self, size, site);
+}
+
+static inline void *Allocator_realloc(Allocator *self, void *ptr, uptr size,
+                                      const char *site) {
+    return self->reallocate(self, ptr, size, site);
+}
+
+static inline void Allocator_free(Allocator *self, void *ptr,
+                                  const char *site) {
+    self->deallocate(self, ptr, site);
+}
+
+/// Make room for one more element in a growable array, doubling its
+/// capacity when it is full. New elements are zeroed.
+/// \param self The allocator the array was allocated from.
+/// \param items The array, or `NULL`.
+/// \param count The number of elements in use.
+/// \param capacity The capacity of the array; updated if it grows.
+/// \param size The size of an element.
+/// \param site The call site, for allocators that track them.
+/// \return The array, which may have moved.
+/// \see GROW
+void *Allocator_grow(Allocator *self, void *items, uptr count, uptr *capacity,
+                     uptr size, const char *site);
+
+/// Attribute subsequent allocations to a compiler phase.
+/// \param self The allocator.
+/// \param phase The name of the phase, e.g. `"lex"`.
+/// \return The previous phase, so that it can be restored.
+const char *Allocator_set_phase(Allocator *self, const char *phase);
+
+/// Release an allocator created by one of the `_new` functions.
+/// \param self The allocator to release.
+/// \remark Destroying an arena releases every allocation made from it.
+void Allocator_destroy(Allocator *self);
+
+/// Create an arena allocator.
+/// Allocations are carved out of large blocks, and individual frees are
+/// ignored; everything is released at once when the arena is destroyed.
+/// \param parent The allocator that blocks are requested from.
+/// \param block_size The size of each block, or 0 for the default.
+/// \return The new allocator.
+/// \remark Arenas are not safe to share between threads.
+Allocator *ArenaAllocator_new(Allocator *parent, uptr block_size);
+
+/// Create a debug allocator.
+/// Every allocation is forwarded to `parent`, and the number of calls and
+/// bytes are accounted to the call-site and phase that requested them.
+/// Allocations that are still live are reported as leaks.
+/// \param parent The allocator that allocations are forwarded to.
+/// \return The new allocator.
+/// \remark This allocator is safe to use from multiple threads.
+/// \see DebugAllocator_report
+Allocator *DebugAllocator_new(Allocator *parent);
+
+/// Print the per call-site accounting of a debug allocator, followed by
+/// every allocation that has not yet been freed.
+/// \param self The debug allocator.
+/// \param out The stream to print to.
+/// \return The number of leaked allocations.
+uptr DebugAllocator_report(Allocator *self, FILE *out);
+
+/// Create an allocator from the name of its backend.
+/// \param name One of `"system"`, `"arena"` or `"debug"`.
+/// \return The new allocator, or `NULL` if the name is not recognised.
+/// \remark The returned allocator must be released with `Allocator_destroy`.
+Allocator *Allocator_from_name(const char *name);
+
+#endif //LIMBO_ALLOC_H
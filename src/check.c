@@ -0,0 +1,777 @@
+#include <stdatomic.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include "check.h"
+
+/// The type given to expressions that failed to check, so that one mistake
+/// is not reported again by every enclosing expression.
+static Type *type_error = &(Type) {
+    .kind = TError,
+};
+
+/// The state used while checking a single function.
+typedef struct Checker {
+    /// The table to intern composite types in.
+    TypeTable *types;
+    /// The list to record errors in.
+    Diagnostics *diagnostics;
+    /// The return type of the function being checked.
+    Type *return_type;
+} Checker;
+
+static Type *check_expr(Checker *checker, Node *node);
+static void check_stmt(Checker *checker, Node *node);
+
+static bool is_integral(const Type *type) {
+    return type->kind == TInt || type->kind == TBig || type->kind == TByte;
+}
+
+static bool is_numeric(const Type *type) {
+    return is_integral(type) || type->kind == TReal;
+}
+
+/// Check an expression that must have a particular type.
+/// \return The type of the expression.
+static Type *expect(Checker *checker, Node *node, Type *type,
+                    const char *what) {
+    Type *actual = check_expr(checker, node);
+    if (actual != type_error && type != type_error
+        && !Type_assignable(type, actual)) {
+        diag_error(checker->diagnostics, node->token,
+                   "%s must be %s, not %s", what,
+                   Type_describe(type), Type_describe(actual));
+    }
+    return actual;
+}
+
+/// Check the condition of a control flow statement.
+static void check_cond(Checker *checker, Node *node) {
+    if (node != NULL) {
+        expect(checker, node, type_int, "condition");
+    }
+}
+
+/// Whether an expression denotes a location that can be assigned to.
+static bool is_lvalue(const Node *node) {
+    switch (node->kind) {
+        case NODE_IDENTIFIER:
+            return node->decl == NULL || node->decl->kind == DECL_VAR;
+        case NODE_INDEX:
+        case NODE_DOT:
+        case NODE_NIL: // nil discards a value in a tuple assignment
+            return true;
+        case NODE_TUPLE:
+            for (const Node *elem = node->body; elem; elem = elem->next) {
+                if (!is_lvalue(elem)) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Check the operands of a binary operator, which must have the same type.
+/// \return The type of the operands, or `type_error`.
+static Type *check_operands(Checker *checker, Node *node) {
+    Type *left = check_expr(checker, node->left);
+    Type *right = check_expr(checker, node->right);
+    if (left == type_error || right == type_error) {
+        return type_error;
+    }
+    if (left != right && !Type_assignable(left, right)
+        && !Type_assignable(right, left)) {
+        diag_error(checker->diagnostics, node->token,
+                   "operands have different types, %s and %s",
+                   Type_describe(left), Type_describe(right));
+        return type_error;
+    }
+    return left == type_nil ? right : left;
+}
+
+/// Check an arithmetic or bitwise operator.
+/// \param operand The type of the operands, or `type_error`.
+/// \param op The node of the operator, for diagnostics.
+/// \param kind The operator, stripped of any assignment.
+/// \return The type of the result.
+static Type *check_arith(Checker *checker, Node *op, Type *operand,
+                         NodeKind kind) {
+    if (operand == type_error) {
+        return type_error;
+    }
+    bool ok;
+    switch (kind) {
+        case NODE_ADD:
+            ok = is_numeric(operand) || operand->kind == TString;
+            break;
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_EXP:
+            ok = is_numeric(operand);
+            break;
+        default:
+            ok = is_integral(operand);
+            break;
+    }
+    if (!ok) {
+        diag_error(checker->diagnostics, op->token,
+                   "operator cannot be applied to %s",
+                   Type_describe(operand));
+        return type_error;
+    }
+    return operand;
+}
+
+/// The arithmetic operator that a compound assignment applies.
+static NodeKind assignment_operator(NodeKind kind) {
+    switch (kind) {
+        case NODE_ASSIGN_ADD: return NODE_ADD;
+        case NODE_ASSIGN_SUB: return NODE_SUB;
+        case NODE_ASSIGN_MUL: return NODE_MUL;
+        case NODE_ASSIGN_DIV: return NODE_DIV;
+        case NODE_ASSIGN_MOD: return NODE_MOD;
+        case NODE_ASSIGN_BIT_AND: return NODE_BIT_AND;
+        case NODE_ASSIGN_BIT_OR: return NODE_BIT_OR;
+        case NODE_ASSIGN_BIT_XOR: return NODE_BIT_XOR;
+        case NODE_ASSIGN_SHL: return NODE_SHL;
+        case NODE_ASSIGN_SHR: return NODE_SHR;
+        default: return NODE_NOP;
+    }
+}
+
+/// Check the arguments of a call against the parameters of the callee.
+static Type *check_call(Checker *checker, Node *node) {
+    Type *callee = check_expr(checker, node->left);
+    uptr n_args = 0;
+    for (Node *arg = node->right; arg; arg = arg->next) {
+        n_args++;
+    }
+    if (callee == type_error) {
+        for (Node *arg = node->right; arg; arg = arg->next) {
+            check_expr(checker, arg);
+        }
+        return type_error;
+    }
+    if (callee->kind != TFn) {
+        diag_error(checker->diagnostics, node->token,
+                   "cannot call a value of type %s", Type_describe(callee));
+        return type_error;
+    }
+    if (n_args != callee->n_params) {
+        diag_error(checker->diagnostics, node->token,
+                   "expected %lu arguments, but got %lu",
+                   callee->n_params, n_args);
+    }
+
+    uptr i = 0;
+    for (Node *arg = node->right; arg; arg = arg->next, i++) {
+        if (i < callee->n_params) {
+            expect(checker, arg, callee->params[i], "argument");
+        } else {
+            check_expr(checker, arg);
+        }
+    }
+    return callee->return_type ? callee->return_type : type_none;
+}
+
+static Type *check_literal(Checker *checker, Node *node) {
+    (void) checker;
+    // Literals synthesised by later passes carry their own type.
+    if (node->type != NULL) {
+        return node->type;
+    }
+    switch (node->kind) {
+        case NODE_INTEGRAL:
+            if (node->int_value > INT32_MAX || node->int_value < INT32_MIN) {
+                return type_big;
+            }
+            return type_int;
+        case NODE_REAL:
+            return type_real;
+        case NODE_STRING:
+            return type_string;
+        default:
+            return type_nil;
+    }
+}
+
+static Type *check_expr_kind(Checker *checker, Node *node) {
+    Type *left, *right;
+    switch (node->kind) {
+        case NODE_INTEGRAL:
+        case NODE_REAL:
+        case NODE_STRING:
+        case NODE_NIL:
+            return check_literal(checker, node);
+
+        case NODE_IDENTIFIER:
+            if (node->decl == NULL) {
+                diag_error(checker->diagnostics, node->token,
+                           "unresolved name");
+                return type_error;
+            }
+            if (node->decl->type == NULL) {
+                diag_error(checker->diagnostics, node->token,
+                           "name used before its type is known");
+                return type_error;
+            }
+            return node->decl->type;
+
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_MOD:
+        case NODE_EXP:
+        case NODE_BIT_AND:
+        case NODE_BIT_OR:
+        case NODE_BIT_XOR:
+            return check_arith(checker, node, check_operands(checker, node),
+                               node->kind);
+
+        case NODE_SHL:
+        case NODE_SHR:
+            left = check_expr(checker, node->left);
+            expect(checker, node->right, type_int, "shift count");
+            return check_arith(checker, node, left, node->kind);
+
+        case NODE_EQ:
+        case NODE_NEQ:
+            check_operands(checker, node);
+            return type_int;
+
+        case NODE_LT:
+        case NODE_GT:
+        case NODE_LTE:
+        case NODE_GTE:
+            left = check_operands(checker, node);
+            if (left != type_error && !is_numeric(left)
+                && left->kind != TString) {
+                diag_error(checker->diagnostics, node->token,
+                           "%s values cannot be ordered", Type_describe(left));
+            }
+            return type_int;
+
+        case NODE_AND:
+        case NODE_OR:
+            expect(checker, node->left, type_int, "operand");
+            expect(checker, node->right, type_int, "operand");
+            return type_int;
+
+        case NODE_NOT:
+            expect(checker, node->left, type_int, "operand");
+            return type_int;
+
+        case NODE_NEG:
+            left = check_expr(checker, node->left);
+            return check_arith(checker, node, left, NODE_SUB);
+
+        case NODE_BIT_NOT:
+            left = check_expr(checker, node->left);
+            return check_arith(checker, node, left, NODE_BIT_XOR);
+
+        case NODE_INC:
+        case NODE_DEC:
+            left = check_expr(checker, node->left);
+            if (!is_lvalue(node->left)) {
+                diag_error(checker->diagnostics, node->token,
+                           "operand cannot be assigned to");
+            }
+            return check_arith(checker, node, left, NODE_SUB);
+
+        case NODE_ASSIGN:
+            left = check_expr(checker, node->left);
+            if (!is_lvalue(node->left)) {
+                diag_error(checker->diagnostics, node->token,
+                           "left side cannot be assigned to");
+            }
+            expect(checker, node->right, left, "assigned value");
+            return left;
+
+        case NODE_ASSIGN_ADD:
+        case NODE_ASSIGN_SUB:
+        case NODE_ASSIGN_MUL:
+        case NODE_ASSIGN_DIV:
+        case NODE_ASSIGN_MOD:
+        case NODE_ASSIGN_BIT_AND:
+        case NODE_ASSIGN_BIT_OR:
+        case NODE_ASSIGN_BIT_XOR:
+            if (!is_lvalue(node->left)) {
+                diag_error(checker->diagnostics, node->token,
+                           "left side cannot be assigned to");
+            }
+            return check_arith(checker, node, check_operands(checker, node),
+                               assignment_operator(node->kind));
+
+        case NODE_ASSIGN_SHL:
+        case NODE_ASSIGN_SHR:
+            left = check_expr(checker, node->left);
+            expect(checker, node->right, type_int, "shift count");
+            return check_arith(checker, node, left,
+                               assignment_operator(node->kind));
+
+        case NODE_DECL_EXP:
+            right = check_expr(checker, node->right);
+            if (right == type_nil) {
+                diag_error(checker->diagnostics, node->token,
+                           "cannot infer a type from nil");
+                right = type_error;
+            }
+            for (Node *name = node->left; name; name = name->next) {
+                if (name->decl && right != type_error) {
+                    name->decl->type = right;
+                }
+                name->type = right;
+            }
+            return right;
+
+        case NODE_CONS:
+            left = check_expr(checker, node->left);
+            right = check_expr(checker, node->right);
+            if (left == type_error || right == type_error) {
+                return type_error;
+            }
+            if (right == type_nil) {
+                return TypeTable_list(checker->types, left);
+            }
+            if (right->kind != TList || !Type_assignable(right->elem, left)) {
+                diag_error(checker->diagnostics, node->token,
+                           "cannot cons %s onto %s",
+                           Type_describe(left), Type_describe(right));
+                return type_error;
+            }
+            return right;
+
+        case NODE_HD:
+        case NODE_TL:
+            left = check_expr(checker, node->left);
+            if (left == type_error) {
+                return type_error;
+            }
+            if (left->kind != TList) {
+                diag_error(checker->diagnostics, node->token,
+                           "operand must be a list, not %s",
+                           Type_describe(left));
+                return type_error;
+            }
+            return node->kind == NODE_HD ? left->elem : left;
+
+        case NODE_LEN:
+            left = check_expr(checker, node->left);
+            if (left != type_error && left->kind != TString
+                && left->kind != TArray && left->kind != TList) {
+                diag_error(checker->diagnostics, node->token,
+                           "len cannot be applied to %s", Type_describe(left));
+            }
+            return type_int;
+
+        case NODE_REF:
+            left = check_expr(checker, node->left);
+            if (left == type_error) {
+                return type_error;
+            }
+            if (!left->can_ref) {
+                diag_error(checker->diagnostics, node->token,
+                           "cannot take a reference to %s",
+                           Type_describe(left));
+                return type_error;
+            }
+            return TypeTable_ref(checker->types, left);
+
+        case NODE_ARRAY:
+            expect(checker, node->left, type_int, "array size");
+            if (node->type == NULL || node->type->kind != TArray) {
+                diag_error(checker->diagnostics, node->token,
+                           "array needs an array type");
+                return type_error;
+            }
+            return node->type;
+
+        case NODE_CHAN:
+            if (node->left) {
+                expect(checker, node->left, type_int, "buffer size");
+            }
+            if (node->type == NULL || node->type->kind != TChan) {
+                diag_error(checker->diagnostics, node->token,
+                           "chan needs a channel type");
+                return type_error;
+            }
+            return node->type;
+
+        case NODE_TAGOF:
+            left = check_expr(checker, node->left);
+            if (left != type_error && left->kind != TAdtPick
+                && !(left->kind == TRef && left->elem->kind == TAdtPick)) {
+                diag_error(checker->diagnostics, node->token,
+                           "tagof needs a pick adt, not %s",
+                           Type_describe(left));
+            }
+            return type_int;
+
+        case NODE_CAST:
+            left = check_expr(checker, node->left);
+            if (node->type == NULL) {
+                return type_error;
+            }
+            if (left != type_error && left != node->type
+                && !(is_numeric(left) && is_numeric(node->type))
+                && !(left->kind == TString
+                     && (is_numeric(node->type)
+                         || (node->type->kind == TArray
+                             && node->type->elem == type_byte)))
+                && !(node->type->kind == TString
+                     && (is_numeric(left)
+                         || (left->kind == TArray
+                             && left->elem == type_byte)))) {
+                diag_error(checker->diagnostics, node->token,
+                           "cannot convert %s to %s", Type_describe(left),
+                           Type_describe(node->type));
+            }
+            return node->type;
+
+        case NODE_CHAN_TX:
+            left = check_expr(checker, node->left);
+            if (left == type_error) {
+                return type_error;
+            }
+            if (left->kind != TChan) {
+                diag_error(checker->diagnostics, node->token,
+                           "operand must be a channel, not %s",
+                           Type_describe(left));
+                return type_error;
+            }
+            if (node->right) {
+                expect(checker, node->right, left->elem, "sent value");
+            }
+            return left->elem;
+
+        case NODE_FUNCTION_CALL:
+            return check_call(checker, node);
+
+        case NODE_LOAD:
+            expect(checker, node->left, type_string, "module path");
+            if (node->type == NULL || node->type->kind != TModule) {
+                diag_error(checker->diagnostics, node->token,
+                           "load needs a module type");
+                return type_error;
+            }
+            return node->type;
+
+        case NODE_INDEX:
+            left = check_expr(checker, node->left);
+            expect(checker, node->right, type_int, "index");
+            if (left == type_error) {
+                return type_error;
+            }
+            if (left->kind == TString) {
+                return type_int;
+            }
+            if (left->kind != TArray) {
+                diag_error(checker->diagnostics, node->token,
+                           "cannot index %s", Type_describe(left));
+                return type_error;
+            }
+            return left->elem;
+
+        case NODE_DOT: {
+            left = check_expr(checker, node->left);
+            if (left == type_error) {
+                return type_error;
+            }
+            Type *aggregate = left->kind == TRef ? left->elem : left;
+            Member *member = NULL;
+            if (aggregate->kind == TAdt || aggregate->kind == TAdtPick
+                || aggregate->kind == TModule) {
+                member = Type_member(aggregate, node->token);
+            }
+            if (member == NULL) {
+                diag_error(checker->diagnostics, node->token,
+                           "%s has no member named '%.*s'",
+                           Type_describe(left), (int) node->token->length,
+                           node->token->location);
+                return type_error;
+            }
+            return member->type;
+        }
+
+        case NODE_TUPLE: {
+            uptr n = 0;
+            for (Node *elem = node->body; elem; elem = elem->next) {
+                n++;
+            }
+            Type *elems[n ? n : 1];
+            n = 0;
+            bool failed = false;
+            for (Node *elem = node->body; elem; elem = elem->next) {
+                elems[n] = check_expr(checker, elem);
+                failed |= elems[n++] == type_error;
+            }
+            return failed ? type_error
+                          : TypeTable_tuple(checker->types, n, elems);
+        }
+
+        default:
+            diag_error(checker->diagnostics, node->token,
+                       "expected an expression");
+            return type_error;
+    }
+}
+
+static Type *check_expr(Checker *checker, Node *node) {
+    Type *type = check_expr_kind(checker, node);
+    node->type = type;
+    return type;
+}
+
+static void check_case(Checker *checker, Node *node) {
+    Type *scrutinee = check_expr(checker, node->cond);
+    if (scrutinee != type_error && !is_integral(scrutinee)
+        && scrutinee->kind != TString) {
+        diag_error(checker->diagnostics, node->cond->token,
+                   "cannot case on %s", Type_describe(scrutinee));
+        scrutinee = type_error;
+    }
+
+    for (Node *arm = node->body; arm; arm = arm->next) {
+        for (Node *label = arm->left; label; label = label->next) {
+            if (label->kind == NODE_NOP) {
+                continue;
+            }
+            if (label->kind == NODE_TO) {
+                expect(checker, label->left, scrutinee, "case label");
+                expect(checker, label->right, scrutinee, "case label");
+                label->type = scrutinee;
+            } else {
+                expect(checker, label, scrutinee, "case label");
+            }
+        }
+        check_stmt(checker, arm->body);
+    }
+}
+
+/// Check an `alt`, whose labels each send or receive on a channel, and set
+/// its type to a tuple of the index of the alternative done and the value
+/// of each alternative, in the order of the alt table: sends, then
+/// receives.
+static void check_alt(Checker *checker, Node *node) {
+    uptr n = 0;
+    for (Node *arm = node->body; arm; arm = arm->next) {
+        for (Node *label = arm->left; label; label = label->next) {
+            n++;
+        }
+    }
+    Type *sends[n ? n : 1], *receives[n ? n : 1];
+    uptr n_sends = 0, n_receives = 0;
+    bool failed = false;
+    for (Node *arm = node->body; arm; arm = arm->next) {
+        for (Node *label = arm->left; label; label = label->next) {
+            if (label->kind == NODE_NOP) {
+                continue;
+            }
+            Node *transfer = label;
+            if (label->kind == NODE_DECL_EXP || label->kind == NODE_ASSIGN) {
+                transfer = label->right;
+            }
+            if (transfer == NULL || transfer->kind != NODE_CHAN_TX
+                || (transfer != label && transfer->right != NULL)) {
+                diag_error(checker->diagnostics, label->token,
+                           "alt label must send or receive on a channel");
+                failed = true;
+                continue;
+            }
+            Type *type = check_expr(checker, label);
+            failed |= type == type_error;
+            if (transfer->right) {
+                sends[n_sends++] = transfer->type;
+            } else {
+                receives[n_receives++] = transfer->type;
+            }
+        }
+        check_stmt(checker, arm->body);
+    }
+
+    Type *members[n + 1];
+    members[0] = type_int;
+    memcpy(members + 1, sends, n_sends * sizeof(Type *));
+    memcpy(members + 1 + n_sends, receives, n_receives * sizeof(Type *));
+    node->type = failed ? type_error
+                        : TypeTable_tuple(checker->types,
+                                          1 + n_sends + n_receives, members);
+}
+
+static void check_stmt(Checker *checker, Node *node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case NODE_NOP:
+            case NODE_BREAK:
+            case NODE_CONTINUE:
+            case NODE_EXIT:
+                break;
+
+            case NODE_BLOCK:
+                check_stmt(checker, node->body);
+                break;
+
+            case NODE_DECL:
+                for (Node *name = node->left; name; name = name->next) {
+                    name->type = name->decl ? name->decl->type : type_error;
+                }
+                // The names share one declared type, and the initialiser is
+                // checked once against it.
+                if (node->right && node->left && node->left->type) {
+                    expect(checker, node->right, node->left->type,
+                           "initialiser");
+                }
+                break;
+
+            case NODE_IF:
+                check_cond(checker, node->cond);
+                check_stmt(checker, node->then);
+                check_stmt(checker, node->else_);
+                break;
+
+            case NODE_WHILE:
+            case NODE_DO:
+                check_cond(checker, node->cond);
+                check_stmt(checker, node->body);
+                break;
+
+            case NODE_FOR:
+                check_stmt(checker, node->init);
+                check_cond(checker, node->cond);
+                if (node->inc) {
+                    check_expr(checker, node->inc);
+                }
+                check_stmt(checker, node->body);
+                break;
+
+            case NODE_CASE:
+                check_case(checker, node);
+                break;
+
+            case NODE_ALT:
+                check_alt(checker, node);
+                break;
+
+            case NODE_RETURN:
+                if (node->left) {
+                    if (checker->return_type == type_none) {
+                        diag_error(checker->diagnostics, node->token,
+                                   "function does not return a value");
+                        check_expr(checker, node->left);
+                    } else {
+                        expect(checker, node->left, checker->return_type,
+                               "return value");
+                    }
+                } else if (checker->return_type != type_none) {
+                    diag_error(checker->diagnostics, node->token,
+                               "function must return a value");
+                }
+                break;
+
+            case NODE_SPAWN:
+                if (node->left->kind != NODE_FUNCTION_CALL) {
+                    diag_error(checker->diagnostics, node->token,
+                               "spawn needs a function call");
+                }
+                check_expr(checker, node->left);
+                break;
+
+            default:
+                check_expr(checker, node);
+                break;
+        }
+    }
+}
+
+void check_function(TypeTable *types, Node *function,
+                    Diagnostics *diagnostics) {
+    Type *fn = function->decl ? function->decl->type : NULL;
+    Checker checker = {
+        .types = types,
+        .diagnostics = diagnostics,
+        .return_type = fn && fn->return_type ? fn->return_type : type_none,
+    };
+
+    uptr i = 0;
+    for (Node *param = function->left; param; param = param->next, i++) {
+        if (fn && i < fn->n_params && param->decl
+            && param->decl->type == NULL) {
+            param->decl->type = fn->params[i];
+        }
+        param->type = param->decl ? param->decl->type : NULL;
+    }
+    function->type = fn;
+    check_stmt(&checker, function->body);
+}
+
+/// The work shared between the threads of `check_functions`.
+typedef struct CheckJob {
+    TypeTable *types;
+    Node **functions;
+    uptr count;
+    /// The index of the next function to be checked.
+    atomic_size_t next;
+    /// The diagnostics of each function.
+    Diagnostics *results;
+} CheckJob;
+
+static int check_worker(void *arg) {
+    CheckJob *job = arg;
+    while (true) {
+        uptr i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->count) {
+            return 0;
+        }
+        check_function(job->types, job->functions[i], &job->results[i]);
+    }
+}
+
+uptr check_functions(TypeTable *types, Node **functions, uptr count,
+                     uptr n_threads, Diagnostics *diagnostics) {
+    Allocator *allocator = diagnostics->allocator;
+    if (n_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = online > 0 ? (uptr) online : 1;
+    }
+    if (n_threads > count) {
+        n_threads = count ? count : 1;
+    }
+
+    CheckJob job = {
+        .types = types,
+        .functions = functions,
+        .count = count,
+        .results = ALLOC(allocator, (count ? count : 1) * sizeof(Diagnostics)),
+    };
+    atomic_init(&job.next, 0);
+    for (uptr i = 0; i < count; i++) {
+        Diagnostics_init(&job.results[i], allocator);
+    }
+
+    // The calling thread does its share of the work too.
+    thrd_t *threads = ALLOC(allocator, n_threads * sizeof(thrd_t));
+    uptr started = 0;
+    for (uptr i = 1; i < n_threads; i++) {
+        if (thrd_create(&threads[started], check_worker, &job) != thrd_success) {
+            break;
+        }
+        started++;
+    }
+    check_worker(&job);
+    for (uptr i = 0; i < started; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    FREE(allocator, threads);
+
+    uptr errors = 0;
+    for (uptr i = 0; i < count; i++) {
+        errors += job.results[i].errors;
+        Diagnostics_append(diagnostics, &job.results[i]);
+    }
+    FREE(allocator, job.results);
+    return errors;
+}
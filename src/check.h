@@ -0,0 +1,33 @@
+#ifndef LIMBO_CHECK_H
+#define LIMBO_CHECK_H
+
+#include "error.h"
+#include "parser.h"
+#include "type.h"
+
+/// Type check the body of a single function, setting `Node.type` on every
+/// expression within it.
+/// \param types The table to intern composite types in.
+/// \param function The `NODE_FUNCTION` to check.
+/// \param diagnostics The list to record errors in.
+/// \remark Module-level declarations must already be resolved, every adt laid
+/// out, and the names within the body bound to their declarations.
+void check_function(TypeTable *types, Node *function, Diagnostics *diagnostics);
+
+/// Type check the bodies of many functions in parallel.
+/// Each function is checked independently, with its diagnostics recorded
+/// separately, and the diagnostics are then appended to `diagnostics` in
+/// the order the functions were given, whatever order they finished in.
+/// \param types The table to intern composite types in.
+/// \param functions The `NODE_FUNCTION`s to check.
+/// \param count The number of functions.
+/// \param n_threads The number of threads to use, or 0 to use one per
+/// online processor.
+/// \param diagnostics The list to record errors in.
+/// \return The number of errors found.
+/// \remark The allocator of `diagnostics` must be safe to use from multiple
+/// threads.
+uptr check_functions(TypeTable *types, Node **functions, uptr count,
+                     uptr n_threads, Diagnostics *diagnostics);
+
+#endif //LIMBO_CHECK_H
@@ -0,0 +1,639 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dis.h"
+#include "error.h"
+
+static const char *op_names[DIS_MAXOP] = {
+    "nop", "alt", "nbalt", "goto", "call", "frame", "spawn", "runt", "load",
+    "mcall", "mspawn", "mframe", "ret", "jmp", "case", "exit", "new", "newa",
+    "newcb", "newcw", "newcf", "newcp", "newcm", "newcmp", "send", "recv",
+    "consb", "consw", "consp", "consf", "consm", "consmp", "headb", "headw",
+    "headp", "headf", "headm", "headmp", "tail", "lea", "indx", "movp",
+    "movm", "movmp", "movb", "movw", "movf", "cvtbw", "cvtwb", "cvtfw",
+    "cvtwf", "cvtca", "cvtac", "cvtwc", "cvtcw", "cvtfc", "cvtcf", "addb",
+    "addw", "addf", "subb", "subw", "subf", "mulb", "mulw", "mulf", "divb",
+    "divw", "divf", "modw", "modb", "andb", "andw", "orb", "orw", "xorb",
+    "xorw", "shlb", "shlw", "shrb", "shrw", "insc", "indc", "addc", "lenc",
+    "lena", "lenl", "beqb", "bneb", "bltb", "bleb", "bgtb", "bgeb", "beqw",
+    "bnew", "bltw", "blew", "bgtw", "bgew", "beqf", "bnef", "bltf", "blef",
+    "bgtf", "bgef", "beqc", "bnec", "bltc", "blec", "bgtc", "bgec", "slicea",
+    "slicela", "slicec", "indw", "indf", "indb", "negf", "movl", "addl",
+    "subl", "divl", "modl", "mull", "andl", "orl", "xorl", "shll", "shrl",
+    "bnel", "bltl", "blel", "bgtl", "bgel", "beql", "cvtlf", "cvtfl", "cvtlw",
+    "cvtwl", "cvtlc", "cvtcl", "headl", "consl", "newcl", "casec", "indl",
+    "movpc", "tcmp", "mnewz", "cvtrf", "cvtfr", "cvtws", "cvtsw", "lsrw",
+    "lsrl", "eclr", "newz", "newaz", "raise", "casel", "mulx", "divx",
+    "cvtxx", "mulx0", "divx0", "cvtxx0", "mulx1", "divx1", "cvtxx1", "cvtfx",
+    "cvtxf", "expw", "expl", "expf", "self",
+};
+
+const char *dis_op_name(DisOp op) {
+    return op < DIS_MAXOP ? op_names[op] : "???";
+}
+
+DisModule *DisModule_new(Allocator *allocator, const char *name) {
+    DisModule *self = ALLOC(allocator, sizeof(DisModule));
+    self->allocator = allocator;
+    self->name = DisModule_string(self, name, strlen(name));
+    self->entry_pc = -1;
+    self->entry_type = -1;
+    return self;
+}
+
+void DisModule_free(DisModule *self) {
+    Allocator *allocator = self->allocator;
+    for (uptr i = 0; i < self->n_types; i++) {
+        FREE(allocator, self->types[i].map);
+    }
+    for (uptr i = 0; i < self->n_imports; i++) {
+        FREE(allocator, self->imports[i].fns);
+    }
+    for (uptr i = 0; i < self->n_strings; i++) {
+        FREE(allocator, self->strings[i]);
+    }
+    FREE(allocator, self->strings);
+    FREE(allocator, self->code);
+    FREE(allocator, self->types);
+    FREE(allocator, self->data);
+    FREE(allocator, self->links);
+    FREE(allocator, self->imports);
+    FREE(allocator, self);
+}
+
+i32 DisModule_emit(DisModule *self, DisInst inst) {
+    GROW(self->allocator, self->code, self->n_code, self->code_capacity);
+    self->code[self->n_code] = inst;
+    return (i32) self->n_code++;
+}
+
+i32 DisModule_add_type(DisModule *self, uptr size, const u8 *map,
+                       uptr map_length) {
+    GROW(self->allocator, self->types, self->n_types, self->types_capacity);
+    DisModule_set_type(self, (i32) self->n_types, size, map, map_length);
+    return (i32) self->n_types++;
+}
+
+void DisModule_set_type(DisModule *self, i32 index, uptr size, const u8 *map,
+                        uptr map_length) {
+    DisType *type = &self->types[index];
+    FREE(self->allocator, type->map);
+    type->size = size;
+    type->map_length = map_length;
+    type->map = NULL;
+    if (map_length > 0) {
+        type->map = ALLOC(self->allocator, map_length);
+        memcpy(type->map, map, map_length);
+    }
+}
+
+void DisModule_add_data(DisModule *self, DisData data) {
+    GROW(self->allocator, self->data, self->n_data, self->data_capacity);
+    self->data[self->n_data++] = data;
+}
+
+void DisModule_add_link(DisModule *self, DisLink link) {
+    GROW(self->allocator, self->links, self->n_links, self->links_capacity);
+    self->links[self->n_links++] = link;
+}
+
+i32 DisModule_add_import(DisModule *self) {
+    GROW(self->allocator, self->imports, self->n_imports,
+         self->imports_capacity);
+    self->flags |= DIS_HASLDT;
+    return (i32) self->n_imports++;
+}
+
+i32 DisModule_import_fn(DisModule *self, i32 import, const char *name,
+                        u32 signature) {
+    DisImport *table = &self->imports[import];
+    for (uptr i = 0; i < table->n_fns; i++) {
+        if (table->fns[i].signature == signature
+            && strcmp(table->fns[i].name, name) == 0) {
+            return (i32) i;
+        }
+    }
+    GROW(self->allocator, table->fns, table->n_fns, table->fns_capacity);
+    table->fns[table->n_fns] = (DisImportFn) {
+        signature, DisModule_string(self, name, strlen(name))};
+    return (i32) table->n_fns++;
+}
+
+const char *DisModule_string(DisModule *self, const char *text, uptr length) {
+    GROW(self->allocator, self->strings, self->n_strings,
+         self->strings_capacity);
+    char *copy = ALLOC(self->allocator, length + 1);
+    memcpy(copy, text, length);
+    self->strings[self->n_strings++] = copy;
+    return copy;
+}
+
+void DisWriter_init(DisWriter *self, FILE *out) {
+    self->out = out;
+    self->written = 0;
+    self->failed = false;
+    self->length = 0;
+}
+
+bool DisWriter_flush(DisWriter *self) {
+    if (self->length > 0 && !self->failed
+        && fwrite(self->buffer, 1, self->length, self->out) != self->length) {
+        self->failed = true;
+    }
+    self->written += self->length;
+    self->length = 0;
+    return !self->failed;
+}
+
+void DisWriter_byte(DisWriter *self, u8 byte) {
+    if (self->length == DIS_WRITER_BUFFER) {
+        DisWriter_flush(self);
+    }
+    self->buffer[self->length++] = byte;
+}
+
+void DisWriter_bytes(DisWriter *self, const void *bytes, uptr length) {
+    if (self->length + length <= DIS_WRITER_BUFFER) {
+        memcpy(self->buffer + self->length, bytes, length);
+        self->length += length;
+        return;
+    }
+    // Too big to buffer: write it straight through rather than copying it.
+    DisWriter_flush(self);
+    if (length >= DIS_WRITER_BUFFER) {
+        if (!self->failed && fwrite(bytes, 1, length, self->out) != length) {
+            self->failed = true;
+        }
+        self->written += length;
+        return;
+    }
+    memcpy(self->buffer, bytes, length);
+    self->length = length;
+}
+
+void DisWriter_operand(DisWriter *self, i32 value) {
+    if (value >= -64 && value <= 63) {
+        DisWriter_byte(self, (u8) (value & 0x7F));
+    } else if (value >= -8192 && value <= 8191) {
+        DisWriter_byte(self, (u8) (((value >> 8) & 0x3F) | 0x80));
+        DisWriter_byte(self, (u8) value);
+    } else {
+        if (value < -(1 << 29) || value >= (1 << 29)) {
+            error("Dis operand %d does not fit in 30 bits", value);
+        }
+        DisWriter_byte(self, (u8) (((value >> 24) & 0x3F) | 0xC0));
+        DisWriter_byte(self, (u8) (value >> 16));
+        DisWriter_byte(self, (u8) (value >> 8));
+        DisWriter_byte(self, (u8) value);
+    }
+}
+
+void DisWriter_word(DisWriter *self, u32 value) {
+    u8 bytes[4] = {(u8) (value >> 24), (u8) (value >> 16), (u8) (value >> 8),
+                   (u8) value};
+    DisWriter_bytes(self, bytes, sizeof bytes);
+}
+
+static void write_u64(DisWriter *writer, u64 value) {
+    DisWriter_word(writer, (u32) (value >> 32));
+    DisWriter_word(writer, (u32) value);
+}
+
+/// The address mode bits of a source or destination operand.
+static u8 operand_mode(DisMode mode) {
+    switch (mode) {
+        case DIS_NONE:
+            return 3;
+        case DIS_MP:
+            return 0;
+        case DIS_FP:
+            return 1;
+        case DIS_IMM:
+            return 2;
+        case DIS_IND_MP:
+            return 4;
+        case DIS_IND_FP:
+            return 5;
+    }
+    return 3;
+}
+
+/// The address mode bits of a middle operand.
+static u8 middle_mode(DisMode mode) {
+    switch (mode) {
+        case DIS_NONE:
+            return 0x00;
+        case DIS_IMM:
+            return 0x40;
+        case DIS_FP:
+            return 0x80;
+        case DIS_MP:
+            return 0xC0;
+        default:
+            error("invalid middle operand mode %d", mode);
+    }
+}
+
+static void write_operand(DisWriter *writer, DisOperand operand) {
+    switch (operand.mode) {
+        case DIS_NONE:
+            break;
+        case DIS_IND_MP:
+        case DIS_IND_FP:
+            DisWriter_operand(writer, operand.offset);
+            DisWriter_operand(writer, operand.index);
+            break;
+        default:
+            DisWriter_operand(writer, operand.offset);
+            break;
+    }
+}
+
+static void write_inst(DisWriter *writer, const DisInst *inst) {
+    DisWriter_byte(writer, (u8) inst->op);
+    DisWriter_byte(writer, (u8) (middle_mode(inst->mid.mode)
+                                 | operand_mode(inst->src.mode) << 3
+                                 | operand_mode(inst->dst.mode)));
+    write_operand(writer, inst->mid);
+    write_operand(writer, inst->src);
+    write_operand(writer, inst->dst);
+}
+
+static void write_string(DisWriter *writer, const char *string) {
+    DisWriter_bytes(writer, string, strlen(string) + 1);
+}
+
+static void write_data(DisWriter *writer, const DisData *data) {
+    if (data->count > 0 && data->count < 16) {
+        DisWriter_byte(writer, (u8) (data->kind << 4 | data->count));
+    } else {
+        DisWriter_byte(writer, (u8) (data->kind << 4));
+        DisWriter_operand(writer, (i32) data->count);
+    }
+    DisWriter_operand(writer, data->offset);
+    switch (data->kind) {
+        case DIS_DEFB:
+            for (uptr i = 0; i < data->count; i++) {
+                DisWriter_byte(writer, (u8) data->int_value);
+            }
+            break;
+        case DIS_DEFW:
+            for (uptr i = 0; i < data->count; i++) {
+                DisWriter_word(writer, (u32) data->int_value);
+            }
+            break;
+        case DIS_DEFL:
+            for (uptr i = 0; i < data->count; i++) {
+                write_u64(writer, (u64) data->int_value);
+            }
+            break;
+        case DIS_DEFF:
+            for (uptr i = 0; i < data->count; i++) {
+                u64 bits;
+                memcpy(&bits, &data->real_value, sizeof bits);
+                write_u64(writer, bits);
+            }
+            break;
+        case DIS_DEFS:
+            DisWriter_bytes(writer, data->string_value, data->count);
+            break;
+        default:
+            error("unsupported Dis data item kind %d", data->kind);
+    }
+}
+
+bool dis_write_module(const DisModule *module, DisWriter *writer) {
+    // Header. Every size is a count of items rather than of encoded bytes, so
+    // each section can be streamed out as it is encoded.
+    DisWriter_operand(writer, DIS_XMAGIC);
+    DisWriter_operand(writer, (i32) module->flags);
+    DisWriter_operand(writer, (i32) module->stack_extent);
+    DisWriter_operand(writer, (i32) module->n_code);
+    DisWriter_operand(writer, (i32) module->data_size);
+    DisWriter_operand(writer, (i32) module->n_types);
+    DisWriter_operand(writer, (i32) module->n_links);
+    DisWriter_operand(writer, module->entry_pc);
+    DisWriter_operand(writer, module->entry_type);
+
+    for (uptr i = 0; i < module->n_code; i++) {
+        write_inst(writer, &module->code[i]);
+    }
+
+    for (uptr i = 0; i < module->n_types; i++) {
+        const DisType *type = &module->types[i];
+        DisWriter_operand(writer, (i32) i);
+        DisWriter_operand(writer, (i32) type->size);
+        DisWriter_operand(writer, (i32) type->map_length);
+        DisWriter_bytes(writer, type->map, type->map_length);
+    }
+
+    for (uptr i = 0; i < module->n_data; i++) {
+        write_data(writer, &module->data[i]);
+    }
+    DisWriter_byte(writer, DIS_DEFZ);
+
+    write_string(writer, module->name);
+
+    for (uptr i = 0; i < module->n_links; i++) {
+        const DisLink *link = &module->links[i];
+        DisWriter_operand(writer, link->pc);
+        DisWriter_operand(writer, link->type);
+        DisWriter_word(writer, link->signature);
+        write_string(writer, link->name);
+    }
+
+    if (module->flags & DIS_HASLDT) {
+        DisWriter_operand(writer, (i32) module->n_imports);
+        for (uptr i = 0; i < module->n_imports; i++) {
+            const DisImport *import = &module->imports[i];
+            DisWriter_operand(writer, (i32) import->n_fns);
+            for (uptr j = 0; j < import->n_fns; j++) {
+                DisWriter_word(writer, import->fns[j].signature);
+                write_string(writer, import->fns[j].name);
+            }
+        }
+        DisWriter_byte(writer, 0);
+    }
+
+    return DisWriter_flush(writer);
+}
+
+bool dis_write_file(const DisModule *module, const char *path) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        return false;
+    }
+    DisWriter *writer = ALLOC(module->allocator, sizeof(DisWriter));
+    DisWriter_init(writer, out);
+    bool ok = dis_write_module(module, writer);
+    FREE(module->allocator, writer);
+    return fclose(out) == 0 && ok;
+}
+
+/// A cursor over an encoded module.
+typedef struct DisReader {
+    const u8 *bytes;
+    uptr length, position;
+    /// Whether the encoding ended early or held something invalid.
+    bool failed;
+} DisReader;
+
+static u8 read_byte(DisReader *reader) {
+    if (reader->position >= reader->length) {
+        reader->failed = true;
+        return 0;
+    }
+    return reader->bytes[reader->position++];
+}
+
+/// Read a value in the variable-length operand encoding.
+/// \see DisWriter_operand
+static i32 read_operand(DisReader *reader) {
+    u8 first = read_byte(reader);
+    switch (first & 0xC0) {
+        case 0x00:
+            return first;
+        case 0x40:
+            return (i32) first - 0x80;
+        case 0x80: {
+            i32 value = (first & 0x3F) << 8 | read_byte(reader);
+            return first & 0x20 ? value - (1 << 14) : value;
+        }
+        default: {
+            i32 value = (first & 0x3F) << 24;
+            value |= read_byte(reader) << 16;
+            value |= read_byte(reader) << 8;
+            value |= read_byte(reader);
+            return first & 0x20 ? value - (1 << 30) : value;
+        }
+    }
+}
+
+static u32 read_word(DisReader *reader) {
+    u32 value = 0;
+    for (int i = 0; i < 4; i++) {
+        value = value << 8 | read_byte(reader);
+    }
+    return value;
+}
+
+static u64 read_u64(DisReader *reader) {
+    u64 high = read_word(reader);
+    return high << 32 | read_word(reader);
+}
+
+/// Read a NUL-terminated string into storage owned by the module.
+static const char *read_string(DisReader *reader, DisModule *module) {
+    const char *start = (const char *) reader->bytes + reader->position;
+    uptr length = 0;
+    while (!reader->failed && read_byte(reader) != 0) {
+        length++;
+    }
+    return reader->failed ? "" : DisModule_string(module, start, length);
+}
+
+static DisOperand read_inst_operand(DisReader *reader, DisMode mode) {
+    DisOperand operand = {.mode = mode};
+    switch (mode) {
+        case DIS_NONE:
+            break;
+        case DIS_IND_MP:
+        case DIS_IND_FP:
+            operand.offset = read_operand(reader);
+            operand.index = read_operand(reader);
+            break;
+        default:
+            operand.offset = read_operand(reader);
+            break;
+    }
+    return operand;
+}
+
+static bool read_inst(DisReader *reader, DisInst *inst) {
+    static const DisMode modes[8] = {
+        DIS_MP, DIS_FP, DIS_IMM, DIS_NONE, DIS_IND_MP, DIS_IND_FP,
+        DIS_NONE, DIS_NONE,
+    };
+    static const DisMode middles[4] = {DIS_NONE, DIS_IMM, DIS_FP, DIS_MP};
+    u8 op = read_byte(reader), address = read_byte(reader);
+    u8 src = (address >> 3) & 7, dst = address & 7;
+    if (op >= DIS_MAXOP || src > 5 || dst > 5) {
+        return false;
+    }
+    inst->op = op;
+    inst->mid = read_inst_operand(reader, middles[address >> 6]);
+    inst->src = read_inst_operand(reader, modes[src]);
+    inst->dst = read_inst_operand(reader, modes[dst]);
+    return !reader->failed;
+}
+
+/// Read one data item, splitting it into an item per element.
+static bool read_data(DisReader *reader, DisModule *module, u8 first) {
+    u8 kind = first >> 4;
+    i32 count = first & 0x0F;
+    if (count == 0) {
+        count = read_operand(reader);
+    }
+    i32 offset = read_operand(reader);
+    static const uptr sizes[] = {
+        [DIS_DEFB] = 1, [DIS_DEFW] = 4, [DIS_DEFS] = 1, [DIS_DEFF] = 8,
+        [DIS_DEFL] = 8,
+    };
+    if (count < 0 || offset < 0 || kind >= sizeof sizes / sizeof *sizes
+        || sizes[kind] == 0) {
+        return false;
+    }
+    uptr end = (uptr) offset + (kind == DIS_DEFS ? sizeof(void *)
+                                                 : (uptr) count * sizes[kind]);
+    if (end > module->data_size) {
+        return false;
+    }
+    if (kind == DIS_DEFS) {
+        if ((uptr) count > reader->length - reader->position) {
+            return false;
+        }
+        const char *text = (const char *) reader->bytes + reader->position;
+        reader->position += (uptr) count;
+        DisModule_add_data(module, (DisData) {
+            .kind = kind, .offset = offset, .count = (uptr) count,
+            .string_value = DisModule_string(module, text, (uptr) count)});
+        return true;
+    }
+    for (i32 i = 0; i < count && !reader->failed; i++) {
+        DisData data = {
+            .kind = kind, .offset = offset + i * (i32) sizes[kind],
+            .count = 1};
+        switch (kind) {
+            case DIS_DEFB:
+                data.int_value = read_byte(reader);
+                break;
+            case DIS_DEFW:
+                data.int_value = (i32) read_word(reader);
+                break;
+            case DIS_DEFL:
+                data.int_value = (i64) read_u64(reader);
+                break;
+            default: {
+                u64 bits = read_u64(reader);
+                memcpy(&data.real_value, &bits, sizeof bits);
+                break;
+            }
+        }
+        DisModule_add_data(module, data);
+    }
+    return true;
+}
+
+static bool read_module(DisReader *reader, DisModule *module) {
+    if (read_operand(reader) != DIS_XMAGIC) {
+        return false;
+    }
+    module->flags = (u32) read_operand(reader);
+    i32 stack_extent = read_operand(reader);
+    i32 n_code = read_operand(reader);
+    i32 data_size = read_operand(reader);
+    i32 n_types = read_operand(reader);
+    i32 n_links = read_operand(reader);
+    module->entry_pc = read_operand(reader);
+    module->entry_type = read_operand(reader);
+    if (reader->failed || stack_extent < 0 || n_code < 0 || data_size < 0
+        || n_types < 0 || n_links < 0) {
+        return false;
+    }
+    module->stack_extent = (uptr) stack_extent;
+    module->data_size = (uptr) data_size;
+
+    for (i32 i = 0; i < n_code; i++) {
+        DisInst inst;
+        if (!read_inst(reader, &inst)) {
+            return false;
+        }
+        DisModule_emit(module, inst);
+    }
+
+    for (i32 i = 0; i < n_types; i++) {
+        DisModule_add_type(module, 0, NULL, 0);
+    }
+    for (i32 i = 0; i < n_types; i++) {
+        i32 index = read_operand(reader);
+        i32 size = read_operand(reader);
+        i32 map_length = read_operand(reader);
+        if (reader->failed || index < 0 || index >= n_types || size < 0
+            || map_length < 0
+            || (uptr) map_length > reader->length - reader->position) {
+            return false;
+        }
+        DisModule_set_type(module, index, (uptr) size,
+                           reader->bytes + reader->position,
+                           (uptr) map_length);
+        reader->position += (uptr) map_length;
+    }
+
+    for (u8 first; (first = read_byte(reader)) != DIS_DEFZ;) {
+        if (reader->failed || !read_data(reader, module, first)) {
+            return false;
+        }
+    }
+
+    module->name = read_string(reader, module);
+
+    for (i32 i = 0; i < n_links; i++) {
+        DisLink link;
+        link.pc = read_operand(reader);
+        link.type = read_operand(reader);
+        link.signature = read_word(reader);
+        link.name = read_string(reader, module);
+        DisModule_add_link(module, link);
+    }
+
+    if (module->flags & DIS_HASLDT) {
+        i32 n_imports = read_operand(reader);
+        for (i32 i = 0; i < n_imports && !reader->failed; i++) {
+            i32 import = DisModule_add_import(module);
+            i32 n_fns = read_operand(reader);
+            for (i32 j = 0; j < n_fns && !reader->failed; j++) {
+                DisImport *table = &module->imports[import];
+                GROW(module->allocator, table->fns, table->n_fns,
+                     table->fns_capacity);
+                u32 signature = read_word(reader);
+                table->fns[table->n_fns++] = (DisImportFn) {
+                    signature, read_string(reader, module)};
+            }
+        }
+        read_byte(reader);
+    }
+    return !reader->failed;
+}
+
+DisModule *dis_read_module(Allocator *allocator, const u8 *bytes,
+                           uptr length) {
+    DisReader reader = {bytes, length, 0, false};
+    DisModule *module = DisModule_new(allocator, "");
+    if (!read_module(&reader, module)) {
+        DisModule_free(module);
+        return NULL;
+    }
+    return module;
+}
+
+DisModule *dis_read_file(Allocator *allocator, const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return NULL;
+    }
+    u8 *bytes = NULL;
+    uptr length = 0, capacity = 0;
+    for (;;) {
+        GROW(allocator, bytes, length, capacity);
+        uptr n = fread(bytes + length, 1, capacity - length, in);
+        length += n;
+        if (n == 0) {
+            break;
+        }
+    }
+    bool failed = ferror(in);
+    fclose(in);
+    DisModule *module = failed ? NULL
+                               : dis_read_module(allocator, bytes, length);
+    FREE(allocator, bytes);
+    return module;
+}
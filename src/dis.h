@@ -0,0 +1,318 @@
+#ifndef LIMBO_DIS_H
+#define LIMBO_DIS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "alloc.h"
+#include "num.h"
+
+/// The magic number at the start of an unsigned `.dis` object file.
+#define DIS_XMAGIC 819248
+
+/// Runtime flags in the `.dis` header.
+#define DIS_MUSTCOMPILE (1 << 0)
+#define DIS_DONTCOMPILE (1 << 1)
+#define DIS_SHAREMP (1 << 2)
+#define DIS_HASLDT (1 << 6)
+
+/// Data section item kinds, stored in the high nibble of an item's byte.
+#define DIS_DEFZ 0
+#define DIS_DEFB 1
+#define DIS_DEFW 2
+#define DIS_DEFS 3
+#define DIS_DEFF 4
+#define DIS_DEFA 5
+#define DIS_DIND 6
+#define DIS_DAPOP 7
+#define DIS_DEFL 8
+
+/// The words at the start of every frame, which the VM manages.
+#define DIS_REGLINK 0
+#define DIS_REGFP 1
+#define DIS_REGMOD 2
+#define DIS_REGTYP 3
+/// The word holding the address that a function's result is stored to.
+#define DIS_REGRET 4
+/// The number of words reserved at the start of every frame.
+#define DIS_NREG 5
+
+/// The Dis instruction set, in opcode order.
+typedef enum DisOp {
+    INOP, IALT, INBALT, IGOTO, ICALL, IFRAME, ISPAWN, IRUNT, ILOAD, IMCALL,
+    IMSPAWN, IMFRAME, IRET, IJMP, ICASE, IEXIT, INEW, INEWA, INEWCB, INEWCW,
+    INEWCF, INEWCP, INEWCM, INEWCMP, ISEND, IRECV, ICONSB, ICONSW, ICONSP,
+    ICONSF, ICONSM, ICONSMP, IHEADB, IHEADW, IHEADP, IHEADF, IHEADM,
+    IHEADMP, ITAIL, ILEA, IINDX, IMOVP, IMOVM, IMOVMP, IMOVB, IMOVW, IMOVF,
+    ICVTBW, ICVTWB, ICVTFW, ICVTWF, ICVTCA, ICVTAC, ICVTWC, ICVTCW, ICVTFC,
+    ICVTCF, IADDB, IADDW, IADDF, ISUBB, ISUBW, ISUBF, IMULB, IMULW, IMULF,
+    IDIVB, IDIVW, IDIVF, IMODW, IMODB, IANDB, IANDW, IORB, IORW, IXORB,
+    IXORW, ISHLB, ISHLW, ISHRB, ISHRW, IINSC, IINDC, IADDC, ILENC, ILENA,
+    ILENL, IBEQB, IBNEB, IBLTB, IBLEB, IBGTB, IBGEB, IBEQW, IBNEW, IBLTW,
+    IBLEW, IBGTW, IBGEW, IBEQF, IBNEF, IBLTF, IBLEF, IBGTF, IBGEF, IBEQC,
+    IBNEC, IBLTC, IBLEC, IBGTC, IBGEC, ISLICEA, ISLICELA, ISLICEC, IINDW,
+    IINDF, IINDB, INEGF, IMOVL, IADDL, ISUBL, IDIVL, IMODL, IMULL, IANDL,
+    IORL, IXORL, ISHLL, ISHRL, IBNEL, IBLTL, IBLEL, IBGTL, IBGEL, IBEQL,
+    ICVTLF, ICVTFL, ICVTLW, ICVTWL, ICVTLC, ICVTCL, IHEADL, ICONSL, INEWCL,
+    ICASEC, IINDL, IMOVPC, ITCMP, IMNEWZ, ICVTRF, ICVTFR, ICVTWS, ICVTSW,
+    ILSRW, ILSRL, IECLR, INEWZ, INEWAZ, IRAISE, ICASEL, IMULX, IDIVX,
+    ICVTXX, IMULX0, IDIVX0, ICVTXX0, IMULX1, IDIVX1, ICVTXX1, ICVTFX,
+    ICVTXF, IEXPW, IEXPL, IEXPF, ISELF,
+    DIS_MAXOP,
+} DisOp;
+
+/// How an operand is addressed.
+typedef enum DisMode {
+    /// No operand.
+    DIS_NONE,
+    /// `offset(mp)`: a word of module data.
+    DIS_MP,
+    /// `offset(fp)`: a word of the current frame.
+    DIS_FP,
+    /// `$offset`: an immediate value.
+    DIS_IMM,
+    /// `index(offset(mp))`: `index` bytes into the object that the module
+    /// data at `offset` points to.
+    DIS_IND_MP,
+    /// `index(offset(fp))`: `index` bytes into the object that the frame
+    /// word at `offset` points to.
+    DIS_IND_FP,
+} DisMode;
+
+/// An instruction operand.
+typedef struct DisOperand {
+    DisMode mode;
+    /// The offset, or the immediate value.
+    i32 offset;
+    /// For double indirect operands, the offset within the object.
+    i32 index;
+} DisOperand;
+
+/// A single instruction.
+/// \remark The middle operand may only be `DIS_NONE`, `DIS_IMM`, `DIS_FP`
+/// or `DIS_MP`, and only with a small offset.
+typedef struct DisInst {
+    DisOp op;
+    DisOperand src, mid, dst;
+} DisInst;
+
+/// A type descriptor, giving the size and pointer map of heap objects,
+/// frames and module data.
+typedef struct DisType {
+    uptr size;
+    uptr map_length;
+    u8 *map;
+} DisType;
+
+/// An item of initialised module data.
+typedef struct DisData {
+    /// One of the `DIS_DEF` kinds.
+    u8 kind;
+    /// The offset in module data that the item initialises.
+    i32 offset;
+    /// The number of elements, or the number of bytes of a string.
+    uptr count;
+    union {
+        /// For `DIS_DEFW`, `DIS_DEFL` and `DIS_DEFB`.
+        i64 int_value;
+        /// For `DIS_DEFF`.
+        f64 real_value;
+        /// For `DIS_DEFS`, the UTF-8 text.
+        /// \see DisModule_string
+        const char *string_value;
+    };
+} DisData;
+
+/// A function exported by the module.
+typedef struct DisLink {
+    /// The entry point of the function.
+    i32 pc;
+    /// The descriptor of the function's frame.
+    i32 type;
+    /// The signature of the function's type.
+    u32 signature;
+    const char *name;
+} DisLink;
+
+/// A function imported from another module.
+typedef struct DisImportFn {
+    u32 signature;
+    const char *name;
+} DisImportFn;
+
+/// The functions imported from one module, in the order that `mframe` and
+/// `mcall` index them.
+typedef struct DisImport {
+    DisImportFn *fns;
+    uptr n_fns, fns_capacity;
+} DisImport;
+
+/// A Dis module being built in memory.
+typedef struct DisModule {
+    Allocator *allocator;
+    /// The name of the module.
+    const char *name;
+    /// Runtime flags.
+    u32 flags;
+    /// The largest frame size of any function.
+    uptr stack_extent;
+    /// The entry point and its frame descriptor, or -1 if there are none.
+    i32 entry_pc, entry_type;
+    /// The size of module data.
+    uptr data_size;
+
+    DisInst *code;
+    uptr n_code, code_capacity;
+    DisType *types;
+    uptr n_types, types_capacity;
+    DisData *data;
+    uptr n_data, data_capacity;
+    DisLink *links;
+    uptr n_links, links_capacity;
+    DisImport *imports;
+    uptr n_imports, imports_capacity;
+    /// Strings owned by the module.
+    /// \see DisModule_string
+    char **strings;
+    uptr n_strings, strings_capacity;
+} DisModule;
+
+/// Create an empty module.
+/// \param allocator The allocator to allocate the module from.
+/// \param name The name of the module, which is copied.
+/// \return The new module.
+DisModule *DisModule_new(Allocator *allocator, const char *name);
+
+/// Free a module.
+/// \param self The module.
+void DisModule_free(DisModule *self);
+
+/// Append an instruction.
+/// \param self The module.
+/// \param inst The instruction.
+/// \return The program counter of the instruction.
+i32 DisModule_emit(DisModule *self, DisInst inst);
+
+/// Add a type descriptor.
+/// \param self The module.
+/// \param size The size of the described object.
+/// \param map The pointer map, which is copied.
+/// \param map_length The length of the map in bytes.
+/// \return The index of the descriptor.
+i32 DisModule_add_type(DisModule *self, uptr size, const u8 *map,
+                       uptr map_length);
+
+/// Replace a type descriptor, e.g. one reserved before its size was known.
+/// \param self The module.
+/// \param index The index of the descriptor.
+/// \param size The size of the described object.
+/// \param map The pointer map, which is copied.
+/// \param map_length The length of the map in bytes.
+void DisModule_set_type(DisModule *self, i32 index, uptr size, const u8 *map,
+                        uptr map_length);
+
+/// Add an item of initialised module data.
+/// \param self The module.
+/// \param data The item.
+void DisModule_add_data(DisModule *self, DisData data);
+
+/// Export a function.
+/// \param self The module.
+/// \param link The exported function.
+void DisModule_add_link(DisModule *self, DisLink link);
+
+/// Add an empty import table for a module that is loaded.
+/// \param self The module.
+/// \return The index of the import table, for the `load` instruction.
+i32 DisModule_add_import(DisModule *self);
+
+/// Add a function to an import table, if it is not already there.
+/// \param self The module.
+/// \param import The index of the import table.
+/// \param name The name of the function, which is copied.
+/// \param signature The signature of the function.
+/// \return The index of the function within the table, for `mframe`
+/// and `mcall`.
+i32 DisModule_import_fn(DisModule *self, i32 import, const char *name,
+                        u32 signature);
+
+/// Copy a string into storage owned by the module, so that names and data
+/// can outlive the syntax tree they came from.
+/// \param self The module.
+/// \param text The text to copy. It does not need to be NUL-terminated.
+/// \param length The length of the text.
+/// \return The NUL-terminated copy.
+const char *DisModule_string(DisModule *self, const char *text, uptr length);
+
+/// The size of the buffer that `.dis` files are encoded through.
+#define DIS_WRITER_BUFFER (64 * 1024)
+
+/// A buffered writer that encodes a module straight to a stream.
+/// The encoding of a module never exists in memory as a whole; at most one
+/// buffer's worth is held before it is flushed.
+typedef struct DisWriter {
+    FILE *out;
+    /// The number of bytes written to `out` so far.
+    uptr written;
+    /// Whether any write to `out` has failed.
+    bool failed;
+    uptr length;
+    u8 buffer[DIS_WRITER_BUFFER];
+} DisWriter;
+
+/// Initialise a writer.
+/// \param self The writer.
+/// \param out The stream to write to.
+void DisWriter_init(DisWriter *self, FILE *out);
+
+/// Write a single byte.
+void DisWriter_byte(DisWriter *self, u8 byte);
+
+/// Write bytes.
+void DisWriter_bytes(DisWriter *self, const void *bytes, uptr length);
+
+/// Write a value in the variable-length operand encoding: one byte for
+/// values in [-64, 63], two bytes for [-8192, 8191], and four bytes for
+/// any other 30-bit value.
+void DisWriter_operand(DisWriter *self, i32 value);
+
+/// Write a 32-bit big-endian word.
+void DisWriter_word(DisWriter *self, u32 value);
+
+/// Flush any buffered bytes to the stream.
+/// \return Whether every write succeeded.
+bool DisWriter_flush(DisWriter *self);
+
+/// Encode a module in the `.dis` object format.
+/// \param module The module.
+/// \param writer The writer to encode through; it is flushed at the end.
+/// \return Whether the module was written successfully.
+bool dis_write_module(const DisModule *module, DisWriter *writer);
+
+/// Encode a module to a `.dis` file.
+/// \param module The module.
+/// \param path The path of the file to create.
+/// \return Whether the file was written successfully.
+bool dis_write_file(const DisModule *module, const char *path);
+
+/// Decode a module from the `.dis` object format, as `dis_write_module`
+/// encodes it.
+/// \param allocator The allocator to allocate the module from.
+/// \param bytes The encoded module.
+/// \param length The length of the encoding.
+/// \return The module, or `NULL` if the encoding is truncated or invalid.
+/// \remark Data items are split into one item per element.
+DisModule *dis_read_module(Allocator *allocator, const u8 *bytes,
+                           uptr length);
+
+/// Decode a module from a `.dis` file.
+/// \param allocator The allocator to allocate the module from.
+/// \param path The path of the file.
+/// \return The module, or `NULL` if the file cannot be read or is invalid.
+DisModule *dis_read_file(Allocator *allocator, const char *path);
+
+/// The assembler mnemonic of an instruction.
+/// \param op The opcode.
+/// \return The mnemonic, e.g. `"addw"`.
+const char *dis_op_name(DisOp op);
+
+#endif //LIMBO_DIS_H
@@ -0,0 +1,892 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "driver.h"
+#include "error.h"
+
+// The source cache
+
+void SourceCache_init(SourceCache *self, Allocator *allocator) {
+    *self = (SourceCache) {.allocator = allocator};
+    self->paths = Interner_new(allocator);
+}
+
+static void release_source(SourceCache *self, CachedSource *source) {
+    Token_free(source->tokens, self->allocator);
+    FREE(self->allocator, source->includes);
+    FREE(self->allocator, (char *) source->file.contents);
+}
+
+void SourceCache_free(SourceCache *self) {
+    for (uptr i = 0; i < self->sources_capacity; i++) {
+        if (self->sources[i] != NULL) {
+            release_source(self, self->sources[i]);
+            FREE(self->allocator, self->sources[i]);
+        }
+    }
+    FREE(self->allocator, self->sources);
+    FREE(self->allocator, self->include_dirs);
+    Interner_free(self->paths);
+}
+
+void SourceCache_include(SourceCache *self, const char *dir) {
+    GROW(self->allocator, self->include_dirs, self->n_include_dirs,
+         self->include_dirs_capacity);
+    self->include_dirs[self->n_include_dirs++] = dir;
+}
+
+/// Read a whole file.
+/// \return The contents, NUL-terminated, or `NULL` if it cannot be read.
+static char *read_file(Allocator *allocator, const char *path, uptr *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    char *contents = NULL;
+    uptr length = 0, capacity = 0;
+    for (;;) {
+        // Room for at least one more byte, and the NUL.
+        GROW(allocator, contents, length + 1, capacity);
+        uptr n = fread(contents + length, 1, capacity - length - 1, file);
+        length += n;
+        if (n == 0) {
+            break;
+        }
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    if (failed) {
+        FREE(allocator, contents);
+        return NULL;
+    }
+    contents[length] = '\0';
+    *size = length;
+    return contents;
+}
+
+/// The FNV-1a hash of a file's contents.
+static u64 hash_bytes(const char *bytes, uptr length) {
+    u64 hash = 14695981039346656037u;
+    for (uptr i = 0; i < length; i++) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+/// Lex a file in a child process, which is all a lexical error, which
+/// exits, can end. The child's messages are copied to `errors`.
+/// \return Whether the file lexed.
+static bool probe(SourceCache *self, const SourceFile *file, FILE *errors) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        fprintf(errors, "cannot lex '%s' apart\n", file->name);
+        return false;
+    }
+    // The child must not write out what is buffered here a second time.
+    fflush(stdout);
+    fflush(stderr);
+    fflush(errors);
+    pid_t child = fork();
+    if (child < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        fprintf(errors, "cannot lex '%s' apart\n", file->name);
+        return false;
+    }
+    if (child == 0) {
+        close(pipe_fds[0]);
+        dup2(pipe_fds[1], STDERR_FILENO);
+        lex((SourceFile *) file, self->allocator);
+        _exit(EXIT_SUCCESS);
+    }
+    close(pipe_fds[1]);
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(pipe_fds[0], buffer, sizeof buffer)) != 0) {
+        if (n > 0) {
+            fwrite(buffer, 1, (uptr) n, errors);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    close(pipe_fds[0]);
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/// Note the names a file includes: each `include` followed by a string.
+static void find_includes(SourceCache *self, CachedSource *source) {
+    uptr capacity = 0;
+    for (Token *t = source->tokens; t != NULL && t->next != NULL;
+         t = t->next) {
+        if (t->kind == TOKEN_KEYWORD && t->length == 7
+            && memcmp(t->location, "include", 7) == 0
+            && t->next->kind == TOKEN_STRING) {
+            GROW(self->allocator, source->includes, source->n_includes,
+                 capacity);
+            source->includes[source->n_includes++] = t->next->string_value;
+        }
+    }
+}
+
+CachedSource *SourceCache_get(SourceCache *self, const char *path,
+                              FILE *errors) {
+    struct stat st;
+    char *real = realpath(path, NULL);
+    if (real == NULL || stat(real, &st) != 0) {
+        fprintf(errors, "cannot read '%s'\n", path);
+        free(real);
+        return NULL;
+    }
+    Symbol symbol = Interner_intern(self->paths, real, strlen(real));
+    free(real);
+    const char *name = Interner_name(self->paths, symbol);
+    GROW(self->allocator, self->sources, symbol, self->sources_capacity);
+    CachedSource *source = self->sources[symbol];
+    if (source != NULL && source->size == (u64) st.st_size
+        && source->mtime.tv_sec == st.st_mtim.tv_sec
+        && source->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        self->hits++;
+        return source;
+    }
+
+    uptr size = 0;
+    char *contents = read_file(self->allocator, name, &size);
+    if (contents == NULL) {
+        fprintf(errors, "cannot read '%s'\n", path);
+        return NULL;
+    }
+    u64 hash = hash_bytes(contents, size);
+    if (source != NULL && source->size == size && source->hash == hash) {
+        // Touched, but not changed.
+        source->mtime = st.st_mtim;
+        FREE(self->allocator, contents);
+        self->hits++;
+        return source;
+    }
+    SourceFile file = {
+        .name = name,
+        .file_number = symbol,
+        .contents = contents,
+    };
+    if (self->isolate && !probe(self, &file, errors)) {
+        FREE(self->allocator, contents);
+        return NULL;
+    }
+
+    if (source == NULL) {
+        source = ALLOC(self->allocator, sizeof(CachedSource));
+        self->sources[symbol] = source;
+    } else {
+        release_source(self, source);
+        *source = (CachedSource) {0};
+    }
+    source->file = file;
+    source->mtime = st.st_mtim;
+    source->size = size;
+    source->hash = hash;
+    source->tokens = lex(&source->file, self->allocator);
+    find_includes(self, source);
+    self->lexed++;
+    return source;
+}
+
+// Compiling
+
+void print_token(const Token *token, FILE *out) {
+    const char *kind = "";
+    switch (token->kind) {
+        case TOKEN_IDENTIFIER:
+            kind = "IDENTIFIER";
+            break;
+        case TOKEN_PUNCTUATOR:
+            kind = "PUNCTUATOR";
+            break;
+        case TOKEN_KEYWORD:
+            kind = "KEYWORD";
+            break;
+        case TOKEN_STRING:
+            kind = "STRING";
+            break;
+        case TOKEN_INTEGRAL:
+            kind = "INTEGRAL";
+            break;
+        case TOKEN_REAL:
+            kind = "REAL";
+            break;
+        case TOKEN_EOF:
+            kind = "EOF";
+            break;
+    }
+    fprintf(out, "%s at (%lu, %lu): ", kind, token->source_file_line,
+            token->source_file_column);
+    switch (token->kind) {
+        case TOKEN_IDENTIFIER:
+        case TOKEN_PUNCTUATOR:
+        case TOKEN_KEYWORD:
+            fprintf(out, "%.*s", (int) token->length, token->location);
+            break;
+        case TOKEN_STRING:
+            fprintf(out, "\"%s\"", token->string_value);
+            break;
+        case TOKEN_INTEGRAL:
+            fprintf(out, "%ld", token->int_value);
+            break;
+        case TOKEN_REAL:
+            fprintf(out, "%f", token->real_value);
+            break;
+        case TOKEN_EOF:
+            break;
+    }
+    fputc('\n', out);
+}
+
+/// Find a file that a source file includes: beside it, or else in one of
+/// the include directories.
+/// \return The path, which the caller frees, or `NULL`.
+static char *find_include(SourceCache *cache, const char *from,
+                          const char *name) {
+    if (name[0] == '/') {
+        return access(name, R_OK) == 0 ? strdup(name) : NULL;
+    }
+    const char *slash = strrchr(from, '/');
+    char path[PATH_MAX];
+    if (slash == NULL) {
+        snprintf(path, sizeof path, "%s", name);
+    } else {
+        snprintf(path, sizeof path, "%.*s/%s", (int) (slash - from), from,
+                 name);
+    }
+    for (uptr i = 0; access(path, R_OK) != 0; i++) {
+        if (i == cache->n_include_dirs) {
+            return NULL;
+        }
+        snprintf(path, sizeof path, "%s/%s", cache->include_dirs[i], name);
+    }
+    return strdup(path);
+}
+
+bool driver_compile(SourceCache *cache, const char *path, FILE *out,
+                    FILE *errors) {
+    CachedSource *source = SourceCache_get(cache, path, errors);
+    if (source == NULL) {
+        return false;
+    }
+    // Every file included, directly or not, is lexed once.
+    Allocator *a = cache->allocator;
+    CachedSource **seen = NULL;
+    uptr n_seen = 0, seen_capacity = 0;
+    GROW(a, seen, n_seen, seen_capacity);
+    seen[n_seen++] = source;
+    bool ok = true;
+    for (uptr i = 0; ok && i < n_seen; i++) {
+        for (uptr j = 0; ok && j < seen[i]->n_includes; j++) {
+            char *include = find_include(cache, seen[i]->file.name,
+                                         seen[i]->includes[j]);
+            if (include == NULL) {
+                fprintf(errors, "%s: cannot find include '%s'\n",
+                        seen[i]->file.name, seen[i]->includes[j]);
+                ok = false;
+                continue;
+            }
+            CachedSource *included = SourceCache_get(cache, include, errors);
+            free(include);
+            ok = included != NULL;
+            bool repeat = false;
+            for (uptr k = 0; ok && k < n_seen; k++) {
+                repeat |= seen[k] == included;
+            }
+            if (ok && !repeat) {
+                GROW(a, seen, n_seen, seen_capacity);
+                seen[n_seen++] = included;
+            }
+        }
+    }
+    FREE(a, seen);
+    for (Token *t = ok ? source->tokens : NULL; t != NULL; t = t->next) {
+        print_token(t, out);
+    }
+    return ok;
+}
+
+// Scanning dependencies
+
+/// A module that a file loads.
+typedef struct DepsLoad {
+    /// The module type.
+    Symbol module;
+    /// The path, when it is written as a string.
+    Symbol path;
+    /// Otherwise, the constant that holds the path: `of->name`, or `name`
+    /// with `of` 0.
+    Symbol of, name;
+} DepsLoad;
+
+/// A string constant, which a `load` may name as its path.
+typedef struct DepsConstant {
+    /// The module it is declared in, or 0.
+    Symbol module;
+    Symbol name, value;
+} DepsConstant;
+
+/// What the dependency scan has found so far.
+typedef struct Deps {
+    Allocator *allocator;
+    /// Every name, path and string the scan keeps.
+    Interner *names;
+    /// The names included, as written, in the order they were found.
+    Symbol *includes;
+    uptr n_includes, includes_capacity;
+    /// The modules implemented.
+    Symbol *implements;
+    uptr n_implements, implements_capacity;
+    DepsLoad *loads;
+    uptr n_loads, loads_capacity;
+    DepsConstant *constants;
+    uptr n_constants, constants_capacity;
+    /// The module whose declaration the scan is in, or 0, and the depth of
+    /// braces it was declared at.
+    Symbol module;
+    uptr depth, module_depth;
+} Deps;
+
+static void push_symbol(Allocator *allocator, Symbol **items, uptr *count,
+                        uptr *capacity, Symbol symbol) {
+    GROW(allocator, *items, *count, *capacity);
+    (*items)[(*count)++] = symbol;
+}
+
+static Symbol deps_name(Deps *deps, const char *start, const char *end) {
+    return Interner_intern(deps->names, start, (uptr) (end - start));
+}
+
+static bool is_name_start(char c) {
+    return isalpha((unsigned char) c) || c == '_' || (unsigned char) c >= 0x80;
+}
+
+static const char *skip_name(const char *p, const char *end) {
+    while (p < end && (is_name_start(*p) || isdigit((unsigned char) *p))) {
+        p++;
+    }
+    return p;
+}
+
+/// Skip white space and comments.
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end) {
+        if (*p == '#') {
+            const char *newline = memchr(p, '\n', (uptr) (end - p));
+            p = newline != NULL ? newline : end;
+        } else if (isspace((unsigned char) *p)) {
+            p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+/// Skip a string or character literal from its opening quote.
+/// \return Just past the closing quote, or where the literal breaks off.
+static const char *skip_quoted(const char *p, const char *end) {
+    char quote = *p++;
+    if (quote == '`') {
+        const char *close = memchr(p, '`', (uptr) (end - p));
+        return close != NULL ? close + 1 : end;
+    }
+    // The text is NUL-terminated at `end`, which stops `strcspn`.
+    const char stops[] = {quote, '\\', '\n', '\0'};
+    while (p < end) {
+        p += strcspn(p, stops);
+        if (p >= end || *p == '\n') {
+            break;
+        }
+        if (*p == quote) {
+            return p + 1;
+        }
+        p += *p == '\\' ? 2 : 1;
+    }
+    return p < end ? p : end;
+}
+
+/// Read a string literal, if there is one.
+/// \param value Set to its text as written, or 0 if there is none.
+/// \return Where the literal ends.
+static const char *scan_string(Deps *deps, const char *p, const char *end,
+                               Symbol *value) {
+    *value = 0;
+    if (p == end || *p != '"') {
+        return p;
+    }
+    const char *close = skip_quoted(p, end);
+    if (close - p >= 2 && close[-1] == '"') {
+        *value = deps_name(deps, p + 1, close - 1);
+    }
+    return close;
+}
+
+/// Look at what follows a name, for the few constructs that give
+/// dependencies away: `include "file"`, `implement Name, ...`,
+/// `load Module path`, and the string constants of modules, which a path
+/// may name.
+/// \param start The start of the name.
+/// \param p The end of the name.
+/// \return Where to carry on scanning.
+static const char *scan_name(Deps *deps, const char *start, const char *p,
+                             const char *end) {
+    Allocator *a = deps->allocator;
+    uptr length = (uptr) (p - start);
+    if (length == 7 && memcmp(start, "include", 7) == 0) {
+        Symbol name;
+        p = scan_string(deps, skip_blanks(p, end), end, &name);
+        if (name != 0) {
+            push_symbol(a, &deps->includes, &deps->n_includes,
+                        &deps->includes_capacity, name);
+        }
+        return p;
+    }
+    if (length == 9 && memcmp(start, "implement", 9) == 0) {
+        for (;;) {
+            const char *name = skip_blanks(p, end);
+            p = skip_name(name, end);
+            if (p == name) {
+                return p;
+            }
+            push_symbol(a, &deps->implements, &deps->n_implements,
+                        &deps->implements_capacity, deps_name(deps, name, p));
+            p = skip_blanks(p, end);
+            if (p == end || *p != ',') {
+                return p;
+            }
+            p++;
+        }
+    }
+    if (length == 4 && memcmp(start, "load", 4) == 0) {
+        DepsLoad load = {0};
+        const char *name = skip_blanks(p, end);
+        p = skip_name(name, end);
+        if (p == name) {
+            return p;
+        }
+        load.module = deps_name(deps, name, p);
+        p = skip_blanks(p, end);
+        if (p < end && *p == '"') {
+            p = scan_string(deps, p, end, &load.path);
+        } else {
+            name = p;
+            p = skip_name(name, end);
+            if (p == name) {
+                return p;
+            }
+            load.name = deps_name(deps, name, p);
+            const char *arrow = skip_blanks(p, end);
+            if (arrow[0] == '-' && arrow[1] == '>') {
+                name = skip_blanks(arrow + 2, end);
+                p = skip_name(name, end);
+                if (p == name) {
+                    return p;
+                }
+                load.of = load.name;
+                load.name = deps_name(deps, name, p);
+            }
+        }
+        GROW(a, deps->loads, deps->n_loads, deps->loads_capacity);
+        deps->loads[deps->n_loads++] = load;
+        return p;
+    }
+
+    // `Name: module` opens a module declaration, and `Name: con "..."`
+    // declares a string constant.
+    const char *colon = skip_blanks(p, end);
+    if (colon == end || colon[0] != ':' || colon[1] == '='
+        || colon[1] == ':') {
+        return p;
+    }
+    const char *word = skip_blanks(colon + 1, end);
+    const char *word_end = skip_name(word, end);
+    uptr word_length = (uptr) (word_end - word);
+    if (word_length == 6 && memcmp(word, "module", 6) == 0) {
+        deps->module = deps_name(deps, start, p);
+        deps->module_depth = deps->depth;
+        return word_end;
+    }
+    if (word_length == 3 && memcmp(word, "con", 3) == 0) {
+        DepsConstant constant = {
+            .module = deps->module,
+            .name = deps_name(deps, start, p),
+        };
+        p = scan_string(deps, skip_blanks(word_end, end), end,
+                        &constant.value);
+        if (constant.value != 0) {
+            GROW(a, deps->constants, deps->n_constants,
+                 deps->constants_capacity);
+            deps->constants[deps->n_constants++] = constant;
+        }
+        return p;
+    }
+    return p;
+}
+
+/// Scan a file for dependencies, skipping comments and literals whole and
+/// looking only at names.
+/// \param p The contents, NUL-terminated at `end`.
+static void scan_file(Deps *deps, const char *p, const char *end) {
+    deps->module = 0;
+    deps->depth = 0;
+    while (p < end) {
+        char c = *p;
+        if (is_name_start(c)) {
+            const char *start = p;
+            p = scan_name(deps, start, skip_name(p, end), end);
+        } else if (isdigit((unsigned char) c)) {
+            p = skip_name(p, end);
+        } else if (c == '#') {
+            const char *newline = memchr(p, '\n', (uptr) (end - p));
+            p = newline != NULL ? newline : end;
+        } else if (c == '"' || c == '\'' || c == '`') {
+            p = skip_quoted(p, end);
+        } else {
+            if (c == '{') {
+                deps->depth++;
+            } else if (c == '}' && deps->depth > 0) {
+                deps->depth--;
+                if (deps->module != 0 && deps->depth == deps->module_depth) {
+                    deps->module = 0;
+                }
+            }
+            p++;
+        }
+    }
+}
+
+/// The path a load names, if the files scanned say what it is.
+static Symbol load_path(const Deps *deps, const DepsLoad *load) {
+    if (load->path != 0) {
+        return load->path;
+    }
+    for (uptr i = 0; i < deps->n_constants; i++) {
+        const DepsConstant *constant = &deps->constants[i];
+        if (constant->module == load->of && constant->name == load->name) {
+            return constant->value;
+        }
+    }
+    return 0;
+}
+
+/// Write a path as a Makefile rule names it.
+static void write_make_path(const char *path, FILE *out) {
+    for (; *path != '\0'; path++) {
+        if (*path == ' ' || *path == '#') {
+            fputc('\\', out);
+        } else if (*path == '$') {
+            fputc('$', out);
+        }
+        fputc(*path, out);
+    }
+}
+
+static void write_json_string(const char *text, FILE *out) {
+    fputc('"', out);
+    for (; *text != '\0'; text++) {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_json_names(Interner *names, const Symbol *symbols,
+                             uptr count, FILE *out) {
+    fputc('[', out);
+    for (uptr i = 0; i < count; i++) {
+        fputs(i > 0 ? ", " : "", out);
+        write_json_string(Interner_name(names, symbols[i]), out);
+    }
+    fputc(']', out);
+}
+
+bool driver_deps(SourceCache *cache, const char *path, DepsFormat format,
+                 FILE *out, FILE *errors) {
+    Allocator *a = cache->allocator;
+    Deps deps = {.allocator = a, .names = Interner_new(a)};
+    // The files scanned, as they were found and by real path.
+    Symbol *files = NULL, *real_files = NULL;
+    uptr n_files = 0, files_capacity = 0, n_real_files = 0,
+            real_files_capacity = 0;
+    char *real = realpath(path, NULL);
+    const char *key = real != NULL ? real : path;
+    push_symbol(a, &files, &n_files, &files_capacity,
+                Interner_intern(deps.names, path, strlen(path)));
+    push_symbol(a, &real_files, &n_real_files, &real_files_capacity,
+                Interner_intern(deps.names, key, strlen(key)));
+    free(real);
+
+    bool ok = true;
+    for (uptr i = 0; ok && i < n_files; i++) {
+        const char *name = Interner_name(deps.names, files[i]);
+        uptr size = 0;
+        char *contents = read_file(a, name, &size);
+        if (contents == NULL) {
+            fprintf(errors, "cannot read '%s'\n", name);
+            ok = false;
+            break;
+        }
+        uptr first = deps.n_includes;
+        scan_file(&deps, contents, contents + size);
+        FREE(a, contents);
+
+        for (uptr j = first; ok && j < deps.n_includes; j++) {
+            const char *written = Interner_name(deps.names, deps.includes[j]);
+            char *include = find_include(cache, name, written);
+            if (include == NULL) {
+                fprintf(errors, "%s: cannot find include '%s'\n", name,
+                        written);
+                ok = false;
+                break;
+            }
+            real = realpath(include, NULL);
+            key = real != NULL ? real : include;
+            Symbol real_symbol = Interner_intern(deps.names, key, strlen(key));
+            free(real);
+            bool repeat = false;
+            for (uptr k = 0; k < n_files; k++) {
+                repeat |= real_files[k] == real_symbol;
+            }
+            if (!repeat) {
+                push_symbol(a, &files, &n_files, &files_capacity,
+                            Interner_intern(deps.names, include,
+                                            strlen(include)));
+                push_symbol(a, &real_files, &n_real_files,
+                            &real_files_capacity, real_symbol);
+            }
+            free(include);
+        }
+    }
+
+    // The object is the source with `.b` replaced by `.dis`.
+    uptr length = strlen(path);
+    if (length > 2 && strcmp(path + length - 2, ".b") == 0) {
+        length -= 2;
+    }
+    char target[PATH_MAX + 4];
+    snprintf(target, sizeof target, "%.*s.dis", (int) length, path);
+
+    if (ok && format == DEPS_MAKE) {
+        write_make_path(target, out);
+        fputc(':', out);
+        for (uptr i = 0; i < n_files; i++) {
+            fputc(' ', out);
+            write_make_path(Interner_name(deps.names, files[i]), out);
+        }
+        fputc('\n', out);
+        // A rule for each included file, so that deleting one does not
+        // stop make.
+        for (uptr i = 1; i < n_files; i++) {
+            fputc('\n', out);
+            write_make_path(Interner_name(deps.names, files[i]), out);
+            fputs(":\n", out);
+        }
+    } else if (ok) {
+        fputs("{\"source\": ", out);
+        write_json_string(path, out);
+        fputs(", \"target\": ", out);
+        write_json_string(target, out);
+        fputs(", \"implements\": ", out);
+        write_json_names(deps.names, deps.implements, deps.n_implements,
+                         out);
+        fputs(", \"includes\": ", out);
+        write_json_names(deps.names, files + 1, n_files - 1, out);
+        fputs(", \"loads\": [", out);
+        for (uptr i = 0; i < deps.n_loads; i++) {
+            Symbol load = load_path(&deps, &deps.loads[i]);
+            fputs(i > 0 ? ", " : "", out);
+            fputs("{\"module\": ", out);
+            write_json_string(Interner_name(deps.names, deps.loads[i].module),
+                              out);
+            fputs(", \"path\": ", out);
+            if (load != 0) {
+                write_json_string(Interner_name(deps.names, load), out);
+            } else {
+                fputs("null", out);
+            }
+            fputc('}', out);
+        }
+        fputs("]}\n", out);
+    }
+
+    FREE(a, files);
+    FREE(a, real_files);
+    FREE(a, deps.includes);
+    FREE(a, deps.implements);
+    FREE(a, deps.loads);
+    FREE(a, deps.constants);
+    Interner_free(deps.names);
+    return ok;
+}
+
+// The server
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int signal) {
+    (void) signal;
+    stopping = 1;
+}
+
+static bool write_all(int fd, const char *bytes, uptr length) {
+    while (length > 0) {
+        ssize_t n = write(fd, bytes, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        length -= (uptr) n;
+    }
+    return true;
+}
+
+/// Answer one request on a connection.
+static void answer(SourceCache *cache, int client) {
+    char path[PATH_MAX];
+    uptr length = 0;
+    char *newline = NULL;
+    while (newline == NULL && length < sizeof path - 1) {
+        ssize_t n = read(client, path + length, sizeof path - 1 - length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        newline = memchr(path + length, '\n', (uptr) n);
+        length += (uptr) n;
+    }
+    if (newline == NULL) {
+        return;
+    }
+    *newline = '\0';
+
+    char *output = NULL, *messages = NULL;
+    size_t output_length = 0, messages_length = 0;
+    FILE *out = open_memstream(&output, &output_length);
+    FILE *errors = open_memstream(&messages, &messages_length);
+    if (out == NULL || errors == NULL) {
+        error("cannot buffer a reply\n");
+    }
+    bool ok = driver_compile(cache, path, out, errors);
+    fclose(out);
+    fclose(errors);
+    if (write_all(client, ok ? "0" : "1", 1)) {
+        write_all(client, ok ? output : messages,
+                  ok ? output_length : messages_length);
+    }
+    free(output);
+    free(messages);
+}
+
+bool driver_serve(SourceCache *cache, const char *socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof address.sun_path) {
+        fprintf(stderr, "socket path '%s' is too long\n", socket_path);
+        return false;
+    }
+    strcpy(address.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0
+        || bind(listener, (struct sockaddr *) &address, sizeof address) != 0
+        || listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "cannot listen on '%s': %s\n", socket_path,
+                strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        return false;
+    }
+    // Without SA_RESTART, a signal interrupts accept, so that the loop sees
+    // it is time to stop.
+    struct sigaction action = {.sa_handler = stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    while (!stopping) {
+        int client = accept(listener, NULL, NULL);
+        if (client >= 0) {
+            answer(cache, client);
+            close(client);
+        }
+    }
+    close(listener);
+    unlink(socket_path);
+    return true;
+}
+
+bool driver_request(const char *socket_path, const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    char *real = realpath(path, NULL);
+    if (real == NULL) {
+        fprintf(stderr, "cannot read '%s'\n", path);
+        return false;
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    strncpy(address.sun_path, socket_path, sizeof address.sun_path - 1);
+    if (server < 0
+        || connect(server, (struct sockaddr *) &address, sizeof address)
+           != 0) {
+        fprintf(stderr, "cannot connect to '%s': %s\n", socket_path,
+                strerror(errno));
+        free(real);
+        if (server >= 0) {
+            close(server);
+        }
+        return false;
+    }
+    bool sent = write_all(server, real, strlen(real))
+                && write_all(server, "\n", 1);
+    free(real);
+
+    char status = '1';
+    bool got_status = false;
+    char buffer[4096];
+    ssize_t n;
+    while (sent && (n = read(server, buffer, sizeof buffer)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        const char *text = buffer;
+        if (!got_status) {
+            status = buffer[0];
+            got_status = true;
+            text++;
+            n--;
+        }
+        fwrite(text, 1, (uptr) n, status == '0' ? stdout : stderr);
+    }
+    close(server);
+    if (!got_status) {
+        fprintf(stderr, "no reply from '%s'\n", socket_path);
+    }
+    return got_status && status == '0';
+}
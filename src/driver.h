@@ -0,0 +1,128 @@
+#ifndef LIMBO_DRIVER_H
+#define LIMBO_DRIVER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "alloc.h"
+#include "intern.h"
+#include "lexer.h"
+#include "num.h"
+
+/// A source file as it was lexed, kept for as long as it does not change.
+typedef struct CachedSource {
+    /// The file, named by its real path, and its contents.
+    SourceFile file;
+    /// What the file looked like when it was read, to tell whether it has
+    /// changed since.
+    struct timespec mtime;
+    u64 size, hash;
+    Token *tokens;
+    /// The names the file includes, as written, which point into `tokens`.
+    const char **includes;
+    uptr n_includes;
+} CachedSource;
+
+/// Lexed source files, so that a file that many compiles include is read
+/// and lexed once rather than once each.
+typedef struct SourceCache {
+    Allocator *allocator;
+    /// The real paths of the files, interned; a path's symbol indexes
+    /// `sources`.
+    Interner *paths;
+    CachedSource **sources;
+    uptr sources_capacity;
+    /// Directories to look for included files in, after the directory of
+    /// the file that includes them.
+    const char **include_dirs;
+    uptr n_include_dirs, include_dirs_capacity;
+    /// Whether to lex new and changed files in a child process first, so
+    /// that a lexical error is reported rather than exiting.
+    bool isolate;
+    /// The number of times a file was found unchanged, and lexed.
+    u64 hits, lexed;
+} SourceCache;
+
+/// Initialise an empty cache.
+/// \param self The cache.
+/// \param allocator The allocator for the cache and the tokens.
+void SourceCache_init(SourceCache *self, Allocator *allocator);
+
+/// Free a cache and every file in it.
+/// \param self The cache.
+void SourceCache_free(SourceCache *self);
+
+/// Add a directory to look for included files in.
+/// \param self The cache.
+/// \param dir The directory, which must outlive the cache.
+void SourceCache_include(SourceCache *self, const char *dir);
+
+/// Look up a source file, reading and lexing it again if it has changed.
+/// A file whose modification time or size differ, but whose contents hash
+/// the same, is not lexed again.
+/// \param self The cache.
+/// \param path The path of the file.
+/// \param errors Where to report why the file cannot be had.
+/// \return The file, or `NULL` if it cannot be read or, when `isolate` is
+/// set, lexed.
+CachedSource *SourceCache_get(SourceCache *self, const char *path,
+                              FILE *errors);
+
+/// Print a token, as the compiler's token dump shows it.
+/// \param token The token.
+/// \param out Where to print it.
+void print_token(const Token *token, FILE *out);
+
+/// Compile a source file: lex it and every file it includes.
+/// \param cache The cache to take the files from.
+/// \param path The path of the file.
+/// \param out Where the token dump of the file goes.
+/// \param errors Where errors go.
+/// \return Whether the file and everything it includes were found and
+/// lexed.
+bool driver_compile(SourceCache *cache, const char *path, FILE *out,
+                    FILE *errors);
+
+/// How `driver_deps` writes what a file depends on.
+typedef enum DepsFormat {
+    /// A Makefile rule making the `.dis` file depend on the source and
+    /// everything it includes, and an empty rule for each included file.
+    DEPS_MAKE,
+    /// A line of JSON giving the source, the `.dis` file, the modules
+    /// implemented, the files included, and the modules loaded with their
+    /// paths, or `null` where a path is not a string constant.
+    DEPS_JSON,
+} DepsFormat;
+
+/// Find what a source file depends on, without lexing it: only `include`,
+/// `implement` and `load` and the string constants of modules are looked
+/// at, and everything else is skipped over.
+/// \param cache The cache, for its include directories. Its files are not
+/// used.
+/// \param path The path of the file.
+/// \param format How to write the dependencies.
+/// \param out Where the dependencies go.
+/// \param errors Where errors go.
+/// \return Whether the file and everything it includes were found.
+bool driver_deps(SourceCache *cache, const char *path, DepsFormat format,
+                 FILE *out, FILE *errors);
+
+/// Serve compile requests on a Unix domain socket until interrupted,
+/// keeping the cache warm between them.
+/// Each request is the path of a file followed by a newline. The reply is
+/// `'0'` followed by the output of `driver_compile`, or `'1'` followed by
+/// the errors.
+/// \param cache The cache, which should have `isolate` set.
+/// \param socket_path The path to listen on. Any socket already there is
+/// replaced.
+/// \return Whether the server started.
+bool driver_serve(SourceCache *cache, const char *socket_path);
+
+/// Send a compile request to a server, copying the output of the compile to
+/// standard output and any errors to standard error.
+/// \param socket_path The path the server listens on.
+/// \param path The path of the file to compile.
+/// \return Whether the compile succeeded.
+bool driver_request(const char *socket_path, const char *path);
+
+#endif //LIMBO_DRIVER_H
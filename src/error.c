@@ -42,9 +42,14 @@ static void formatted_error(const char *filename, const char *input,
 }
 
 noreturn void error_at(const SourceFile *file, const char *location, const char *fmt, ...) {
+    uptr line_number = 1;
+    for (const char *p = file->contents; p < location; p++) {
+        if (*p == '\n') line_number++;
+    }
+
     va_list args;
     va_start(args, fmt);
-    formatted_error(file->name, file->contents, file->file_number, location, fmt, args);
+    formatted_error(file->name, file->contents, line_number, location, fmt, args);
     va_end(args);
     exit(EXIT_FAILURE);
 }
@@ -53,7 +58,7 @@ noreturn void error_token(const Token *token, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
     formatted_error(token->source_file->name, token->source_file->contents,
-                    token->source_file->file_number, token->location, fmt, args);
+                    token->source_file_line, token->location, fmt, args);
     va_end(args);
     exit(EXIT_FAILURE);
 }
@@ -62,6 +67,88 @@ void warn_token(const Token *token, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
     formatted_error(token->source_file->name, token->source_file->contents,
-                    token->source_file->file_number, token->location, fmt, args);
+                    token->source_file_line, token->location, fmt, args);
+    va_end(args);
+}
+
+void Diagnostics_init(Diagnostics *self, Allocator *allocator) {
+    self->allocator = allocator;
+    self->head = NULL;
+    self->tail = &self->head;
+    self->errors = 0;
+}
+
+void Diagnostics_free(Diagnostics *self) {
+    Diagnostic *d = self->head;
+    while (d != NULL) {
+        Diagnostic *next = d->next;
+        FREE(self->allocator, d->message);
+        FREE(self->allocator, d);
+        d = next;
+    }
+    Diagnostics_init(self, self->allocator);
+}
+
+void Diagnostics_append(Diagnostics *self, Diagnostics *other) {
+    if (other->head == NULL) {
+        return;
+    }
+    *self->tail = other->head;
+    self->tail = other->tail;
+    self->errors += other->errors;
+    Diagnostics_init(other, other->allocator);
+}
+
+static void record(Diagnostics *self, const Token *token, bool is_error,
+                   const char *fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+
+    Diagnostic *d = ALLOC(self->allocator, sizeof(Diagnostic));
+    d->token = token;
+    d->is_error = is_error;
+    d->message = ALLOC(self->allocator, length + 1);
+    vsnprintf(d->message, length + 1, fmt, args);
+
+    *self->tail = d;
+    self->tail = &d->next;
+    if (is_error) {
+        self->errors++;
+    }
+}
+
+void diag_error(Diagnostics *self, const Token *token, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    record(self, token, true, fmt, args);
+    va_end(args);
+}
+
+void diag_warn(Diagnostics *self, const Token *token, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    record(self, token, false, fmt, args);
+    va_end(args);
+}
+
+/// Forward a message to `formatted_error` through a `va_list`.
+static void print_at(const Token *token, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    formatted_error(token->source_file->name, token->source_file->contents,
+                    token->source_file_line, token->location, fmt, args);
     va_end(args);
 }
+
+void Diagnostics_print(const Diagnostics *self) {
+    for (const Diagnostic *d = self->head; d != NULL; d = d->next) {
+        const char *prefix = d->is_error ? "" : "warning: ";
+        if (d->token) {
+            print_at(d->token, "%s%s", prefix, d->message);
+        } else {
+            fprintf(stderr, "%s%s\n", prefix, d->message);
+        }
+    }
+}
@@ -3,6 +3,7 @@
 
 #include <stdnoreturn.h>
 #include <stdarg.h>
+#include "alloc.h"
 #include "lexer.h"
 
 /// Report an error and then exit the program.
@@ -36,4 +37,64 @@ noreturn void error_token(const Token *token, const char *fmt, ...);
 /// \param ... The arguments for the format string.
 void warn_token(const Token *token, const char *fmt, ...);
 
+typedef struct Diagnostic Diagnostic;
+/// A diagnostic message that has been recorded but not yet reported.
+struct Diagnostic {
+    /// The next diagnostic in the list, if any.
+    Diagnostic *next;
+    /// The token that caused the diagnostic, or `NULL` if it has no location.
+    const Token *token;
+    /// Whether this diagnostic is an error, rather than a warning.
+    bool is_error;
+    /// The formatted message.
+    char *message;
+};
+
+/// An ordered list of diagnostics.
+/// Phases that run in parallel record their diagnostics here rather than
+/// exiting at the first error, so they can be reported in a deterministic
+/// order once every thread has finished.
+typedef struct Diagnostics {
+    /// The allocator that diagnostics are allocated from.
+    Allocator *allocator;
+    /// The first diagnostic, if any.
+    Diagnostic *head;
+    /// Where the next diagnostic will be linked.
+    Diagnostic **tail;
+    /// The number of errors recorded.
+    uptr errors;
+} Diagnostics;
+
+/// Initialise an empty list of diagnostics.
+/// \param self The list to initialise.
+/// \param allocator The allocator to allocate diagnostics from.
+void Diagnostics_init(Diagnostics *self, Allocator *allocator);
+
+/// Free every diagnostic in a list.
+/// \param self The list.
+void Diagnostics_free(Diagnostics *self);
+
+/// Move every diagnostic from `other` to the end of `self`.
+/// \param self The list to append to.
+/// \param other The list to empty.
+void Diagnostics_append(Diagnostics *self, Diagnostics *other);
+
+/// Print every diagnostic in a list, in the order they were recorded.
+/// \param self The list.
+void Diagnostics_print(const Diagnostics *self);
+
+/// Record an error caused by the given token.
+/// \param self The list to record the error in.
+/// \param token The token that caused the error, or `NULL`.
+/// \param fmt The format string for the error message.
+/// \param ... The arguments for the format string.
+void diag_error(Diagnostics *self, const Token *token, const char *fmt, ...);
+
+/// Record a warning caused by the given token.
+/// \param self The list to record the warning in.
+/// \param token The token that caused the warning, or `NULL`.
+/// \param fmt The format string for the warning message.
+/// \param ... The arguments for the format string.
+void diag_warn(Diagnostics *self, const Token *token, const char *fmt, ...);
+
 #endif //LIMBO_ERROR_H
@@ -0,0 +1,689 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "fold.h"
+#include "unicode.h"
+
+/// The state used while folding.
+typedef struct Folder {
+    /// The allocator for strings created by folding.
+    Allocator *allocator;
+    /// The list to record errors in.
+    Diagnostics *diagnostics;
+    /// Whether `con` declarations that have not been evaluated yet may be
+    /// evaluated on demand. Only true while evaluating module-level `con`s.
+    bool evaluate_cons;
+} Folder;
+
+static bool fold(Folder *folder, Node *node);
+static bool evaluate_con(Folder *folder, Decl *decl);
+
+bool is_constant(const Node *node) {
+    return node != NULL && (node->kind == NODE_INTEGRAL
+                            || node->kind == NODE_REAL
+                            || node->kind == NODE_STRING);
+}
+
+static bool is_integral(const Type *type) {
+    return type->kind == TInt || type->kind == TBig || type->kind == TByte;
+}
+
+/// The type of a literal, inferring it if no type has been assigned yet.
+static Type *literal_type(Node *node) {
+    if (node->type == NULL) {
+        switch (node->kind) {
+            case NODE_INTEGRAL:
+                node->type = node->int_value > INT32_MAX
+                             || node->int_value < INT32_MIN ? type_big
+                                                            : type_int;
+                break;
+            case NODE_REAL:
+                node->type = type_real;
+                break;
+            default:
+                node->type = type_string;
+                break;
+        }
+    }
+    return node->type;
+}
+
+/// Wrap a value to the width of an integral type.
+static i64 wrap(const Type *type, u64 value) {
+    switch (type->kind) {
+        case TInt: return (i32) (u32) value;
+        case TByte: return (u8) value;
+        default: return (i64) value;
+    }
+}
+
+/// The width of an integral type, in bits.
+static i64 width(const Type *type) {
+    switch (type->kind) {
+        case TInt: return 32;
+        case TByte: return 8;
+        default: return 64;
+    }
+}
+
+/// Replace a node with another, keeping its place in a statement list.
+static void replace(Node *node, const Node *with) {
+    Node *next = node->next;
+    *node = *with;
+    node->next = next;
+}
+
+static void clear_operands(Node *node) {
+    node->left = node->right = NULL;
+    node->cond = node->then = node->else_ = node->init = node->inc = NULL;
+    node->body = NULL;
+    node->decl = NULL;
+}
+
+static bool make_int(Node *node, Type *type, u64 value) {
+    clear_operands(node);
+    node->kind = NODE_INTEGRAL;
+    node->type = type;
+    node->int_value = wrap(type, value);
+    return true;
+}
+
+static bool make_real(Node *node, f64 value) {
+    clear_operands(node);
+    node->kind = NODE_REAL;
+    node->type = type_real;
+    node->real_value = value;
+    return true;
+}
+
+static bool make_string(Node *node, const char *value, uptr length) {
+    clear_operands(node);
+    node->kind = NODE_STRING;
+    node->type = type_string;
+    node->string_value = value;
+    node->string_length = length;
+    return true;
+}
+
+/// The number of code points in a UTF-8 string.
+static uptr codepoint_count(const char *str, uptr length) {
+    const char *p = str, *end = str + length;
+    uptr count = 0;
+    while (p < end) {
+        const char *next;
+        if (utf8_decode(p, &next) == 0 && *p != '\0') {
+            next = p + 1;
+        }
+        p = next;
+        count++;
+    }
+    return count;
+}
+
+static int compare_strings(const Node *left, const Node *right) {
+    uptr n = left->string_length < right->string_length
+             ? left->string_length : right->string_length;
+    int c = memcmp(left->string_value, right->string_value, n);
+    if (c != 0) {
+        return c;
+    }
+    return (left->string_length > right->string_length)
+           - (left->string_length < right->string_length);
+}
+
+static bool fold_comparison(Node *node, int c) {
+    switch (node->kind) {
+        case NODE_EQ: return make_int(node, type_int, c == 0);
+        case NODE_NEQ: return make_int(node, type_int, c != 0);
+        case NODE_LT: return make_int(node, type_int, c < 0);
+        case NODE_GT: return make_int(node, type_int, c > 0);
+        case NODE_LTE: return make_int(node, type_int, c <= 0);
+        case NODE_GTE: return make_int(node, type_int, c >= 0);
+        default: return false;
+    }
+}
+
+static bool fold_integral(Folder *folder, Node *node, Type *type,
+                          i64 a, i64 b) {
+    u64 ua = (u64) a, ub = (u64) b;
+    switch (node->kind) {
+        case NODE_ADD: return make_int(node, type, ua + ub);
+        case NODE_SUB: return make_int(node, type, ua - ub);
+        case NODE_MUL: return make_int(node, type, ua * ub);
+
+        case NODE_DIV:
+        case NODE_MOD:
+            if (b == 0) {
+                diag_error(folder->diagnostics, node->token,
+                           "division by zero");
+                return false;
+            }
+            // Dividing the most negative value by -1 overflows, and wraps.
+            if (b == -1) {
+                return make_int(node, type, node->kind == NODE_DIV ? -ua : 0);
+            }
+            return make_int(node, type, node->kind == NODE_DIV ? a / b : a % b);
+
+        case NODE_BIT_AND: return make_int(node, type, ua & ub);
+        case NODE_BIT_OR: return make_int(node, type, ua | ub);
+        case NODE_BIT_XOR: return make_int(node, type, ua ^ ub);
+
+        // Only the low bits of the count are used, as in the interpreter
+        // and on x86, so shifting an int by 32 leaves it unchanged.
+        case NODE_SHL:
+            return make_int(node, type, ua << (ub & (width(type) - 1)));
+
+        case NODE_SHR:
+            // byte is unsigned; int and big shift in their sign bit.
+            return make_int(node, type, a >> (ub & (width(type) - 1)));
+
+        case NODE_EXP: {
+            if (b < 0) {
+                return false;
+            }
+            u64 result = 1, base = ua;
+            for (u64 e = ub; e; e >>= 1) {
+                if (e & 1) {
+                    result *= base;
+                }
+                base *= base;
+            }
+            return make_int(node, type, result);
+        }
+
+        case NODE_AND: return make_int(node, type_int, a && b);
+        case NODE_OR: return make_int(node, type_int, a || b);
+
+        default:
+            return fold_comparison(node, (a > b) - (a < b));
+    }
+}
+
+static bool fold_real(Node *node, f64 a, f64 b) {
+    switch (node->kind) {
+        case NODE_ADD: return make_real(node, a + b);
+        case NODE_SUB: return make_real(node, a - b);
+        case NODE_MUL: return make_real(node, a * b);
+        case NODE_DIV: return make_real(node, a / b);
+        case NODE_EXP: return make_real(node, pow(a, b));
+        case NODE_EQ: return make_int(node, type_int, a == b);
+        case NODE_NEQ: return make_int(node, type_int, a != b);
+        case NODE_LT: return make_int(node, type_int, a < b);
+        case NODE_GT: return make_int(node, type_int, a > b);
+        case NODE_LTE: return make_int(node, type_int, a <= b);
+        case NODE_GTE: return make_int(node, type_int, a >= b);
+        default: return false;
+    }
+}
+
+static bool fold_binary(Folder *folder, Node *node) {
+    Node *left = node->left, *right = node->right;
+    Type *type = literal_type(left);
+    literal_type(right);
+
+    if (left->kind == NODE_STRING && right->kind == NODE_STRING) {
+        if (node->kind == NODE_ADD) {
+            uptr length = left->string_length + right->string_length;
+            char *buffer = ALLOC(folder->allocator, length + 1);
+            memcpy(buffer, left->string_value, left->string_length);
+            memcpy(buffer + left->string_length, right->string_value,
+                   right->string_length);
+            return make_string(node, buffer, length);
+        }
+        return fold_comparison(node, compare_strings(left, right));
+    }
+
+    if (left->kind == NODE_REAL) {
+        // The exponent of a real is an int.
+        f64 b = right->kind == NODE_REAL ? right->real_value
+                                         : (f64) right->int_value;
+        return fold_real(node, left->real_value, b);
+    }
+
+    if (left->kind == NODE_INTEGRAL && right->kind == NODE_INTEGRAL
+        && is_integral(type)) {
+        return fold_integral(folder, node, type, left->int_value,
+                             right->int_value);
+    }
+    return false;
+}
+
+/// Whether a node is an integral literal with the given value.
+static bool is_int(const Node *node, i64 value) {
+    return node->kind == NODE_INTEGRAL && node->int_value == value;
+}
+
+/// Remove operations that leave their operand unchanged, such as `x + 0`.
+/// Only integral operations are simplified, as `x + 0.0` is not `x` when
+/// `x` is `-0.0`.
+static void simplify_identity(Node *node) {
+    if (node->type == NULL || !is_integral(node->type)
+        || node->left->type != node->type) {
+        return;
+    }
+    Node *left = node->left, *right = node->right;
+    switch (node->kind) {
+        case NODE_ADD:
+        case NODE_BIT_OR:
+        case NODE_BIT_XOR:
+            if (is_int(left, 0)) {
+                replace(node, right);
+                return;
+            }
+            // fallthrough
+        case NODE_SUB:
+        case NODE_SHL:
+        case NODE_SHR:
+            if (is_int(right, 0)) {
+                replace(node, left);
+            }
+            return;
+        case NODE_MUL:
+            if (is_int(left, 1)) {
+                replace(node, right);
+                return;
+            }
+            // fallthrough
+        case NODE_DIV:
+            if (is_int(right, 1)) {
+                replace(node, left);
+            }
+            return;
+        default:
+            return;
+    }
+}
+
+static bool fold_unary(Folder *folder, Node *node) {
+    (void) folder;
+    Node *operand = node->left;
+    Type *type = literal_type(operand);
+    switch (node->kind) {
+        case NODE_NEG:
+            if (operand->kind == NODE_REAL) {
+                return make_real(node, -operand->real_value);
+            }
+            if (operand->kind != NODE_INTEGRAL) {
+                return false;
+            }
+            return make_int(node, type, -(u64) operand->int_value);
+        case NODE_BIT_NOT:
+            if (operand->kind != NODE_INTEGRAL) {
+                return false;
+            }
+            return make_int(node, type, ~(u64) operand->int_value);
+        case NODE_NOT:
+            if (operand->kind != NODE_INTEGRAL) {
+                return false;
+            }
+            return make_int(node, type_int, !operand->int_value);
+        case NODE_LEN:
+            if (operand->kind != NODE_STRING) {
+                return false;
+            }
+            return make_int(node, type_int,
+                            codepoint_count(operand->string_value,
+                                            operand->string_length));
+        default:
+            return false;
+    }
+}
+
+static bool fold_index(Folder *folder, Node *node) {
+    Node *string = node->left, *index = node->right;
+    if (string->kind != NODE_STRING || index->kind != NODE_INTEGRAL) {
+        return false;
+    }
+    const char *p = string->string_value;
+    const char *end = p + string->string_length;
+    for (i64 i = 0; p < end; i++) {
+        const char *next;
+        u32 c = utf8_decode(p, &next);
+        if (i == index->int_value) {
+            return make_int(node, type_int, c);
+        }
+        p = next > p ? next : p + 1;
+    }
+    diag_error(folder->diagnostics, node->token, "string index out of range");
+    return false;
+}
+
+static bool fold_cast(Folder *folder, Node *node) {
+    Node *operand = node->left;
+    Type *from = literal_type(operand), *to = node->type;
+    if (to == NULL) {
+        return false;
+    }
+
+    if (is_integral(to)) {
+        if (operand->kind == NODE_INTEGRAL) {
+            return make_int(node, to, operand->int_value);
+        }
+        if (operand->kind == NODE_REAL) {
+            // Conversions from real round half away from zero, as in Dis.
+            f64 value = operand->real_value;
+            value = value < 0 ? value - 0.5 : value + 0.5;
+            if (!(fabs(value) < 9.2e18)) {
+                return false;
+            }
+            return make_int(node, to, (i64) value);
+        }
+        return false;
+    }
+
+    if (to->kind == TReal) {
+        if (operand->kind == NODE_INTEGRAL) {
+            return make_real(node, (f64) operand->int_value);
+        }
+        return operand->kind == NODE_REAL
+               && make_real(node, operand->real_value);
+    }
+
+    if (to->kind == TString && operand->kind == NODE_INTEGRAL
+        && is_integral(from)) {
+        char digits[24];
+        int length = snprintf(digits, sizeof digits, "%ld",
+                              operand->int_value);
+        char *buffer = ALLOC(folder->allocator, length + 1);
+        memcpy(buffer, digits, length + 1);
+        return make_string(node, buffer, length);
+    }
+    return false;
+}
+
+/// Replace a reference to a `con` with its value.
+static bool fold_identifier(Folder *folder, Node *node) {
+    Decl *decl = node->decl;
+    if (decl == NULL || decl->kind != DECL_CON) {
+        return false;
+    }
+    if (!is_constant(decl->value)
+        && !(folder->evaluate_cons && evaluate_con(folder, decl))) {
+        return false;
+    }
+    Token *token = node->token;
+    replace(node, decl->value);
+    // Keep the reference's own location for diagnostics.
+    node->token = token;
+    return true;
+}
+
+static bool fold(Folder *folder, Node *node) {
+    if (node == NULL) {
+        return false;
+    }
+
+    switch (node->kind) {
+        case NODE_INTEGRAL:
+        case NODE_REAL:
+        case NODE_STRING:
+            literal_type(node);
+            return true;
+
+        case NODE_IDENTIFIER:
+            return fold_identifier(folder, node);
+
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_MOD:
+        case NODE_EXP:
+        case NODE_BIT_AND:
+        case NODE_BIT_OR:
+        case NODE_BIT_XOR:
+        case NODE_SHL:
+        case NODE_SHR:
+        case NODE_EQ:
+        case NODE_NEQ:
+        case NODE_LT:
+        case NODE_GT:
+        case NODE_LTE:
+        case NODE_GTE: {
+            bool left = fold(folder, node->left);
+            bool right = fold(folder, node->right);
+            if (left && right) {
+                return fold_binary(folder, node);
+            }
+            simplify_identity(node);
+            return is_constant(node);
+        }
+
+        case NODE_AND:
+        case NODE_OR: {
+            bool left = fold(folder, node->left);
+            bool right = fold(folder, node->right);
+            // A constant left operand that decides the result makes the right
+            // operand dead, as it would never be evaluated.
+            if (left && node->left->kind == NODE_INTEGRAL) {
+                bool decided = node->kind == NODE_AND
+                               ? node->left->int_value == 0
+                               : node->left->int_value != 0;
+                if (decided) {
+                    return make_int(node, type_int, node->kind == NODE_OR);
+                }
+            }
+            if (left && right) {
+                return fold_binary(folder, node);
+            }
+            return false;
+        }
+
+        case NODE_NEG:
+        case NODE_BIT_NOT:
+        case NODE_NOT:
+        case NODE_LEN:
+            return fold(folder, node->left) && fold_unary(folder, node);
+
+        case NODE_CAST:
+            return fold(folder, node->left) && fold_cast(folder, node);
+
+        case NODE_INDEX: {
+            bool left = fold(folder, node->left);
+            bool right = fold(folder, node->right);
+            return left && right && fold_index(folder, node);
+        }
+
+        case NODE_FUNCTION_CALL:
+            fold(folder, node->left);
+            for (Node *arg = node->right; arg; arg = arg->next) {
+                fold(folder, arg);
+            }
+            return false;
+
+        case NODE_TUPLE:
+            for (Node *elem = node->body; elem; elem = elem->next) {
+                fold(folder, elem);
+            }
+            return false;
+
+        case NODE_DECL_EXP:
+        case NODE_ASSIGN:
+        case NODE_ASSIGN_ADD:
+        case NODE_ASSIGN_SUB:
+        case NODE_ASSIGN_MUL:
+        case NODE_ASSIGN_DIV:
+        case NODE_ASSIGN_MOD:
+        case NODE_ASSIGN_BIT_AND:
+        case NODE_ASSIGN_BIT_OR:
+        case NODE_ASSIGN_BIT_XOR:
+        case NODE_ASSIGN_SHL:
+        case NODE_ASSIGN_SHR:
+        case NODE_CONS:
+        case NODE_CHAN_TX:
+            // The left operand is a location or a value with side effects,
+            // and is never replaced by a constant.
+            if (node->kind == NODE_CONS || node->kind == NODE_CHAN_TX) {
+                fold(folder, node->left);
+            } else if (node->left && node->left->kind == NODE_INDEX) {
+                fold(folder, node->left->right);
+            }
+            fold(folder, node->right);
+            return false;
+
+        default:
+            fold(folder, node->left);
+            fold(folder, node->right);
+            return false;
+    }
+}
+
+static bool evaluate_con(Folder *folder, Decl *decl) {
+    Node *value = decl->value;
+    if (value == NULL) {
+        diag_error(folder->diagnostics, decl->token,
+                   "'%.*s' is defined in terms of itself",
+                   (int) decl->token->length, decl->token->location);
+        return false;
+    }
+    if (is_constant(value)) {
+        if (decl->type == NULL) {
+            decl->type = literal_type(value);
+        }
+        return true;
+    }
+
+    // Unbind the value while it is evaluated, so a cycle is detected rather
+    // than followed forever.
+    decl->value = NULL;
+    bool constant = fold(folder, value);
+    decl->value = value;
+
+    if (!constant) {
+        diag_error(folder->diagnostics, value->token,
+                   "value of con '%.*s' is not constant",
+                   (int) decl->token->length, decl->token->location);
+        return false;
+    }
+    if (decl->type == NULL) {
+        decl->type = value->type;
+    }
+    return true;
+}
+
+bool fold_expr(Allocator *allocator, Node *node, Diagnostics *diagnostics) {
+    Folder folder = {
+        .allocator = allocator,
+        .diagnostics = diagnostics,
+        .evaluate_cons = false,
+    };
+    return fold(&folder, node);
+}
+
+bool fold_con(Allocator *allocator, Decl *decl, Diagnostics *diagnostics) {
+    Folder folder = {
+        .allocator = allocator,
+        .diagnostics = diagnostics,
+        .evaluate_cons = true,
+    };
+    return evaluate_con(&folder, decl);
+}
+
+/// Replace a statement with a block containing `body`, or with a no-op if
+/// there is no body.
+static void replace_with_block(Node *node, Node *body) {
+    clear_operands(node);
+    node->kind = body ? NODE_BLOCK : NODE_NOP;
+    node->body = body;
+}
+
+static void fold_stmt(Folder *folder, Node *node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case NODE_BLOCK:
+                fold_stmt(folder, node->body);
+                break;
+
+            case NODE_DECL:
+                fold(folder, node->right);
+                break;
+
+            case NODE_IF:
+                fold_stmt(folder, node->then);
+                fold_stmt(folder, node->else_);
+                if (fold(folder, node->cond)
+                    && node->cond->kind == NODE_INTEGRAL) {
+                    replace_with_block(node, node->cond->int_value
+                                             ? node->then : node->else_);
+                }
+                break;
+
+            case NODE_WHILE:
+                fold_stmt(folder, node->body);
+                if (fold(folder, node->cond)
+                    && node->cond->kind == NODE_INTEGRAL
+                    && node->cond->int_value == 0) {
+                    replace_with_block(node, NULL);
+                }
+                break;
+
+            case NODE_DO:
+                fold_stmt(folder, node->body);
+                fold(folder, node->cond);
+                break;
+
+            case NODE_FOR:
+                fold_stmt(folder, node->init);
+                fold(folder, node->inc);
+                fold_stmt(folder, node->body);
+                if (fold(folder, node->cond)
+                    && node->cond->kind == NODE_INTEGRAL
+                    && node->cond->int_value == 0) {
+                    // The initialiser still runs once.
+                    replace_with_block(node, node->init);
+                }
+                break;
+
+            case NODE_CASE:
+                // Arms are not pruned, as a `break` within an arm must keep
+                // referring to the case statement.
+                fold(folder, node->cond);
+                for (Node *arm = node->body; arm; arm = arm->next) {
+                    for (Node *label = arm->left; label; label = label->next) {
+                        if (label->kind == NODE_TO) {
+                            fold(folder, label->left);
+                            fold(folder, label->right);
+                        } else if (label->kind != NODE_NOP) {
+                            fold(folder, label);
+                        }
+                    }
+                    fold_stmt(folder, arm->body);
+                }
+                break;
+
+            case NODE_ALT:
+                for (Node *arm = node->body; arm; arm = arm->next) {
+                    for (Node *label = arm->left; label; label = label->next) {
+                        fold(folder, label);
+                    }
+                    fold_stmt(folder, arm->body);
+                }
+                break;
+
+            case NODE_RETURN:
+            case NODE_SPAWN:
+                fold(folder, node->left);
+                break;
+
+            case NODE_NOP:
+            case NODE_BREAK:
+            case NODE_CONTINUE:
+            case NODE_EXIT:
+                break;
+
+            default:
+                fold(folder, node);
+                break;
+        }
+    }
+}
+
+void fold_function(Allocator *allocator, Node *function,
+                   Diagnostics *diagnostics) {
+    Folder folder = {
+        .allocator = allocator,
+        .diagnostics = diagnostics,
+        .evaluate_cons = false,
+    };
+    fold_stmt(&folder, function->body);
+}
@@ -0,0 +1,48 @@
+#ifndef LIMBO_FOLD_H
+#define LIMBO_FOLD_H
+
+#include "alloc.h"
+#include "error.h"
+#include "parser.h"
+
+/// Whether a node is a literal, i.e. a fully folded constant.
+/// \param node The node.
+/// \return Whether the node is a `NODE_INTEGRAL`, `NODE_REAL` or
+/// `NODE_STRING`.
+bool is_constant(const Node *node);
+
+/// Fold the constant subexpressions of an expression in place.
+/// Arithmetic follows Limbo semantics: `int` wraps at 32 bits, `big` at
+/// 64 bits and `byte` at 8 bits. Shift counts are taken modulo the width,
+/// as the Dis VM does.
+/// \param allocator The allocator for strings created by folding.
+/// \param node The expression to fold.
+/// \param diagnostics The list to record errors in, such as division by a
+/// constant zero.
+/// \return Whether the expression folded to a constant.
+/// \remark Expressions that would fail at run time are left unfolded, so
+/// that they fail in the same way when the program runs.
+bool fold_expr(Allocator *allocator, Node *node, Diagnostics *diagnostics);
+
+/// Evaluate the value of a `con` declaration, replacing `decl->value` with
+/// a literal.
+/// \param allocator The allocator for strings created by folding.
+/// \param decl The declaration.
+/// \param diagnostics The list to record errors in.
+/// \return Whether the value is a constant.
+/// \remark Other `con` declarations that the value refers to are evaluated
+/// first, and a `con` that refers to itself is reported as an error.
+bool fold_con(Allocator *allocator, Decl *decl, Diagnostics *diagnostics);
+
+/// Fold the constant expressions in a function body in place, and prune
+/// statements that can never run, such as the untaken branch of an `if`
+/// with a constant condition.
+/// \param allocator The allocator for strings created by folding.
+/// \param function The `NODE_FUNCTION` to fold.
+/// \param diagnostics The list to record errors in.
+/// \remark Every `con` declaration must already be evaluated; this makes the
+/// function safe to call on several functions in parallel.
+void fold_function(Allocator *allocator, Node *function,
+                   Diagnostics *diagnostics);
+
+#endif //LIMBO_FOLD_H
@@ -0,0 +1,2694 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "gen.h"
+#include "layout.h"
+#include "lower.h"
+
+/// How values of a type are moved and operated on, which selects the suffix
+/// of most Dis instructions.
+typedef enum ValueClass {
+    CLASS_B,  // byte
+    CLASS_W,  // int
+    CLASS_L,  // big
+    CLASS_F,  // real
+    CLASS_C,  // string
+    CLASS_P,  // any other pointer
+    CLASS_M,  // aggregate without pointers
+    CLASS_MP, // aggregate with pointers
+} ValueClass;
+
+
+
+/// How the operand of a value relates to the value.
+typedef enum Storage {
+    /// The value has a slot of its own, which an instruction that consumes
+    /// the value's last use may update in place.
+    STORAGE_OWNED,
+    /// The operand refers to storage that does not change while the value is
+    /// live, such as a constant or a member of an owned slot.
+    STORAGE_STABLE,
+    /// The operand refers to memory that later instructions may change, such
+    /// as an array element. Only used when the value's single use follows it
+    /// with nothing in between that could change the memory.
+    STORAGE_VOLATILE,
+} Storage;
+
+/// A branch or jump to a block that may not be generated yet.
+typedef struct BlockPatch {
+    /// The instruction, or for an entry of a `case` or `goto` table, the
+    /// index of the item of module data holding it.
+    i32 pc;
+    IrBlock *block;
+    bool data;
+} BlockPatch;
+
+/// An instruction that refers to a function that may not be generated yet.
+typedef struct CallPatch {
+    i32 pc;
+    uptr function;
+    /// Whether the instruction is a `frame`, which needs the function's frame
+    /// descriptor, rather than a `call` or `spawn`, which needs its entry.
+    bool frame;
+} CallPatch;
+
+/// A value in module data.
+typedef struct Constant {
+    u8 kind;
+    i64 int_value;
+    f64 real_value;
+    const char *string_value;
+    uptr string_length;
+    i32 offset;
+} Constant;
+
+/// The layout of a type, which is all that its descriptor, or zeroed module
+/// data for it, depends on. Types laid out alike share them.
+typedef struct Layout {
+    uptr size, align;
+    u8 *map;
+    uptr map_length;
+    /// The index of the descriptor, or the offset of the data.
+    i32 index;
+} Layout;
+
+/// The import table generated for a module type, which module types of the
+/// same name and signature share.
+typedef struct ImportIndex {
+    const char *name;
+    u32 signature;
+    i32 index;
+} ImportIndex;
+
+typedef struct FunctionInfo {
+    Node *function;
+    i32 pc;
+    i32 type;
+    /// For the cache: the digest of the function alone, once it is worked
+    /// out, and the functions it refers to.
+    bool digested;
+    u64 digest;
+    Node **callees;
+    uptr n_callees;
+    /// The last walk of the functions a key depends on that met it.
+    uptr visit;
+} FunctionInfo;
+
+/// A frame slot for a value or temporary. While a function is generated,
+/// every slot has a virtual offset of its own; afterwards, slots that are
+/// never live at the same time are packed into the same frame memory.
+typedef struct FrameSlot {
+    /// The virtual offset, and the offset in the frame once packed.
+    i32 offset, frame_offset;
+    uptr size, align;
+    /// The type held, for its pointers, or `NULL` for a word that the garbage
+    /// collector does not scan.
+    const Type *type;
+    /// The first and last pc at which the slot may be live, or -1 if it is
+    /// never used.
+    i32 start, end;
+} FrameSlot;
+
+/// A pointer map that grows as slots are allocated.
+typedef struct PointerMap {
+    u8 *bits;
+    uptr capacity;
+} PointerMap;
+
+typedef struct Gen {
+    Allocator *allocator;
+    DisModule *module;
+    Diagnostics *diagnostics;
+    PassManager *passes;
+
+    FunctionInfo *functions;
+    uptr n_functions;
+    CallPatch *calls;
+    uptr n_calls, calls_capacity;
+    Constant *constants;
+    uptr n_constants, constants_capacity;
+    Layout *descriptors;
+    uptr n_descriptors, descriptors_capacity;
+    ImportIndex *imports;
+    uptr n_imports, imports_capacity;
+    /// Zeroed module data for aggregate constants, by layout.
+    Layout *zeros;
+    uptr n_zeros, zeros_capacity;
+    PointerMap data_map;
+    /// The offset of a zeroed word of module data, or -1.
+    i32 nil;
+    /// The cache of generated functions, or `NULL`, and a hash of everything
+    /// generated so far that generating a function depends on.
+    GenCache *cache;
+    u64 state;
+    uptr visit;
+
+    // The function being generated
+    IrFunction *ir;
+    uptr frame_size;
+    PointerMap frame_map;
+    /// The slots allocated so far, in order of virtual offset, which starts
+    /// at `slots_base`, after the parameters.
+    FrameSlot *slots;
+    uptr n_slots, slots_capacity;
+    uptr slots_base, virtual_size;
+    /// By value number: the operand holding each value, how it is held, and
+    /// the value whose slot it is held in, if any.
+    DisOperand *operands;
+    u8 *storage;
+    IrInst **roots;
+    /// By value number: the number of uses of each value, and its last user.
+    u32 *uses;
+    IrInst **users;
+    /// By block number: the pc of each block, or -1 if it is not generated
+    /// yet.
+    i32 *block_pcs;
+    BlockPatch *patches;
+    uptr n_patches, patches_capacity;
+    /// The items of module data generated for the function that hold pcs.
+    i32 *data_pcs;
+    uptr n_data_pcs, data_pcs_capacity;
+} Gen;
+
+static uptr align_to(uptr offset, uptr align) {
+    return (offset + align - 1) / align * align;
+}
+
+static bool is_aggregate(const Type *type) {
+    return type->kind == TAdt || type->kind == TAdtPick
+           || type->kind == TTuple;
+}
+
+static ValueClass class_of(const Type *type) {
+    switch (type->kind) {
+        case TByte:
+            return CLASS_B;
+        case TInt:
+            return CLASS_W;
+        case TBig:
+            return CLASS_L;
+        case TReal:
+            return CLASS_F;
+        case TString:
+            return CLASS_C;
+        case TAdt:
+        case TAdtPick:
+        case TTuple: {
+            uptr length = layout_map_length(type);
+            u8 map[length ? length : 1];
+            return layout_pointer_map(type, map) ? CLASS_MP : CLASS_M;
+        }
+        default:
+            return CLASS_P;
+    }
+}
+
+// Operands
+
+static DisOperand none(void) {
+    return (DisOperand) {DIS_NONE, 0, 0};
+}
+
+static DisOperand imm(i32 value) {
+    return (DisOperand) {DIS_IMM, value, 0};
+}
+
+static DisOperand fp(i32 offset) {
+    return (DisOperand) {DIS_FP, offset, 0};
+}
+
+static DisOperand mp(i32 offset) {
+    return (DisOperand) {DIS_MP, offset, 0};
+}
+
+/// The operand `index(base)`, for a pointer held in a frame or data slot.
+static DisOperand indirect(DisOperand base, i32 index) {
+    return (DisOperand) {
+        base.mode == DIS_MP ? DIS_IND_MP : DIS_IND_FP, base.offset, index};
+}
+
+/// The operand `delta` bytes further into the value `op` refers to.
+static DisOperand displace(DisOperand op, i32 delta) {
+    if (op.mode == DIS_IND_FP || op.mode == DIS_IND_MP) {
+        op.index += delta;
+    } else {
+        op.offset += delta;
+    }
+    return op;
+}
+
+static bool same_operand(DisOperand a, DisOperand b) {
+    return a.mode == b.mode && a.offset == b.offset && a.index == b.index;
+}
+
+static bool fits_immediate(i64 value) {
+    return value >= -(1 << 29) && value < (1 << 29);
+}
+
+/// The slot that a virtual frame offset falls in, or `NULL` if it is not in
+/// a slot, such as a parameter.
+static FrameSlot *find_slot(Gen *g, i32 offset) {
+    if (offset < (i32) g->slots_base) {
+        return NULL;
+    }
+    uptr low = 0, high = g->n_slots;
+    while (low < high) {
+        uptr mid = low + (high - low) / 2;
+        FrameSlot *slot = &g->slots[mid];
+        if (offset < slot->offset) {
+            high = mid;
+        } else if (offset >= slot->offset + (i32) (slot->size ? slot->size : 1)) {
+            low = mid + 1;
+        } else {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/// Extend the live range of the slot an operand refers to, if any, to `pc`.
+static void touch(Gen *g, DisOperand op, i32 pc) {
+    if (op.mode != DIS_FP && op.mode != DIS_IND_FP) {
+        return;
+    }
+    FrameSlot *slot = find_slot(g, op.offset);
+    if (slot == NULL) {
+        return;
+    }
+    if (slot->start < 0 || pc < slot->start) {
+        slot->start = pc;
+    }
+    if (pc > slot->end) {
+        slot->end = pc;
+    }
+}
+
+static i32 emit(Gen *g, DisOp op, DisOperand src, DisOperand mid,
+                DisOperand dst) {
+    i32 pc = DisModule_emit(g->module, (DisInst) {op, src, mid, dst});
+    touch(g, src, pc);
+    touch(g, mid, pc);
+    touch(g, dst, pc);
+    return pc;
+}
+
+static i32 here(Gen *g) {
+    return (i32) g->module->n_code;
+}
+
+// Slots
+
+static void map_set(Gen *g, PointerMap *map, uptr word) {
+    uptr byte = word / 8;
+    while (byte >= map->capacity) {
+        uptr old_capacity = map->capacity;
+        map->capacity = old_capacity ? old_capacity * 2 : 16;
+        map->bits = REALLOC(g->allocator, map->bits, map->capacity);
+        memset(map->bits + old_capacity, 0, map->capacity - old_capacity);
+    }
+    map->bits[byte] |= 0x80 >> (word % 8);
+}
+
+/// Mark the pointers of a value of `type` at `offset` in a pointer map.
+static void map_mark(Gen *g, PointerMap *map, uptr offset, const Type *type) {
+    if (is_aggregate(type)) {
+        uptr length = layout_map_length(type);
+        u8 bits[length ? length : 1];
+        layout_pointer_map(type, bits);
+        for (uptr word = 0; word < length * 8; word++) {
+            if (bits[word / 8] & (0x80 >> (word % 8))) {
+                map_set(g, map, offset / LAYOUT_WORD + word);
+            }
+        }
+    } else if (class_of(type) == CLASS_C || class_of(type) == CLASS_P) {
+        map_set(g, map, offset / LAYOUT_WORD);
+    }
+}
+
+/// The pointer map covering `size` bytes, grown so that every byte exists.
+static const u8 *map_bits(Gen *g, PointerMap *map, uptr size, uptr *length) {
+    *length = (size / LAYOUT_WORD + 7) / 8;
+    if (*length > map->capacity) {
+        map->bits = REALLOC(g->allocator, map->bits, *length);
+        memset(map->bits + map->capacity, 0, *length - map->capacity);
+        map->capacity = *length;
+    }
+    return map->bits;
+}
+
+static i32 slot(Gen *g, uptr *size, PointerMap *map, const Type *type) {
+    *size = align_to(*size, type->align ? type->align : 1);
+    i32 offset = (i32) *size;
+    *size += type->size;
+    map_mark(g, map, offset, type);
+    return offset;
+}
+
+static DisOperand new_slot(Gen *g, const Type *type, uptr size,
+                           uptr align) {
+    g->virtual_size = align_to(g->virtual_size, align ? align : 1);
+    i32 offset = (i32) g->virtual_size;
+    g->virtual_size += size ? size : 1;
+    GROW(g->allocator, g->slots, g->n_slots, g->slots_capacity);
+    g->slots[g->n_slots++] = (FrameSlot) {
+        offset, -1, size, align ? align : 1, type, -1, -1};
+    return fp(offset);
+}
+
+/// Allocate a frame slot for a value of `type`.
+static DisOperand temp(Gen *g, const Type *type) {
+    return new_slot(g, type, type->size, type->align);
+}
+
+/// Allocate a frame word that the garbage collector does not scan, for frame
+/// pointers and addresses within objects.
+static DisOperand word_temp(Gen *g) {
+    return new_slot(g, NULL, LAYOUT_WORD, LAYOUT_WORD);
+}
+
+/// The slots that a slot may share memory with hold the same kind of
+/// pointers, so that the frame's pointer map is right for all of them.
+/// \return `NULL` for slots without pointers, the same type for every
+/// single pointer, or the slot's own type for aggregates with pointers.
+static const Type *sharing_key(const Type *type) {
+    if (type == NULL) {
+        return NULL;
+    }
+    switch (class_of(type)) {
+        case CLASS_C:
+        case CLASS_P:
+            return type_string;
+        case CLASS_MP:
+            return type;
+        default:
+            return NULL;
+    }
+}
+
+static int compare_slot_starts(const void *a, const void *b) {
+    const FrameSlot *x = *(FrameSlot *const *) a, *y = *(FrameSlot *const *) b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/// Give each used slot a frame offset, reusing the memory of an earlier
+/// slot with the same size, alignment and pointers whose live range ended
+/// before this one starts.
+static void pack_slots(Gen *g) {
+    FrameSlot **order = ALLOC(g->allocator, (g->n_slots ? g->n_slots : 1)
+                                            * sizeof(FrameSlot *));
+    uptr n = 0;
+    for (uptr i = 0; i < g->n_slots; i++) {
+        if (g->slots[i].start >= 0) {
+            order[n++] = &g->slots[i];
+        }
+    }
+    qsort(order, n, sizeof(FrameSlot *), compare_slot_starts);
+
+    // The most recent slot placed at each distinct frame offset.
+    FrameSlot **placed = ALLOC(g->allocator, (n ? n : 1) * sizeof(FrameSlot *));
+    uptr n_placed = 0;
+    for (uptr i = 0; i < n; i++) {
+        FrameSlot *slot = order[i];
+        const Type *key = sharing_key(slot->type);
+        FrameSlot *free = NULL;
+        uptr j;
+        for (j = 0; j < n_placed; j++) {
+            FrameSlot *other = placed[j];
+            if (other->end < slot->start && other->size == slot->size
+                && other->align == slot->align
+                && sharing_key(other->type) == key) {
+                free = other;
+                break;
+            }
+        }
+        if (free) {
+            slot->frame_offset = free->frame_offset;
+            placed[j] = slot;
+            continue;
+        }
+        g->frame_size = align_to(g->frame_size, slot->align);
+        slot->frame_offset = (i32) g->frame_size;
+        g->frame_size += slot->size;
+        if (slot->type) {
+            map_mark(g, &g->frame_map, slot->frame_offset, slot->type);
+        }
+        placed[n_placed++] = slot;
+    }
+    FREE(g->allocator, placed);
+    FREE(g->allocator, order);
+}
+
+/// Rewrite the virtual offsets in the code from `pc` on to frame offsets.
+static void relocate_slots(Gen *g, i32 pc) {
+    for (; pc < here(g); pc++) {
+        DisInst *inst = &g->module->code[pc];
+        DisOperand *ops[] = {&inst->src, &inst->mid, &inst->dst};
+        for (uptr i = 0; i < 3; i++) {
+            if (ops[i]->mode != DIS_FP && ops[i]->mode != DIS_IND_FP) {
+                continue;
+            }
+            FrameSlot *slot = find_slot(g, ops[i]->offset);
+            if (slot) {
+                ops[i]->offset += slot->frame_offset - slot->offset;
+            }
+        }
+    }
+}
+
+/// The offset of parameter `index` in the frame of a function of type `fn`.
+static i32 param_offset(const Type *fn, uptr index) {
+    uptr offset = DIS_NREG * LAYOUT_WORD;
+    for (uptr i = 0; i < fn->n_params; i++) {
+        const Type *param = fn->params[i];
+        offset = align_to(offset, param->align ? param->align : 1);
+        if (i == index) {
+            break;
+        }
+        offset += param->size;
+    }
+    return (i32) offset;
+}
+
+// Module data
+
+static i32 constant(Gen *g, Constant value, const Type *type) {
+    for (uptr i = 0; i < g->n_constants; i++) {
+        const Constant *c = &g->constants[i];
+        if (c->kind == value.kind && c->int_value == value.int_value
+            && memcmp(&c->real_value, &value.real_value, sizeof(f64)) == 0
+            && c->string_length == value.string_length
+            && (value.kind != DIS_DEFS
+                || memcmp(c->string_value, value.string_value,
+                          value.string_length) == 0)) {
+            return c->offset;
+        }
+    }
+    value.offset = slot(g, &g->module->data_size, &g->data_map, type);
+    DisData data = {
+        .kind = value.kind,
+        .offset = value.offset,
+        .count = value.kind == DIS_DEFS ? value.string_length : 1,
+    };
+    switch (value.kind) {
+        case DIS_DEFF:
+            data.real_value = value.real_value;
+            break;
+        case DIS_DEFS:
+            value.string_value = DisModule_string(g->module, value.string_value,
+                                                  value.string_length);
+            data.string_value = value.string_value;
+            break;
+        default:
+            data.int_value = value.int_value;
+            break;
+    }
+    // An empty string is a nil pointer, which needs no initialisation.
+    if (value.kind != DIS_DEFS || value.string_length > 0) {
+        DisModule_add_data(g->module, data);
+    }
+    GROW(g->allocator, g->constants, g->n_constants, g->constants_capacity);
+    g->constants[g->n_constants++] = value;
+    return value.offset;
+}
+
+/// An operand holding the number `value` converted to `type`.
+static DisOperand number(Gen *g, const Type *type, i64 value) {
+    switch (class_of(type)) {
+        case CLASS_W:
+            if (fits_immediate(value)) {
+                return imm((i32) value);
+            }
+            return mp(constant(g, (Constant) {DIS_DEFW, .int_value = (i32) value}, type));
+        case CLASS_B:
+            return mp(constant(g, (Constant) {DIS_DEFB, .int_value = (u8) value}, type));
+        case CLASS_L:
+            return mp(constant(g, (Constant) {DIS_DEFL, .int_value = value}, type));
+        case CLASS_F:
+            return mp(constant(g, (Constant) {DIS_DEFF, .real_value = value},
+                               type));
+        default:
+            return imm(0);
+    }
+}
+
+/// Reserve module data for a `case` or `goto` table of `int`s, which holds
+/// no pointers.
+/// \return The offset of the table.
+static i32 table(Gen *g, uptr entries) {
+    g->module->data_size = align_to(g->module->data_size, type_int->align);
+    i32 offset = (i32) g->module->data_size;
+    g->module->data_size += entries * type_int->size;
+    return offset;
+}
+
+/// Set entry `index` of a table to a number.
+static void table_word(Gen *g, i32 table, uptr index, i64 value) {
+    DisModule_add_data(g->module, (DisData) {
+        .kind = DIS_DEFW,
+        .offset = table + (i32) (index * type_int->size),
+        .count = 1,
+        .int_value = value,
+    });
+}
+
+/// Set entry `index` of a table to the pc of a block, once it is generated.
+static void table_pc(Gen *g, i32 table, uptr index, IrBlock *block) {
+    table_word(g, table, index, g->block_pcs[block->id]);
+    GROW(g->allocator, g->data_pcs, g->n_data_pcs, g->data_pcs_capacity);
+    g->data_pcs[g->n_data_pcs++] = (i32) g->module->n_data - 1;
+    if (g->block_pcs[block->id] < 0) {
+        GROW(g->allocator, g->patches, g->n_patches, g->patches_capacity);
+        g->patches[g->n_patches++] = (BlockPatch) {
+            (i32) g->module->n_data - 1, block, true};
+    }
+}
+
+/// An operand holding `nil`.
+static DisOperand nil(Gen *g) {
+    if (g->nil < 0) {
+        g->module->data_size = align_to(g->module->data_size, LAYOUT_WORD);
+        g->nil = (i32) g->module->data_size;
+        g->module->data_size += LAYOUT_WORD;
+    }
+    return mp(g->nil);
+}
+
+// Types
+
+static void hash_u32(u32 *hash, u32 value) {
+    for (int i = 0; i < 4; i++) {
+        *hash = (*hash ^ ((value >> (i * 8)) & 0xFF)) * 16777619u;
+    }
+}
+
+static void hash_token(u32 *hash, const Token *token) {
+    for (uptr i = 0; token && i < token->length; i++) {
+        *hash = (*hash ^ (u8) token->location[i]) * 16777619u;
+    }
+}
+
+static void hash_type(u32 *hash, const Type *type, uptr depth) {
+    // Bound the depth so that recursive adts terminate.
+    if (type == NULL || depth > 8) {
+        hash_u32(hash, 0);
+        return;
+    }
+    hash_u32(hash, type->kind);
+    hash_token(hash, type->name);
+    hash_type(hash, type->elem, depth + 1);
+    if (type->kind == TFn) {
+        hash_type(hash, type->return_type, depth + 1);
+        hash_u32(hash, (u32) type->n_params);
+        for (uptr i = 0; i < type->n_params; i++) {
+            hash_type(hash, type->params[i], depth + 1);
+        }
+    }
+    hash_u32(hash, (u32) type->n_members);
+    for (uptr i = 0; i < type->n_members; i++) {
+        hash_token(hash, type->members[i].name);
+        hash_type(hash, type->members[i].type, depth + 1);
+    }
+}
+
+/// The signature of a type, which the VM uses to check that a loaded module
+/// matches the interface it was compiled against.
+static u32 signature(const Type *type) {
+    u32 hash = 2166136261u;
+    hash_type(&hash, type, 0);
+    return hash;
+}
+
+/// Find a layout among those generated.
+/// \return Its index or offset, or -1.
+static i32 find_layout(const Layout *layouts, uptr count, const Layout *key) {
+    for (uptr i = 0; i < count; i++) {
+        const Layout *l = &layouts[i];
+        if (l->size == key->size && l->align == key->align
+            && l->map_length == key->map_length
+            && memcmp(l->map, key->map, key->map_length) == 0) {
+            return l->index;
+        }
+    }
+    return -1;
+}
+
+/// Add a layout to those generated, with a copy of its map.
+static void add_layout(Gen *g, Layout **layouts, uptr *count, uptr *capacity,
+                       Layout layout) {
+    u8 *map = ALLOC(g->allocator, layout.map_length ? layout.map_length : 1);
+    memcpy(map, layout.map, layout.map_length);
+    layout.map = map;
+    GROW(g->allocator, *layouts, *count, *capacity);
+    (*layouts)[(*count)++] = layout;
+}
+
+/// The type descriptor for heap objects of `type`.
+static i32 descriptor(Gen *g, const Type *type) {
+    uptr length = is_aggregate(type) || type->is_ptr ? layout_map_length(type)
+                                                     : 0;
+    u8 map[length ? length : 1];
+    if (length > 0) {
+        layout_pointer_map(type, map);
+    }
+    Layout key = {type->size, 0, map, length, -1};
+    i32 index = find_layout(g->descriptors, g->n_descriptors, &key);
+    if (index >= 0) {
+        return index;
+    }
+    key.index = DisModule_add_type(g->module, type->size, map, length);
+    add_layout(g, &g->descriptors, &g->n_descriptors,
+               &g->descriptors_capacity, key);
+    return key.index;
+}
+
+/// The import table for a module type.
+static i32 import_table(Gen *g, const Type *module) {
+    const Token *name = module->name;
+    uptr length = name ? name->length : 0;
+    u32 sig = signature(module);
+    for (uptr i = 0; i < g->n_imports; i++) {
+        const ImportIndex *import = &g->imports[i];
+        if (import->signature == sig && strlen(import->name) == length
+            && memcmp(import->name, name ? name->location : "", length) == 0) {
+            return import->index;
+        }
+    }
+    i32 index = DisModule_add_import(g->module);
+    GROW(g->allocator, g->imports, g->n_imports, g->imports_capacity);
+    g->imports[g->n_imports++] = (ImportIndex) {
+        DisModule_string(g->module, name ? name->location : "", length), sig,
+        index};
+    return index;
+}
+
+// Moves
+
+static void move(Gen *g, const Type *type, DisOperand src, DisOperand dst) {
+    if (same_operand(src, dst)) {
+        return;
+    }
+    switch (class_of(type)) {
+        case CLASS_B:
+            emit(g, IMOVB, src, none(), dst);
+            break;
+        case CLASS_W:
+            emit(g, IMOVW, src, none(), dst);
+            break;
+        case CLASS_L:
+            emit(g, IMOVL, src, none(), dst);
+            break;
+        case CLASS_F:
+            emit(g, IMOVF, src, none(), dst);
+            break;
+        case CLASS_C:
+        case CLASS_P:
+            emit(g, IMOVP, src, none(), dst);
+            break;
+        case CLASS_M:
+            emit(g, IMOVM, src, imm((i32) type->size), dst);
+            break;
+        case CLASS_MP:
+            emit(g, IMOVMP, src, imm(descriptor(g, type)), dst);
+            break;
+    }
+}
+
+/// An operand that can be used as a middle operand: a small immediate, or a
+/// frame or data slot.
+static DisOperand middle(Gen *g, const Type *type, DisOperand op) {
+    if (op.mode == DIS_FP || op.mode == DIS_MP
+        || (op.mode == DIS_IMM && class_of(type) == CLASS_W)) {
+        return op;
+    }
+    DisOperand t = temp(g, type);
+    move(g, type, op, t);
+    return t;
+}
+
+/// An operand that can be the base of a double indirect operand.
+static DisOperand base(Gen *g, const Type *type, DisOperand op) {
+    if (op.mode == DIS_FP || op.mode == DIS_MP) {
+        return op;
+    }
+    DisOperand t = temp(g, type);
+    move(g, type, op, t);
+    return t;
+}
+
+// Expressions
+
+/// The instruction for an arithmetic operator, or `INOP` if the operator
+/// does not apply to the class.
+static DisOp arith_op(NodeKind kind, ValueClass class) {
+    static const DisOp ops[][CLASS_C + 1] = {
+        [NODE_ADD] = {IADDB, IADDW, IADDL, IADDF, IADDC},
+        [NODE_SUB] = {ISUBB, ISUBW, ISUBL, ISUBF},
+        [NODE_MUL] = {IMULB, IMULW, IMULL, IMULF},
+        [NODE_DIV] = {IDIVB, IDIVW, IDIVL, IDIVF},
+        [NODE_MOD] = {IMODB, IMODW, IMODL},
+        [NODE_BIT_AND] = {IANDB, IANDW, IANDL},
+        [NODE_BIT_OR] = {IORB, IORW, IORL},
+        [NODE_BIT_XOR] = {IXORB, IXORW, IXORL},
+        [NODE_SHL] = {ISHLB, ISHLW, ISHLL},
+        [NODE_SHR] = {ISHRB, ISHRW, ISHRL},
+        [NODE_EXP] = {INOP, IEXPW, IEXPL, IEXPF},
+    };
+    if (kind >= sizeof ops / sizeof ops[0] || class > CLASS_C) {
+        return INOP;
+    }
+    return ops[kind][class];
+}
+
+/// The conditional branch for a comparison, or `INOP` if the comparison does
+/// not apply to the class.
+static DisOp branch_op(NodeKind kind, ValueClass class) {
+    static const DisOp ops[][CLASS_C + 1] = {
+        [NODE_EQ] = {IBEQB, IBEQW, IBEQL, IBEQF, IBEQC},
+        [NODE_NEQ] = {IBNEB, IBNEW, IBNEL, IBNEF, IBNEC},
+        [NODE_LT] = {IBLTB, IBLTW, IBLTL, IBLTF, IBLTC},
+        [NODE_LTE] = {IBLEB, IBLEW, IBLEL, IBLEF, IBLEC},
+        [NODE_GT] = {IBGTB, IBGTW, IBGTL, IBGTF, IBGTC},
+        [NODE_GTE] = {IBGEB, IBGEW, IBGEL, IBGEF, IBGEC},
+    };
+    if (class == CLASS_P && (kind == NODE_EQ || kind == NODE_NEQ)) {
+        // Pointers are compared as whole words.
+        if (LAYOUT_WORD == sizeof(i64)) {
+            return kind == NODE_EQ ? IBEQL : IBNEL;
+        }
+        return kind == NODE_EQ ? IBEQW : IBNEW;
+    }
+    if (kind >= sizeof ops / sizeof ops[0] || class > CLASS_C) {
+        return INOP;
+    }
+    return ops[kind][class];
+}
+
+static NodeKind invert_comparison(NodeKind kind) {
+    switch (kind) {
+        case NODE_EQ: return NODE_NEQ;
+        case NODE_NEQ: return NODE_EQ;
+        case NODE_LT: return NODE_GTE;
+        case NODE_LTE: return NODE_GT;
+        case NODE_GT: return NODE_LTE;
+        case NODE_GTE: return NODE_LT;
+        default: return kind;
+    }
+}
+
+static bool is_comparison(NodeKind kind) {
+    return invert_comparison(kind) != kind;
+}
+
+/// The instruction converting between two classes, or `INOP`.
+static DisOp conversion(const Type *from, const Type *to) {
+    ValueClass f = class_of(from), t = class_of(to);
+    if (to->kind == TArray) {
+        return f == CLASS_C ? ICVTCA : INOP;
+    }
+    if (from->kind == TArray) {
+        return t == CLASS_C ? ICVTAC : INOP;
+    }
+    static const DisOp ops[CLASS_C + 1][CLASS_C + 1] = {
+        [CLASS_B] = {[CLASS_W] = ICVTBW},
+        [CLASS_W] = {ICVTWB, INOP, ICVTWL, ICVTWF, ICVTWC},
+        [CLASS_L] = {INOP, ICVTLW, INOP, ICVTLF, ICVTLC},
+        [CLASS_F] = {INOP, ICVTFW, ICVTFL, INOP, ICVTFC},
+        [CLASS_C] = {INOP, ICVTCW, ICVTCL, ICVTCF},
+    };
+    if (f > CLASS_C || t > CLASS_C) {
+        return INOP;
+    }
+    return ops[f][t];
+}
+
+static void unsupported(Gen *g, IrInst *inst, const char *what) {
+    diag_error(g->diagnostics, inst->token, "cannot generate code for %s yet",
+               what);
+}
+
+// Values
+
+/// An operand holding a constant.
+static DisOperand constant_operand(Gen *g, const IrInst *inst) {
+    Type *type = inst->type;
+    switch (class_of(type)) {
+        case CLASS_B:
+        case CLASS_W:
+        case CLASS_L:
+            return number(g, type, inst->int_value);
+        case CLASS_F:
+            return mp(constant(g, (Constant) {
+                DIS_DEFF, .real_value = inst->real_value}, type));
+        case CLASS_C:
+            if (inst->string_length == 0) {
+                return nil(g);
+            }
+            return mp(constant(g, (Constant) {
+                DIS_DEFS, .string_value = inst->string_value,
+                .string_length = inst->string_length}, type));
+        case CLASS_P:
+            return nil(g);
+        default: {
+            // Aggregates of zeroes share zeroed module data.
+            uptr length = layout_map_length(type);
+            u8 map[length ? length : 1];
+            layout_pointer_map(type, map);
+            Layout key = {type->size, type->align, map, length, -1};
+            key.index = find_layout(g->zeros, g->n_zeros, &key);
+            if (key.index < 0) {
+                key.index = slot(g, &g->module->data_size, &g->data_map,
+                                 type);
+                add_layout(g, &g->zeros, &g->n_zeros, &g->zeros_capacity,
+                           key);
+            }
+            return mp(key.index);
+        }
+    }
+}
+
+static DisOperand operand(Gen *g, const IrInst *value) {
+    return g->operands[value->id];
+}
+
+/// The operand for a member of the adt a reference refers to, which is in
+/// the frame when the reference never escapes.
+static DisOperand field(Gen *g, const IrInst *ref, const Member *m) {
+    if (ref->op == IR_NEW && ref->in_frame) {
+        return displace(operand(g, ref), (i32) m->offset);
+    }
+    return indirect(base(g, ref->type, operand(g, ref)), (i32) m->offset);
+}
+
+/// Give a value a slot of its own.
+static DisOperand own(Gen *g, IrInst *inst) {
+    DisOperand t = temp(g, inst->type);
+    g->operands[inst->id] = t;
+    g->storage[inst->id] = STORAGE_OWNED;
+    g->roots[inst->id] = inst;
+    return t;
+}
+
+/// Give a value a slot, taking over the slot of `from` when this is the
+/// last use of `from`, so that updating a copy needs no copy.
+/// \return Whether the slot already holds `from`.
+static bool own_or_reuse(Gen *g, IrInst *inst, IrInst *from) {
+    if (g->storage[from->id] == STORAGE_OWNED && g->uses[from->id] == 1
+        && from->block == inst->block) {
+        g->operands[inst->id] = operand(g, from);
+        g->storage[inst->id] = STORAGE_OWNED;
+        g->roots[inst->id] = g->roots[from->id];
+        return true;
+    }
+    own(g, inst);
+    return false;
+}
+
+/// Whether the memory an instruction's operand refers to cannot change
+/// before the instruction's only use.
+static bool used_at_once(Gen *g, const IrInst *inst) {
+    const IrInst *user = g->users[inst->id];
+    if (g->uses[inst->id] != 1 || user->block != inst->block
+        || user->op == IR_PHI) {
+        return false;
+    }
+    for (const IrInst *i = inst->next; i != user; i = i->next) {
+        if (IrInst_has_effects(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Hold a value in memory that `op` refers to, copying it to a slot of its
+/// own unless it is used before the memory can change.
+static void alias_volatile(Gen *g, IrInst *inst, DisOperand op) {
+    if (used_at_once(g, inst)) {
+        g->operands[inst->id] = op;
+        g->storage[inst->id] = STORAGE_VOLATILE;
+        g->roots[inst->id] = NULL;
+        return;
+    }
+    move(g, inst->type, op, own(g, inst));
+}
+
+/// Hold a value in part of the storage of another value, `of`.
+static void alias_within(Gen *g, IrInst *inst, IrInst *of, DisOperand op) {
+    if (g->storage[of->id] == STORAGE_VOLATILE) {
+        alias_volatile(g, inst, op);
+        return;
+    }
+    g->operands[inst->id] = op;
+    g->storage[inst->id] = STORAGE_STABLE;
+    g->roots[inst->id] = g->roots[of->id];
+}
+
+/// The type that a comparison compares.
+static Type *compared_type(const IrInst *inst) {
+    Type *type = inst->args[0]->type;
+    return type == type_nil ? inst->args[1]->type : type;
+}
+
+/// Whether a comparison is only used by the branch that ends its block,
+/// and can be generated as part of it.
+static bool is_fused(Gen *g, const IrInst *inst) {
+    return inst->op == IR_BINARY && is_comparison(inst->operator)
+           && g->uses[inst->id] == 1 && inst->next
+           && inst->next->op == IR_BRANCH && inst->next->args[0] == inst;
+}
+
+/// Emit a branch to a block, to be patched once the block is generated.
+static void branch(Gen *g, DisOp op, DisOperand src, DisOperand mid,
+                   IrBlock *target) {
+    i32 pc = emit(g, op, src, mid, imm(g->block_pcs[target->id]));
+    if (g->block_pcs[target->id] < 0) {
+        GROW(g->allocator, g->patches, g->n_patches, g->patches_capacity);
+        g->patches[g->n_patches++] = (BlockPatch) {pc, target, false};
+    }
+}
+
+/// Emit a comparison as a conditional branch.
+/// \return Whether the comparison applies to the operand types.
+static bool gen_compare(Gen *g, IrInst *inst, NodeKind kind,
+                        IrBlock *target) {
+    Type *type = compared_type(inst);
+    DisOp op = branch_op(kind, class_of(type));
+    if (op == INOP) {
+        unsupported(g, inst, "this comparison");
+        return false;
+    }
+    DisOperand right = middle(g, type, operand(g, inst->args[1]));
+    branch(g, op, operand(g, inst->args[0]), right, target);
+    return true;
+}
+
+/// Materialise a condition as the `int` 0 or 1, given a branch that is
+/// taken when it holds.
+static void gen_flag(Gen *g, IrInst *inst, DisOp op, DisOperand src,
+                     DisOperand mid) {
+    DisOperand t = own(g, inst);
+    emit(g, IMOVW, imm(1), none(), t);
+    emit(g, op, src, mid, imm(here(g) + 2));
+    emit(g, IMOVW, imm(0), none(), t);
+}
+
+static void gen_binary(Gen *g, IrInst *inst) {
+    if (is_comparison(inst->operator)) {
+        if (is_fused(g, inst)) {
+            // Generated with the branch.
+            return;
+        }
+        Type *type = compared_type(inst);
+        DisOp op = branch_op(inst->operator, class_of(type));
+        if (op == INOP) {
+            unsupported(g, inst, "this comparison");
+            own(g, inst);
+            return;
+        }
+        gen_flag(g, inst, op, operand(g, inst->args[0]),
+                 middle(g, type, operand(g, inst->args[1])));
+        return;
+    }
+    DisOp op = arith_op(inst->operator, class_of(inst->type));
+    if (op == INOP) {
+        unsupported(g, inst, "this operator");
+        own(g, inst);
+        return;
+    }
+    DisOperand left = middle(g, inst->args[0]->type,
+                             operand(g, inst->args[0]));
+    DisOperand right = operand(g, inst->args[1]);
+    emit(g, op, right, left, own(g, inst));
+}
+
+/// Join `n` strings into `dst`. Joining each half first and the halves
+/// last copies each character about log n times, where joining from left to
+/// right copies the first string n - 1 times.
+static void concat(Gen *g, IrInst **pieces, u32 n, DisOperand dst) {
+    if (n == 1) {
+        move(g, type_string, operand(g, pieces[0]), dst);
+        return;
+    }
+    u32 half = n / 2;
+    DisOperand left, right;
+    if (half == 1) {
+        left = middle(g, type_string, operand(g, pieces[0]));
+    } else {
+        concat(g, pieces, half, dst);
+        left = dst;
+    }
+    if (n - half == 1) {
+        right = operand(g, pieces[half]);
+    } else {
+        right = temp(g, type_string);
+        concat(g, pieces + half, n - half, right);
+    }
+    emit(g, IADDC, right, left, dst);
+}
+
+static void gen_unary(Gen *g, IrInst *inst) {
+    Type *type = inst->type;
+    IrInst *arg = inst->args[0];
+    DisOperand value = operand(g, arg);
+    switch (inst->operator) {
+        case NODE_NOT:
+            gen_flag(g, inst, IBEQW, value, imm(0));
+            return;
+
+        case NODE_LEN: {
+            DisOp op;
+            switch (arg->type->kind) {
+                case TString:
+                    op = ILENC;
+                    break;
+                case TList:
+                    op = ILENL;
+                    break;
+                default:
+                    op = ILENA;
+                    break;
+            }
+            emit(g, op, value, none(), own(g, inst));
+            return;
+        }
+
+        case NODE_TAGOF:
+            if (arg->type->kind == TRef) {
+                alias_volatile(g, inst,
+                               indirect(base(g, arg->type, value), 0));
+            } else {
+                alias_within(g, inst, arg, value);
+            }
+            return;
+
+        default:
+            break;
+    }
+
+    if (inst->operator == NODE_NEG && class_of(type) == CLASS_F) {
+        emit(g, INEGF, value, none(), own(g, inst));
+        return;
+    }
+    // -x is 0 - x, and ~x is x ^ -1.
+    NodeKind kind = inst->operator == NODE_NEG ? NODE_SUB : NODE_BIT_XOR;
+    DisOp op = arith_op(kind, class_of(type));
+    if (op == INOP) {
+        unsupported(g, inst, "this operator");
+        own(g, inst);
+        return;
+    }
+    DisOperand constant = number(g, type, kind == NODE_SUB ? 0 : -1);
+    if (kind == NODE_SUB) {
+        DisOperand zero = middle(g, type, constant);
+        emit(g, op, value, zero, own(g, inst));
+    } else {
+        DisOperand mid = middle(g, type, value);
+        emit(g, op, constant, mid, own(g, inst));
+    }
+}
+
+static void gen_convert(Gen *g, IrInst *inst) {
+    IrInst *arg = inst->args[0];
+    Type *from = arg->type, *to = inst->type;
+    DisOperand value = operand(g, arg);
+    if (class_of(from) == class_of(to) && from->kind != TArray
+        && to->kind != TArray) {
+        alias_within(g, inst, arg, value);
+        return;
+    }
+    // Bytes only convert to and from int, so go through an int.
+    if ((class_of(from) == CLASS_B) != (class_of(to) == CLASS_B)
+        && class_of(from) != CLASS_W && class_of(to) != CLASS_W) {
+        DisOperand t = temp(g, type_int);
+        emit(g, conversion(from, type_int), value, none(), t);
+        value = t;
+        from = type_int;
+    }
+    DisOp op = conversion(from, to);
+    if (op == INOP) {
+        unsupported(g, inst, "this conversion");
+        own(g, inst);
+        return;
+    }
+    emit(g, op, value, none(), own(g, inst));
+}
+
+static const Member *member(const Type *type, uptr index) {
+    const Type *aggregate = type->kind == TRef ? type->elem : type;
+    return &aggregate->members[index];
+}
+
+static DisOp list_op(const Type *elem, bool head, DisOperand *mid, Gen *g) {
+    static const DisOp heads[] = {
+        [CLASS_B] = IHEADB, [CLASS_W] = IHEADW, [CLASS_L] = IHEADL,
+        [CLASS_F] = IHEADF, [CLASS_C] = IHEADP, [CLASS_P] = IHEADP,
+        [CLASS_M] = IHEADM, [CLASS_MP] = IHEADMP,
+    };
+    static const DisOp conses[] = {
+        [CLASS_B] = ICONSB, [CLASS_W] = ICONSW, [CLASS_L] = ICONSL,
+        [CLASS_F] = ICONSF, [CLASS_C] = ICONSP, [CLASS_P] = ICONSP,
+        [CLASS_M] = ICONSM, [CLASS_MP] = ICONSMP,
+    };
+    ValueClass class = class_of(elem);
+    *mid = none();
+    if (class == CLASS_M) {
+        *mid = imm((i32) elem->size);
+    } else if (class == CLASS_MP) {
+        *mid = imm(descriptor(g, elem));
+    }
+    return head ? heads[class] : conses[class];
+}
+
+/// Generate a call, or start the callee in a new process.
+static void gen_call(Gen *g, IrInst *inst) {
+    bool remote = inst->op == IR_MCALL || inst->op == IR_MSPAWN;
+    bool spawn = inst->op == IR_SPAWN || inst->op == IR_MSPAWN;
+    IrInst **args = inst->args + remote;
+    Type *fn;
+    Decl *decl = inst->decl;
+    if (remote) {
+        fn = member(inst->args[0]->type, inst->index)->type;
+    } else {
+        fn = decl->type;
+        bool local = decl && decl->offset >= 0
+                     && (uptr) decl->offset < g->n_functions
+                     && g->functions[decl->offset].function->decl == decl;
+        if (!local) {
+            unsupported(g, inst, "calls to this kind of value");
+            if (inst->type != type_none) {
+                own(g, inst);
+            }
+            return;
+        }
+    }
+
+    DisOperand frame = word_temp(g);
+    DisOperand module = none();
+    i32 index = 0;
+    if (remote) {
+        IrInst *value = inst->args[0];
+        module = base(g, value->type, operand(g, value));
+        const Token *name = member(value->type, inst->index)->name;
+        char text[name->length + 1];
+        memcpy(text, name->location, name->length);
+        text[name->length] = '\0';
+        index = DisModule_import_fn(
+            g->module, import_table(g, value->type), text, signature(fn));
+        emit(g, IMFRAME, module, imm(index), frame);
+    } else {
+        i32 pc = emit(g, IFRAME, imm(-1), none(), frame);
+        GROW(g->allocator, g->calls, g->n_calls, g->calls_capacity);
+        g->calls[g->n_calls++] = (CallPatch) {pc, decl->offset, true};
+    }
+
+    for (uptr i = 0; i < fn->n_params && i < inst->n_args - remote; i++) {
+        move(g, fn->params[i], operand(g, args[i]),
+             indirect(frame, param_offset(fn, i)));
+    }
+
+    DisOperand result = none();
+    if (inst->type != type_none) {
+        result = own(g, inst);
+        emit(g, ILEA, result, none(),
+             indirect(frame, DIS_REGRET * LAYOUT_WORD));
+    }
+
+    if (remote) {
+        emit(g, spawn ? IMSPAWN : IMCALL, frame, imm(index), module);
+    } else {
+        i32 pc = emit(g, spawn ? ISPAWN : ICALL, frame, none(), imm(-1));
+        GROW(g->allocator, g->calls, g->n_calls, g->calls_capacity);
+        g->calls[g->n_calls++] = (CallPatch) {pc, decl->offset, false};
+    }
+    // The callee writes the result as it returns.
+    touch(g, result, here(g) - 1);
+}
+
+/// Generate an `alt`. Its table is a frame area that the garbage collector
+/// does not scan: the numbers of sends and receives, then a channel and the
+/// address of a value for each alternative. The values are the members of
+/// the result, into which values to send are first copied, and into which
+/// the value received is written.
+static void gen_alt(Gen *g, IrInst *inst) {
+    uptr n = inst->type->n_members - 1, n_sends = inst->index;
+    DisOperand result = own(g, inst);
+    DisOperand table = new_slot(g, NULL, 2 * sizeof(i32)
+                                         + n * 2 * LAYOUT_WORD,
+                                LAYOUT_WORD);
+    emit(g, IMOVW, imm((i32) n_sends), none(), table);
+    emit(g, IMOVW, imm((i32) (n - n_sends)), none(),
+         displace(table, sizeof(i32)));
+    u32 arg = 0;
+    for (uptr i = 0; i < n; i++) {
+        DisOperand entry = displace(table, (i32) (2 * sizeof(i32)
+                                                  + i * 2 * LAYOUT_WORD));
+        // The channel is held by its own slot, so the table's copy of it
+        // is not counted.
+        emit(g, IMOVL, operand(g, inst->args[arg++]), none(), entry);
+        const Member *m = member(inst->type, 1 + i);
+        DisOperand value = displace(result, (i32) m->offset);
+        if (i < n_sends) {
+            move(g, m->type, operand(g, inst->args[arg++]), value);
+        }
+        emit(g, ILEA, value, none(), displace(entry, LAYOUT_WORD));
+    }
+    const Member *index = member(inst->type, 0);
+    emit(g, inst->op == IR_ALT ? IALT : INBALT, table, none(),
+         displace(result, (i32) index->offset));
+}
+
+/// The instruction that creates a channel of values of `elem`, and its
+/// source operand.
+static DisOp channel_op(Gen *g, const Type *elem, DisOperand *src) {
+    static const DisOp ops[] = {
+        [CLASS_B] = INEWCB, [CLASS_W] = INEWCW, [CLASS_L] = INEWCL,
+        [CLASS_F] = INEWCF, [CLASS_C] = INEWCP, [CLASS_P] = INEWCP,
+        [CLASS_M] = INEWCM, [CLASS_MP] = INEWCMP,
+    };
+    ValueClass class = class_of(elem);
+    *src = none();
+    if (class == CLASS_M) {
+        *src = imm((i32) elem->size);
+    } else if (class == CLASS_MP) {
+        *src = imm(descriptor(g, elem));
+    }
+    return ops[class];
+}
+
+static void gen_inst(Gen *g, IrInst *inst) {
+    IrInst **args = inst->args;
+    switch (inst->op) {
+        case IR_CONST:
+            g->operands[inst->id] = constant_operand(g, inst);
+            g->storage[inst->id] = STORAGE_STABLE;
+            g->roots[inst->id] = NULL;
+            return;
+
+        case IR_PHI:
+            // A phi with one predecessor is just its argument. Others are
+            // placed before any code is generated.
+            if (inst->block->n_preds == 1) {
+                alias_within(g, inst, args[0], operand(g, args[0]));
+            }
+            return;
+
+        case IR_PARAM:
+            // Placed before any code is generated.
+            return;
+
+        case IR_GLOBAL:
+            alias_volatile(g, inst, mp(inst->decl->offset));
+            return;
+
+        case IR_SET_GLOBAL:
+            move(g, inst->decl->type, operand(g, args[0]),
+                 mp(inst->decl->offset));
+            return;
+
+        case IR_COPY:
+            alias_within(g, inst, args[0], operand(g, args[0]));
+            return;
+
+        case IR_BINARY:
+            gen_binary(g, inst);
+            return;
+
+        case IR_CONCAT:
+            concat(g, args, inst->n_args, own(g, inst));
+            return;
+
+        case IR_UNARY:
+            gen_unary(g, inst);
+            return;
+
+        case IR_CONVERT:
+            gen_convert(g, inst);
+            return;
+
+        case IR_INDEX: {
+            DisOperand value = operand(g, args[0]);
+            DisOperand index = operand(g, args[1]);
+            if (args[0]->type->kind == TString) {
+                DisOperand mid = middle(g, type_int, index);
+                emit(g, IINDC, value, mid, own(g, inst));
+                return;
+            }
+            DisOperand address = word_temp(g);
+            emit(g, IINDX, value, address, index);
+            alias_volatile(g, inst, indirect(address, 0));
+            return;
+        }
+
+        case IR_SET_INDEX: {
+            DisOperand address = word_temp(g);
+            emit(g, IINDX, operand(g, args[0]), address, operand(g, args[1]));
+            move(g, args[0]->type->elem, operand(g, args[2]),
+                 indirect(address, 0));
+            return;
+        }
+
+        case IR_SET_CHAR: {
+            if (!own_or_reuse(g, inst, args[0])) {
+                move(g, inst->type, operand(g, args[0]), operand(g, inst));
+            }
+            DisOperand index = middle(g, type_int, operand(g, args[1]));
+            emit(g, IINSC, operand(g, args[2]), index, operand(g, inst));
+            return;
+        }
+
+        case IR_FIELD: {
+            i32 offset = (i32) member(args[0]->type, inst->index)->offset;
+            alias_within(g, inst, args[0],
+                         displace(operand(g, args[0]), offset));
+            return;
+        }
+
+        case IR_INSERT: {
+            if (!own_or_reuse(g, inst, args[0])) {
+                move(g, inst->type, operand(g, args[0]), operand(g, inst));
+            }
+            const Member *m = member(inst->type, inst->index);
+            move(g, m->type, operand(g, args[1]),
+                 displace(operand(g, inst), (i32) m->offset));
+            return;
+        }
+
+        case IR_MAKE: {
+            DisOperand t = own(g, inst);
+            for (u32 i = 0; i < inst->n_args && i < inst->type->n_members;
+                 i++) {
+                const Member *m = &inst->type->members[i];
+                move(g, m->type, operand(g, args[i]),
+                     displace(t, (i32) m->offset));
+            }
+            return;
+        }
+
+        case IR_LOAD_FIELD: {
+            Type *ref = args[0]->type;
+            alias_volatile(g, inst,
+                           field(g, args[0], member(ref, inst->index)));
+            return;
+        }
+
+        case IR_STORE_FIELD: {
+            const Member *m = member(args[0]->type, inst->index);
+            move(g, m->type, operand(g, args[1]), field(g, args[0], m));
+            return;
+        }
+
+        case IR_NEW: {
+            Type *elem = args[0]->type;
+            if (inst->in_frame) {
+                // The slot holds the adt itself, not a pointer to it.
+                DisOperand t = temp(g, elem);
+                g->operands[inst->id] = t;
+                g->storage[inst->id] = STORAGE_OWNED;
+                g->roots[inst->id] = inst;
+                move(g, elem, operand(g, args[0]), t);
+                return;
+            }
+            DisOperand t = own(g, inst);
+            emit(g, INEW, imm(descriptor(g, elem)), none(), t);
+            move(g, elem, operand(g, args[0]), indirect(t, 0));
+            return;
+        }
+
+        case IR_NEW_ARRAY:
+            emit(g, INEWAZ, operand(g, args[0]),
+                 imm(descriptor(g, inst->type->elem)), own(g, inst));
+            return;
+
+        case IR_NEW_CHANNEL: {
+            DisOperand src;
+            DisOp op = channel_op(g, inst->type->elem, &src);
+            DisOperand buffer = inst->n_args > 0
+                                ? middle(g, type_int, operand(g, args[0]))
+                                : none();
+            emit(g, op, src, buffer, own(g, inst));
+            return;
+        }
+
+        case IR_CONS: {
+            // cons prepends to its destination in place.
+            DisOperand value = operand(g, args[0]);
+            if (!own_or_reuse(g, inst, args[1])) {
+                move(g, inst->type, operand(g, args[1]), operand(g, inst));
+            }
+            DisOperand mid;
+            DisOp op = list_op(inst->type->elem, false, &mid, g);
+            emit(g, op, value, mid, operand(g, inst));
+            return;
+        }
+
+        case IR_HEAD: {
+            DisOperand mid;
+            DisOp op = list_op(inst->type, true, &mid, g);
+            emit(g, op, operand(g, args[0]), mid, own(g, inst));
+            return;
+        }
+
+        case IR_TAIL:
+            emit(g, ITAIL, operand(g, args[0]), none(), own(g, inst));
+            return;
+
+        case IR_CALL:
+        case IR_MCALL:
+        case IR_SPAWN:
+        case IR_MSPAWN:
+            gen_call(g, inst);
+            return;
+
+        case IR_LOAD:
+            emit(g, ILOAD, operand(g, args[0]),
+                 imm(import_table(g, inst->type)), own(g, inst));
+            return;
+
+        case IR_SEND:
+            emit(g, ISEND, operand(g, args[1]), none(), operand(g, args[0]));
+            return;
+
+        case IR_RECV:
+            emit(g, IRECV, operand(g, args[0]), none(), own(g, inst));
+            return;
+
+        case IR_ALT:
+        case IR_NBALT:
+            gen_alt(g, inst);
+            return;
+
+        default:
+            return;
+    }
+}
+
+/// Copy the arguments of the phis of `target` for the edge from `block`
+/// into the phis' slots. The copies happen all at once, so an argument that
+/// is held in the slot of another phi is read before that slot is written.
+static void gen_phi_copies(Gen *g, IrBlock *block, IrBlock *target) {
+    if (target->n_preds == 1) {
+        return;
+    }
+    u32 k = 0;
+    while (k < target->n_preds && target->preds[k] != block) {
+        k++;
+    }
+    if (k == target->n_preds) {
+        return;
+    }
+
+    uptr n = 0;
+    for (IrInst *phi = target->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+        n++;
+    }
+    DisOperand sources[n ? n : 1];
+    uptr i = 0;
+    for (IrInst *phi = target->first; phi && phi->op == IR_PHI;
+         phi = phi->next, i++) {
+        IrInst *arg = phi->args[k];
+        sources[i] = operand(g, arg);
+        IrInst *root = g->roots[arg->id];
+        if (root && root->op == IR_PHI && root->block == target
+            && !same_operand(sources[i], operand(g, phi))) {
+            DisOperand t = temp(g, phi->type);
+            move(g, phi->type, sources[i], t);
+            sources[i] = t;
+        }
+    }
+    i = 0;
+    for (IrInst *phi = target->first; phi && phi->op == IR_PHI;
+         phi = phi->next, i++) {
+        move(g, phi->type, sources[i], operand(g, phi));
+    }
+}
+
+/// Emit a switch as a chain of comparisons, one or two per case. Values below
+/// a case that did not match an earlier one match no case at all.
+static void switch_chain(Gen *g, IrInst *inst, DisOperand value) {
+    IrBlock *otherwise = inst->targets[0];
+    for (uptr i = 0; i < inst->n_cases; i++) {
+        const IrCase *c = &inst->cases[i];
+        IrBlock *target = inst->targets[c->target];
+        DisOperand low = middle(g, type_int, number(g, type_int, c->low));
+        if (c->low == c->high) {
+            branch(g, IBEQW, value, low, target);
+            continue;
+        }
+        DisOperand high = middle(g, type_int, number(g, type_int, c->high));
+        branch(g, IBLTW, value, low, otherwise);
+        branch(g, IBLEW, value, high, target);
+    }
+}
+
+/// Emit a switch whose cases cover most of their span as a `goto` through a
+/// table with the target of every value in the span, after checking that
+/// the value is in the span.
+static void switch_goto(Gen *g, IrInst *inst, DisOperand value) {
+    IrBlock *otherwise = inst->targets[0];
+    i64 low = inst->cases[0].low, high = inst->cases[inst->n_cases - 1].high;
+    DisOperand first = middle(g, type_int, number(g, type_int, low));
+    branch(g, IBLTW, value, first, otherwise);
+    branch(g, IBGTW, value,
+           middle(g, type_int, number(g, type_int, high)), otherwise);
+    DisOperand index = value;
+    if (low != 0) {
+        index = word_temp(g);
+        emit(g, ISUBW, number(g, type_int, low),
+             middle(g, type_int, value), index);
+    }
+
+    i32 offset = table(g, (uptr) (high - low + 1));
+    i64 v = low;
+    for (uptr i = 0; i < inst->n_cases; i++) {
+        const IrCase *c = &inst->cases[i];
+        for (; v < c->low; v++) {
+            table_pc(g, offset, (uptr) (v - low), otherwise);
+        }
+        for (; v <= c->high; v++) {
+            table_pc(g, offset, (uptr) (v - low), inst->targets[c->target]);
+        }
+    }
+    emit(g, IGOTO, index, none(), mp(offset));
+}
+
+/// Emit a switch as a `case`, which binary searches a table of the form
+/// `n, (low, high + 1, pc) * n, default pc`, with the ranges sorted.
+static void switch_case(Gen *g, IrInst *inst, DisOperand value) {
+    uptr n = inst->n_cases;
+    i32 offset = table(g, 1 + 3 * n + 1);
+    table_word(g, offset, 0, (i64) n);
+    for (uptr i = 0; i < n; i++) {
+        const IrCase *c = &inst->cases[i];
+        table_word(g, offset, 1 + 3 * i, c->low);
+        table_word(g, offset, 2 + 3 * i, c->high + 1);
+        table_pc(g, offset, 3 + 3 * i, inst->targets[c->target]);
+    }
+    table_pc(g, offset, 1 + 3 * n, inst->targets[0]);
+    emit(g, ICASE, value, none(), mp(offset));
+}
+
+/// Emit a switch. A few cases are compared in turn; more become a `goto`
+/// through a table indexed by the value if they are dense, or otherwise a
+/// `case`.
+static void gen_switch(Gen *g, IrInst *inst, IrBlock *next) {
+    IrBlock *otherwise = inst->targets[0];
+    if (inst->n_targets == 1) {
+        gen_phi_copies(g, inst->block, otherwise);
+        if (otherwise != next) {
+            branch(g, IJMP, none(), none(), otherwise);
+        }
+        return;
+    }
+
+    DisOperand value = operand(g, inst->args[0]);
+    i64 low = inst->cases[0].low, high = inst->cases[inst->n_cases - 1].high;
+    i64 span = high - low + 1, covered = 0;
+    for (uptr i = 0; i < inst->n_cases; i++) {
+        covered += inst->cases[i].high - inst->cases[i].low + 1;
+    }
+    if (inst->n_cases <= 3 || high >= INT32_MAX) {
+        // The end of the last range would not fit in a `case` table.
+        switch_chain(g, inst, value);
+    } else if (span <= 4096 && covered * 10 >= span * 4) {
+        switch_goto(g, inst, value);
+        return;
+    } else {
+        switch_case(g, inst, value);
+        return;
+    }
+    if (otherwise != next) {
+        branch(g, IJMP, none(), none(), otherwise);
+    }
+}
+
+static void gen_terminator(Gen *g, IrInst *inst, IrBlock *next) {
+    switch (inst->op) {
+        case IR_JUMP:
+            gen_phi_copies(g, inst->block, inst->targets[0]);
+            if (inst->targets[0] != next) {
+                branch(g, IJMP, none(), none(), inst->targets[0]);
+            }
+            return;
+
+        case IR_BRANCH: {
+            IrBlock *if_true = inst->targets[0], *if_false = inst->targets[1];
+            IrInst *cond = inst->args[0];
+            // Fall through to whichever target is next.
+            bool invert = if_true == next;
+            IrBlock *target = invert ? if_false : if_true;
+            IrBlock *other = invert ? if_true : if_false;
+            if (is_fused(g, cond)) {
+                NodeKind kind = invert ? invert_comparison(cond->operator)
+                                       : cond->operator;
+                gen_compare(g, cond, kind, target);
+            } else {
+                branch(g, invert ? IBEQW : IBNEW, operand(g, cond), imm(0),
+                       target);
+            }
+            if (other != next) {
+                branch(g, IJMP, none(), none(), other);
+            }
+            return;
+        }
+
+        case IR_SWITCH:
+            gen_switch(g, inst, next);
+            return;
+
+        case IR_RETURN:
+            if (inst->n_args > 0) {
+                Type *fn = g->ir->type;
+                Type *type = fn && fn->return_type ? fn->return_type
+                                                   : inst->args[0]->type;
+                move(g, type, operand(g, inst->args[0]),
+                     indirect(fp(DIS_REGRET * LAYOUT_WORD), 0));
+            }
+            emit(g, IRET, none(), none(), none());
+            return;
+
+        default:
+            emit(g, IEXIT, none(), none(), none());
+            return;
+    }
+}
+
+static void count_uses(Gen *g, IrFunction *function) {
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            for (u32 i = 0; i < inst->n_args; i++) {
+                g->uses[inst->args[i]->id]++;
+                g->users[inst->args[i]->id] = inst;
+            }
+        }
+    }
+}
+
+static bool bit(const u64 *set, u32 index) {
+    return set[index / 64] >> (index % 64) & 1;
+}
+
+/// Extend the live range of each slot over the blocks that the values held
+/// in it are live into or out of. Until then a range only covers the pcs
+/// that refer to the slot, which misses a value that is live around a loop.
+static void extend_live_ranges(Gen *g, IrBlock **order, uptr count) {
+    IrFunction *ir = g->ir;
+    Allocator *a = ir->allocator;
+    uptr words = (ir->next_value + 64) / 64;
+    u64 *live_in = ALLOC(a, (ir->next_block + 1) * words * sizeof(u64));
+    u64 *live_out = ALLOC(a, (ir->next_block + 1) * words * sizeof(u64));
+    u64 *live = ALLOC(a, words * sizeof(u64));
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uptr i = count; i-- > 0;) {
+            IrBlock *block = order[i];
+            u64 *out = &live_out[block->id * words];
+            IrBlock **succs;
+            u32 n_succs = IrBlock_succs(block, &succs);
+            for (u32 j = 0; j < n_succs; j++) {
+                const u64 *in = &live_in[succs[j]->id * words];
+                for (uptr w = 0; w < words; w++) {
+                    out[w] |= in[w];
+                }
+                // A phi uses its argument at the end of that predecessor.
+                for (IrInst *phi = succs[j]->first; phi && phi->op == IR_PHI;
+                     phi = phi->next) {
+                    for (u32 k = 0; k < succs[j]->n_preds; k++) {
+                        if (succs[j]->preds[k] == block) {
+                            u32 id = phi->args[k]->id;
+                            out[id / 64] |= (u64) 1 << (id % 64);
+                        }
+                    }
+                }
+            }
+
+            memcpy(live, out, words * sizeof(u64));
+            for (IrInst *inst = block->last; inst; inst = inst->prev) {
+                live[inst->id / 64] &= ~((u64) 1 << (inst->id % 64));
+                if (inst->op == IR_PHI) {
+                    continue;
+                }
+                for (u32 k = 0; k < inst->n_args; k++) {
+                    u32 id = inst->args[k]->id;
+                    live[id / 64] |= (u64) 1 << (id % 64);
+                }
+            }
+            u64 *in = &live_in[block->id * words];
+            if (memcmp(in, live, words * sizeof(u64)) != 0) {
+                memcpy(in, live, words * sizeof(u64));
+                changed = true;
+            }
+        }
+    }
+
+    for (uptr i = 0; i < count; i++) {
+        IrBlock *block = order[i];
+        i32 start = g->block_pcs[block->id];
+        i32 end = (i + 1 < count ? g->block_pcs[order[i + 1]->id]
+                                 : here(g)) - 1;
+        if (end < start) {
+            end = start;
+        }
+        const u64 *in = &live_in[block->id * words];
+        const u64 *out = &live_out[block->id * words];
+        for (u32 id = 0; id < ir->next_value; id++) {
+            if (bit(in, id)) {
+                touch(g, g->operands[id], start);
+            }
+            if (bit(out, id)) {
+                touch(g, g->operands[id], end);
+            }
+        }
+        for (IrInst *phi = block->first; phi && phi->op == IR_PHI;
+             phi = phi->next) {
+            touch(g, g->operands[phi->id], start);
+        }
+    }
+}
+
+static void gen_function(Gen *g, FunctionInfo *info) {
+    Node *function = info->function;
+    Type *fn = function->type;
+    IrFunction *ir = lower_function(g->allocator, function, g->diagnostics);
+    if (g->passes) {
+        PassManager_run(g->passes, ir);
+    }
+    IrFunction_split_critical_edges(ir);
+    uptr count;
+    IrBlock **order = IrFunction_dominators(ir, &count);
+
+    Allocator *a = ir->allocator;
+    uptr n_values = ir->next_value + 1;
+    g->ir = ir;
+    g->operands = ALLOC(a, n_values * sizeof(DisOperand));
+    g->storage = ALLOC(a, n_values);
+    g->roots = ALLOC(a, n_values * sizeof(IrInst *));
+    g->uses = ALLOC(a, n_values * sizeof(u32));
+    g->users = ALLOC(a, n_values * sizeof(IrInst *));
+    g->block_pcs = ALLOC(a, (ir->next_block + 1) * sizeof(i32));
+    g->n_patches = 0;
+    g->n_data_pcs = 0;
+    count_uses(g, ir);
+    for (u32 i = 0; i <= ir->next_block; i++) {
+        g->block_pcs[i] = -1;
+    }
+
+    g->frame_size = DIS_NREG * LAYOUT_WORD;
+    if (g->frame_map.bits) {
+        memset(g->frame_map.bits, 0, g->frame_map.capacity);
+    }
+    i32 params[fn && fn->n_params ? fn->n_params : 1];
+    for (uptr i = 0; fn && i < fn->n_params; i++) {
+        params[i] = slot(g, &g->frame_size, &g->frame_map, fn->params[i]);
+    }
+    g->slots_base = g->virtual_size = g->frame_size;
+    g->n_slots = 0;
+    // Phis and parameters need their slots before any branch to them is
+    // generated.
+    for (uptr i = 0; i < count; i++) {
+        for (IrInst *inst = order[i]->first; inst; inst = inst->next) {
+            if (inst->op == IR_PHI && order[i]->n_preds > 1) {
+                own(g, inst);
+            } else if (inst->op == IR_PARAM && fn && inst->index < fn->n_params) {
+                g->operands[inst->id] = fp(params[inst->index]);
+                g->storage[inst->id] = STORAGE_OWNED;
+                g->roots[inst->id] = inst;
+            }
+        }
+    }
+
+    info->pc = here(g);
+    for (uptr i = 0; i < count; i++) {
+        IrBlock *block = order[i];
+        g->block_pcs[block->id] = here(g);
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            if (ir_is_terminator(inst->op)) {
+                gen_terminator(g, inst, i + 1 < count ? order[i + 1] : NULL);
+            } else {
+                gen_inst(g, inst);
+            }
+        }
+    }
+    for (uptr i = 0; i < g->n_patches; i++) {
+        const BlockPatch *patch = &g->patches[i];
+        i32 pc = g->block_pcs[patch->block->id];
+        if (patch->data) {
+            g->module->data[patch->pc].int_value = pc;
+        } else {
+            g->module->code[patch->pc].dst = imm(pc);
+        }
+    }
+    extend_live_ranges(g, order, count);
+    pack_slots(g);
+    relocate_slots(g, info->pc);
+
+    uptr size = align_to(g->frame_size, LAYOUT_WORD), length;
+    const u8 *map = map_bits(g, &g->frame_map, size, &length);
+    info->type = DisModule_add_type(g->module, size, map, length);
+    if (size > g->module->stack_extent) {
+        g->module->stack_extent = size;
+    }
+    IrFunction_free(ir);
+    g->ir = NULL;
+}
+
+// Caching
+
+/// The version of the format functions are cached in.
+#define GEN_CACHE_VERSION 1
+
+/// The magic number at the start of a cached function.
+#define GEN_CACHE_MAGIC "LIMBOGEN"
+
+/// The starting value of a hash.
+#define GEN_HASH_BASIS 14695981039346656037u
+
+/// FNV-1a, 64 bits.
+static void mix(u64 *hash, const void *bytes, uptr length) {
+    const u8 *p = bytes;
+    for (uptr i = 0; i < length; i++) {
+        *hash = (*hash ^ p[i]) * 1099511628211u;
+    }
+}
+
+static void mix_u64(u64 *hash, u64 value) {
+    mix(hash, &value, sizeof value);
+}
+
+static void mix_text(u64 *hash, const char *text, uptr length) {
+    mix_u64(hash, length);
+    mix(hash, text, length);
+}
+
+static void mix_token(u64 *hash, const Token *token) {
+    mix_text(hash, token ? token->location : "", token ? token->length : 0);
+}
+
+/// A walk of a function's syntax tree, for its digest.
+typedef struct KeyWalk {
+    Gen *g;
+    u64 hash;
+    /// The declarations and types met so far. After the first time, each
+    /// is hashed as the order it was met in, so that the digest does not
+    /// depend on where anything is in memory.
+    const void **seen;
+    uptr n_seen, seen_capacity;
+    /// The functions referred to, whose bodies may be inlined.
+    Node **callees;
+    uptr n_callees, callees_capacity;
+} KeyWalk;
+
+/// Note something met in a walk.
+/// \return Whether it had been met before.
+static bool walk_seen(KeyWalk *w, const void *item) {
+    for (uptr i = 0; i < w->n_seen; i++) {
+        if (w->seen[i] == item) {
+            mix_u64(&w->hash, i + 1);
+            return true;
+        }
+    }
+    GROW(w->g->allocator, w->seen, w->n_seen, w->seen_capacity);
+    w->seen[w->n_seen++] = item;
+    mix_u64(&w->hash, 0);
+    return false;
+}
+
+static void walk_type(KeyWalk *w, const Type *type) {
+    u64 *hash = &w->hash;
+    mix_u64(hash, type != NULL);
+    if (type == NULL || walk_seen(w, type)) {
+        return;
+    }
+    mix_u64(hash, type->kind);
+    mix_u64(hash, type->size);
+    mix_u64(hash, type->align);
+    mix_u64(hash, type->is_ptr);
+    mix_token(hash, type->name);
+    mix_u64(hash, type->n_members);
+    for (uptr i = 0; i < type->n_members; i++) {
+        const Member *m = &type->members[i];
+        mix_token(hash, m->name);
+        mix_u64(hash, m->index);
+        mix_u64(hash, m->align);
+        mix_u64(hash, m->offset);
+        walk_type(w, m->type);
+    }
+    mix_u64(hash, type->n_variants);
+    for (uptr i = 0; i < type->n_variants; i++) {
+        walk_type(w, type->variants[i]);
+    }
+    walk_type(w, type->elem);
+    walk_type(w, type->return_type);
+    mix_u64(hash, type->n_params);
+    for (uptr i = 0; i < type->n_params; i++) {
+        walk_type(w, type->params[i]);
+    }
+}
+
+static void walk_node(KeyWalk *w, const Node *node);
+
+static void walk_decl(KeyWalk *w, const Decl *decl) {
+    u64 *hash = &w->hash;
+    mix_u64(hash, decl != NULL);
+    if (decl == NULL || walk_seen(w, decl)) {
+        return;
+    }
+    mix_u64(hash, decl->kind);
+    mix_u64(hash, decl->depth == 0);
+    walk_type(w, decl->type);
+    if (decl->kind == DECL_VAR && decl->depth > 0) {
+        // A local is told apart from others only by where it is used.
+        return;
+    }
+    mix_token(hash, decl->token);
+    mix_u64(hash, (u64) decl->offset);
+    if (decl->kind == DECL_CON) {
+        mix_u64(hash, decl->value != NULL);
+        if (decl->value != NULL) {
+            walk_node(w, decl->value);
+        }
+    } else if (decl->kind == DECL_FN) {
+        const Gen *g = w->g;
+        mix_u64(hash, decl->offset >= 0
+                      && (uptr) decl->offset < g->n_functions
+                      && g->functions[decl->offset].function->decl == decl);
+        if (decl->value != NULL && decl->value->kind == NODE_FUNCTION) {
+            GROW(g->allocator, w->callees, w->n_callees, w->callees_capacity);
+            w->callees[w->n_callees++] = decl->value;
+        }
+    }
+}
+
+static void walk_list(KeyWalk *w, const Node *node) {
+    for (; node != NULL; node = node->next) {
+        walk_node(w, node);
+    }
+    mix_u64(&w->hash, 0);
+}
+
+static void walk_node(KeyWalk *w, const Node *node) {
+    u64 *hash = &w->hash;
+    mix_u64(hash, node->kind + 1);
+    walk_type(w, node->type);
+    mix_token(hash, node->token);
+    mix_u64(hash, (u64) node->int_value);
+    mix(hash, &node->real_value, sizeof node->real_value);
+    mix_text(hash, node->string_value ? node->string_value : "",
+             node->string_value ? node->string_length : 0);
+    walk_decl(w, node->decl);
+    walk_list(w, node->left);
+    walk_list(w, node->right);
+    walk_list(w, node->cond);
+    walk_list(w, node->then);
+    walk_list(w, node->else_);
+    walk_list(w, node->init);
+    walk_list(w, node->inc);
+    walk_list(w, node->body);
+}
+
+/// Work out the digest of a function alone, and the functions it refers to.
+static void digest(Gen *g, Node *function, u64 *hash, Node ***callees,
+                   uptr *n_callees) {
+    KeyWalk w = {.g = g, .hash = GEN_HASH_BASIS};
+    walk_node(&w, function);
+    FREE(g->allocator, w.seen);
+    *hash = w.hash;
+    *callees = w.callees;
+    *n_callees = w.n_callees;
+}
+
+/// The function of the module a node is, if it is one.
+static FunctionInfo *module_function(Gen *g, const Node *function) {
+    const Decl *decl = function->decl;
+    if (decl != NULL && decl->offset >= 0
+        && (uptr) decl->offset < g->n_functions
+        && g->functions[decl->offset].function == function) {
+        return &g->functions[decl->offset];
+    }
+    return NULL;
+}
+
+/// The key a function is cached under: the digests of the function and of
+/// every function it may inline, directly or not, the passes, and the state
+/// of the module it is generated in.
+static u64 function_key(Gen *g, FunctionInfo *info) {
+    Allocator *a = g->allocator;
+    u64 key = GEN_HASH_BASIS;
+    mix_u64(&key, GEN_CACHE_VERSION);
+    mix_u64(&key, LAYOUT_WORD);
+    mix_u64(&key, g->state);
+    mix_u64(&key, g->passes != NULL);
+    if (g->passes != NULL) {
+        mix_u64(&key, g->passes->max_iterations);
+        for (uptr i = 0; i < g->passes->n_passes; i++) {
+            const char *name = g->passes->passes[i].name;
+            mix_text(&key, name, strlen(name));
+        }
+    }
+
+    // Walk the functions that may be inlined, breadth first.
+    g->visit++;
+    Node **queue = NULL;
+    uptr n_queue = 0, queue_capacity = 0;
+    GROW(a, queue, n_queue, queue_capacity);
+    queue[n_queue++] = info->function;
+    info->visit = g->visit;
+    for (uptr i = 0; i < n_queue; i++) {
+        FunctionInfo *f = module_function(g, queue[i]);
+        u64 hash;
+        Node **callees;
+        uptr n_callees;
+        if (f != NULL) {
+            if (!f->digested) {
+                digest(g, f->function, &f->digest, &f->callees,
+                       &f->n_callees);
+                f->digested = true;
+            }
+            hash = f->digest;
+            callees = f->callees;
+            n_callees = f->n_callees;
+        } else {
+            digest(g, queue[i], &hash, &callees, &n_callees);
+        }
+        mix_u64(&key, hash);
+        for (uptr j = 0; j < n_callees; j++) {
+            FunctionInfo *callee = module_function(g, callees[j]);
+            bool queued = false;
+            if (callee != NULL) {
+                queued = callee->visit == g->visit;
+                callee->visit = g->visit;
+            } else {
+                for (uptr k = 0; k < n_queue; k++) {
+                    queued |= queue[k] == callees[j];
+                }
+            }
+            if (!queued) {
+                GROW(a, queue, n_queue, queue_capacity);
+                queue[n_queue++] = callees[j];
+            }
+        }
+        if (f == NULL) {
+            FREE(a, callees);
+        }
+    }
+    FREE(a, queue);
+    return key;
+}
+
+/// A growable buffer that cached functions are encoded in.
+typedef struct Bytes {
+    u8 *data;
+    uptr length, capacity;
+} Bytes;
+
+static void put(Gen *g, Bytes *b, const void *bytes, uptr length) {
+    if (length == 0) {
+        return;
+    }
+    while (b->length + length > b->capacity) {
+        GROW(g->allocator, b->data, b->capacity, b->capacity);
+    }
+    memcpy(b->data + b->length, bytes, length);
+    b->length += length;
+}
+
+static void put_u64(Gen *g, Bytes *b, u64 value) {
+    put(g, b, &value, sizeof value);
+}
+
+static void put_text(Gen *g, Bytes *b, const void *text, uptr length) {
+    put_u64(g, b, length);
+    put(g, b, text, length);
+}
+
+static void put_operand(Gen *g, Bytes *b, DisOperand op) {
+    put_u64(g, b, op.mode);
+    put_u64(g, b, (u64) op.offset);
+    put_u64(g, b, (u64) op.index);
+}
+
+/// A cached function being decoded.
+typedef struct Unpacker {
+    const u8 *p, *end;
+    bool failed;
+} Unpacker;
+
+static const u8 *take(Unpacker *u, uptr length) {
+    if (u->failed || (uptr) (u->end - u->p) < length) {
+        u->failed = true;
+        return NULL;
+    }
+    const u8 *bytes = u->p;
+    u->p += length;
+    return bytes;
+}
+
+static u64 take_u64(Unpacker *u) {
+    u64 value = 0;
+    const u8 *bytes = take(u, sizeof value);
+    if (bytes != NULL) {
+        memcpy(&value, bytes, sizeof value);
+    }
+    return value;
+}
+
+/// \return The text, which is not NUL-terminated, or "" if there is none.
+static const char *take_text(Unpacker *u, uptr *length) {
+    *length = take_u64(u);
+    const u8 *text = take(u, *length);
+    if (text == NULL) {
+        *length = 0;
+        return "";
+    }
+    return (const char *) text;
+}
+
+static DisOperand take_operand(Unpacker *u) {
+    DisOperand op;
+    op.mode = (DisMode) take_u64(u);
+    op.offset = (i32) take_u64(u);
+    op.index = (i32) take_u64(u);
+    return op;
+}
+
+/// Whether an instruction's destination is the pc of a branch target.
+static bool is_jump(DisOp op) {
+    return op == IJMP || (op >= IBEQB && op <= IBGEC)
+           || (op >= IBNEL && op <= IBEQL);
+}
+
+/// How much of the module there was before a function was generated.
+typedef struct GenMarks {
+    uptr code, data, types, imports, constants, descriptors, zeros, calls;
+    uptr data_size;
+    i32 nil;
+    /// The number of functions in each import table.
+    uptr *import_fns;
+} GenMarks;
+
+static GenMarks mark(Gen *g) {
+    DisModule *m = g->module;
+    GenMarks marks = {
+        m->n_code, m->n_data, m->n_types, m->n_imports, g->n_constants,
+        g->n_descriptors, g->n_zeros, g->n_calls, m->data_size, g->nil,
+        ALLOC(g->allocator, (m->n_imports ? m->n_imports : 1) * sizeof(uptr)),
+    };
+    for (uptr i = 0; i < m->n_imports; i++) {
+        marks.import_fns[i] = m->imports[i].n_fns;
+    }
+    return marks;
+}
+
+/// The marks that a cached function must have been generated after, which
+/// begin what it records of the module.
+static void put_marks(Gen *g, Bytes *b, const GenMarks *marks) {
+    put_u64(g, b, marks->data);
+    put_u64(g, b, marks->types);
+    put_u64(g, b, marks->imports);
+    put_u64(g, b, marks->constants);
+    put_u64(g, b, marks->descriptors);
+    put_u64(g, b, marks->zeros);
+    put_u64(g, b, marks->data_size);
+    put_u64(g, b, (u64) marks->nil);
+}
+
+static void put_layout(Gen *g, Bytes *b, const Layout *layout) {
+    put_u64(g, b, layout->size);
+    put_u64(g, b, layout->align);
+    put_text(g, b, layout->map, layout->map_length);
+    put_u64(g, b, (u64) layout->index);
+}
+
+/// Record what generating a function added: to the module as a whole in
+/// `module`, which later functions depend on, and its code in `code`, which
+/// they do not. Pcs in `code` are relative to the start of the function.
+static void record(Gen *g, const GenMarks *marks, const FunctionInfo *info,
+                   Bytes *module, Bytes *code) {
+    DisModule *m = g->module;
+    put_marks(g, module, marks);
+    put_u64(g, module, m->data_size);
+    put_u64(g, module, (u64) g->nil);
+    uptr first = marks->data_size / LAYOUT_WORD / 8;
+    uptr end = (m->data_size / LAYOUT_WORD + 7) / 8;
+    if (end > g->data_map.capacity) {
+        end = g->data_map.capacity;
+    }
+    put_text(g, module, g->data_map.bits + first,
+             end > first ? end - first : 0);
+
+    put_u64(g, module, m->n_types - marks->types);
+    for (uptr i = marks->types; i < m->n_types; i++) {
+        put_u64(g, module, m->types[i].size);
+        put_text(g, module, m->types[i].map, m->types[i].map_length);
+    }
+    put_u64(g, module, m->n_data - marks->data);
+    for (uptr i = marks->data; i < m->n_data; i++) {
+        const DisData *data = &m->data[i];
+        put_u64(g, module, data->kind);
+        put_u64(g, module, (u64) data->offset);
+        put_u64(g, module, data->count);
+        bool pc = false;
+        for (uptr j = 0; j < g->n_data_pcs; j++) {
+            pc |= (uptr) g->data_pcs[j] == i;
+        }
+        if (data->kind == DIS_DEFS) {
+            put(g, module, data->string_value, data->count);
+        } else {
+            u64 value = 0;
+            if (!pc) {
+                memcpy(&value, &data->int_value, sizeof value);
+            }
+            put_u64(g, module, value);
+        }
+    }
+    put_u64(g, module, m->n_imports - marks->imports);
+    uptr n_fns = 0;
+    for (uptr i = 0; i < m->n_imports; i++) {
+        n_fns += m->imports[i].n_fns
+                 - (i < marks->imports ? marks->import_fns[i] : 0);
+    }
+    put_u64(g, module, n_fns);
+    for (uptr i = 0; i < m->n_imports; i++) {
+        const DisImport *import = &m->imports[i];
+        uptr j = i < marks->imports ? marks->import_fns[i] : 0;
+        for (; j < import->n_fns; j++) {
+            put_u64(g, module, i);
+            put_u64(g, module, import->fns[j].signature);
+            put_text(g, module, import->fns[j].name,
+                     strlen(import->fns[j].name));
+        }
+    }
+    put_u64(g, module, g->n_constants - marks->constants);
+    for (uptr i = marks->constants; i < g->n_constants; i++) {
+        const Constant *c = &g->constants[i];
+        put_u64(g, module, c->kind);
+        put_u64(g, module, (u64) c->int_value);
+        put(g, module, &c->real_value, sizeof c->real_value);
+        put_text(g, module, c->kind == DIS_DEFS ? c->string_value : "",
+                 c->kind == DIS_DEFS ? c->string_length : 0);
+        put_u64(g, module, (u64) c->offset);
+    }
+    put_u64(g, module, g->n_descriptors - marks->descriptors);
+    for (uptr i = marks->descriptors; i < g->n_descriptors; i++) {
+        put_layout(g, module, &g->descriptors[i]);
+    }
+    put_u64(g, module, g->n_zeros - marks->zeros);
+    for (uptr i = marks->zeros; i < g->n_zeros; i++) {
+        put_layout(g, module, &g->zeros[i]);
+    }
+    put_u64(g, module, g->n_imports - marks->imports);
+    for (uptr i = marks->imports; i < g->n_imports; i++) {
+        const ImportIndex *import = &g->imports[i];
+        put_text(g, module, import->name, strlen(import->name));
+        put_u64(g, module, import->signature);
+        put_u64(g, module, (u64) import->index);
+    }
+
+    i32 base = info->pc;
+    put_u64(g, code, (u64) info->type);
+    put_u64(g, code, m->n_code - marks->code);
+    for (uptr i = marks->code; i < m->n_code; i++) {
+        DisInst inst = m->code[i];
+        if (is_jump(inst.op) && inst.dst.mode == DIS_IMM) {
+            inst.dst.offset -= base;
+        }
+        put_u64(g, code, inst.op);
+        put_operand(g, code, inst.src);
+        put_operand(g, code, inst.mid);
+        put_operand(g, code, inst.dst);
+    }
+    put_u64(g, code, g->n_calls - marks->calls);
+    for (uptr i = marks->calls; i < g->n_calls; i++) {
+        put_u64(g, code, (u64) (g->calls[i].pc - base));
+        put_u64(g, code, g->calls[i].function);
+        put_u64(g, code, g->calls[i].frame);
+    }
+    put_u64(g, code, g->n_data_pcs);
+    for (uptr i = 0; i < g->n_data_pcs; i++) {
+        put_u64(g, code, (u64) g->data_pcs[i]);
+        put_u64(g, code, (u64) (m->data[g->data_pcs[i]].int_value - base));
+    }
+}
+
+static Layout take_layout(Unpacker *u) {
+    Layout layout;
+    layout.size = take_u64(u);
+    layout.align = take_u64(u);
+    layout.map = (u8 *) take_text(u, &layout.map_length);
+    layout.index = (i32) take_u64(u);
+    return layout;
+}
+
+/// Add a cached function to the module, as `record` recorded it.
+/// \return Whether the function was generated in the same state of the
+/// module. If not, nothing has been added.
+static bool replay(Gen *g, Unpacker *module, Unpacker *code,
+                   FunctionInfo *info) {
+    DisModule *m = g->module;
+    Bytes expected = {0};
+    GenMarks marks = mark(g);
+    put_marks(g, &expected, &marks);
+    FREE(g->allocator, marks.import_fns);
+    const u8 *found = take(module, expected.length);
+    bool same = found != NULL
+                && memcmp(found, expected.data, expected.length) == 0;
+    FREE(g->allocator, expected.data);
+    if (!same) {
+        return false;
+    }
+
+    m->data_size = take_u64(module);
+    g->nil = (i32) take_u64(module);
+    uptr first = marks.data_size / LAYOUT_WORD / 8, length;
+    const u8 *map = (const u8 *) take_text(module, &length);
+    for (uptr i = 0; i < length; i++) {
+        for (uptr bit = 0; bit < 8; bit++) {
+            if (map[i] & (0x80 >> bit)) {
+                map_set(g, &g->data_map, (first + i) * 8 + bit);
+            }
+        }
+    }
+
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        uptr size = take_u64(module);
+        const char *type_map = take_text(module, &length);
+        DisModule_add_type(m, size, (const u8 *) type_map, length);
+    }
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        DisData data = {.kind = (u8) take_u64(module)};
+        data.offset = (i32) take_u64(module);
+        data.count = take_u64(module);
+        if (data.kind == DIS_DEFS) {
+            const u8 *text = take(module, data.count);
+            data.string_value = DisModule_string(
+                m, text ? (const char *) text : "", text ? data.count : 0);
+        } else {
+            u64 value = take_u64(module);
+            memcpy(&data.int_value, &value, sizeof value);
+        }
+        DisModule_add_data(m, data);
+    }
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        DisModule_add_import(m);
+    }
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        i32 import = (i32) take_u64(module);
+        u32 sig = (u32) take_u64(module);
+        const char *text = take_text(module, &length);
+        char name[length + 1];
+        memcpy(name, text, length);
+        name[length] = '\0';
+        if ((uptr) import < m->n_imports) {
+            DisModule_import_fn(m, import, name, sig);
+        }
+    }
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        Constant c = {.kind = (u8) take_u64(module)};
+        c.int_value = (i64) take_u64(module);
+        const u8 *real = take(module, sizeof c.real_value);
+        if (real != NULL) {
+            memcpy(&c.real_value, real, sizeof c.real_value);
+        }
+        const char *text = take_text(module, &c.string_length);
+        if (c.kind == DIS_DEFS) {
+            c.string_value = DisModule_string(m, text, c.string_length);
+        }
+        c.offset = (i32) take_u64(module);
+        GROW(g->allocator, g->constants, g->n_constants,
+             g->constants_capacity);
+        g->constants[g->n_constants++] = c;
+    }
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        add_layout(g, &g->descriptors, &g->n_descriptors,
+                   &g->descriptors_capacity, take_layout(module));
+    }
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        add_layout(g, &g->zeros, &g->n_zeros, &g->zeros_capacity,
+                   take_layout(module));
+    }
+    for (u64 n = take_u64(module); n > 0 && !module->failed; n--) {
+        const char *text = take_text(module, &length);
+        ImportIndex import = {.name = DisModule_string(m, text, length)};
+        import.signature = (u32) take_u64(module);
+        import.index = (i32) take_u64(module);
+        GROW(g->allocator, g->imports, g->n_imports, g->imports_capacity);
+        g->imports[g->n_imports++] = import;
+    }
+
+    i32 base = here(g);
+    info->pc = base;
+    info->type = (i32) take_u64(code);
+    for (u64 n = take_u64(code); n > 0 && !code->failed; n--) {
+        DisInst inst = {.op = (DisOp) take_u64(code)};
+        inst.src = take_operand(code);
+        inst.mid = take_operand(code);
+        inst.dst = take_operand(code);
+        if (is_jump(inst.op) && inst.dst.mode == DIS_IMM) {
+            inst.dst.offset += base;
+        }
+        DisModule_emit(m, inst);
+    }
+    for (u64 n = take_u64(code); n > 0 && !code->failed; n--) {
+        CallPatch call = {.pc = base + (i32) take_u64(code)};
+        call.function = take_u64(code);
+        call.frame = take_u64(code);
+        GROW(g->allocator, g->calls, g->n_calls, g->calls_capacity);
+        g->calls[g->n_calls++] = call;
+    }
+    for (u64 n = take_u64(code); n > 0 && !code->failed; n--) {
+        uptr index = take_u64(code);
+        i64 pc = base + (i64) take_u64(code);
+        if (index < m->n_data) {
+            m->data[index].int_value = pc;
+        }
+    }
+    if (module->failed || code->failed || module->p != module->end
+        || code->p != code->end || (uptr) info->type >= m->n_types) {
+        error("internal compiler error: malformed cached function\n");
+    }
+    if (m->types[info->type].size > m->stack_extent) {
+        m->stack_extent = m->types[info->type].size;
+    }
+    return true;
+}
+
+/// Read a cached function, checking that it is whole and is the one wanted.
+/// \return The file's contents, or `NULL` if there is no such function.
+static u8 *load_entry(Gen *g, const char *path, u64 key, Unpacker *module,
+                      Unpacker *code) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    u8 *bytes = NULL;
+    uptr length = 0, capacity = 0;
+    for (;;) {
+        GROW(g->allocator, bytes, length, capacity);
+        uptr n = fread(bytes + length, 1, capacity - length, file);
+        length += n;
+        if (n == 0) {
+            break;
+        }
+    }
+    bool failed = ferror(file);
+    fclose(file);
+
+    Unpacker u = {.p = bytes, .end = bytes + length};
+    u64 checksum = GEN_HASH_BASIS;
+    failed |= length < sizeof checksum;
+    if (!failed) {
+        u.end -= sizeof checksum;
+        mix(&checksum, bytes, length - sizeof checksum);
+        failed |= memcmp(u.end, &checksum, sizeof checksum) != 0;
+    }
+    u.failed = failed;
+    const u8 *magic = take(&u, strlen(GEN_CACHE_MAGIC));
+    failed |= magic == NULL
+              || memcmp(magic, GEN_CACHE_MAGIC, strlen(GEN_CACHE_MAGIC)) != 0;
+    failed |= take_u64(&u) != GEN_CACHE_VERSION;
+    failed |= take_u64(&u) != key;
+    uptr module_length = take_u64(&u);
+    const u8 *module_bytes = take(&u, module_length);
+    uptr code_length = take_u64(&u);
+    const u8 *code_bytes = take(&u, code_length);
+    failed |= u.failed || u.p != u.end;
+    if (failed) {
+        FREE(g->allocator, bytes);
+        return NULL;
+    }
+    *module = (Unpacker) {.p = module_bytes,
+                          .end = module_bytes + module_length};
+    *code = (Unpacker) {.p = code_bytes, .end = code_bytes + code_length};
+    return bytes;
+}
+
+/// Write a function to the cache. The file appears whole or not at all, and
+/// a failure only means that the function is generated again next time.
+static void store_entry(Gen *g, const char *path, u64 key,
+                        const Bytes *module, const Bytes *code) {
+    Bytes b = {0};
+    put(g, &b, GEN_CACHE_MAGIC, strlen(GEN_CACHE_MAGIC));
+    put_u64(g, &b, GEN_CACHE_VERSION);
+    put_u64(g, &b, key);
+    put_text(g, &b, module->data, module->length);
+    put_text(g, &b, code->data, code->length);
+    u64 checksum = GEN_HASH_BASIS;
+    mix(&checksum, b.data, b.length);
+    put_u64(g, &b, checksum);
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof temporary, "%s.%ld", path, (long) getpid());
+    FILE *file = fopen(temporary, "wb");
+    if (file != NULL) {
+        bool written = fwrite(b.data, 1, b.length, file) == b.length;
+        written &= fclose(file) == 0;
+        if (!written || rename(temporary, path) != 0) {
+            remove(temporary);
+        }
+    }
+    FREE(g->allocator, b.data);
+}
+
+/// Take a function from the cache, or generate it and add it.
+static void cached_function(Gen *g, FunctionInfo *info) {
+    u64 key = function_key(g, info);
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%016llx.fn", g->cache->dir,
+             (unsigned long long) key);
+    Unpacker module, code;
+    u8 *entry = load_entry(g, path, key, &module, &code);
+    if (entry != NULL) {
+        const u8 *start = module.p;
+        uptr length = (uptr) (module.end - module.p);
+        if (replay(g, &module, &code, info)) {
+            mix(&g->state, start, length);
+            g->cache->hits++;
+            FREE(g->allocator, entry);
+            return;
+        }
+        FREE(g->allocator, entry);
+    }
+
+    g->cache->misses++;
+    GenMarks marks = mark(g);
+    Diagnostic **tail = g->diagnostics->tail;
+    gen_function(g, info);
+    Bytes module_bytes = {0}, code_bytes = {0};
+    record(g, &marks, info, &module_bytes, &code_bytes);
+    mix(&g->state, module_bytes.data, module_bytes.length);
+    // A function with errors is generated again, to report them again.
+    if (*tail == NULL) {
+        store_entry(g, path, key, &module_bytes, &code_bytes);
+    }
+    FREE(g->allocator, marks.import_fns);
+    FREE(g->allocator, module_bytes.data);
+    FREE(g->allocator, code_bytes.data);
+}
+
+DisModule *gen_module(Allocator *allocator, const char *name, Decl **globals,
+                      uptr n_globals, Node **functions, uptr n_functions,
+                      PassManager *passes, GenCache *cache,
+                      Diagnostics *diagnostics) {
+    Gen g = {
+        .allocator = allocator,
+        .module = DisModule_new(allocator, name),
+        .diagnostics = diagnostics,
+        .passes = passes,
+        .cache = cache,
+        .n_functions = n_functions,
+        .nil = -1,
+    };
+
+    // Descriptor 0 describes module data, which is only complete at the end.
+    i32 data_type = DisModule_add_type(g.module, 0, NULL, 0);
+    for (uptr i = 0; i < n_globals; i++) {
+        globals[i]->offset = slot(&g, &g.module->data_size, &g.data_map,
+                                  globals[i]->type);
+    }
+
+    g.functions = ALLOC(allocator, (n_functions ? n_functions : 1)
+                                   * sizeof(FunctionInfo));
+    for (uptr i = 0; i < n_functions; i++) {
+        g.functions[i] = (FunctionInfo) {.function = functions[i]};
+        if (functions[i]->decl) {
+            functions[i]->decl->offset = (i32) i;
+        }
+    }
+    if (cache != NULL) {
+        // Functions depend on the globals only through their offsets and the
+        // module data after them, which the keys and this cover.
+        uptr length;
+        const u8 *map = map_bits(&g, &g.data_map, g.module->data_size,
+                                 &length);
+        g.state = GEN_HASH_BASIS;
+        mix_u64(&g.state, g.module->data_size);
+        mix(&g.state, map, length);
+    }
+    for (uptr i = 0; i < n_functions; i++) {
+        if (cache != NULL) {
+            cached_function(&g, &g.functions[i]);
+        } else {
+            gen_function(&g, &g.functions[i]);
+        }
+    }
+
+    for (uptr i = 0; i < g.n_calls; i++) {
+        const CallPatch *call = &g.calls[i];
+        const FunctionInfo *callee = &g.functions[call->function];
+        DisInst *inst = &g.module->code[call->pc];
+        if (call->frame) {
+            inst->src = imm(callee->type);
+        } else {
+            inst->dst = imm(callee->pc);
+        }
+    }
+
+    for (uptr i = 0; i < n_functions; i++) {
+        Decl *decl = functions[i]->decl;
+        if (decl == NULL || decl->token == NULL) {
+            continue;
+        }
+        const char *fn_name = DisModule_string(
+            g.module, decl->token->location, decl->token->length);
+        DisModule_add_link(g.module, (DisLink) {
+            g.functions[i].pc, g.functions[i].type, signature(decl->type),
+            fn_name});
+        if (strcmp(fn_name, "init") == 0) {
+            g.module->entry_pc = g.functions[i].pc;
+            g.module->entry_type = g.functions[i].type;
+        }
+    }
+
+    uptr size = align_to(g.module->data_size, LAYOUT_WORD), length;
+    const u8 *map = map_bits(&g, &g.data_map, size, &length);
+    g.module->data_size = size;
+    DisModule_set_type(g.module, data_type, size, map, length);
+
+    for (uptr i = 0; i < n_functions; i++) {
+        FREE(allocator, g.functions[i].callees);
+    }
+    for (uptr i = 0; i < g.n_descriptors; i++) {
+        FREE(allocator, g.descriptors[i].map);
+    }
+    for (uptr i = 0; i < g.n_zeros; i++) {
+        FREE(allocator, g.zeros[i].map);
+    }
+    FREE(allocator, g.functions);
+    FREE(allocator, g.calls);
+    FREE(allocator, g.constants);
+    FREE(allocator, g.descriptors);
+    FREE(allocator, g.imports);
+    FREE(allocator, g.zeros);
+    FREE(allocator, g.patches);
+    FREE(allocator, g.data_pcs);
+    FREE(allocator, g.slots);
+    FREE(allocator, g.data_map.bits);
+    FREE(allocator, g.frame_map.bits);
+    return g.module;
+}
@@ -0,0 +1,59 @@
+#ifndef LIMBO_GEN_H
+#define LIMBO_GEN_H
+
+#include "alloc.h"
+#include "dis.h"
+#include "error.h"
+#include "opt.h"
+#include "parser.h"
+
+/// Functions generated before, kept on disk so that a function that has not
+/// changed is not lowered, optimised or translated again.
+/// A function is kept under a hash of its syntax tree, the types, module data
+/// and functions it refers to, the bodies of the functions it may inline,
+/// the passes, and everything generated before it that its code depends
+/// on. A module is the same whether its functions come from the cache or
+/// not.
+typedef struct GenCache {
+    /// The directory the functions are kept in, which must exist.
+    const char *dir;
+    /// The number of functions found in the cache, and generated.
+    uptr hits, misses;
+} GenCache;
+
+/// Lower a module to Dis instructions. Each function is lowered to SSA form,
+/// optimised, and then translated to Dis.
+/// \param allocator The allocator to allocate the module from.
+/// \param name The name of the module.
+/// \param globals The module-level variables, which are placed in module
+/// data in this order.
+/// \param n_globals The number of module-level variables.
+/// \param functions The `NODE_FUNCTION` nodes of the module.
+/// \param n_functions The number of functions.
+/// \param passes The passes to optimise each function with, or `NULL` to
+/// generate code without optimising.
+/// \param cache The cache of generated functions, or `NULL`. Functions that
+/// report errors are not kept.
+/// \param diagnostics The list to record errors in, such as constructs that
+/// cannot be lowered yet.
+/// \return The module. Every function is exported, and a function named
+/// `init` is the entry point.
+/// \note
+///     Frames start with the `DIS_NREG` words that the VM manages, followed by
+///     the parameters in order, then locals and temporaries, which share
+///     memory when they are never live at the same time and hold the same
+///     kind of pointers. Results are stored through the pointer in word
+///     `DIS_REGRET`. Module data starts with the module-level variables,
+///     followed by constants.
+///
+///     Offsets and pointer maps use the host word size, `LAYOUT_WORD`, and
+///     `nil` is a zero pointer.
+/// \remark Functions must be type checked and folded, and every adt they use
+/// must already be laid out. The `Decl.offset` of each module-level variable
+/// and function is assigned here.
+DisModule *gen_module(Allocator *allocator, const char *name, Decl **globals,
+                      uptr n_globals, Node **functions, uptr n_functions,
+                      PassManager *passes, GenCache *cache,
+                      Diagnostics *diagnostics);
+
+#endif //LIMBO_GEN_H
@@ -0,0 +1,839 @@
+#include <string.h>
+#include "error.h"
+#include "heap.h"
+#include "unicode.h"
+
+static u8 pointer_map[] = {0x80};
+
+const DisType heap_type_byte = {1, 0, NULL};
+const DisType heap_type_word = {4, 0, NULL};
+const DisType heap_type_big = {8, 0, NULL};
+const DisType heap_type_real = {8, 0, NULL};
+const DisType heap_type_pointer = {8, 1, pointer_map};
+
+void *heap_alloc(Allocator *allocator, HeapKind kind, const DisType *type,
+                 uptr size) {
+    Heap *header = ALLOC(allocator, sizeof(Heap) + size);
+    atomic_init(&header->ref, 1);
+    header->kind = (u8) kind;
+    atomic_init(&header->buffered, false);
+    header->type = type;
+    return header + 1;
+}
+
+/// The pointer held by word `word` of a block, as its pointer map numbers
+/// them: one bit per word, most significant bit first.
+static void **map_word(u8 *base, uptr word) {
+    return (void **) (base + word * sizeof(void *));
+}
+
+/// The cell of a channel's buffer for a position.
+static u8 *cell(Channel *channel, uptr position) {
+    return channel->buffer + position % channel->capacity * channel->stride;
+}
+
+static _Atomic uptr *sequence(Channel *channel, uptr position) {
+    return (_Atomic uptr *) cell(channel, position);
+}
+
+void heap_ref_map(u8 *base, const DisType *type) {
+    if (type == NULL) {
+        return;
+    }
+    for (uptr i = 0; i < type->map_length; i++) {
+        for (u8 bits = type->map[i], bit = 0; bits; bits <<= 1, bit++) {
+            if (bits & 0x80) {
+                heap_ref(*map_word(base, i * 8 + bit));
+            }
+        }
+    }
+}
+
+void heap_unref_map(Allocator *allocator, u8 *base, const DisType *type) {
+    if (type == NULL) {
+        return;
+    }
+    for (uptr i = 0; i < type->map_length; i++) {
+        for (u8 bits = type->map[i], bit = 0; bits; bits <<= 1, bit++) {
+            if (bits & 0x80) {
+                void **word = map_word(base, i * 8 + bit);
+                void *pointer = *word;
+                *word = NULL;
+                heap_unref(allocator, pointer);
+            }
+        }
+    }
+}
+
+void heap_copy(Allocator *allocator, u8 *dst, const u8 *src, uptr size,
+               const DisType *type) {
+    if (type == NULL) {
+        memmove(dst, src, size);
+        return;
+    }
+    // Take the new references before dropping the old, in case the two
+    // values share objects.
+    heap_ref_map((u8 *) src, type);
+    heap_unref_map(allocator, dst, type);
+    memmove(dst, src, size);
+}
+
+/// The colours of the cycle collector's marks.
+enum {
+    /// Live, as far as the collector knows.
+    BLACK,
+    /// Being tried: its count holds only references from outside the
+    /// objects being tried.
+    GRAY,
+    /// Garbage, unless something black turns out to refer to it.
+    WHITE,
+    /// Released while a thread had it among its possible roots, so left for
+    /// the collector to free.
+    DEAD,
+};
+
+/// The release work of the calling thread, or `NULL`.
+static thread_local HeapLocal *local;
+
+void heap_attach(HeapLocal *self) {
+    local = self;
+}
+
+/// Whether an object can be part of a cycle: whether it can hold pointers.
+/// Module data, which nearly every object is reachable from, is left out,
+/// so that the collector never traces the whole heap.
+static bool may_cycle(Heap *header) {
+    void *contents = header + 1;
+    switch ((HeapKind) header->kind) {
+        case HEAP_RECORD:
+            return header->type != NULL && header->type->map_length > 0;
+        case HEAP_ARRAY:
+            return ((Array *) contents)->type != NULL;
+        case HEAP_LIST:
+            return ((List *) contents)->type != NULL;
+        case HEAP_CHANNEL:
+            return ((Channel *) contents)->type != NULL;
+        case HEAP_STRING:
+        case HEAP_MODULE:
+            break;
+    }
+    return false;
+}
+
+/// Call a function on each object that a block of memory points to.
+static void each_in_map(u8 *base, const DisType *type,
+                        void (*fn)(void *, Heap *), void *context) {
+    if (type == NULL) {
+        return;
+    }
+    for (uptr i = 0; i < type->map_length; i++) {
+        for (u8 bits = type->map[i], bit = 0; bits; bits <<= 1, bit++) {
+            void *pointer = *map_word(base, i * 8 + bit);
+            if ((bits & 0x80) && pointer != NULL) {
+                fn(context, heap_header(pointer));
+            }
+        }
+    }
+}
+
+/// Call a function on each object that an object that may be part of a
+/// cycle refers to.
+static void each_child(Heap *header, void (*fn)(void *, Heap *),
+                       void *context) {
+    void *contents = header + 1;
+    switch ((HeapKind) header->kind) {
+        case HEAP_RECORD:
+            each_in_map(contents, header->type, fn, context);
+            break;
+        case HEAP_ARRAY: {
+            Array *array = contents;
+            for (uptr i = 0; i < array->length; i++) {
+                each_in_map(array->data + i * array->size, array->type, fn,
+                            context);
+            }
+            break;
+        }
+        case HEAP_LIST: {
+            List *list = contents;
+            each_in_map(list->data, list->type, fn, context);
+            if (list->tail != NULL) {
+                fn(context, heap_header(list->tail));
+            }
+            break;
+        }
+        case HEAP_CHANNEL: {
+            Channel *channel = contents;
+            for (uptr i = channel->head; i != channel->tail; i++) {
+                each_in_map(cell(channel, i) + sizeof(uptr), channel->type,
+                            fn, context);
+            }
+            break;
+        }
+        case HEAP_STRING:
+        case HEAP_MODULE:
+            break;
+    }
+}
+
+/// Drop the references that an object's contents hold.
+static void release_contents(Allocator *allocator, Heap *header) {
+    void *contents = header + 1;
+    switch ((HeapKind) header->kind) {
+        case HEAP_RECORD:
+            heap_unref_map(allocator, contents, header->type);
+            break;
+        case HEAP_STRING:
+            break;
+        case HEAP_ARRAY: {
+            Array *array = contents;
+            for (uptr i = 0; array->type && i < array->length; i++) {
+                heap_unref_map(allocator, array->data + i * array->size,
+                               array->type);
+            }
+            break;
+        }
+        case HEAP_LIST: {
+            List *list = contents;
+            heap_unref_map(allocator, list->data, list->type);
+            heap_unref(allocator, list->tail);
+            list->tail = NULL;
+            break;
+        }
+        case HEAP_CHANNEL: {
+            Channel *channel = contents;
+            for (uptr i = channel->head; channel->type && i != channel->tail;
+                 i++) {
+                heap_unref_map(allocator, cell(channel, i) + sizeof(uptr),
+                               channel->type);
+            }
+            channel->head = atomic_load(&channel->tail);
+            break;
+        }
+        case HEAP_MODULE: {
+            ModuleLink *link = contents;
+            if (link->mp != NULL) {
+                heap_unref_map(allocator, link->mp, link->data_type);
+            }
+            break;
+        }
+    }
+}
+
+/// Release the memory that an object owns besides its references, but not
+/// the object itself.
+static void release_storage(Allocator *allocator, Heap *header) {
+    void *contents = header + 1;
+    if (header->kind == HEAP_CHANNEL) {
+        Channel *channel = contents;
+        FREE(allocator, channel->buffer);
+        mtx_destroy(&channel->lock);
+    } else if (header->kind == HEAP_MODULE) {
+        ModuleLink *link = contents;
+        FREE(allocator, link->mp);
+        FREE(allocator, link->entries);
+    }
+}
+
+/// Record an object that may be part of a garbage cycle, unless some
+/// thread has already.
+static void buffer(HeapLocal *self, Heap *header) {
+    if (!atomic_load_explicit(&header->buffered, memory_order_relaxed)
+        && !atomic_exchange_explicit(&header->buffered, true,
+                                     memory_order_relaxed)) {
+        GROW(self->allocator, self->roots, self->n_roots,
+             self->roots_capacity);
+        self->roots[self->n_roots++] = header;
+    }
+}
+
+/// Leave an object that has lost its last reference for `heap_release`.
+static void defer(HeapLocal *self, Heap *header) {
+    GROW(self->allocator, self->pending, self->n_pending,
+         self->pending_capacity);
+    self->pending[self->n_pending++] = header;
+}
+
+/// Drop the possible roots that a thread has recorded without looking for
+/// cycles.
+static void forget_roots(HeapLocal *self) {
+    for (uptr i = 0; i < self->n_roots; i++) {
+        Heap *header = self->roots[i];
+        if (header->colour == DEAD) {
+            FREE(self->allocator, header);
+        } else {
+            atomic_store_explicit(&header->buffered, false,
+                                  memory_order_relaxed);
+        }
+    }
+    self->n_roots = 0;
+}
+
+/// Count down a reference to an object, leaving it for `heap_release` if it
+/// was the last one.
+static void drop(HeapLocal *self, Heap *header) {
+    // The object is recorded while this reference still keeps it alive; a
+    // thread that drops the last one then leaves it for the collector.
+    if (may_cycle(header)
+        && atomic_load_explicit(&header->ref, memory_order_relaxed) > 1) {
+        buffer(self, header);
+    }
+    if (atomic_fetch_sub_explicit(&header->ref, 1,
+                                  memory_order_acq_rel) == 1) {
+        defer(self, header);
+    }
+}
+
+/// Count down every reference that a thread has dropped since it last did.
+static void apply_decrements(HeapLocal *self) {
+    while (self->n_decrements > 0) {
+        drop(self, self->decrements[--self->n_decrements]);
+    }
+}
+
+void heap_unref(Allocator *allocator, void *contents) {
+    if (contents == NULL) {
+        return;
+    }
+    Heap *header = heap_header(contents);
+    if (local != NULL) {
+        GROW(local->allocator, local->decrements, local->n_decrements,
+             local->decrements_capacity);
+        local->decrements[local->n_decrements++] = header;
+        return;
+    }
+    // Release everything now, as a batch of work of its own. Objects are
+    // released one at a time rather than recursively, so that dropping a
+    // long list cannot overflow the C stack.
+    HeapLocal now = {.allocator = allocator};
+    local = &now;
+    drop(&now, header);
+    heap_release(UINTPTR_MAX);
+    forget_roots(&now);
+    local = NULL;
+    HeapLocal_free(&now);
+}
+
+bool heap_release(uptr budget) {
+    apply_decrements(local);
+    for (; budget > 0 && local->n_pending > 0; budget--) {
+        Heap *header = local->pending[--local->n_pending];
+        release_contents(local->allocator, header);
+        release_storage(local->allocator, header);
+        if (atomic_load_explicit(&header->buffered, memory_order_relaxed)) {
+            header->colour = DEAD;
+        } else {
+            FREE(local->allocator, header);
+        }
+        // The references the contents held.
+        apply_decrements(local);
+    }
+    return local->n_pending > 0;
+}
+
+void HeapLocal_free(HeapLocal *self) {
+    FREE(self->allocator, self->decrements);
+    FREE(self->allocator, self->pending);
+    FREE(self->allocator, self->roots);
+    self->decrements = NULL;
+    self->pending = NULL;
+    self->roots = NULL;
+    self->n_decrements = self->decrements_capacity = 0;
+    self->n_pending = self->pending_capacity = 0;
+    self->n_roots = self->roots_capacity = 0;
+}
+
+// Cycles
+
+/// The state of a cycle collection.
+/// The graph is walked with stacks of our own rather than recursively, as
+/// cycles can be as long as the heap is large.
+typedef struct Collector {
+    Allocator *allocator;
+    Heap **stack;
+    uptr n_stack, stack_capacity;
+    /// The objects being made black again, as something live refers to
+    /// them.
+    Heap **blacken;
+    uptr n_blacken, blacken_capacity;
+    /// The garbage found.
+    Heap **garbage;
+    uptr n_garbage, garbage_capacity;
+} Collector;
+
+static void push(Allocator *allocator, Heap ***stack, uptr *n,
+                 uptr *capacity, Heap *header) {
+    GROW(allocator, *stack, *n, *capacity);
+    (*stack)[(*n)++] = header;
+}
+
+/// Take the reference from a gray object off one it refers to.
+static void gray_child(void *context, Heap *child) {
+    Collector *c = context;
+    if (!may_cycle(child)) {
+        return;
+    }
+    atomic_fetch_sub_explicit(&child->ref, 1, memory_order_relaxed);
+    if (child->colour != GRAY) {
+        child->colour = GRAY;
+        push(c->allocator, &c->stack, &c->n_stack, &c->stack_capacity,
+             child);
+    }
+}
+
+/// Give back the reference from a black object to one it refers to.
+static void black_child(void *context, Heap *child) {
+    Collector *c = context;
+    if (!may_cycle(child)) {
+        return;
+    }
+    atomic_fetch_add_explicit(&child->ref, 1, memory_order_relaxed);
+    if (child->colour != BLACK) {
+        child->colour = BLACK;
+        push(c->allocator, &c->blacken, &c->n_blacken, &c->blacken_capacity,
+             child);
+    }
+}
+
+static void scan_child(void *context, Heap *child) {
+    Collector *c = context;
+    if (may_cycle(child) && child->colour == GRAY) {
+        push(c->allocator, &c->stack, &c->n_stack, &c->stack_capacity,
+             child);
+    }
+}
+
+static void white_child(void *context, Heap *child) {
+    Collector *c = context;
+    if (may_cycle(child) && child->colour == WHITE) {
+        child->colour = BLACK;
+        push(c->allocator, &c->stack, &c->n_stack, &c->stack_capacity,
+             child);
+        push(c->allocator, &c->garbage, &c->n_garbage, &c->garbage_capacity,
+             child);
+    }
+}
+
+/// Drop a garbage object's reference to one that cannot be part of a
+/// cycle, and so was not tried.
+static void green_child(void *context, Heap *child) {
+    Collector *c = context;
+    if (!may_cycle(child)) {
+        heap_unref(c->allocator, child + 1);
+    }
+}
+
+/// Take the references among the objects reachable from a root off their
+/// counts, making them gray.
+static void mark_gray(Collector *c, Heap *root) {
+    if (root->colour == GRAY) {
+        return;
+    }
+    root->colour = GRAY;
+    push(c->allocator, &c->stack, &c->n_stack, &c->stack_capacity, root);
+    while (c->n_stack > 0) {
+        each_child(c->stack[--c->n_stack], gray_child, c);
+    }
+}
+
+/// Make the gray objects reachable from a root white if nothing outside
+/// refers to them, or black again, with their counts restored, if
+/// something does.
+static void scan(Collector *c, Heap *root) {
+    scan_child(c, root);
+    while (c->n_stack > 0) {
+        Heap *header = c->stack[--c->n_stack];
+        if (header->colour != GRAY) {
+            continue;
+        }
+        if (atomic_load_explicit(&header->ref, memory_order_relaxed) > 0) {
+            header->colour = BLACK;
+            push(c->allocator, &c->blacken, &c->n_blacken,
+                 &c->blacken_capacity, header);
+            while (c->n_blacken > 0) {
+                each_child(c->blacken[--c->n_blacken], black_child, c);
+            }
+        } else {
+            header->colour = WHITE;
+            each_child(header, scan_child, c);
+        }
+    }
+}
+
+/// Gather the white objects reachable from a root as garbage.
+static void collect_white(Collector *c, Heap *root) {
+    white_child(c, root);
+    while (c->n_stack > 0) {
+        each_child(c->stack[--c->n_stack], white_child, c);
+    }
+}
+
+void heap_collect_cycles(HeapLocal **locals, uptr n_locals) {
+    if (n_locals == 0) {
+        return;
+    }
+    Collector c = {.allocator = locals[0]->allocator};
+    // Counts that still include dropped references would keep garbage alive.
+    for (uptr i = 0; i < n_locals; i++) {
+        apply_decrements(locals[i]);
+    }
+    // Merge the threads' roots, dropping those that lost their last
+    // reference since: the dead, which are freed here, and those still to
+    // be released, which their threads free.
+    Heap **roots = NULL;
+    uptr n_roots = 0, roots_capacity = 0;
+    for (uptr i = 0; i < n_locals; i++) {
+        for (uptr j = 0; j < locals[i]->n_roots; j++) {
+            Heap *header = locals[i]->roots[j];
+            if (header->colour == DEAD) {
+                FREE(c.allocator, header);
+            } else if (atomic_load_explicit(&header->ref,
+                                            memory_order_relaxed) == 0) {
+                atomic_store_explicit(&header->buffered, false,
+                                      memory_order_relaxed);
+            } else {
+                push(c.allocator, &roots, &n_roots, &roots_capacity, header);
+            }
+        }
+        locals[i]->n_roots = 0;
+    }
+
+    for (uptr i = 0; i < n_roots; i++) {
+        mark_gray(&c, roots[i]);
+    }
+    for (uptr i = 0; i < n_roots; i++) {
+        scan(&c, roots[i]);
+    }
+    for (uptr i = 0; i < n_roots; i++) {
+        atomic_store_explicit(&roots[i]->buffered, false,
+                              memory_order_relaxed);
+    }
+    for (uptr i = 0; i < n_roots; i++) {
+        collect_white(&c, roots[i]);
+    }
+
+    // The garbage only refers to itself and to objects that cannot be part
+    // of a cycle, whose references are all that is left to drop.
+    for (uptr i = 0; i < c.n_garbage; i++) {
+        Heap *header = c.garbage[i];
+        each_child(header, green_child, &c);
+        release_storage(c.allocator, header);
+    }
+    for (uptr i = 0; i < c.n_garbage; i++) {
+        FREE(c.allocator, c.garbage[i]);
+    }
+    FREE(c.allocator, roots);
+    FREE(c.allocator, c.stack);
+    FREE(c.allocator, c.blacken);
+    FREE(c.allocator, c.garbage);
+}
+
+// Strings
+
+/// The size of a character of a string.
+static uptr char_size(bool wide) {
+    return wide ? sizeof(u32) : 1;
+}
+
+static String *alloc_string(Allocator *allocator, uptr length,
+                            uptr capacity, bool wide) {
+    String *string = heap_alloc(allocator, HEAP_STRING, NULL,
+                                sizeof(String) + capacity * char_size(wide));
+    string->length = length;
+    string->capacity = capacity;
+    string->wide = wide;
+    return string;
+}
+
+String *String_new(Allocator *allocator, uptr length, bool wide) {
+    return alloc_string(allocator, length, length, wide);
+}
+
+/// Set a character of a string, which its encoding must have room for.
+static void put_char(String *self, uptr index, u32 c) {
+    if (self->wide) {
+        ((u32 *) self->data)[index] = c;
+    } else {
+        self->data[index] = (u8) c;
+    }
+}
+
+/// Copy characters from one string to another, converting them if the two
+/// are encoded differently.
+static void copy_chars(String *dst, uptr at, const String *src, uptr start,
+                       uptr n) {
+    if (dst->wide == src->wide) {
+        uptr size = char_size(dst->wide);
+        memcpy(dst->data + at * size, src->data + start * size, n * size);
+        return;
+    }
+    for (uptr i = 0; i < n; i++) {
+        put_char(dst, at + i, String_at(src, start + i));
+    }
+}
+
+/// Decode one character of bounded UTF-8 text.
+/// \return The character, or U+FFFD for a malformed sequence.
+static u32 decode(const char **text, const char *end) {
+    // utf8_decode stops at a NUL, so pad a sequence cut short by the end.
+    char padded[5] = {0};
+    const char *p = *text, *next = NULL;
+    if (end - p < 4) {
+        memcpy(padded, p, (uptr) (end - p));
+        p = padded;
+    }
+    u32 c = utf8_decode(p, &next);
+    if (next == NULL) {
+        *text += 1;
+        return 0xFFFD;
+    }
+    *text += next - p;
+    return c;
+}
+
+String *String_from_utf8(Allocator *allocator, const char *text,
+                         uptr length) {
+    const char *end = text + length;
+    uptr n = 0;
+    u32 widest = 0;
+    for (const char *p = text; p < end; n++) {
+        u32 c = decode(&p, end);
+        widest = c > widest ? c : widest;
+    }
+    if (n == 0) {
+        return NULL;
+    }
+    String *string = String_new(allocator, n, widest > 0xFF);
+    if (widest < 0x80) {
+        // The text is ASCII, which is Latin-1 as it is.
+        memcpy(string->data, text, n);
+        return string;
+    }
+    const char *p = text;
+    for (uptr i = 0; i < n; i++) {
+        put_char(string, i, decode(&p, end));
+    }
+    return string;
+}
+
+uptr String_utf8(const String *self, char *buffer) {
+    uptr length = 0;
+    for (uptr i = 0; self != NULL && i < self->length; i++) {
+        u32 c = String_at(self, i);
+        if (c < 0x80) {
+            if (buffer != NULL) {
+                buffer[length] = (char) c;
+            }
+            length++;
+            continue;
+        }
+        char bytes[4];
+        UTF8Length n = utf8_encode(c, bytes);
+        if (n == UTF8_INVALID) {
+            n = utf8_encode(0xFFFD, bytes);
+        }
+        if (buffer != NULL) {
+            memcpy(buffer + length, bytes, n);
+        }
+        length += n;
+    }
+    return length;
+}
+
+void String_write(const String *self, FILE *out) {
+    for (uptr i = 0; self != NULL && i < self->length;) {
+        // Runs of ASCII in a Latin-1 string are already UTF-8.
+        uptr run = i;
+        while (!self->wide && run < self->length && self->data[run] < 0x80) {
+            run++;
+        }
+        if (run > i) {
+            fwrite(self->data + i, 1, run - i, out);
+            i = run;
+            continue;
+        }
+        char bytes[4];
+        UTF8Length n = utf8_encode(String_at(self, i++), bytes);
+        if (n == UTF8_INVALID) {
+            n = utf8_encode(0xFFFD, bytes);
+        }
+        fwrite(bytes, 1, n, out);
+    }
+}
+
+i32 String_compare(const String *a, const String *b) {
+    uptr la = a ? a->length : 0, lb = b ? b->length : 0;
+    uptr n = la < lb ? la : lb;
+    if (n > 0 && !a->wide && !b->wide) {
+        // Latin-1 bytes sort as their characters do.
+        int c = memcmp(a->data, b->data, n);
+        if (c != 0) {
+            return c < 0 ? -1 : 1;
+        }
+    } else {
+        for (uptr i = 0; i < n; i++) {
+            u32 ca = String_at(a, i), cb = String_at(b, i);
+            if (ca != cb) {
+                return ca < cb ? -1 : 1;
+            }
+        }
+    }
+    return (la > lb) - (la < lb);
+}
+
+String *String_slice(Allocator *allocator, const String *self, uptr start,
+                     uptr end) {
+    if (end <= start) {
+        return NULL;
+    }
+    bool wide = false;
+    for (uptr i = start; self->wide && !wide && i < end; i++) {
+        wide = String_at(self, i) > 0xFF;
+    }
+    String *slice = String_new(allocator, end - start, wide);
+    copy_chars(slice, 0, self, start, end - start);
+    return slice;
+}
+
+String *String_concat(Allocator *allocator, String *a, String *b) {
+    if (a == NULL || b == NULL) {
+        String *result = a ? a : b;
+        heap_ref(result);
+        return result;
+    }
+    String *result = String_new(allocator, a->length + b->length,
+                                a->wide || b->wide);
+    copy_chars(result, 0, a, 0, a->length);
+    copy_chars(result, a->length, b, 0, b->length);
+    return result;
+}
+
+String *String_set(Allocator *allocator, String *self, uptr index, u32 c) {
+    uptr length = self ? self->length : 0;
+    bool append = index == length;
+    bool wide = c > 0xFF || (self != NULL && self->wide);
+    if (self != NULL && index < self->capacity && self->wide == wide
+        && atomic_load_explicit(&heap_header(self)->ref,
+                                memory_order_acquire) == 1) {
+        put_char(self, index, c);
+        self->length += append;
+        return self;
+    }
+    // Appending leaves room to grow, so that building a string a character
+    // at a time is not quadratic.
+    uptr new_length = length + append;
+    uptr capacity = append ? new_length * 2 : new_length;
+    String *copy = alloc_string(allocator, new_length, capacity, wide);
+    if (self != NULL) {
+        copy_chars(copy, 0, self, 0, length);
+    }
+    put_char(copy, index, c);
+    heap_unref(allocator, self);
+    return copy;
+}
+
+// Arrays, lists and channels
+
+Array *Array_new(Allocator *allocator, uptr length, uptr size,
+                 const DisType *type) {
+    Array *array = heap_alloc(allocator, HEAP_ARRAY, NULL,
+                              sizeof(Array) + length * size);
+    array->length = length;
+    array->size = size;
+    array->type = type && type->map_length ? type : NULL;
+    array->data = (u8 *) (array + 1);
+    return array;
+}
+
+List *List_cons(Allocator *allocator, List *tail, uptr size,
+                const DisType *type) {
+    List *list = heap_alloc(allocator, HEAP_LIST, NULL, sizeof(List) + size);
+    list->tail = tail;
+    list->size = size;
+    list->type = type && type->map_length ? type : NULL;
+    return list;
+}
+
+Channel *Channel_new(Allocator *allocator, uptr size, const DisType *type,
+                     uptr capacity) {
+    Channel *channel = heap_alloc(allocator, HEAP_CHANNEL, NULL,
+                                  sizeof(Channel));
+    channel->size = size;
+    channel->type = type && type->map_length ? type : NULL;
+    channel->capacity = capacity;
+    if (mtx_init(&channel->lock, mtx_plain) != thrd_success) {
+        error("cannot create a channel lock\n");
+    }
+    if (capacity > 0) {
+        // Values are word aligned, after the sequence number.
+        channel->stride = sizeof(uptr)
+                          + (size + sizeof(uptr) - 1) / sizeof(uptr)
+                            * sizeof(uptr);
+        channel->buffer = ALLOC(allocator, capacity * channel->stride);
+        for (uptr i = 0; i < capacity; i++) {
+            atomic_init(sequence(channel, i), i);
+        }
+    }
+    return channel;
+}
+
+bool Channel_put(Channel *self, const u8 *value) {
+    if (self->capacity == 0) {
+        return false;
+    }
+    uptr position = atomic_load_explicit(&self->tail, memory_order_relaxed);
+    for (;;) {
+        uptr seq = atomic_load_explicit(sequence(self, position),
+                                        memory_order_acquire);
+        iptr lag = (iptr) (seq - position);
+        if (lag < 0) {
+            // The cell still holds the value put a lap ago.
+            return false;
+        }
+        if (lag == 0 && atomic_compare_exchange_weak_explicit(
+                &self->tail, &position, position + 1, memory_order_relaxed,
+                memory_order_relaxed)) {
+            break;
+        }
+        if (lag > 0) {
+            position = atomic_load_explicit(&self->tail,
+                                            memory_order_relaxed);
+        }
+    }
+    u8 *data = cell(self, position) + sizeof(uptr);
+    heap_ref_map((u8 *) value, self->type);
+    memcpy(data, value, self->size);
+    atomic_store_explicit(sequence(self, position), position + 1,
+                          memory_order_release);
+    return true;
+}
+
+bool Channel_take(Allocator *allocator, Channel *self, u8 *value) {
+    if (self->capacity == 0) {
+        return false;
+    }
+    uptr position = atomic_load_explicit(&self->head, memory_order_relaxed);
+    for (;;) {
+        uptr seq = atomic_load_explicit(sequence(self, position),
+                                        memory_order_acquire);
+        iptr lag = (iptr) (seq - (position + 1));
+        if (lag < 0) {
+            // The cell has not been filled for this lap.
+            return false;
+        }
+        if (lag == 0 && atomic_compare_exchange_weak_explicit(
+                &self->head, &position, position + 1, memory_order_relaxed,
+                memory_order_relaxed)) {
+            break;
+        }
+        if (lag > 0) {
+            position = atomic_load_explicit(&self->head,
+                                            memory_order_relaxed);
+        }
+    }
+    // The buffered value's references move to the receiver.
+    heap_unref_map(allocator, value, self->type);
+    memcpy(value, cell(self, position) + sizeof(uptr), self->size);
+    atomic_store_explicit(sequence(self, position),
+                          position + self->capacity, memory_order_release);
+    return true;
+}
@@ -0,0 +1,351 @@
+#ifndef LIMBO_HEAP_H
+#define LIMBO_HEAP_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <threads.h>
+#include "alloc.h"
+#include "dis.h"
+#include "num.h"
+
+/// What a heap object holds, which decides how it is released.
+typedef enum HeapKind {
+    /// An adt, tuple or other record, laid out by a type descriptor.
+    HEAP_RECORD,
+    /// A `String`.
+    HEAP_STRING,
+    /// An `Array`.
+    HEAP_ARRAY,
+    /// A `List` cell.
+    HEAP_LIST,
+    /// A `Channel`.
+    HEAP_CHANNEL,
+    /// A `ModuleLink`.
+    HEAP_MODULE,
+} HeapKind;
+
+/// The header in front of every heap object.
+/// Dis code only ever sees pointers to the contents, just past the header;
+/// `nil` is the null pointer.
+typedef struct Heap {
+    /// The number of references to the object, which processes on
+    /// different threads may share.
+    _Atomic u32 ref;
+    /// A `HeapKind`.
+    u8 kind;
+    /// The cycle collector's mark.
+    u8 colour;
+    /// Whether the object is among the possible roots of garbage cycles
+    /// that some thread has recorded.
+    atomic_bool buffered;
+    /// For records, the descriptor of the contents.
+    const DisType *type;
+} Heap;
+
+/// A string of Unicode characters.
+/// The empty string is `nil`, so a string always has at least one character.
+/// A string whose characters are all at most U+00FF takes a byte for each,
+/// as Latin-1; any other takes four, as UTF-32.
+typedef struct String {
+    /// The number of characters.
+    uptr length;
+    /// The number of characters `data` has room for.
+    uptr capacity;
+    /// Whether the characters are UTF-32. Only a string made with a
+    /// character above U+00FF in it, or that had one set, is.
+    bool wide;
+    alignas(u32) u8 data[];
+} String;
+
+/// An array of elements laid out by a descriptor.
+typedef struct Array {
+    uptr length;
+    /// The size of an element.
+    uptr size;
+    /// The descriptor of an element, or `NULL` if it holds no pointers.
+    const DisType *type;
+    /// The elements.
+    u8 *data;
+} Array;
+
+/// A cell of a list.
+typedef struct List {
+    /// The rest of the list, or `NULL`.
+    struct List *tail;
+    /// The size of the element.
+    uptr size;
+    /// The descriptor of the element, or `NULL` if it holds no pointers.
+    const DisType *type;
+    /// The element.
+    u8 data[];
+} List;
+
+struct VmWaiter;
+
+/// The processes blocked on one side of a channel, first to last.
+/// \remark It is managed by the VM.
+typedef struct ChannelQueue {
+    struct VmWaiter *first, *last;
+} ChannelQueue;
+
+/// A channel, with an optional buffer.
+/// Values go in and out of the buffer without a lock. Each cell of it holds
+/// a sequence number, which says whether the cell is full for the put at a
+/// position or empty for the take at one, followed by a value.
+typedef struct Channel {
+    /// The size of a value.
+    uptr size;
+    /// The descriptor of a value, or `NULL` if it holds no pointers.
+    const DisType *type;
+    /// The buffer, of `capacity` cells `stride` bytes apart.
+    u8 *buffer;
+    uptr capacity, stride;
+    /// The positions of the next put and the next take, which only grow.
+    /// They are a cache line apart, as senders and receivers update them.
+    _Atomic uptr tail;
+    u8 tail_line[64 - sizeof(uptr)];
+    _Atomic uptr head;
+    u8 head_line[64 - sizeof(uptr)];
+    /// The number of processes blocked on the channel. While there are
+    /// any, values only move with the lock held.
+    _Atomic uptr waiting;
+    /// The processes blocked sending to, and receiving from, the channel.
+    ChannelQueue senders, receivers;
+    /// Guards the queues.
+    mtx_t lock;
+} Channel;
+
+struct VmModule;
+struct VmLinkEntry;
+
+/// An instance of a loaded module: its own module data, and the functions
+/// that the loading module imports from it.
+typedef struct ModuleLink {
+    struct VmModule *module;
+    /// The module data, or `NULL` for builtin modules.
+    u8 *mp;
+    /// The descriptor of the module data, or `NULL`.
+    const DisType *data_type;
+    /// The imported functions, in the order of the loader's import table.
+    struct VmLinkEntry *entries;
+    uptr n_entries;
+} ModuleLink;
+
+/// A thread's share of the work of releasing objects.
+/// References dropped on a thread with one attached are only counted down a
+/// batch at a time, so that processes sharing an object do not contend for
+/// its count while they run. Objects that lose their last reference are
+/// then released a batch at a time too, and objects that lose a reference
+/// but not their last are recorded in case they are part of a garbage
+/// cycle, which reference counts alone never release.
+typedef struct HeapLocal {
+    Allocator *allocator;
+    /// Objects that have lost a reference that their counts still include.
+    Heap **decrements;
+    uptr n_decrements, decrements_capacity;
+    /// Objects whose last reference has gone, whose contents have still to
+    /// be released.
+    Heap **pending;
+    uptr n_pending, pending_capacity;
+    /// Objects that may be part of garbage cycles.
+    Heap **roots;
+    uptr n_roots, roots_capacity;
+} HeapLocal;
+
+/// Descriptors of the basic value classes, for lists, arrays and channels
+/// of them.
+extern const DisType heap_type_byte, heap_type_word, heap_type_big,
+        heap_type_real, heap_type_pointer;
+
+/// The header of a heap object.
+/// \param contents A pointer to the contents of the object.
+/// \return The header.
+static inline Heap *heap_header(const void *contents) {
+    return (Heap *) contents - 1;
+}
+
+/// Allocate a zeroed heap object with one reference.
+/// \param allocator The allocator to allocate the object from.
+/// \param kind What the object holds.
+/// \param type For records, the descriptor of the contents; otherwise `NULL`.
+/// \param size The size of the contents.
+/// \return A pointer to the contents.
+void *heap_alloc(Allocator *allocator, HeapKind kind, const DisType *type,
+                 uptr size);
+
+/// Add a reference to a heap object.
+/// \param contents A pointer to the contents of the object, or `NULL`.
+static inline void heap_ref(void *contents) {
+    if (contents != NULL) {
+        atomic_fetch_add_explicit(&heap_header(contents)->ref, 1,
+                                  memory_order_relaxed);
+    }
+}
+
+/// Drop a reference to a heap object, releasing it and everything it
+/// refers to when it was the last one.
+/// \param allocator The allocator the object was allocated from.
+/// \param contents A pointer to the contents of the object, or `NULL`.
+/// \remark With a `HeapLocal` attached to the thread, the count is only
+/// decremented, and the object released, by `heap_release`. Until then the
+/// count is too high, never too low, so an object that looks unshared is.
+void heap_unref(Allocator *allocator, void *contents);
+
+/// Attach a thread's share of the release work to the calling thread.
+/// \param local The work, or `NULL` to release objects at once again.
+void heap_attach(HeapLocal *local);
+
+/// Count down the references dropped on the calling thread, which must have
+/// a `HeapLocal` attached, and release some of the objects that lost their
+/// last one.
+/// \param budget The most objects to release.
+/// \return Whether any are left to release.
+bool heap_release(uptr budget);
+
+/// Release garbage cycles among the objects that threads have recorded as
+/// possible roots, by trial deletion.
+/// \param locals The work of every thread that has touched the heap.
+/// \param n_locals The number of threads.
+/// \remark No other thread may touch the heap meanwhile. The references
+/// that every thread has dropped are counted down first. Objects that the
+/// cycles refer to but that cannot be part of one are released as
+/// `heap_unref` would on the calling thread.
+void heap_collect_cycles(HeapLocal **locals, uptr n_locals);
+
+/// Release the memory of a thread's share of the release work, which must
+/// have none left.
+/// \param self The work.
+void HeapLocal_free(HeapLocal *self);
+
+/// Add a reference to every pointer that a block of memory holds.
+/// \param base The block.
+/// \param type The descriptor of the block, or `NULL`.
+void heap_ref_map(u8 *base, const DisType *type);
+
+/// Drop a reference to every pointer that a block of memory holds.
+/// \param allocator The allocator the objects were allocated from.
+/// \param base The block.
+/// \param type The descriptor of the block, or `NULL`.
+void heap_unref_map(Allocator *allocator, u8 *base, const DisType *type);
+
+/// Copy a value, adjusting the references of the pointers in it.
+/// \param allocator The allocator heap objects are allocated from.
+/// \param dst The value to overwrite.
+/// \param src The value to copy, which may overlap `dst`.
+/// \param size The size of the value.
+/// \param type The descriptor of the value, or `NULL`.
+void heap_copy(Allocator *allocator, u8 *dst, const u8 *src, uptr size,
+               const DisType *type);
+
+/// Allocate a string.
+/// \param allocator The allocator to allocate the string from.
+/// \param length The number of characters, which are zeroed.
+/// \param wide Whether the characters are UTF-32 rather than Latin-1.
+/// \return The string.
+String *String_new(Allocator *allocator, uptr length, bool wide);
+
+/// A character of a string.
+/// \param self The string.
+/// \param index The index of the character, which must be in range.
+/// \return The character.
+static inline u32 String_at(const String *self, uptr index) {
+    return self->wide ? ((const u32 *) self->data)[index]
+                      : self->data[index];
+}
+
+/// Make a string from UTF-8 text.
+/// \param allocator The allocator to allocate the string from.
+/// \param text The text. Malformed sequences become U+FFFD.
+/// \param length The length of the text in bytes.
+/// \return The string, or `NULL` if the text is empty.
+String *String_from_utf8(Allocator *allocator, const char *text,
+                         uptr length);
+
+/// The length of a string encoded as UTF-8.
+/// \param self The string, or `NULL`.
+/// \param buffer Where to encode it, or `NULL` to only measure it.
+/// \return The number of bytes.
+uptr String_utf8(const String *self, char *buffer);
+
+/// Write a string to a stream as UTF-8.
+/// \param self The string, or `NULL`.
+/// \param out The stream.
+void String_write(const String *self, FILE *out);
+
+/// Compare two strings character by character.
+/// \return Less than, equal to, or greater than zero as `a` sorts before,
+/// with, or after `b`.
+i32 String_compare(const String *a, const String *b);
+
+/// Copy part of a string, in Latin-1 if it fits.
+/// \param allocator The allocator to allocate the result from.
+/// \param self The string, or `NULL` if the part is empty.
+/// \param start The index of the first character.
+/// \param end The index past the last character, at most the length.
+/// \return The result, or `NULL` if it is empty.
+String *String_slice(Allocator *allocator, const String *self, uptr start,
+                     uptr end);
+
+/// Concatenate two strings.
+/// \param allocator The allocator to allocate the result from.
+/// \param a The first string, or `NULL`.
+/// \param b The second string, or `NULL`.
+/// \return The result, with a new reference.
+String *String_concat(Allocator *allocator, String *a, String *b);
+
+/// Set or append a character of a string, as `insc` does.
+/// The string is copied first if anything else refers to it.
+/// \param allocator The allocator strings are allocated from.
+/// \param self The string, or `NULL`; its reference passes to the result.
+/// \param index The index to set, or the length of the string to append.
+/// \param c The character.
+/// \return The updated string.
+String *String_set(Allocator *allocator, String *self, uptr index, u32 c);
+
+/// Allocate an array of zeroed elements.
+/// \param allocator The allocator to allocate the array from.
+/// \param length The number of elements.
+/// \param size The size of an element.
+/// \param type The descriptor of an element, or `NULL`.
+/// \return The array.
+Array *Array_new(Allocator *allocator, uptr length, uptr size,
+                 const DisType *type);
+
+/// Allocate a list cell with a zeroed element.
+/// \param allocator The allocator to allocate the cell from.
+/// \param tail The rest of the list; its reference passes to the cell.
+/// \param size The size of the element.
+/// \param type The descriptor of the element, or `NULL`.
+/// \return The cell.
+List *List_cons(Allocator *allocator, List *tail, uptr size,
+                const DisType *type);
+
+/// Allocate a channel.
+/// \param allocator The allocator to allocate the channel from.
+/// \param size The size of a value.
+/// \param type The descriptor of a value, or `NULL`.
+/// \param capacity The number of values it buffers.
+/// \return The channel.
+Channel *Channel_new(Allocator *allocator, uptr size, const DisType *type,
+                     uptr capacity);
+
+/// Put a copy of a value in a channel's buffer, if there is room.
+/// Any number of threads may put and take at once.
+/// \param self The channel.
+/// \param value The value.
+/// \return Whether there was room.
+bool Channel_put(Channel *self, const u8 *value);
+
+/// Take the oldest value from a channel's buffer, if there is one.
+/// \param allocator The allocator heap objects are allocated from.
+/// \param self The channel.
+/// \param value Where to move the value, whose old contents are released.
+/// \return Whether there was a value.
+/// \remark A put that has claimed a cell but not yet filled it may make
+/// this report the buffer empty; the putter notices blocked processes
+/// afterwards. The same goes for a take and `Channel_put`.
+bool Channel_take(Allocator *allocator, Channel *self, u8 *value);
+
+#endif //LIMBO_HEAP_H
@@ -0,0 +1,107 @@
+#include <string.h>
+#include "intern.h"
+#include "error.h"
+
+/// The FNV-1a hash of a string.
+/// \remark Never returns zero, as zero marks an empty slot.
+static u32 hash_string(const char *str, uptr len) {
+    u32 hash = 2166136261u;
+    for (uptr i = 0; i < len; i++) {
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+Interner *Interner_new(Allocator *allocator) {
+    Interner *self = ALLOC(allocator, sizeof(Interner));
+    self->allocator = allocator;
+    if (mtx_init(&self->lock, mtx_plain) != thrd_success) {
+        error("internal compiler error: could not create interner lock\n");
+    }
+    self->capacity = 256;
+    self->slots = ALLOC(allocator, self->capacity * sizeof(InternSlot));
+    // Symbol 0 is reserved.
+    self->names = ALLOC(allocator, self->capacity * sizeof(InternName));
+    self->names[0] = (InternName) { "", 0 };
+    self->count = 1;
+    return self;
+}
+
+void Interner_free(Interner *self) {
+    for (uptr i = 1; i < self->count; i++) {
+        FREE(self->allocator, (void *) self->names[i].text);
+    }
+    FREE(self->allocator, self->names);
+    FREE(self->allocator, self->slots);
+    mtx_destroy(&self->lock);
+    FREE(self->allocator, self);
+}
+
+/// Double the capacity of the interner, rehashing every slot.
+static void grow(Interner *self) {
+    InternSlot *old = self->slots;
+    uptr old_capacity = self->capacity;
+
+    self->capacity *= 2;
+    self->slots = ALLOC(self->allocator, self->capacity * sizeof(InternSlot));
+    self->names = REALLOC(self->allocator, self->names,
+                          self->capacity * sizeof(InternName));
+
+    uptr mask = self->capacity - 1;
+    for (uptr i = 0; i < old_capacity; i++) {
+        if (old[i].hash == 0) {
+            continue;
+        }
+        uptr j = old[i].hash & mask;
+        while (self->slots[j].hash != 0) {
+            j = (j + 1) & mask;
+        }
+        self->slots[j] = old[i];
+    }
+    FREE(self->allocator, old);
+}
+
+Symbol Interner_intern(Interner *self, const char *str, uptr len) {
+    u32 hash = hash_string(str, len);
+
+    mtx_lock(&self->lock);
+    if ((self->count + 1) * 4 > self->capacity * 3) {
+        grow(self);
+    }
+
+    uptr mask = self->capacity - 1;
+    uptr i = hash & mask;
+    while (self->slots[i].hash != 0) {
+        if (self->slots[i].hash == hash) {
+            InternName *name = &self->names[self->slots[i].symbol];
+            if (name->length == len && memcmp(name->text, str, len) == 0) {
+                Symbol symbol = self->slots[i].symbol;
+                mtx_unlock(&self->lock);
+                return symbol;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+
+    char *text = ALLOC(self->allocator, len + 1);
+    memcpy(text, str, len);
+    text[len] = '\0';
+
+    Symbol symbol = (Symbol) self->count++;
+    self->names[symbol] = (InternName) { text, len };
+    self->slots[i] = (InternSlot) { hash, symbol };
+    mtx_unlock(&self->lock);
+    return symbol;
+}
+
+const char *Interner_name(Interner *self, Symbol symbol) {
+    mtx_lock(&self->lock);
+    if (symbol >= self->count) {
+        mtx_unlock(&self->lock);
+        error("internal compiler error: unknown symbol %u\n", symbol);
+    }
+    const char *text = self->names[symbol].text;
+    mtx_unlock(&self->lock);
+    return text;
+}
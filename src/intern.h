@@ -0,0 +1,67 @@
+#ifndef LIMBO_INTERN_H
+#define LIMBO_INTERN_H
+
+#include <threads.h>
+#include "alloc.h"
+#include "num.h"
+
+/// An interned string. Two symbols are equal if and only if the strings they
+/// were interned from are equal.
+/// \remark The symbol `0` is never returned by the interner, and can be used
+/// to mean "no symbol".
+typedef u32 Symbol;
+
+/// A slot in the interner's hash table.
+typedef struct InternSlot {
+    /// The hash of the string, or zero if the slot is empty.
+    u32 hash;
+    /// The symbol of the string.
+    Symbol symbol;
+} InternSlot;
+
+/// The text of an interned string.
+typedef struct InternName {
+    const char *text;
+    uptr length;
+} InternName;
+
+/// A table that maps strings to symbols.
+/// \remark The interner is safe to use from multiple threads.
+typedef struct Interner {
+    /// The allocator that the table and strings are allocated from.
+    Allocator *allocator;
+    /// Guards everything below.
+    mtx_t lock;
+    /// Open-addressing hash table, indexed by string hash.
+    InternSlot *slots;
+    uptr capacity;
+    /// The text of each symbol, indexed by symbol.
+    InternName *names;
+    uptr count;
+} Interner;
+
+/// Create an interner.
+/// \param allocator The allocator that the interner allocates from.
+/// \return The new interner.
+/// \see Interner_free
+Interner *Interner_new(Allocator *allocator);
+
+/// Free an interner and every string interned in it.
+/// \param self The interner.
+void Interner_free(Interner *self);
+
+/// Intern a string.
+/// \param self The interner.
+/// \param str The string to intern. It does not need to be NUL-terminated.
+/// \param len The length of the string.
+/// \return The symbol for the string.
+Symbol Interner_intern(Interner *self, const char *str, uptr len);
+
+/// Look up the text of a symbol.
+/// \param self The interner.
+/// \param symbol The symbol.
+/// \return The NUL-terminated text that was interned.
+/// \remark The text remains valid until the interner is freed.
+const char *Interner_name(Interner *self, Symbol symbol);
+
+#endif //LIMBO_INTERN_H
@@ -0,0 +1,729 @@
+#include <string.h>
+#include "ir.h"
+
+IrFunction *IrFunction_new(Allocator *parent, Node *node) {
+    Allocator *arena = ArenaAllocator_new(parent, 0);
+    IrFunction *self = ALLOC(arena, sizeof(IrFunction));
+    self->allocator = arena;
+    self->parent = parent;
+    self->node = node;
+    self->decl = node ? node->decl : NULL;
+    self->type = node ? node->type : NULL;
+    self->entry = IrFunction_block(self);
+    self->entry->sealed = true;
+    return self;
+}
+
+void IrFunction_free(IrFunction *self) {
+    // The function itself lives in its arena.
+    Allocator_destroy(self->allocator);
+}
+
+IrBlock *IrFunction_block(IrFunction *self) {
+    IrBlock *block = ALLOC(self->allocator, sizeof(IrBlock));
+    block->id = self->next_block++;
+    block->function = self;
+    if (self->last) {
+        self->last->next = block;
+    } else {
+        self->entry = block;
+    }
+    self->last = block;
+    self->n_blocks++;
+    return block;
+}
+
+IrInst *IrFunction_inst(IrFunction *self, IrOp op, Type *type, Token *token) {
+    IrInst *inst = ALLOC(self->allocator, sizeof(IrInst));
+    inst->op = op;
+    inst->id = self->next_value++;
+    inst->type = type ? type : type_none;
+    inst->token = token;
+    return inst;
+}
+
+void IrInst_add_arg(IrInst *self, IrFunction *function, IrInst *arg) {
+    GROW(function->allocator, self->args, self->n_args, self->args_capacity);
+    self->args[self->n_args++] = arg;
+}
+
+void IrInst_add_target(IrInst *self, IrFunction *function, IrBlock *target) {
+    GROW(function->allocator, self->targets, self->n_targets,
+         self->targets_capacity);
+    self->targets[self->n_targets++] = target;
+}
+
+void IrInst_remove_arg(IrInst *self, u32 index) {
+    memmove(&self->args[index], &self->args[index + 1],
+            (self->n_args - index - 1) * sizeof(IrInst *));
+    self->n_args--;
+}
+
+bool ir_is_terminator(IrOp op) {
+    return op >= IR_JUMP;
+}
+
+bool IrInst_has_effects(const IrInst *self) {
+    switch (self->op) {
+        case IR_SET_GLOBAL:
+        case IR_SET_INDEX:
+        case IR_STORE_FIELD:
+        case IR_CALL:
+        case IR_MCALL:
+        case IR_SPAWN:
+        case IR_MSPAWN:
+        case IR_LOAD:
+        case IR_SEND:
+        case IR_RECV:
+        case IR_ALT:
+        case IR_NBALT:
+        case IR_JUMP:
+        case IR_BRANCH:
+        case IR_SWITCH:
+        case IR_RETURN:
+        case IR_EXIT:
+            return true;
+
+        // These raise an exception for an index out of range or a nil
+        // pointer.
+        case IR_INDEX:
+        case IR_SET_CHAR:
+        case IR_HEAD:
+        case IR_TAIL:
+            return !self->in_bounds;
+        case IR_LOAD_FIELD:
+            return true;
+
+        // These raise an exception for a negative length or buffer size.
+        case IR_NEW_ARRAY:
+            return self->args[0]->op != IR_CONST
+                   || self->args[0]->int_value < 0;
+        case IR_NEW_CHANNEL:
+            return self->n_args > 0
+                   && (self->args[0]->op != IR_CONST
+                       || self->args[0]->int_value < 0);
+
+        case IR_BINARY: {
+            if (self->operator != NODE_DIV && self->operator != NODE_MOD) {
+                return false;
+            }
+            const IrInst *divisor = self->args[1];
+            if (self->type->kind == TReal) {
+                return false;
+            }
+            return divisor->op != IR_CONST || divisor->int_value == 0;
+        }
+
+        default:
+            return false;
+    }
+}
+
+bool IrInst_is_pure(const IrInst *self) {
+    switch (self->op) {
+        case IR_CONST:
+        case IR_BINARY:
+        case IR_UNARY:
+        case IR_CONVERT:
+        case IR_CONCAT:
+        case IR_FIELD:
+        case IR_INSERT:
+        case IR_MAKE:
+        case IR_HEAD:
+        case IR_TAIL:
+            return true;
+        case IR_INDEX:
+            // Strings are values, but arrays can be changed through any
+            // reference to them.
+            return self->args[0]->type->kind == TString;
+        default:
+            return false;
+    }
+}
+
+static void link_after(IrBlock *block, IrInst *position, IrInst *inst) {
+    inst->block = block;
+    inst->prev = position;
+    inst->next = position ? position->next : block->first;
+    if (inst->next) {
+        inst->next->prev = inst;
+    } else {
+        block->last = inst;
+    }
+    if (position) {
+        position->next = inst;
+    } else {
+        block->first = inst;
+    }
+}
+
+void IrBlock_append(IrBlock *self, IrInst *inst) {
+    IrInst *terminator = IrBlock_terminator(self);
+    if (terminator && !ir_is_terminator(inst->op)) {
+        link_after(self, terminator->prev, inst);
+    } else {
+        link_after(self, self->last, inst);
+    }
+}
+
+void IrBlock_prepend(IrBlock *self, IrInst *inst) {
+    IrInst *position = NULL;
+    if (inst->op != IR_PHI) {
+        for (IrInst *i = self->first; i && i->op == IR_PHI; i = i->next) {
+            position = i;
+        }
+    }
+    link_after(self, position, inst);
+}
+
+void IrBlock_insert_before(IrInst *position, IrInst *inst) {
+    link_after(position->block, position->prev, inst);
+}
+
+void IrBlock_remove(IrInst *inst) {
+    IrBlock *block = inst->block;
+    if (inst->prev) {
+        inst->prev->next = inst->next;
+    } else {
+        block->first = inst->next;
+    }
+    if (inst->next) {
+        inst->next->prev = inst->prev;
+    } else {
+        block->last = inst->prev;
+    }
+    inst->prev = inst->next = NULL;
+    inst->block = NULL;
+}
+
+IrInst *IrBlock_terminator(const IrBlock *self) {
+    IrInst *last = self->last;
+    return last && ir_is_terminator(last->op) ? last : NULL;
+}
+
+u32 IrBlock_succs(const IrBlock *self, IrBlock ***succs) {
+    IrInst *terminator = IrBlock_terminator(self);
+    if (terminator == NULL) {
+        *succs = NULL;
+        return 0;
+    }
+    *succs = terminator->targets;
+    return terminator->n_targets;
+}
+
+IrBlock *IrBlock_split(IrInst *at) {
+    IrBlock *block = at->block;
+    IrBlock *rest = IrFunction_block(block->function);
+    rest->sealed = true;
+    if (at->next) {
+        rest->first = at->next;
+        rest->last = block->last;
+        at->next->prev = NULL;
+        at->next = NULL;
+        block->last = at;
+        for (IrInst *inst = rest->first; inst; inst = inst->next) {
+            inst->block = rest;
+        }
+    }
+    IrBlock **succs;
+    u32 n_succs = IrBlock_succs(rest, &succs);
+    for (u32 i = 0; i < n_succs; i++) {
+        for (u32 k = 0; k < succs[i]->n_preds; k++) {
+            if (succs[i]->preds[k] == block) {
+                succs[i]->preds[k] = rest;
+                break;
+            }
+        }
+    }
+    return rest;
+}
+
+void IrBlock_add_pred(IrBlock *to, IrBlock *from) {
+    GROW(to->function->allocator, to->preds, to->n_preds,
+         to->preds_capacity);
+    to->preds[to->n_preds++] = from;
+}
+
+void IrBlock_remove_pred(IrBlock *to, IrBlock *from) {
+    for (u32 k = 0; k < to->n_preds; k++) {
+        if (to->preds[k] != from) {
+            continue;
+        }
+        memmove(&to->preds[k], &to->preds[k + 1],
+                (to->n_preds - k - 1) * sizeof(IrBlock *));
+        to->n_preds--;
+        for (IrInst *phi = to->first; phi && phi->op == IR_PHI;
+             phi = phi->next) {
+            if (k < phi->n_args) {
+                IrInst_remove_arg(phi, k);
+            }
+        }
+        return;
+    }
+}
+
+void IrBlock_jump(IrBlock *self, IrBlock *target) {
+    IrInst *jump = IrFunction_inst(self->function, IR_JUMP, NULL, NULL);
+    IrInst_add_target(jump, self->function, target);
+    IrBlock_append(self, jump);
+    IrBlock_add_pred(target, self);
+}
+
+void IrBlock_branch(IrBlock *self, IrInst *cond, IrBlock *if_true,
+                    IrBlock *if_false) {
+    IrInst *branch = IrFunction_inst(self->function, IR_BRANCH, NULL,
+                                     cond->token);
+    IrInst_add_arg(branch, self->function, cond);
+    IrInst_add_target(branch, self->function, if_true);
+    IrInst_add_target(branch, self->function, if_false);
+    IrBlock_append(self, branch);
+    IrBlock_add_pred(if_true, self);
+    IrBlock_add_pred(if_false, self);
+}
+
+void IrBlock_switch(IrBlock *self, IrInst *value, IrBlock *otherwise) {
+    IrInst *inst = IrFunction_inst(self->function, IR_SWITCH, NULL,
+                                   value->token);
+    IrInst_add_arg(inst, self->function, value);
+    IrInst_add_target(inst, self->function, otherwise);
+    IrBlock_append(self, inst);
+    IrBlock_add_pred(otherwise, self);
+}
+
+void IrBlock_add_case(IrBlock *self, i64 low, i64 high, IrBlock *target) {
+    IrInst *inst = self->last;
+    u32 index = 0;
+    while (index < inst->n_targets && inst->targets[index] != target) {
+        index++;
+    }
+    if (index == inst->n_targets) {
+        IrInst_add_target(inst, self->function, target);
+        IrBlock_add_pred(target, self);
+    }
+    Allocator *a = self->function->allocator;
+    GROW(a, inst->cases, inst->n_cases, inst->cases_capacity);
+    inst->cases[inst->n_cases++] = (IrCase) {low, high, index};
+}
+
+static IrInst *forwarded(IrInst *value) {
+    IrInst *root = value;
+    while (root->forward) {
+        root = root->forward;
+    }
+    // Compress the chain, so that later lookups are direct.
+    while (value->forward && value->forward != root) {
+        IrInst *next = value->forward;
+        value->forward = root;
+        value = next;
+    }
+    return root;
+}
+
+bool IrFunction_apply_forwards(IrFunction *self) {
+    bool changed = false;
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            for (u32 i = 0; i < inst->n_args; i++) {
+                if (inst->args[i]->forward) {
+                    inst->args[i] = forwarded(inst->args[i]);
+                }
+            }
+        }
+    }
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        for (IrInst *inst = block->first, *next; inst; inst = next) {
+            next = inst->next;
+            if (inst->forward) {
+                IrBlock_remove(inst);
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+/// Number the blocks reachable from the entry in reverse postorder, and
+/// return them in that order.
+static IrBlock **reverse_postorder(IrFunction *self, uptr *count) {
+    IrBlock **order = ALLOC(self->allocator,
+                            (self->n_blocks + 1) * sizeof(IrBlock *));
+    IrBlock **stack = ALLOC(self->allocator,
+                            (self->n_blocks + 1) * sizeof(IrBlock *));
+    u32 *next_succ = ALLOC(self->allocator,
+                           (self->next_block + 1) * sizeof(u32));
+    bool *seen = ALLOC(self->allocator, self->next_block + 1);
+
+    uptr n = 0, depth = 0;
+    stack[depth++] = self->entry;
+    seen[self->entry->id] = true;
+    while (depth > 0) {
+        IrBlock *block = stack[depth - 1];
+        IrBlock **succs;
+        u32 n_succs = IrBlock_succs(block, &succs);
+        if (next_succ[block->id] < n_succs) {
+            IrBlock *succ = succs[next_succ[block->id]++];
+            if (!seen[succ->id]) {
+                seen[succ->id] = true;
+                stack[depth++] = succ;
+            }
+            continue;
+        }
+        order[n++] = block;
+        depth--;
+    }
+
+    for (uptr i = 0; i < n / 2; i++) {
+        IrBlock *t = order[i];
+        order[i] = order[n - 1 - i];
+        order[n - 1 - i] = t;
+    }
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        block->rpo = UINT32_MAX;
+    }
+    for (uptr i = 0; i < n; i++) {
+        order[i]->rpo = (u32) i;
+    }
+    FREE(self->allocator, stack);
+    FREE(self->allocator, next_succ);
+    FREE(self->allocator, seen);
+    *count = n;
+    return order;
+}
+
+bool IrFunction_remove_unreachable(IrFunction *self) {
+    uptr count;
+    IrBlock **order = reverse_postorder(self, &count);
+    FREE(self->allocator, order);
+    if (count == self->n_blocks) {
+        return false;
+    }
+
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        if (block->rpo != UINT32_MAX) {
+            continue;
+        }
+        IrBlock **succs;
+        u32 n_succs = IrBlock_succs(block, &succs);
+        for (u32 i = 0; i < n_succs; i++) {
+            if (succs[i]->rpo != UINT32_MAX) {
+                IrBlock_remove_pred(succs[i], block);
+            }
+        }
+    }
+
+    IrBlock **link = &self->entry;
+    self->last = NULL;
+    self->n_blocks = 0;
+    while (*link) {
+        IrBlock *block = *link;
+        if (block->rpo == UINT32_MAX) {
+            *link = block->next;
+            continue;
+        }
+        self->last = block;
+        self->n_blocks++;
+        link = &block->next;
+    }
+    return true;
+}
+
+static IrBlock *intersect(IrBlock *a, IrBlock *b) {
+    while (a != b) {
+        while (a->rpo > b->rpo) {
+            a = a->idom;
+        }
+        while (b->rpo > a->rpo) {
+            b = b->idom;
+        }
+    }
+    return a;
+}
+
+IrBlock **IrFunction_dominators(IrFunction *self, uptr *count) {
+    IrBlock **order = reverse_postorder(self, count);
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        block->idom = NULL;
+        block->loop_depth = 0;
+    }
+
+    // The iterative algorithm of Cooper, Harvey and Kennedy. The entry is
+    // its own dominator while the algorithm runs.
+    self->entry->idom = self->entry;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uptr i = 1; i < *count; i++) {
+            IrBlock *block = order[i];
+            IrBlock *idom = NULL;
+            for (u32 k = 0; k < block->n_preds; k++) {
+                IrBlock *pred = block->preds[k];
+                if (pred->idom == NULL) {
+                    continue;
+                }
+                idom = idom ? intersect(pred, idom) : pred;
+            }
+            if (idom != block->idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    self->entry->idom = NULL;
+
+    // A back edge goes to a block that dominates its source. The body of the
+    // loop is every block that reaches the source without passing through
+    // the header.
+    IrBlock **stack = ALLOC(self->allocator,
+                            (self->n_blocks + 1) * sizeof(IrBlock *));
+    i64 stamp = 0;
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        block->mark = 0;
+    }
+    for (uptr i = 0; i < *count; i++) {
+        IrBlock *header = order[i];
+        uptr depth = 0;
+        stamp++;
+        for (u32 k = 0; k < header->n_preds; k++) {
+            IrBlock *pred = header->preds[k];
+            if (pred->rpo != UINT32_MAX && pred->mark != stamp
+                && IrBlock_dominates(header, pred)) {
+                pred->mark = stamp;
+                stack[depth++] = pred;
+            }
+        }
+        if (depth == 0) {
+            continue;
+        }
+        header->mark = stamp;
+        header->loop_depth++;
+        while (depth > 0) {
+            IrBlock *block = stack[--depth];
+            if (block == header) {
+                continue;
+            }
+            block->loop_depth++;
+            for (u32 k = 0; k < block->n_preds; k++) {
+                IrBlock *pred = block->preds[k];
+                if (pred->rpo != UINT32_MAX && pred->mark != stamp) {
+                    pred->mark = stamp;
+                    stack[depth++] = pred;
+                }
+            }
+        }
+    }
+    FREE(self->allocator, stack);
+    return order;
+}
+
+bool IrBlock_dominates(const IrBlock *a, const IrBlock *b) {
+    for (; b; b = b->idom) {
+        if (a == b) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void IrFunction_split_critical_edges(IrFunction *self) {
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        IrInst *terminator = IrBlock_terminator(block);
+        if (terminator == NULL || terminator->n_targets < 2) {
+            continue;
+        }
+        for (u32 i = 0; i < terminator->n_targets; i++) {
+            IrBlock *target = terminator->targets[i];
+            if (target->n_preds < 2) {
+                continue;
+            }
+            IrBlock *middle = IrFunction_block(self);
+            // Move the new block from the end of the list to just after the
+            // branch, so that it can fall through to its target.
+            for (IrBlock *b = block; b; b = b->next) {
+                if (b->next == middle) {
+                    b->next = NULL;
+                    self->last = b;
+                    break;
+                }
+            }
+            middle->next = block->next;
+            block->next = middle;
+            if (self->last == block) {
+                self->last = middle;
+            }
+            middle->sealed = true;
+
+            // Take over the edge in place, so the target's phi arguments
+            // stay in step with its predecessors.
+            for (u32 k = 0; k < target->n_preds; k++) {
+                if (target->preds[k] == block) {
+                    target->preds[k] = middle;
+                    break;
+                }
+            }
+            IrBlock_add_pred(middle, block);
+            IrInst *jump = IrFunction_inst(self, IR_JUMP, NULL, NULL);
+            IrInst_add_target(jump, self, target);
+            IrBlock_append(middle, jump);
+            terminator->targets[i] = middle;
+        }
+    }
+}
+
+uptr IrFunction_size(const IrFunction *self) {
+    uptr size = 0;
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            size++;
+        }
+    }
+    return size;
+}
+
+static const char *op_name(IrOp op) {
+    static const char *names[] = {
+        [IR_CONST] = "const", [IR_PARAM] = "param", [IR_GLOBAL] = "global",
+        [IR_SET_GLOBAL] = "setglobal", [IR_PHI] = "phi", [IR_COPY] = "copy",
+        [IR_BINARY] = "binary", [IR_UNARY] = "unary",
+        [IR_CONVERT] = "convert", [IR_CONCAT] = "concat",
+        [IR_INDEX] = "index",
+        [IR_SET_INDEX] = "setindex", [IR_SET_CHAR] = "setchar",
+        [IR_FIELD] = "field", [IR_INSERT] = "insert", [IR_MAKE] = "make",
+        [IR_LOAD_FIELD] = "loadfield", [IR_STORE_FIELD] = "storefield",
+        [IR_NEW] = "new", [IR_NEW_ARRAY] = "newarray",
+        [IR_NEW_CHANNEL] = "newchan", [IR_CONS] = "cons",
+        [IR_HEAD] = "hd", [IR_TAIL] = "tl", [IR_CALL] = "call",
+        [IR_MCALL] = "mcall",
+        [IR_SPAWN] = "spawn", [IR_MSPAWN] = "mspawn", [IR_LOAD] = "load",
+        [IR_SEND] = "send", [IR_RECV] = "recv", [IR_ALT] = "alt",
+        [IR_NBALT] = "nbalt", [IR_JUMP] = "jump",
+        [IR_BRANCH] = "branch", [IR_SWITCH] = "switch",
+        [IR_RETURN] = "return", [IR_EXIT] = "exit",
+    };
+    return names[op];
+}
+
+static const char *operator_name(NodeKind kind) {
+    switch (kind) {
+        case NODE_ADD: return "+";
+        case NODE_SUB: return "-";
+        case NODE_MUL: return "*";
+        case NODE_DIV: return "/";
+        case NODE_MOD: return "%";
+        case NODE_EXP: return "**";
+        case NODE_BIT_AND: return "&";
+        case NODE_BIT_OR: return "|";
+        case NODE_BIT_XOR: return "^";
+        case NODE_SHL: return "<<";
+        case NODE_SHR: return ">>";
+        case NODE_EQ: return "==";
+        case NODE_NEQ: return "!=";
+        case NODE_LT: return "<";
+        case NODE_LTE: return "<=";
+        case NODE_GT: return ">";
+        case NODE_GTE: return ">=";
+        case NODE_NEG: return "neg";
+        case NODE_BIT_NOT: return "~";
+        case NODE_NOT: return "!";
+        case NODE_LEN: return "len";
+        default: return "?";
+    }
+}
+
+static void print_decl(const Decl *decl, FILE *out) {
+    if (decl && decl->token) {
+        fprintf(out, " %.*s", (int) decl->token->length,
+                decl->token->location);
+    }
+}
+
+void IrFunction_print(const IrFunction *self, FILE *out) {
+    fprintf(out, "fn");
+    print_decl(self->decl, out);
+    fprintf(out, "\n");
+    for (IrBlock *block = self->entry; block; block = block->next) {
+        fprintf(out, "b%u:", block->id);
+        if (block->n_preds) {
+            fprintf(out, " ; preds");
+            for (u32 k = 0; k < block->n_preds; k++) {
+                fprintf(out, " b%u", block->preds[k]->id);
+            }
+        }
+        fprintf(out, "\n");
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            fprintf(out, "    ");
+            if (inst->type != type_none) {
+                fprintf(out, "v%u: %s = ", inst->id, Type_describe(inst->type));
+            }
+            fprintf(out, "%s", op_name(inst->op));
+            switch (inst->op) {
+                case IR_CONST:
+                    if (inst->type->kind == TReal) {
+                        fprintf(out, " %g", inst->real_value);
+                    } else if (inst->type->kind == TString) {
+                        fprintf(out, " \"%.*s\"", (int) inst->string_length,
+                                inst->string_value ? inst->string_value : "");
+                    } else {
+                        fprintf(out, " %ld", inst->int_value);
+                    }
+                    break;
+                case IR_BINARY:
+                case IR_UNARY:
+                    fprintf(out, " %s", operator_name(inst->operator));
+                    break;
+                case IR_INDEX:
+                case IR_SET_INDEX:
+                case IR_SET_CHAR:
+                case IR_HEAD:
+                case IR_TAIL:
+                    if (inst->in_bounds) {
+                        fprintf(out, " inbounds");
+                    }
+                    break;
+                case IR_NEW:
+                    if (inst->in_frame) {
+                        fprintf(out, " inframe");
+                    }
+                    break;
+                case IR_PARAM:
+                case IR_FIELD:
+                case IR_INSERT:
+                case IR_LOAD_FIELD:
+                case IR_STORE_FIELD:
+                case IR_MCALL:
+                case IR_MSPAWN:
+                case IR_ALT:
+                case IR_NBALT:
+                    fprintf(out, " #%lu", inst->index);
+                    break;
+                case IR_GLOBAL:
+                case IR_SET_GLOBAL:
+                case IR_CALL:
+                case IR_SPAWN:
+                    print_decl(inst->decl, out);
+                    break;
+                default:
+                    break;
+            }
+            for (u32 i = 0; i < inst->n_args; i++) {
+                fprintf(out, "%s v%u", i ? "," : "", inst->args[i]->id);
+            }
+            if (inst->op == IR_SWITCH) {
+                fprintf(out, " default b%u", inst->targets[0]->id);
+                for (uptr i = 0; i < inst->n_cases; i++) {
+                    const IrCase *c = &inst->cases[i];
+                    fprintf(out, ", %ld", c->low);
+                    if (c->high != c->low) {
+                        fprintf(out, " to %ld", c->high);
+                    }
+                    fprintf(out, " b%u", inst->targets[c->target]->id);
+                }
+            } else {
+                for (u32 i = 0; i < inst->n_targets; i++) {
+                    fprintf(out, "%s b%u", i ? "," : "",
+                            inst->targets[i]->id);
+                }
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
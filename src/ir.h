@@ -0,0 +1,377 @@
+#ifndef LIMBO_IR_H
+#define LIMBO_IR_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "alloc.h"
+#include "parser.h"
+
+/// An enum representing the operations of the mid-level IR.
+/// Operands are stored in `IrInst.args`, as follows.
+typedef enum IrOp {
+    /// A literal, in `int_value`, `real_value` or `string_value`. A constant
+    /// of a pointer type is `nil`, and of an aggregate type is all zeroes.
+    IR_CONST,
+    /// Parameter number `index` of the function.
+    IR_PARAM,
+    /// Read the module-level variable `decl`.
+    IR_GLOBAL,
+    /// Write `args[0]` to the module-level variable `decl`.
+    IR_SET_GLOBAL,
+    /// One argument per predecessor of the block, in the same order.
+    IR_PHI,
+    /// `args[0]`, unchanged.
+    IR_COPY,
+    /// `args[0] operator args[1]`, where `operator` is a binary `NodeKind`.
+    /// Comparisons produce an `int` that is 0 or 1.
+    IR_BINARY,
+    /// `operator args[0]`, where `operator` is `NODE_NEG`, `NODE_BIT_NOT`,
+    /// `NODE_NOT`, `NODE_LEN` or `NODE_TAGOF`.
+    IR_UNARY,
+    /// `args[0]` converted to `type`.
+    IR_CONVERT,
+    /// The strings `args` joined in order, for a chain of three or more
+    /// strings added together.
+    IR_CONCAT,
+    /// Element `args[1]` of the array or string `args[0]`.
+    IR_INDEX,
+    /// Store `args[2]` into element `args[1]` of the array `args[0]`.
+    IR_SET_INDEX,
+    /// The string `args[0]` with character `args[1]` set to `args[2]`.
+    IR_SET_CHAR,
+    /// Member `index` of the aggregate value `args[0]`.
+    IR_FIELD,
+    /// The aggregate value `args[0]` with member `index` set to `args[1]`.
+    IR_INSERT,
+    /// An aggregate value with its members set to `args`, in order.
+    IR_MAKE,
+    /// Member `index` of the adt that the `ref` `args[0]` points to.
+    IR_LOAD_FIELD,
+    /// Store `args[1]` into member `index` of the adt that `args[0]` points
+    /// to.
+    IR_STORE_FIELD,
+    /// A new `ref` to a copy of `args[0]`.
+    IR_NEW,
+    /// A new array of `args[0]` elements, all zero.
+    IR_NEW_ARRAY,
+    /// A new channel, with a buffer of `args[0]` values if there is an
+    /// argument.
+    IR_NEW_CHANNEL,
+    /// `args[0] :: args[1]`.
+    IR_CONS,
+    /// `hd args[0]`.
+    IR_HEAD,
+    /// `tl args[0]`.
+    IR_TAIL,
+    /// Call the function `decl` with `args`.
+    IR_CALL,
+    /// Call member `index` of the module `args[0]`, with the rest of `args`.
+    IR_MCALL,
+    /// Like `IR_CALL`, but in a new process.
+    IR_SPAWN,
+    /// Like `IR_MCALL`, but in a new process.
+    IR_MSPAWN,
+    /// Load the implementation of the module type `type` from the path
+    /// `args[0]`.
+    IR_LOAD,
+    /// Send `args[1]` on the channel `args[0]`.
+    IR_SEND,
+    /// Receive a value from the channel `args[0]`.
+    IR_RECV,
+    /// Do one of the sends and receives of an `alt`, blocking until one can
+    /// go ahead. The first `index` pairs of `args` are a channel and a value
+    /// to send on it, and the rest are channels to receive from. The result
+    /// is a tuple of the index of the alternative done, then a member for
+    /// each alternative, in the same order, which holds the value received.
+    IR_ALT,
+    /// Like `IR_ALT`, but if none can go ahead, the index is the number of
+    /// alternatives.
+    IR_NBALT,
+
+    // Terminators
+
+    /// Continue at `targets[0]`.
+    IR_JUMP,
+    /// Continue at `targets[0]` if `args[0]` is non-zero, else `targets[1]`.
+    IR_BRANCH,
+    /// Continue at the target of the case whose range holds the `int`
+    /// `args[0]`, or at `targets[0]` if no case does.
+    /// \see IrCase
+    IR_SWITCH,
+    /// Return `args[0]`, if there is an argument.
+    IR_RETURN,
+    /// Exit the process.
+    IR_EXIT,
+} IrOp;
+
+typedef struct IrBlock IrBlock;
+typedef struct IrFunction IrFunction;
+typedef struct IrInst IrInst;
+
+/// A case of an `IR_SWITCH`. The cases of a switch are sorted and do not
+/// overlap, and its targets are distinct blocks.
+typedef struct IrCase {
+    /// The range of values that the case matches, inclusive.
+    i64 low, high;
+    /// The index of the target that the case continues at.
+    u32 target;
+} IrCase;
+
+/// A single instruction, which is also the SSA value that it defines.
+struct IrInst {
+    IrOp op;
+    /// A number that is unique within the function.
+    u32 id;
+    /// The type of the result, or `type_none` if there is none.
+    Type *type;
+    /// The token the instruction was lowered from, for diagnostics.
+    Token *token;
+    IrBlock *block;
+    IrInst *prev, *next;
+
+    IrInst **args;
+    u32 n_args;
+    uptr args_capacity;
+    /// For terminators, the blocks that control continues at.
+    IrBlock **targets;
+    u32 n_targets;
+    uptr targets_capacity;
+    /// For `IR_SWITCH`, the cases.
+    IrCase *cases;
+    uptr n_cases, cases_capacity;
+
+    /// For `IR_BINARY` and `IR_UNARY`, the operator.
+    NodeKind operator;
+    /// For `IR_PARAM`, `IR_FIELD`, `IR_INSERT`, `IR_LOAD_FIELD`,
+    /// `IR_STORE_FIELD`, `IR_MCALL` and `IR_MSPAWN`, the index of the
+    /// parameter or member. For `IR_ALT` and `IR_NBALT`, the number of
+    /// sends.
+    uptr index;
+    /// For `IR_INDEX`, `IR_SET_INDEX` and `IR_SET_CHAR`, whether the index is
+    /// known to be in bounds, and for `IR_HEAD` and `IR_TAIL`, whether the
+    /// list is known not to be empty, so that the access cannot raise an
+    /// exception.
+    bool in_bounds;
+    /// For `IR_NEW`, whether the reference never escapes the function, so
+    /// that the adt can be held in the frame rather than on the heap.
+    bool in_frame;
+    /// For `IR_GLOBAL`, `IR_SET_GLOBAL`, `IR_CALL` and `IR_SPAWN`, the
+    /// variable or function. While building, the variable a phi is for.
+    Decl *decl;
+    /// For `IR_CONST`, the value.
+    i64 int_value;
+    f64 real_value;
+    const char *string_value;
+    uptr string_length;
+
+    /// Scratch space for passes: a value that this one is being replaced by.
+    /// \see IrFunction_apply_forwards
+    IrInst *forward;
+    /// Scratch space for passes and the backend.
+    i64 mark;
+};
+
+/// A variable's current value within a block, while building SSA form.
+typedef struct IrDef {
+    Decl *decl;
+    IrInst *value;
+} IrDef;
+
+/// A basic block: a list of instructions ending in a terminator.
+/// Phis always come first.
+struct IrBlock {
+    /// A number that is unique within the function.
+    u32 id;
+    IrFunction *function;
+    IrInst *first, *last;
+    /// The blocks that branch here. A block that branches here twice is
+    /// listed twice.
+    IrBlock **preds;
+    u32 n_preds;
+    uptr preds_capacity;
+    /// The next block in the function's list.
+    IrBlock *next;
+
+    // SSA construction
+    bool sealed;
+    IrDef *defs;
+    uptr n_defs, defs_capacity;
+    /// Phis created before all predecessors were known.
+    IrInst **incomplete;
+    uptr n_incomplete, incomplete_capacity;
+
+    // Analyses
+    /// The immediate dominator, or `NULL` for the entry block.
+    /// \see IrFunction_dominators
+    IrBlock *idom;
+    /// The position of the block in reverse postorder.
+    u32 rpo;
+    /// The number of loops the block is nested in.
+    u32 loop_depth;
+    /// Scratch space for passes and the backend.
+    i64 mark;
+};
+
+/// A function in SSA form.
+struct IrFunction {
+    /// The allocator everything in the function is allocated from; owned by
+    /// the function.
+    Allocator *allocator;
+    /// The allocator that `allocator` was created from.
+    Allocator *parent;
+    Node *node;
+    Decl *decl;
+    Type *type;
+    /// The entry block, which is always first in the list.
+    IrBlock *entry;
+    IrBlock *last;
+    uptr n_blocks;
+    /// The next unused value and block numbers.
+    u32 next_value, next_block;
+    /// The size of the function before anything was inlined into it, or 0
+    /// if the inliner has not run on it yet.
+    uptr original_size;
+};
+
+/// Create an empty function.
+/// \param parent The allocator to allocate the function's arena from.
+/// \param node The `NODE_FUNCTION` the function is lowered from.
+/// \return The new function, with an entry block.
+IrFunction *IrFunction_new(Allocator *parent, Node *node);
+
+/// Free a function and everything in it.
+/// \param self The function.
+void IrFunction_free(IrFunction *self);
+
+/// Append a new, unsealed block to a function.
+/// \param self The function.
+/// \return The new block.
+IrBlock *IrFunction_block(IrFunction *self);
+
+/// Create an instruction, without placing it in a block.
+/// \param self The function.
+/// \param op The operation.
+/// \param type The type of the result.
+/// \param token The token the instruction comes from, if any.
+/// \return The new instruction.
+IrInst *IrFunction_inst(IrFunction *self, IrOp op, Type *type, Token *token);
+
+/// Add an argument to an instruction.
+void IrInst_add_arg(IrInst *self, IrFunction *function, IrInst *arg);
+
+/// Add a target to a terminator. The target's predecessors are not updated.
+void IrInst_add_target(IrInst *self, IrFunction *function, IrBlock *target);
+
+/// Remove argument `index` from an instruction.
+void IrInst_remove_arg(IrInst *self, u32 index);
+
+/// Whether an operation ends a block.
+bool ir_is_terminator(IrOp op);
+
+/// Whether an instruction may have an effect other than defining its value,
+/// including raising an exception, so that it cannot be removed even when
+/// its value is unused.
+bool IrInst_has_effects(const IrInst *self);
+
+/// Whether an instruction always produces the same value from the same
+/// arguments and has no effects, so that repeated evaluations can share one.
+bool IrInst_is_pure(const IrInst *self);
+
+/// Append an instruction to a block, before its terminator if it has one.
+void IrBlock_append(IrBlock *self, IrInst *inst);
+
+/// Insert an instruction at the start of a block, after its phis.
+/// Phis themselves are inserted before any other phis.
+void IrBlock_prepend(IrBlock *self, IrInst *inst);
+
+/// Insert an instruction before another.
+void IrBlock_insert_before(IrInst *position, IrInst *inst);
+
+/// Unlink an instruction from its block.
+void IrBlock_remove(IrInst *inst);
+
+/// The terminator of a block, or `NULL` if it has none yet.
+IrInst *IrBlock_terminator(const IrBlock *self);
+
+/// The successors of a block.
+/// \param self The block.
+/// \param succs Set to the successors, which are the terminator's targets.
+/// \return The number of successors.
+u32 IrBlock_succs(const IrBlock *self, IrBlock ***succs);
+
+/// Split a block after an instruction. The instructions that follow it move
+/// to a new block, which takes over the block's successors; the block is
+/// left without a terminator.
+/// \param at The instruction to split after.
+/// \return The new block.
+IrBlock *IrBlock_split(IrInst *at);
+
+/// Add an edge from `from` to `to`, updating `to`'s predecessors.
+void IrBlock_add_pred(IrBlock *to, IrBlock *from);
+
+/// Remove one edge from `from` to `to`, along with the matching phi
+/// arguments in `to`.
+void IrBlock_remove_pred(IrBlock *to, IrBlock *from);
+
+/// End a block with a jump.
+void IrBlock_jump(IrBlock *self, IrBlock *target);
+
+/// End a block with a conditional branch.
+void IrBlock_branch(IrBlock *self, IrInst *cond, IrBlock *if_true,
+                    IrBlock *if_false);
+
+/// End a block with a switch on an `int`, with no cases yet.
+/// \param self The block.
+/// \param value The value to switch on.
+/// \param otherwise The target when no case matches.
+/// \see IrBlock_add_case
+void IrBlock_switch(IrBlock *self, IrInst *value, IrBlock *otherwise);
+
+/// Add a case to the switch that ends a block. Cases must be added in
+/// increasing order.
+/// \param self The block.
+/// \param low The lowest value of the case.
+/// \param high The highest value of the case.
+/// \param target The block to continue at, which may already be a target of
+/// the switch.
+void IrBlock_add_case(IrBlock *self, i64 low, i64 high, IrBlock *target);
+
+/// Replace uses of every instruction whose `forward` is set with the value
+/// it forwards to, then remove the forwarded instructions.
+/// \param self The function.
+/// \return Whether anything was replaced.
+bool IrFunction_apply_forwards(IrFunction *self);
+
+/// Remove blocks that cannot be reached from the entry block.
+/// \param self The function.
+/// \return Whether any block was removed.
+bool IrFunction_remove_unreachable(IrFunction *self);
+
+/// Compute the reverse postorder, immediate dominators and loop depths of
+/// every reachable block.
+/// \param self The function.
+/// \param count The number of reachable blocks.
+/// \return The reachable blocks in reverse postorder, allocated from the
+/// function's allocator.
+IrBlock **IrFunction_dominators(IrFunction *self, uptr *count);
+
+/// Whether `a` dominates `b`.
+/// \remark `IrFunction_dominators` must have been called since the control
+/// flow last changed.
+bool IrBlock_dominates(const IrBlock *a, const IrBlock *b);
+
+/// Insert empty blocks on edges from blocks with several successors to
+/// blocks with several predecessors, so that copies for phis can be placed
+/// at the end of each predecessor.
+/// \param self The function.
+void IrFunction_split_critical_edges(IrFunction *self);
+
+/// The number of instructions in a function.
+uptr IrFunction_size(const IrFunction *self);
+
+/// Print a function in a readable form.
+/// \param self The function.
+/// \param out The stream to print to.
+void IrFunction_print(const IrFunction *self, FILE *out);
+
+#endif //LIMBO_IR_H
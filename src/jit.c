@@ -0,0 +1,904 @@
+// mmap's MAP_ANONYMOUS is not part of strict ISO C.
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include "jit.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+/// A block of native code, mapped executable.
+typedef struct JitCode {
+    struct JitCode *next;
+    void *memory;
+    uptr size;
+} JitCode;
+
+// x86-64 encoding
+
+/// The general purpose registers, numbered as instructions encode them.
+typedef enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Reg;
+
+/// The condition codes of `jcc` and `setcc`. A condition with its low bit
+/// flipped is its negation.
+typedef enum Cond {
+    CC_B = 0x2, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+    CC_P = 0xA, CC_NP, CC_L, CC_GE, CC_LE, CC_G,
+    /// Not a condition: an unconditional jump.
+    CC_ALWAYS = 0x10,
+} Cond;
+
+/// Where native code keeps the Dis registers, and what it uses them for.
+/// RBX, R12 and R13 hold `fp`, `mp` and the budget for the whole of a call.
+/// RAX and RCX hold the values an instruction works on, and RDX, RSI and
+/// RDI the objects its source, middle and destination operands point into.
+#define REG_FP RBX
+#define REG_MP R12
+#define REG_BUDGET R13
+
+/// The registers that cache frame slots.
+static const Reg cache_regs[] = {R8, R9, R10, R11, R14, R15};
+#define N_CACHE (sizeof cache_regs / sizeof *cache_regs)
+
+/// An operand of an x86 instruction: a register, memory at a base
+/// register plus a displacement, or an immediate.
+typedef struct Loc {
+    enum { LOC_REG, LOC_MEM, LOC_IMM } kind;
+    Reg reg;
+    i32 disp;
+} Loc;
+
+static Loc reg_loc(Reg reg) {
+    return (Loc) {.kind = LOC_REG, .reg = reg};
+}
+
+static Loc mem_loc(Reg base, i32 disp) {
+    return (Loc) {.kind = LOC_MEM, .reg = base, .disp = disp};
+}
+
+/// A frame slot whose value a cache register also holds.
+typedef struct CacheEntry {
+    bool valid;
+    i32 offset;
+    u8 size;
+} CacheEntry;
+
+/// A rel32 field to fill in once the code it refers to has been emitted.
+typedef struct Fixup {
+    /// Where the field is.
+    uptr at;
+    /// For a jump within the function, the index of the instruction; for an
+    /// exit, the instruction to return to the interpreter.
+    uptr index;
+    const VmInst *exit;
+} Fixup;
+
+typedef struct Jit {
+    Allocator *allocator;
+    u8 *code;
+    uptr length, capacity;
+    const VmModule *module;
+    /// The function's instructions, `code[start]` up to `code[end]`.
+    uptr start, end;
+    /// For each instruction, where its code starts.
+    uptr *labels;
+    /// Jumps to instructions of the function.
+    Fixup *jumps;
+    uptr n_jumps, jumps_capacity;
+    /// Jumps to code that returns to the interpreter.
+    Fixup *exits;
+    uptr n_exits, exits_capacity;
+    /// Jumps to the epilogue.
+    uptr *returns;
+    uptr n_returns, returns_capacity;
+    CacheEntry cache[N_CACHE];
+    /// The cache register to evict next.
+    uptr victim;
+} Jit;
+
+static void emit(Jit *j, u8 byte) {
+    GROW(j->allocator, j->code, j->length, j->capacity);
+    j->code[j->length++] = byte;
+}
+
+static void emit32(Jit *j, u32 value) {
+    for (int i = 0; i < 4; i++) {
+        emit(j, (u8) (value >> i * 8));
+    }
+}
+
+static void emit64(Jit *j, u64 value) {
+    emit32(j, (u32) value);
+    emit32(j, (u32) (value >> 32));
+}
+
+/// Emit an instruction whose operands are a register and a register or
+/// memory operand.
+/// \param prefix A mandatory prefix, for SSE instructions, or 0.
+/// \param wide Whether the operation is on 64 bits.
+/// \param escape Whether the opcode is in the two-byte `0F` map.
+/// \param reg A register, or an opcode extension.
+static void op(Jit *j, u8 prefix, bool wide, bool escape, u8 opcode, int reg,
+               Loc rm) {
+    if (prefix) {
+        emit(j, prefix);
+    }
+    u8 rex = (u8) (0x40 | wide << 3 | (reg >> 3) << 2 | (rm.reg >> 3));
+    if (rex != 0x40) {
+        emit(j, rex);
+    }
+    if (escape) {
+        emit(j, 0x0F);
+    }
+    emit(j, opcode);
+    if (rm.kind == LOC_REG) {
+        emit(j, (u8) (0xC0 | (reg & 7) << 3 | (rm.reg & 7)));
+        return;
+    }
+    // Always a 32-bit displacement, so R13 needs no special case; RSP and
+    // R12 need a SIB byte.
+    emit(j, (u8) (0x80 | (reg & 7) << 3 | (rm.reg & 7)));
+    if ((rm.reg & 7) == RSP) {
+        emit(j, 0x24);
+    }
+    emit32(j, (u32) rm.disp);
+}
+
+static void mov_imm(Jit *j, Reg reg, i32 value) {
+    if (reg >= R8) {
+        emit(j, 0x41);
+    }
+    emit(j, (u8) (0xB8 + (reg & 7)));
+    emit32(j, (u32) value);
+}
+
+static void mov_imm64(Jit *j, Reg reg, u64 value) {
+    emit(j, (u8) (0x48 | reg >> 3));
+    emit(j, (u8) (0xB8 + (reg & 7)));
+    emit64(j, value);
+}
+
+static void push(Jit *j, Reg reg) {
+    if (reg >= R8) {
+        emit(j, 0x41);
+    }
+    emit(j, (u8) (0x50 + (reg & 7)));
+}
+
+static void pop(Jit *j, Reg reg) {
+    if (reg >= R8) {
+        emit(j, 0x41);
+    }
+    emit(j, (u8) (0x58 + (reg & 7)));
+}
+
+/// Emit a jump with a rel32 to be filled in, and return where it is.
+static uptr jump(Jit *j, Cond cond) {
+    if (cond == CC_ALWAYS) {
+        emit(j, 0xE9);
+    } else {
+        emit(j, 0x0F);
+        emit(j, (u8) (0x80 | cond));
+    }
+    emit32(j, 0);
+    return j->length - 4;
+}
+
+static void patch(Jit *j, uptr at, uptr target) {
+    u32 rel = (u32) (target - (at + 4));
+    memcpy(j->code + at, &rel, 4);
+}
+
+// The register cache
+
+/// Forget the frame slots that overlap a store.
+static void invalidate(Jit *j, i32 offset, u8 size) {
+    for (uptr i = 0; i < N_CACHE; i++) {
+        CacheEntry *e = &j->cache[i];
+        if (e->valid && e->offset < offset + size
+            && offset < e->offset + e->size) {
+            e->valid = false;
+        }
+    }
+}
+
+static void forget_all(Jit *j) {
+    memset(j->cache, 0, sizeof j->cache);
+}
+
+/// The register holding a frame slot, or -1.
+static int cached(const Jit *j, i32 offset, u8 size) {
+    for (uptr i = 0; i < N_CACHE; i++) {
+        const CacheEntry *e = &j->cache[i];
+        if (e->valid && e->offset == offset && e->size == size) {
+            return (int) cache_regs[i];
+        }
+    }
+    return -1;
+}
+
+/// Note that a register holds the value of a frame slot, copying it into
+/// a cache register.
+static void remember(Jit *j, i32 offset, u8 size, Reg reg) {
+    invalidate(j, offset, size);
+    uptr i = j->victim;
+    j->victim = (j->victim + 1) % N_CACHE;
+    op(j, 0, size == 8, false, 0x8B, cache_regs[i], reg_loc(reg));
+    j->cache[i] = (CacheEntry) {true, offset, size};
+}
+
+// Operands
+
+/// Return to the interpreter at `inst` if a condition holds.
+static void exit_if(Jit *j, Cond cond, const VmInst *inst) {
+    GROW(j->allocator, j->exits, j->n_exits, j->exits_capacity);
+    j->exits[j->n_exits++] = (Fixup) {jump(j, cond), 0, inst};
+}
+
+/// Where an operand is, loading the pointer of an indirect one into `temp`.
+/// An indirect operand through `nil` is left for the interpreter to raise.
+static Loc locate(Jit *j, const VmInst *inst, const DisOperand *o,
+                  Reg temp) {
+    switch (o->mode) {
+        case DIS_IMM:
+            return (Loc) {.kind = LOC_IMM, .disp = o->offset};
+        case DIS_FP:
+            return mem_loc(REG_FP, o->offset);
+        case DIS_MP:
+            return mem_loc(REG_MP, o->offset);
+        default:
+            break;
+    }
+    Reg base = o->mode == DIS_IND_FP ? REG_FP : REG_MP;
+    op(j, 0, true, false, 0x8B, temp, mem_loc(base, o->offset));
+    op(j, 0, true, false, 0x85, temp, reg_loc(temp));
+    exit_if(j, CC_E, inst);
+    return mem_loc(temp, o->index);
+}
+
+/// Where to read a word or big operand from, preferring a cache register.
+static Loc source(Jit *j, const VmInst *inst, const DisOperand *o, u8 size,
+                  Reg temp) {
+    if (o->mode == DIS_FP) {
+        int reg = cached(j, o->offset, size);
+        if (reg >= 0) {
+            return reg_loc((Reg) reg);
+        }
+    }
+    return locate(j, inst, o, temp);
+}
+
+/// Load a word or big operand into a register.
+static void load(Jit *j, const VmInst *inst, Reg reg, const DisOperand *o,
+                 u8 size, Reg temp) {
+    Loc from = source(j, inst, o, size, temp);
+    if (from.kind == LOC_IMM) {
+        mov_imm(j, reg, from.disp);
+        return;
+    }
+    if (from.kind == LOC_REG && from.reg == reg) {
+        return;
+    }
+    op(j, 0, size == 8, false, 0x8B, reg, from);
+    if (from.kind == LOC_MEM && o->mode == DIS_FP) {
+        remember(j, o->offset, size, reg);
+    }
+}
+
+/// Load a byte operand into a register.
+static void load_byte(Jit *j, const VmInst *inst, Reg reg,
+                      const DisOperand *o, Reg temp) {
+    op(j, 0, false, true, 0xB6, reg, locate(j, inst, o, temp));
+}
+
+/// Account for a store to an operand.
+static void stored(Jit *j, const DisOperand *o, u8 size) {
+    if (o->mode == DIS_FP) {
+        invalidate(j, o->offset, size);
+    } else if (o->mode != DIS_MP) {
+        // The pointer may be into the frame, as those `lea` makes are.
+        forget_all(j);
+    }
+}
+
+/// Store a register to a byte, word or big operand.
+static void store(Jit *j, const VmInst *inst, const DisOperand *o, u8 size,
+                  Reg reg, Reg temp) {
+    Loc to = locate(j, inst, o, temp);
+    if (size == 1) {
+        op(j, 0, false, false, 0x88, reg, to);
+    } else {
+        op(j, 0, size == 8, false, 0x89, reg, to);
+    }
+    stored(j, o, size);
+    if (o->mode == DIS_FP && size > 1) {
+        remember(j, o->offset, size, reg);
+    }
+}
+
+/// Emit `reg = reg <alu> from`, for the ALU operations that share the
+/// `81 /ext` immediate form: add 0, or 1, and 4, sub 5, xor 6, cmp 7.
+static void alu(Jit *j, int ext, bool wide, Reg reg, Loc from) {
+    if (from.kind == LOC_IMM) {
+        op(j, 0, wide, false, 0x81, ext, reg_loc(reg));
+        emit32(j, (u32) from.disp);
+    } else {
+        op(j, 0, wide, false, (u8) (ext << 3 | 3), reg, from);
+    }
+}
+
+static void load_real(Jit *j, const VmInst *inst, int xmm,
+                      const DisOperand *o, Reg temp) {
+    op(j, 0xF2, false, true, 0x10, xmm, locate(j, inst, o, temp));
+}
+
+static void store_real(Jit *j, const VmInst *inst, const DisOperand *o,
+                       int xmm) {
+    op(j, 0xF2, false, true, 0x11, xmm, locate(j, inst, o, RDI));
+    stored(j, o, 8);
+}
+
+// Control flow
+
+/// Return to the interpreter at `inst`.
+static void leave(Jit *j, const VmInst *inst) {
+    mov_imm64(j, RAX, (u64) (uptr) inst);
+    GROW(j->allocator, j->returns, j->n_returns, j->returns_capacity);
+    j->returns[j->n_returns++] = jump(j, CC_ALWAYS);
+}
+
+/// Jump to a branch target if a condition holds.
+/// Going back charges the budget for the loop's instructions, and returns to
+/// the interpreter to yield when it runs out.
+static void branch(Jit *j, Cond cond, const VmInst *inst) {
+    const VmInst *code = j->module->code;
+    uptr from = (uptr) (inst - code), to = (uptr) (inst->target - code);
+    if (to < j->start || to >= j->end) {
+        if (cond == CC_ALWAYS) {
+            leave(j, inst->target);
+        } else {
+            exit_if(j, cond, inst->target);
+        }
+        return;
+    }
+    uptr skip = 0;
+    if (to <= from) {
+        if (cond != CC_ALWAYS) {
+            skip = jump(j, cond ^ 1);
+        }
+        op(j, 0, true, false, 0x81, 5, mem_loc(REG_BUDGET, 0));
+        emit32(j, (u32) (from - to + 1));
+        cond = CC_GE;
+    }
+    GROW(j->allocator, j->jumps, j->n_jumps, j->jumps_capacity);
+    j->jumps[j->n_jumps++] = (Fixup) {jump(j, cond), to, NULL};
+    if (to <= from) {
+        leave(j, inst->target);
+        if (skip) {
+            patch(j, skip, j->length);
+        }
+    }
+}
+
+// Templates
+
+/// Whether an operand may be used where a value of a class is read.
+/// Immediates are words, and are only taken where a word is read.
+static bool readable(const DisOperand *o, bool word) {
+    return o->mode != DIS_NONE && (word || o->mode != DIS_IMM);
+}
+
+static bool writable(const DisOperand *o) {
+    return o->mode != DIS_NONE && o->mode != DIS_IMM;
+}
+
+/// Whether native code implements an instruction; everything else returns
+/// to the interpreter.
+static bool supported(const VmInst *inst) {
+    const DisOperand *s = &inst->src, *m = &inst->mid, *d = &inst->dst;
+    switch (inst->op) {
+        case IMOVW:
+        case ICVTWB:
+        case ICVTWL:
+        case ICVTWF:
+            return readable(s, true) && writable(d);
+        case IMOVB:
+        case IMOVL:
+        case IMOVF:
+        case ICVTBW:
+        case ICVTLW:
+        case ICVTLF:
+        case INEGF:
+        case ILENA:
+        case ILENC:
+            return readable(s, false) && writable(d);
+        case IADDW: case ISUBW: case IMULW: case IDIVW: case IMODW:
+        case IANDW: case IORW: case IXORW:
+        case ISHLW: case ISHRW: case ILSRW:
+            return readable(s, true) && readable(m, true) && writable(d);
+        case ISHLL: case ISHRL: case ILSRL:
+            return readable(s, true) && readable(m, false) && writable(d);
+        case IADDB: case ISUBB: case IMULB: case IANDB: case IORB:
+        case IXORB:
+        case IADDL: case ISUBL: case IMULL: case IDIVL: case IMODL:
+        case IANDL: case IORL: case IXORL:
+        case IADDF: case ISUBF: case IMULF: case IDIVF:
+            return readable(s, false) && readable(m, false) && writable(d);
+        case IBEQW: case IBNEW: case IBLTW: case IBLEW: case IBGTW:
+        case IBGEW:
+            return readable(s, true) && readable(m, true);
+        case IBEQB: case IBNEB: case IBLTB: case IBLEB: case IBGTB:
+        case IBGEB:
+        case IBEQL: case IBNEL: case IBLTL: case IBLEL: case IBGTL:
+        case IBGEL:
+        case IBEQF: case IBNEF: case IBLTF: case IBLEF: case IBGTF:
+        case IBGEF:
+            return readable(s, false) && readable(m, false);
+        case IJMP:
+            return true;
+        case IINDX: case IINDW: case IINDF: case IINDB: case IINDL:
+            return readable(s, false) && writable(m) && readable(d, true);
+        case IINDC:
+            return readable(s, false) && readable(m, true) && writable(d);
+        default:
+            return false;
+    }
+}
+
+/// The condition of a branch on words, bigs or bytes; bytes are unsigned.
+static Cond condition(DisOp op) {
+    switch (op) {
+        case IBEQW: case IBEQL: case IBEQB: return CC_E;
+        case IBNEW: case IBNEL: case IBNEB: return CC_NE;
+        case IBLTW: case IBLTL: return CC_L;
+        case IBLEW: case IBLEL: return CC_LE;
+        case IBGTW: case IBGTL: return CC_G;
+        case IBGEW: case IBGEL: return CC_GE;
+        case IBLTB: return CC_B;
+        case IBLEB: return CC_BE;
+        case IBGTB: return CC_A;
+        default: return CC_AE;
+    }
+}
+
+/// The `81 /ext` extension of a word or big ALU operation.
+static int alu_ext(DisOp op) {
+    switch (op) {
+        case IADDW: case IADDL: case IADDB: return 0;
+        case IORW: case IORL: case IORB: return 1;
+        case IANDW: case IANDL: case IANDB: return 4;
+        case ISUBW: case ISUBL: case ISUBB: return 5;
+        default: return 6;
+    }
+}
+
+/// Emit `dst = mid <op> src` for words or bigs.
+static void arithmetic(Jit *j, const VmInst *inst, u8 size) {
+    bool wide = size == 8;
+    load(j, inst, RAX, &inst->mid, size, RSI);
+    Loc s = source(j, inst, &inst->src, size, RDX);
+    switch (inst->op) {
+        case IMULW:
+        case IMULL:
+            if (s.kind == LOC_IMM) {
+                op(j, 0, wide, false, 0x69, RAX, reg_loc(RAX));
+                emit32(j, (u32) s.disp);
+            } else {
+                op(j, 0, wide, true, 0xAF, RAX, s);
+            }
+            break;
+        default:
+            alu(j, alu_ext(inst->op), wide, RAX, s);
+            break;
+    }
+    store(j, inst, &inst->dst, size, RAX, RDI);
+}
+
+/// Emit `dst = mid <op> src` for bytes, which wrap.
+static void byte_arithmetic(Jit *j, const VmInst *inst) {
+    load_byte(j, inst, RAX, &inst->mid, RSI);
+    load_byte(j, inst, RCX, &inst->src, RDX);
+    if (inst->op == IMULB) {
+        op(j, 0, false, true, 0xAF, RAX, reg_loc(RCX));
+    } else {
+        alu(j, alu_ext(inst->op), false, RAX, reg_loc(RCX));
+    }
+    store(j, inst, &inst->dst, 1, RAX, RDI);
+}
+
+/// Emit a shift, whose count is a word and is masked as x86 does.
+static void shift(Jit *j, const VmInst *inst, u8 size) {
+    load(j, inst, RCX, &inst->src, 4, RDX);
+    load(j, inst, RAX, &inst->mid, size, RSI);
+    int ext = inst->op == ISHLW || inst->op == ISHLL ? 4
+              : inst->op == ISHRW || inst->op == ISHRL ? 7 : 5;
+    op(j, 0, size == 8, false, 0xD3, ext, reg_loc(RAX));
+    store(j, inst, &inst->dst, size, RAX, RDI);
+}
+
+/// Emit a division or remainder. Dividing by zero, and by -1, which can
+/// overflow, are left to the interpreter.
+static void divide(Jit *j, const VmInst *inst, u8 size) {
+    bool wide = size == 8;
+    load(j, inst, RCX, &inst->src, size, RDX);
+    op(j, 0, wide, false, 0x85, RCX, reg_loc(RCX));
+    exit_if(j, CC_E, inst);
+    op(j, 0, wide, false, 0x83, 7, reg_loc(RCX));
+    emit(j, 0xFF);
+    exit_if(j, CC_E, inst);
+    load(j, inst, RAX, &inst->mid, size, RSI);
+    if (wide) {
+        emit(j, 0x48);
+    }
+    emit(j, 0x99);
+    op(j, 0, wide, false, 0xF7, 7, reg_loc(RCX));
+    bool quotient = inst->op == IDIVW || inst->op == IDIVL;
+    store(j, inst, &inst->dst, size, quotient ? RAX : RDX, RDI);
+}
+
+/// Emit a real operation: `F2 0F` add 58, mul 59, sub 5C, div 5E.
+static void real_arithmetic(Jit *j, const VmInst *inst) {
+    u8 opcode = inst->op == IADDF ? 0x58 : inst->op == IMULF ? 0x59
+                : inst->op == ISUBF ? 0x5C : 0x5E;
+    load_real(j, inst, 0, &inst->mid, RSI);
+    op(j, 0xF2, false, true, opcode, 0, locate(j, inst, &inst->src, RDX));
+    store_real(j, inst, &inst->dst, 0);
+}
+
+/// Emit a real comparison and branch. An unordered comparison, with a NaN,
+/// is only taken by `bnef`.
+static void real_branch(Jit *j, const VmInst *inst) {
+    const DisOperand *a = &inst->src, *b = &inst->mid;
+    // Compare so that "above" is the condition, which NaNs never satisfy.
+    if (inst->op == IBLTF || inst->op == IBLEF) {
+        a = &inst->mid;
+        b = &inst->src;
+    }
+    load_real(j, inst, 0, a, RDX);
+    op(j, 0x66, false, true, 0x2E, 0, locate(j, inst, b, RSI));
+    switch (inst->op) {
+        case IBLTF:
+        case IBGTF:
+            branch(j, CC_A, inst);
+            return;
+        case IBLEF:
+        case IBGEF:
+            branch(j, CC_AE, inst);
+            return;
+        default:
+            break;
+    }
+    // Equal, and not unordered; or not equal, or unordered.
+    bool eq = inst->op == IBEQF;
+    op(j, 0, false, true, 0x90 | (eq ? CC_E : CC_NE), 0, reg_loc(RAX));
+    op(j, 0, false, true, 0x90 | (eq ? CC_NP : CC_P), 0, reg_loc(RCX));
+    op(j, 0, false, false, eq ? 0x20 : 0x08, RCX, reg_loc(RAX));
+    op(j, 0, false, false, 0x84, RAX, reg_loc(RAX));
+    branch(j, CC_NE, inst);
+}
+
+/// Emit `indx` and its kin, with the bounds check inline. The array and
+/// index errors are left to the interpreter to raise.
+static void index_array(Jit *j, const VmInst *inst) {
+    load(j, inst, RAX, &inst->src, 8, RDX);
+    op(j, 0, true, false, 0x85, RAX, reg_loc(RAX));
+    exit_if(j, CC_E, inst);
+    load(j, inst, RCX, &inst->dst, 4, RDI);
+    op(j, 0, true, false, 0x63, RCX, reg_loc(RCX));
+    op(j, 0, true, false, 0x3B, RCX,
+       mem_loc(RAX, offsetof(Array, length)));
+    exit_if(j, CC_AE, inst);
+    op(j, 0, true, true, 0xAF, RCX, mem_loc(RAX, offsetof(Array, size)));
+    op(j, 0, true, false, 0x03, RCX, mem_loc(RAX, offsetof(Array, data)));
+    store(j, inst, &inst->mid, 8, RCX, RSI);
+}
+
+/// Emit `indc`, with the bounds check inline.
+static void index_string(Jit *j, const VmInst *inst) {
+    load(j, inst, RAX, &inst->src, 8, RDX);
+    op(j, 0, true, false, 0x85, RAX, reg_loc(RAX));
+    exit_if(j, CC_E, inst);
+    load(j, inst, RCX, &inst->mid, 4, RSI);
+    op(j, 0, true, false, 0x63, RCX, reg_loc(RCX));
+    op(j, 0, true, false, 0x3B, RCX,
+       mem_loc(RAX, offsetof(String, length)));
+    exit_if(j, CC_AE, inst);
+    // cmp byte [rax + wide], 0
+    op(j, 0, false, false, 0x80, 7, mem_loc(RAX, offsetof(String, wide)));
+    emit(j, 0);
+    uptr is_wide = jump(j, CC_NE);
+    // movzx eax, byte [rax + rcx + data]
+    emit(j, 0x0F);
+    emit(j, 0xB6);
+    emit(j, 0x84);
+    emit(j, 0x08);
+    emit32(j, offsetof(String, data));
+    uptr done = jump(j, CC_ALWAYS);
+    patch(j, is_wide, j->length);
+    // mov eax, [rax + rcx * 4 + data]
+    emit(j, 0x8B);
+    emit(j, 0x84);
+    emit(j, 0x88);
+    emit32(j, offsetof(String, data));
+    patch(j, done, j->length);
+    store(j, inst, &inst->dst, 4, RAX, RDI);
+}
+
+/// Emit `lena` or `lenc`: the length of an array or string, or 0 for nil.
+static void length(Jit *j, const VmInst *inst) {
+    load(j, inst, RAX, &inst->src, 8, RDX);
+    op(j, 0, false, false, 0x33, RCX, reg_loc(RCX));
+    op(j, 0, true, false, 0x85, RAX, reg_loc(RAX));
+    uptr is_nil = jump(j, CC_E);
+    // Array and String both start with the length.
+    op(j, 0, false, false, 0x8B, RCX, mem_loc(RAX, 0));
+    patch(j, is_nil, j->length);
+    store(j, inst, &inst->dst, 4, RCX, RDI);
+}
+
+static void translate(Jit *j, const VmInst *inst) {
+    const DisOperand *s = &inst->src, *d = &inst->dst;
+    switch (inst->op) {
+        case IMOVW:
+            load(j, inst, RAX, s, 4, RDX);
+            store(j, inst, d, 4, RAX, RDI);
+            break;
+        case IMOVL:
+        case IMOVF:
+            load(j, inst, RAX, s, 8, RDX);
+            store(j, inst, d, 8, RAX, RDI);
+            break;
+        case IMOVB:
+        case ICVTBW:
+            load_byte(j, inst, RAX, s, RDX);
+            store(j, inst, d, inst->op == IMOVB ? 1 : 4, RAX, RDI);
+            break;
+        case ICVTWB:
+            load(j, inst, RAX, s, 4, RDX);
+            store(j, inst, d, 1, RAX, RDI);
+            break;
+        case ICVTWL:
+            load(j, inst, RAX, s, 4, RDX);
+            op(j, 0, true, false, 0x63, RAX, reg_loc(RAX));
+            store(j, inst, d, 8, RAX, RDI);
+            break;
+        case ICVTLW:
+            // The low half of a big, which is little-endian.
+            op(j, 0, false, false, 0x8B, RAX, locate(j, inst, s, RDX));
+            store(j, inst, d, 4, RAX, RDI);
+            break;
+        case ICVTWF:
+        case ICVTLF:
+            load(j, inst, RAX, s, inst->op == ICVTWF ? 4 : 8, RDX);
+            op(j, 0xF2, inst->op == ICVTLF, true, 0x2A, 0, reg_loc(RAX));
+            store_real(j, inst, d, 0);
+            break;
+        case INEGF:
+            // Flip the sign bit.
+            load(j, inst, RAX, s, 8, RDX);
+            op(j, 0, true, true, 0xBA, 7, reg_loc(RAX));
+            emit(j, 63);
+            store(j, inst, d, 8, RAX, RDI);
+            break;
+        case IADDW: case ISUBW: case IMULW: case IANDW: case IORW:
+        case IXORW:
+            arithmetic(j, inst, 4);
+            break;
+        case IADDL: case ISUBL: case IMULL: case IANDL: case IORL:
+        case IXORL:
+            arithmetic(j, inst, 8);
+            break;
+        case IADDB: case ISUBB: case IMULB: case IANDB: case IORB:
+        case IXORB:
+            byte_arithmetic(j, inst);
+            break;
+        case ISHLW: case ISHRW: case ILSRW:
+            shift(j, inst, 4);
+            break;
+        case ISHLL: case ISHRL: case ILSRL:
+            shift(j, inst, 8);
+            break;
+        case IDIVW: case IMODW:
+            divide(j, inst, 4);
+            break;
+        case IDIVL: case IMODL:
+            divide(j, inst, 8);
+            break;
+        case IADDF: case ISUBF: case IMULF: case IDIVF:
+            real_arithmetic(j, inst);
+            break;
+        case IBEQW: case IBNEW: case IBLTW: case IBLEW: case IBGTW:
+        case IBGEW:
+        case IBEQL: case IBNEL: case IBLTL: case IBLEL: case IBGTL:
+        case IBGEL: {
+            u8 size = inst->op >= IBEQW && inst->op <= IBGEW ? 4 : 8;
+            load(j, inst, RAX, s, size, RDX);
+            alu(j, 7, size == 8, RAX,
+                source(j, inst, &inst->mid, size, RSI));
+            branch(j, condition(inst->op), inst);
+            break;
+        }
+        case IBEQB: case IBNEB: case IBLTB: case IBLEB: case IBGTB:
+        case IBGEB:
+            load_byte(j, inst, RAX, s, RDX);
+            load_byte(j, inst, RCX, &inst->mid, RSI);
+            alu(j, 7, false, RAX, reg_loc(RCX));
+            branch(j, condition(inst->op), inst);
+            break;
+        case IBEQF: case IBNEF: case IBLTF: case IBLEF: case IBGTF:
+        case IBGEF:
+            real_branch(j, inst);
+            break;
+        case IJMP:
+            branch(j, CC_ALWAYS, inst);
+            break;
+        case IINDX: case IINDW: case IINDF: case IINDB: case IINDL:
+            index_array(j, inst);
+            break;
+        case IINDC:
+            index_string(j, inst);
+            break;
+        default:
+            length(j, inst);
+            break;
+    }
+}
+
+// Compilation
+
+/// Whether an instruction of a function is the target of a branch within it.
+static bool *branch_targets(Jit *j) {
+    const VmInst *code = j->module->code;
+    bool *targets = ALLOC(j->allocator, j->end - j->start);
+    for (uptr i = j->start; i < j->end; i++) {
+        DisOp op = code[i].op;
+        bool jumps = op == IJMP || (op >= IBEQB && op <= IBGEC)
+                     || (op >= IBNEL && op <= IBEQL);
+        if (!jumps) {
+            continue;
+        }
+        uptr to = (uptr) (code[i].target - code);
+        if (to >= j->start && to < j->end) {
+            targets[to - j->start] = true;
+        }
+    }
+    return targets;
+}
+
+/// Map code into executable memory.
+static void *install(Jit *j) {
+    void *memory = mmap(NULL, j->length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(memory, j->code, j->length);
+    if (mprotect(memory, j->length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, j->length);
+        return NULL;
+    }
+    return memory;
+}
+
+bool jit_compile(Allocator *allocator, VmModule *module, uptr function) {
+    VmInst *code = module->code;
+    Jit j = {
+        .allocator = allocator,
+        .module = module,
+        .start = module->functions[function],
+        .end = function + 1 < module->n_functions
+               ? module->functions[function + 1] : module->dis->n_code,
+    };
+    uptr n = j.end - j.start;
+    bool *targets = branch_targets(&j);
+    bool *entries = ALLOC(allocator, n);
+    j.labels = ALLOC(allocator, n * sizeof(uptr));
+
+    for (uptr i = j.start; i < j.end; i++) {
+        const VmInst *inst = &code[i];
+        bool native = supported(inst);
+        // Native code is entered where the interpreter arrives: at the
+        // start, and after instructions native code leaves to it. Code
+        // for these and for branch targets starts with nothing cached.
+        entries[i - j.start] = native && (i == j.start
+                                          || targets[i - j.start]
+                                          || !supported(inst - 1));
+        if (targets[i - j.start] || entries[i - j.start]) {
+            forget_all(&j);
+        }
+        j.labels[i - j.start] = j.length;
+        if (native) {
+            translate(&j, inst);
+        } else {
+            leave(&j, inst);
+        }
+    }
+    leave(&j, &code[j.end]);
+    for (uptr i = 0; i < j.n_exits; i++) {
+        patch(&j, j.exits[i].at, j.length);
+        leave(&j, j.exits[i].exit);
+    }
+    uptr epilogue = j.length;
+    pop(&j, R15);
+    pop(&j, R14);
+    pop(&j, REG_BUDGET);
+    pop(&j, REG_MP);
+    pop(&j, REG_FP);
+    emit(&j, 0xC3);
+
+    // Each entry saves the registers native code keeps, loads the Dis
+    // registers from its arguments, and jumps to its instruction.
+    uptr *prologues = ALLOC(allocator, n * sizeof(uptr));
+    for (uptr i = 0; i < n; i++) {
+        if (!entries[i]) {
+            continue;
+        }
+        prologues[i] = j.length;
+        push(&j, REG_FP);
+        push(&j, REG_MP);
+        push(&j, REG_BUDGET);
+        push(&j, R14);
+        push(&j, R15);
+        op(&j, 0, true, false, 0x8B, REG_FP, reg_loc(RDI));
+        op(&j, 0, true, false, 0x8B, REG_MP, reg_loc(RSI));
+        op(&j, 0, true, false, 0x8B, REG_BUDGET, reg_loc(RDX));
+        patch(&j, jump(&j, CC_ALWAYS), j.labels[i]);
+    }
+    for (uptr i = 0; i < j.n_jumps; i++) {
+        patch(&j, j.jumps[i].at, j.labels[j.jumps[i].index - j.start]);
+    }
+    for (uptr i = 0; i < j.n_returns; i++) {
+        patch(&j, j.returns[i], epilogue);
+    }
+
+    void *memory = install(&j);
+    if (memory != NULL) {
+        JitCode *block = ALLOC(allocator, sizeof(JitCode));
+        *block = (JitCode) {module->native, memory, j.length};
+        module->native = block;
+        for (uptr i = 0; i < n; i++) {
+            if (entries[i]) {
+                code[j.start + i].native = (u8 *) memory + prologues[i];
+            }
+        }
+    }
+    FREE(allocator, prologues);
+    FREE(allocator, j.returns);
+    FREE(allocator, j.exits);
+    FREE(allocator, j.jumps);
+    FREE(allocator, j.labels);
+    FREE(allocator, entries);
+    FREE(allocator, targets);
+    FREE(allocator, j.code);
+    return memory != NULL;
+}
+
+void jit_free(Allocator *allocator, VmModule *module) {
+    while (module->native != NULL) {
+        JitCode *block = module->native;
+        module->native = block->next;
+        munmap(block->memory, block->size);
+        FREE(allocator, block);
+    }
+}
+
+#else
+
+bool jit_compile(Allocator *allocator, VmModule *module, uptr function) {
+    (void) allocator;
+    (void) module;
+    (void) function;
+    return false;
+}
+
+void jit_free(Allocator *allocator, VmModule *module) {
+    (void) allocator;
+    (void) module;
+}
+
+#endif
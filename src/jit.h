@@ -0,0 +1,37 @@
+#ifndef LIMBO_JIT_H
+#define LIMBO_JIT_H
+
+#include <stdbool.h>
+#include "alloc.h"
+#include "num.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && defined(__unix__) && defined(__GNUC__)
+/// Whether hot functions can be compiled to native code on this host.
+#define JIT_SUPPORTED 1
+#endif
+
+/// Native code for part of a function, entered at one of its instructions.
+/// It runs until it reaches an instruction it leaves to the interpreter, or
+/// until a loop uses up the process's quantum.
+/// \param fp The frame.
+/// \param mp The module data.
+/// \param budget The instructions left in the quantum, which is charged for
+/// the body of a loop each time it goes round.
+/// \return The instruction for the interpreter to continue at.
+typedef const VmInst *(*JitEntry)(u8 *fp, u8 *mp, i64 *budget);
+
+/// Compile a function of a module to native code.
+/// Instructions that native code can be entered at get their `native` set.
+/// \param allocator The allocator for the compiler's own data.
+/// \param module The module.
+/// \param function The index of the function in `module->functions`.
+/// \return Whether the function was compiled.
+bool jit_compile(Allocator *allocator, VmModule *module, uptr function);
+
+/// Release the native code made for a module.
+/// \param allocator The allocator that was passed to `jit_compile`.
+/// \param module The module.
+void jit_free(Allocator *allocator, VmModule *module);
+
+#endif //LIMBO_JIT_H
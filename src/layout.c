@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include "layout.h"
+#include "error.h"
+
+static uptr align_to(uptr offset, uptr align) {
+    return (offset + align - 1) / align * align;
+}
+
+static bool is_aggregate(const Type *type) {
+    return type->kind == TAdt || type->kind == TAdtPick
+           || type->kind == TTuple;
+}
+
+/// The state of laying out one run of members.
+typedef struct Placer {
+    /// The offset of the next free byte.
+    uptr offset;
+    /// The strictest alignment of any member placed so far.
+    uptr align;
+    /// The non-pointer members, in the order they should be placed.
+    Member **others;
+    uptr n_others;
+    /// Whether each of `others` has been placed.
+    bool *placed;
+} Placer;
+
+static void place_at(Placer *placer, Member *member) {
+    placer->offset = align_to(placer->offset, member->align);
+    member->offset = placer->offset;
+    placer->offset += member->type->size;
+    if (member->align > placer->align) {
+        placer->align = member->align;
+    }
+}
+
+/// Place a member, first filling any padding it would need with smaller
+/// members that have not been placed yet.
+static void place(Placer *placer, Member *member) {
+    while (placer->offset % member->align != 0) {
+        uptr gap_end = align_to(placer->offset, member->align);
+        bool filled = false;
+        for (uptr i = 0; i < placer->n_others; i++) {
+            Member *other = placer->others[i];
+            if (placer->placed[i] || other == member
+                || placer->offset % other->align != 0
+                || placer->offset + other->type->size > gap_end) {
+                continue;
+            }
+            placer->placed[i] = true;
+            place_at(placer, other);
+            filled = true;
+            break;
+        }
+        if (!filled) {
+            break;
+        }
+    }
+    place_at(placer, member);
+}
+
+/// Order non-pointer members by decreasing alignment, then decreasing size,
+/// then declaration order, so that the layout is deterministic.
+static int compare_members(const void *a, const void *b) {
+    const Member *x = *(Member *const *) a, *y = *(Member *const *) b;
+    if (x->align != y->align) {
+        return x->align < y->align ? 1 : -1;
+    }
+    if (x->type->size != y->type->size) {
+        return x->type->size < y->type->size ? 1 : -1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/// Lay out a run of members, starting at `*offset`.
+/// \param members The members, in declaration order.
+/// \param n The number of members.
+/// \param offset The offset to start at; updated to the end of the run.
+/// \param align The strictest alignment seen; updated by the run.
+/// \param reorder Whether members may be reordered.
+static void lay_out_members(Member *members, uptr n, uptr *offset,
+                            uptr *align, bool reorder) {
+    for (uptr i = 0; i < n; i++) {
+        Type *type = members[i].type;
+        if (is_aggregate(type) && type->align == 0) {
+            // Laying it out here would write to a type that other threads
+            // may be reading.
+            error("internal compiler error: %s member has not been laid "
+                  "out\n", Type_describe(type));
+        }
+        members[i].align = type->align ? type->align : 1;
+    }
+
+    Member *others[n ? n : 1];
+    bool placed[n ? n : 1];
+    Placer placer = {
+        .offset = *offset,
+        .align = *align,
+        .others = others,
+        .n_others = 0,
+        .placed = placed,
+    };
+
+    if (!reorder) {
+        for (uptr i = 0; i < n; i++) {
+            place_at(&placer, &members[i]);
+        }
+    } else {
+        for (uptr i = 0; i < n; i++) {
+            if (!members[i].type->is_ptr) {
+                placed[placer.n_others] = false;
+                others[placer.n_others++] = &members[i];
+            }
+        }
+        qsort(others, placer.n_others, sizeof(Member *), compare_members);
+
+        for (uptr i = 0; i < n; i++) {
+            if (members[i].type->is_ptr) {
+                place(&placer, &members[i]);
+            }
+        }
+        for (uptr i = 0; i < placer.n_others; i++) {
+            if (!placed[i]) {
+                placed[i] = true;
+                place(&placer, others[i]);
+            }
+        }
+    }
+
+    *offset = placer.offset;
+    *align = placer.align;
+}
+
+void layout_type(Type *type, bool reorder) {
+    uptr offset = 0, align = 1;
+    if (type->align != 0 && type->reordered != reorder) {
+        error("internal compiler error: %s laid out with two policies\n",
+              Type_describe(type));
+    }
+
+    switch (type->kind) {
+        case TAdt:
+        case TTuple:
+            lay_out_members(type->members, type->n_members,
+                            &offset, &align, reorder);
+            break;
+
+        case TAdtPick: {
+            // The tag always comes first, so a variant can be identified
+            // before anything else about it is known.
+            offset = type_int->size;
+            align = type_int->align;
+            lay_out_members(type->members, type->n_members,
+                            &offset, &align, reorder);
+            for (uptr i = 0; i < type->n_variants; i++) {
+                Type *variant = type->variants[i];
+                uptr variant_offset = offset, variant_align = align;
+                lay_out_members(variant->members, variant->n_members,
+                                &variant_offset, &variant_align, reorder);
+                variant->elem = type;
+                variant->align = variant_align;
+                variant->size = align_to(variant_offset, variant_align);
+                variant->can_ref = true;
+                variant->reordered = reorder;
+            }
+            break;
+        }
+
+        default:
+            error("internal compiler error: cannot lay out a %s\n",
+                  Type_describe(type));
+    }
+
+    type->align = align;
+    type->size = align_to(offset, align);
+    type->can_ref = true;
+    type->reordered = reorder;
+}
+
+uptr layout_map_length(const Type *type) {
+    uptr words = (type->size + LAYOUT_WORD - 1) / LAYOUT_WORD;
+    return (words + 7) / 8;
+}
+
+/// Mark the pointers of a value of `type` stored at byte offset `base`.
+static uptr mark_pointers(const Type *type, uptr base, u8 *map) {
+    if (type->is_ptr) {
+        uptr word = base / LAYOUT_WORD;
+        map[word / 8] |= 0x80 >> (word % 8);
+        return 1;
+    }
+
+    uptr count = 0;
+    if (type->kind == TAdt && type->elem != NULL) {
+        // A pick variant starts with the tag and common members.
+        count += mark_pointers(type->elem, base, map);
+    }
+    if (is_aggregate(type)) {
+        for (uptr i = 0; i < type->n_members; i++) {
+            count += mark_pointers(type->members[i].type,
+                                   base + type->members[i].offset, map);
+        }
+    }
+    return count;
+}
+
+uptr layout_pointer_map(const Type *type, u8 *map) {
+    memset(map, 0, layout_map_length(type));
+    return mark_pointers(type, 0, map);
+}
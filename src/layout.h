@@ -0,0 +1,53 @@
+#ifndef LIMBO_LAYOUT_H
+#define LIMBO_LAYOUT_H
+
+#include <stdbool.h>
+#include "type.h"
+
+/// The size of a word in a pointer map; each bit of the map covers one word.
+#define LAYOUT_WORD sizeof(void *)
+
+/// Compute the offset of every member of an adt, pick adt or tuple, and the
+/// size and alignment of the type itself.
+/// \param type The type to lay out.
+/// \param reorder Whether members may be placed in a different order to the
+/// one they were declared in.
+/// \note
+///     Without reordering, members are placed in declaration order at their
+///     natural alignment.
+///
+///     With reordering, all pointer members are placed together so that the
+///     garbage collector's pointer map is a single run of bits, and the other
+///     members are placed in decreasing order of alignment. Whenever a member
+///     would need padding before it, smaller members are moved up to fill the
+///     gap instead.
+///
+///     A pick adt starts with its tag, followed by the common members. Each
+///     variant's own members are placed after the common members, and the
+///     size of each variant includes the common part.
+/// \remark Member types that are themselves adts or tuples held by value must
+/// already have been laid out. Only `type` itself is written to, so tuples can
+/// be laid out while other threads read the types of their members.
+/// \remark Each adt keeps the policy it was laid out with, recorded in
+/// `Type.reordered`, wherever it is held by value; `reorder` only applies to
+/// the members of `type` itself. Laying a type out again with the other
+/// policy is an error.
+/// \remark `Member.index` keeps the declaration order; only `Member.offset`
+/// reflects the layout.
+void layout_type(Type *type, bool reorder);
+
+/// The number of bytes needed for the pointer map of a type.
+/// \param type A type that has been laid out.
+/// \return The length of the map, in bytes.
+uptr layout_map_length(const Type *type);
+
+/// Write the pointer map of a type.
+/// Bit `i` of the map, counting from the most significant bit of the first
+/// byte, is set if word `i` of a value of the type holds a pointer, which is
+/// the format used by Dis type descriptors.
+/// \param type A type that has been laid out.
+/// \param map The map to write, of at least `layout_map_length(type)` bytes.
+/// \return The number of pointer words.
+uptr layout_pointer_map(const Type *type, u8 *map);
+
+#endif //LIMBO_LAYOUT_H
@@ -159,7 +159,7 @@ static void read_number_literal(LexerContext *context, Token *token,
 
     const char *p = start;
     uptr length = 0, capacity = 16;
-    char *buffer = calloc(capacity, sizeof(char)), *base;
+    char *buffer = ALLOC(context->allocator, capacity * sizeof(char)), *base;
 
     enum { INTEGER, RADIX_CHAR, RADIX, FRACTION, FRACTION_B,
             EXPONENT_CHAR, EXPONENT_SIGN, EXPONENT } state;
@@ -210,7 +210,7 @@ static void read_number_literal(LexerContext *context, Token *token,
 
             case FRACTION:
                 if (isdigit(c)) break;
-                if (c == 'e' || c == 'E') state = EXPONENT_SIGN;
+                if (c == 'e' || c == 'E') state = EXPONENT_CHAR;
                 else goto finished;
                 break;
 
@@ -238,10 +238,11 @@ static void read_number_literal(LexerContext *context, Token *token,
                       state);
         }
 
-        // grow buffer if necessary
-        if (length >= capacity) {
+        // grow buffer if necessary, leaving room for the terminator
+        if (length + 1 >= capacity) {
             capacity *= 2;
-            buffer = realloc(buffer, capacity * sizeof(char));
+            buffer = REALLOC(context->allocator, buffer,
+                             capacity * sizeof(char));
         }
         // add character to buffer
         buffer[length++] = c;
@@ -249,9 +250,8 @@ static void read_number_literal(LexerContext *context, Token *token,
 
     finished:
 
+    // `p` is just past the number
     buffer[length] = 0;
-    // Backtrack one place
-    p--;
 
     i64 int_value;
     f64 real_value;
@@ -292,6 +292,7 @@ static void read_number_literal(LexerContext *context, Token *token,
             real_value = strtodb(base, NULL, (int)int_value);
             break;
     }
+    FREE(context->allocator, buffer);
 
     Token_new(token, context, TOKEN_INTEGRAL, start, p);
     switch (state) {
@@ -371,7 +372,7 @@ static const char *string_literal_end(LexerContext *context,
 static void read_string_literal(LexerContext *context, Token *token,
                                 const char *start, const char **new_position) {
     const char *end = string_literal_end(context, start + 1);
-    char *buffer = calloc(1, end - start + 1);
+    char *buffer = ALLOC(context->allocator, end - start + 1);
     uptr len = 0;
 
     for (const char *p = start + 1; p < end;) {
@@ -489,7 +490,7 @@ static uptr read_identifier(const LexerContext *context, const char *start,
     return len;
 }
 
-LexerContext LexerContext_from(const SourceFile *file) {
+LexerContext LexerContext_from(const SourceFile *file, Allocator *allocator) {
     LexerContext context = {
             .source_file = file,
             .position = file->contents,
@@ -497,6 +498,7 @@ LexerContext LexerContext_from(const SourceFile *file) {
             .follows_space = false,
             .line_number = 1,
             .column_number = 1,
+            .allocator = allocator,
     };
     return context;
 }
@@ -601,12 +603,12 @@ void lex_one(LexerContext *context, Token *token) {
     Token_new(token, context, TOKEN_EOF, context->position, context->position);
 }
 
-Token *lex(SourceFile *file) {
+Token *lex(SourceFile *file, Allocator *allocator) {
     Token head = {}, *current = &head;
 
-    LexerContext context = LexerContext_from(file);
+    LexerContext context = LexerContext_from(file, allocator);
     while (*context.position) {
-        Token *token = calloc(1, sizeof(Token));
+        Token *token = ALLOC(allocator, sizeof(Token));
         lex_one(&context, token);
         current = current->next = token;
     }
@@ -614,13 +616,13 @@ Token *lex(SourceFile *file) {
     return head.next;
 }
 
-void Token_free(Token* head) {
+void Token_free(Token* head, Allocator *allocator) {
     while (head != NULL) {
         Token *next = head->next;
         if (head->kind == TOKEN_STRING) {
-            free((void *)head->string_value);
+            FREE(allocator, (void *)head->string_value);
         }
-        free(head);
+        FREE(allocator, head);
         head = next;
     }
 }
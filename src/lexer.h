@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdnoreturn.h>
 #include "num.h"
+#include "alloc.h"
 
 // Structs
 
@@ -103,6 +104,8 @@ typedef struct LexerContext {
     uptr line_number;
     /// The column number
     uptr column_number;
+    /// The allocator that tokens and literal values are allocated from.
+    Allocator *allocator;
 } LexerContext;
 
 
@@ -110,14 +113,16 @@ typedef struct LexerContext {
 
 /// Free a linked list of tokens.
 /// \param token The first token in the linked list.
-void Token_free(Token* head);
+/// \param allocator The allocator that the tokens were allocated from.
+void Token_free(Token* head, Allocator *allocator);
 
 // File manipulation
 
 /// Create a lexer context from a source file.
 /// \param file The source file to lex.
+/// \param allocator The allocator to allocate tokens from.
 /// \return The lexer context.
-LexerContext LexerContext_from(const SourceFile *file);
+LexerContext LexerContext_from(const SourceFile *file, Allocator *allocator);
 
 /// Lex a single token from a source file.
 /// \param context The lexer context.
@@ -126,7 +131,9 @@ void lex_one(LexerContext *context, Token *token);
 
 /// Lex an entire file into a linked list of tokens.
 /// \param file The source file to lex.
+/// \param allocator The allocator to allocate tokens from.
 /// \return The first token in the linked list.
-Token *lex(SourceFile *file);
+/// \see Token_free
+Token *lex(SourceFile *file, Allocator *allocator);
 
 #endif //LIMBO_LEXER_H
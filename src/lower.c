@@ -0,0 +1,1323 @@
+#include "lower.h"
+#include <stdlib.h>
+#include "fold.h"
+#include "unicode.h"
+
+/// A statement that `break`, and for loops `continue`, can leave.
+typedef struct Breakable Breakable;
+struct Breakable {
+    Breakable *outer;
+    IrBlock *break_to;
+    /// For loops, the block that `continue` goes to; otherwise `NULL`.
+    IrBlock *continue_to;
+};
+
+/// A location that can be assigned to, with its subexpressions already
+/// evaluated so that compound assignments evaluate them once.
+typedef struct LValue LValue;
+struct LValue {
+    Node *node;
+    /// For members of aggregate values and characters of strings, the
+    /// location holding the aggregate or string.
+    LValue *parent;
+    /// For members of refs and elements of arrays, the ref or array.
+    IrInst *base;
+    /// For elements, the index.
+    IrInst *index;
+    /// For members, the member and its position in the aggregate.
+    Member *member;
+    uptr member_index;
+};
+
+typedef struct Lower {
+    IrFunction *function;
+    Diagnostics *diagnostics;
+    /// The block that instructions are being appended to.
+    IrBlock *block;
+    Breakable *breakable;
+} Lower;
+
+static IrInst *lower_expr(Lower *l, Node *node);
+static void lower_stmts(Lower *l, Node *node);
+
+static bool is_aggregate(const Type *type) {
+    return type->kind == TAdt || type->kind == TAdtPick
+           || type->kind == TTuple;
+}
+
+static IrBlock *new_block(Lower *l) {
+    return IrFunction_block(l->function);
+}
+
+/// Continue in a block that nothing branches to, after a statement that
+/// never falls through.
+static void dead_block(Lower *l) {
+    l->block = new_block(l);
+    l->block->sealed = true;
+}
+
+static IrInst *append(Lower *l, IrOp op, Type *type, Token *token) {
+    IrInst *inst = IrFunction_inst(l->function, op, type, token);
+    IrBlock_append(l->block, inst);
+    return inst;
+}
+
+static void add_arg(Lower *l, IrInst *inst, IrInst *arg) {
+    IrInst_add_arg(inst, l->function, arg);
+}
+
+static IrInst *int_constant(Lower *l, Type *type, i64 value) {
+    IrInst *inst = append(l, IR_CONST, type, NULL);
+    inst->int_value = value;
+    return inst;
+}
+
+/// The zero value of a type: 0, `nil`, or an aggregate of zeroes.
+static IrInst *zero(IrFunction *function, IrBlock *block, Type *type) {
+    IrInst *inst = IrFunction_inst(function, IR_CONST, type, NULL);
+    IrBlock_prepend(block, inst);
+    return inst;
+}
+
+static IrInst *unsupported(Lower *l, Node *node, const char *what) {
+    diag_error(l->diagnostics, node->token, "cannot generate code for %s yet",
+               what);
+    return int_constant(l, node->type ? node->type : type_int, 0);
+}
+
+// SSA construction, following Braun et al., "Simple and Efficient
+// Construction of Static Single Assignment Form". Each block records the
+// current value of every variable assigned in it. Reading a variable that
+// is not assigned in a block looks it up in the predecessors, placing a phi
+// where they meet. Until every predecessor of a block is known, the block is
+// unsealed, and the phis it needs are completed when it is sealed.
+
+static void write_var(IrBlock *block, Decl *decl, IrInst *value) {
+    for (uptr i = 0; i < block->n_defs; i++) {
+        if (block->defs[i].decl == decl) {
+            block->defs[i].value = value;
+            return;
+        }
+    }
+    GROW(block->function->allocator, block->defs, block->n_defs,
+         block->defs_capacity);
+    block->defs[block->n_defs++] = (IrDef) {decl, value};
+}
+
+static IrInst *read_var(IrBlock *block, Decl *decl);
+
+static void add_phi_operands(IrInst *phi) {
+    IrBlock *block = phi->block;
+    for (u32 k = 0; k < block->n_preds; k++) {
+        IrInst_add_arg(phi, block->function,
+                       read_var(block->preds[k], phi->decl));
+    }
+}
+
+static IrInst *new_phi(IrBlock *block, Decl *decl) {
+    IrInst *phi = IrFunction_inst(block->function, IR_PHI, decl->type,
+                                  decl->token);
+    phi->decl = decl;
+    IrBlock_prepend(block, phi);
+    return phi;
+}
+
+static IrInst *read_var(IrBlock *block, Decl *decl) {
+    for (uptr i = 0; i < block->n_defs; i++) {
+        if (block->defs[i].decl == decl) {
+            return block->defs[i].value;
+        }
+    }
+
+    IrInst *value;
+    if (!block->sealed) {
+        value = new_phi(block, decl);
+        GROW(block->function->allocator, block->incomplete,
+             block->n_incomplete, block->incomplete_capacity);
+        block->incomplete[block->n_incomplete++] = value;
+    } else if (block->n_preds == 1) {
+        value = read_var(block->preds[0], decl);
+    } else if (block->n_preds == 0) {
+        // Only reached for a variable read before it is assigned, or in a
+        // block that cannot run.
+        value = zero(block->function, block, decl->type);
+    } else {
+        // Record the phi first, so that a loop back to this block finds it.
+        value = new_phi(block, decl);
+        write_var(block, decl, value);
+        add_phi_operands(value);
+    }
+    write_var(block, decl, value);
+    return value;
+}
+
+/// Mark every predecessor of a block as known.
+static void seal(IrBlock *block) {
+    for (uptr i = 0; i < block->n_incomplete; i++) {
+        add_phi_operands(block->incomplete[i]);
+    }
+    block->n_incomplete = 0;
+    block->sealed = true;
+}
+
+// Expressions
+
+static IrInst *binary(Lower *l, NodeKind kind, Type *type, IrInst *left,
+                      IrInst *right, Token *token) {
+    IrInst *inst = append(l, IR_BINARY, type, token);
+    inst->operator = kind;
+    add_arg(l, inst, left);
+    add_arg(l, inst, right);
+    return inst;
+}
+
+static IrInst *unary(Lower *l, NodeKind kind, Type *type, IrInst *value,
+                     Token *token) {
+    IrInst *inst = append(l, IR_UNARY, type, token);
+    inst->operator = kind;
+    add_arg(l, inst, value);
+    return inst;
+}
+
+static IrInst *field(Lower *l, IrInst *aggregate, uptr index, Token *token) {
+    IrInst *inst = append(l, IR_FIELD, aggregate->type->members[index].type,
+                          token);
+    inst->index = index;
+    add_arg(l, inst, aggregate);
+    return inst;
+}
+
+static IrInst *lower_literal(Lower *l, Node *node, Type *type) {
+    IrInst *inst = append(l, IR_CONST, type, node->token);
+    switch (node->kind) {
+        case NODE_STRING:
+            inst->string_value = node->string_value;
+            inst->string_length = node->string_length;
+            break;
+        case NODE_REAL:
+            inst->real_value = node->real_value;
+            inst->int_value = (i64) node->real_value;
+            break;
+        case NODE_INTEGRAL:
+            inst->int_value = node->int_value;
+            inst->real_value = (f64) node->int_value;
+            break;
+        default:
+            break;
+    }
+    return inst;
+}
+
+/// Find the member that a `NODE_DOT` refers to in an adt, pick adt or tuple,
+/// held by value or through a ref.
+static Member *member_of(Node *node, uptr *index) {
+    Type *type = node->left->type;
+    Type *aggregate = type && type->kind == TRef ? type->elem : type;
+    if (aggregate == NULL || !is_aggregate(aggregate)) {
+        return NULL;
+    }
+    Member *member = Type_member(aggregate, node->token);
+    if (member) {
+        *index = (uptr) (member - aggregate->members);
+    }
+    return member;
+}
+
+/// Lower a condition as branches to `if_true` and `if_false`, evaluating
+/// `and` and `or` lazily. The current block is left terminated.
+static void lower_cond(Lower *l, Node *node, IrBlock *if_true,
+                       IrBlock *if_false) {
+    switch (node->kind) {
+        case NODE_NOT:
+            lower_cond(l, node->left, if_false, if_true);
+            return;
+        case NODE_AND:
+        case NODE_OR: {
+            IrBlock *right = new_block(l);
+            if (node->kind == NODE_AND) {
+                lower_cond(l, node->left, right, if_false);
+            } else {
+                lower_cond(l, node->left, if_true, right);
+            }
+            seal(right);
+            l->block = right;
+            lower_cond(l, node->right, if_true, if_false);
+            return;
+        }
+        case NODE_INTEGRAL:
+            IrBlock_jump(l->block, node->int_value ? if_true : if_false);
+            return;
+        default:
+            IrBlock_branch(l->block, lower_expr(l, node), if_true, if_false);
+            return;
+    }
+}
+
+/// Materialise an `and` or `or` as the `int` 0 or 1.
+static IrInst *lower_bool(Lower *l, Node *node) {
+    IrBlock *yes = new_block(l), *no = new_block(l), *join = new_block(l);
+    lower_cond(l, node, yes, no);
+    seal(yes);
+    seal(no);
+    l->block = yes;
+    IrInst *one = int_constant(l, type_int, 1);
+    IrBlock_jump(yes, join);
+    l->block = no;
+    IrInst *zero = int_constant(l, type_int, 0);
+    IrBlock_jump(no, join);
+    seal(join);
+    l->block = join;
+
+    IrInst *phi = IrFunction_inst(l->function, IR_PHI, type_int, node->token);
+    add_arg(l, phi, one);
+    add_arg(l, phi, zero);
+    IrBlock_prepend(join, phi);
+    return phi;
+}
+
+static IrInst *read_decl(Lower *l, Node *node) {
+    Decl *decl = node->decl;
+    if (decl->depth == 0) {
+        IrInst *inst = append(l, IR_GLOBAL, decl->type, node->token);
+        inst->decl = decl;
+        return inst;
+    }
+    return read_var(l->block, decl);
+}
+
+static bool lvalue(Lower *l, Node *node, LValue *lv) {
+    *lv = (LValue) {.node = node};
+    switch (node->kind) {
+        case NODE_IDENTIFIER:
+            if (node->decl == NULL || node->decl->kind != DECL_VAR) {
+                unsupported(l, node, "assignment to this name");
+                return false;
+            }
+            return true;
+
+        case NODE_DOT:
+            lv->member = member_of(node, &lv->member_index);
+            if (lv->member == NULL) {
+                unsupported(l, node, "this member");
+                return false;
+            }
+            if (node->left->type->kind == TRef) {
+                lv->base = lower_expr(l, node->left);
+                return true;
+            }
+            lv->parent = ALLOC(l->function->allocator, sizeof(LValue));
+            return lvalue(l, node->left, lv->parent);
+
+        case NODE_INDEX:
+            if (node->left->type->kind == TString) {
+                lv->parent = ALLOC(l->function->allocator, sizeof(LValue));
+                if (!lvalue(l, node->left, lv->parent)) {
+                    return false;
+                }
+            } else {
+                lv->base = lower_expr(l, node->left);
+            }
+            lv->index = lower_expr(l, node->right);
+            return true;
+
+        default:
+            unsupported(l, node, "assignment to this expression");
+            return false;
+    }
+}
+
+static IrInst *lvalue_load(Lower *l, LValue *lv) {
+    Node *node = lv->node;
+    switch (node->kind) {
+        case NODE_IDENTIFIER:
+            return read_decl(l, node);
+
+        case NODE_DOT: {
+            if (lv->base) {
+                IrInst *inst = append(l, IR_LOAD_FIELD, lv->member->type,
+                                      node->token);
+                inst->index = lv->member_index;
+                add_arg(l, inst, lv->base);
+                return inst;
+            }
+            return field(l, lvalue_load(l, lv->parent), lv->member_index,
+                         node->token);
+        }
+
+        default: {
+            IrInst *value = lv->base ? lv->base : lvalue_load(l, lv->parent);
+            IrInst *inst = append(l, IR_INDEX, node->type, node->token);
+            add_arg(l, inst, value);
+            add_arg(l, inst, lv->index);
+            return inst;
+        }
+    }
+}
+
+static void lvalue_store(Lower *l, LValue *lv, IrInst *value) {
+    Node *node = lv->node;
+    switch (node->kind) {
+        case NODE_IDENTIFIER:
+            if (node->decl->depth == 0) {
+                IrInst *inst = append(l, IR_SET_GLOBAL, NULL, node->token);
+                inst->decl = node->decl;
+                add_arg(l, inst, value);
+            } else {
+                write_var(l->block, node->decl, value);
+            }
+            return;
+
+        case NODE_DOT: {
+            if (lv->base) {
+                IrInst *inst = append(l, IR_STORE_FIELD, NULL, node->token);
+                inst->index = lv->member_index;
+                add_arg(l, inst, lv->base);
+                add_arg(l, inst, value);
+                return;
+            }
+            IrInst *aggregate = lvalue_load(l, lv->parent);
+            IrInst *inst = append(l, IR_INSERT, aggregate->type, node->token);
+            inst->index = lv->member_index;
+            add_arg(l, inst, aggregate);
+            add_arg(l, inst, value);
+            lvalue_store(l, lv->parent, inst);
+            return;
+        }
+
+        default: {
+            if (lv->base) {
+                IrInst *inst = append(l, IR_SET_INDEX, NULL, node->token);
+                add_arg(l, inst, lv->base);
+                add_arg(l, inst, lv->index);
+                add_arg(l, inst, value);
+                return;
+            }
+            IrInst *string = lvalue_load(l, lv->parent);
+            IrInst *inst = append(l, IR_SET_CHAR, string->type, node->token);
+            add_arg(l, inst, string);
+            add_arg(l, inst, lv->index);
+            add_arg(l, inst, value);
+            lvalue_store(l, lv->parent, inst);
+            return;
+        }
+    }
+}
+
+/// Store each element of a tuple into a list of targets, which may
+/// themselves be tuples, skipping `nil`s.
+static void unpack(Lower *l, Node *targets, IrInst *tuple) {
+    uptr i = 0;
+    for (Node *target = targets; target && i < tuple->type->n_members;
+         target = target->next, i++) {
+        if (target->kind == NODE_NIL) {
+            continue;
+        }
+        IrInst *element = field(l, tuple, i, target->token);
+        if (target->kind == NODE_TUPLE) {
+            unpack(l, target->body, element);
+            continue;
+        }
+        LValue lv;
+        if (lvalue(l, target, &lv)) {
+            lvalue_store(l, &lv, element);
+        }
+    }
+}
+
+static NodeKind assign_operator(NodeKind kind) {
+    switch (kind) {
+        case NODE_ASSIGN_ADD: return NODE_ADD;
+        case NODE_ASSIGN_SUB: return NODE_SUB;
+        case NODE_ASSIGN_MUL: return NODE_MUL;
+        case NODE_ASSIGN_DIV: return NODE_DIV;
+        case NODE_ASSIGN_MOD: return NODE_MOD;
+        case NODE_ASSIGN_BIT_AND: return NODE_BIT_AND;
+        case NODE_ASSIGN_BIT_OR: return NODE_BIT_OR;
+        case NODE_ASSIGN_BIT_XOR: return NODE_BIT_XOR;
+        case NODE_ASSIGN_SHL: return NODE_SHL;
+        default: return NODE_SHR;
+    }
+}
+
+static IrInst *lower_assign(Lower *l, Node *node) {
+    if (node->left->kind == NODE_TUPLE) {
+        IrInst *value = lower_expr(l, node->right);
+        unpack(l, node->left->body, value);
+        return value;
+    }
+
+    LValue lv;
+    if (!lvalue(l, node->left, &lv)) {
+        return lower_expr(l, node->right);
+    }
+    IrInst *value;
+    if (node->kind == NODE_INC || node->kind == NODE_DEC) {
+        Type *type = node->left->type;
+        IrInst *one = int_constant(l, type, 1);
+        one->real_value = 1;
+        value = binary(l, node->kind == NODE_INC ? NODE_ADD : NODE_SUB, type,
+                       lvalue_load(l, &lv), one, node->token);
+    } else if (node->kind == NODE_ASSIGN) {
+        value = lower_expr(l, node->right);
+    } else {
+        IrInst *right = lower_expr(l, node->right);
+        value = binary(l, assign_operator(node->kind), node->left->type,
+                       lvalue_load(l, &lv), right, node->token);
+    }
+    lvalue_store(l, &lv, value);
+    return value;
+}
+
+/// Lower a call, or with `spawn`, start the callee in a new process.
+static IrInst *lower_call(Lower *l, Node *node, bool spawn) {
+    Node *callee = node->left;
+    Type *fn = callee->type;
+    if (fn == NULL || fn->kind != TFn) {
+        return unsupported(l, node, "calls to this kind of value");
+    }
+    uptr n_args = 0;
+    for (Node *arg = node->right; arg; arg = arg->next) {
+        n_args++;
+    }
+    if (n_args > fn->n_params) {
+        return unsupported(l, node, "variadic calls");
+    }
+    Type *result = spawn || fn->return_type == NULL ? type_none
+                                                    : fn->return_type;
+
+    IrInst *inst;
+    if (callee->kind == NODE_IDENTIFIER && callee->decl
+        && callee->decl->kind == DECL_FN) {
+        inst = IrFunction_inst(l->function, spawn ? IR_SPAWN : IR_CALL,
+                               result, node->token);
+        inst->decl = callee->decl;
+    } else if (callee->kind == NODE_DOT
+               && callee->left->type->kind == TModule) {
+        Type *module = callee->left->type;
+        Member *member = Type_member(module, callee->token);
+        if (member == NULL) {
+            return unsupported(l, node, "this member");
+        }
+        inst = IrFunction_inst(l->function, spawn ? IR_MSPAWN : IR_MCALL,
+                               result, node->token);
+        inst->index = (uptr) (member - module->members);
+        add_arg(l, inst, lower_expr(l, callee->left));
+    } else {
+        return unsupported(l, node, "calls to this kind of value");
+    }
+
+    for (Node *arg = node->right; arg; arg = arg->next) {
+        add_arg(l, inst, lower_expr(l, arg));
+    }
+    IrBlock_append(l->block, inst);
+    return inst;
+}
+
+static IrInst *lower_expr(Lower *l, Node *node) {
+    switch (node->kind) {
+        case NODE_INTEGRAL:
+        case NODE_REAL:
+        case NODE_STRING:
+        case NODE_NIL:
+            return lower_literal(l, node, node->type ? node->type : type_nil);
+
+        case NODE_IDENTIFIER:
+            if (node->decl && node->decl->kind == DECL_CON
+                && node->decl->value) {
+                return lower_literal(l, node->decl->value, node->type);
+            }
+            if (node->decl == NULL || node->decl->kind != DECL_VAR) {
+                return unsupported(l, node, "this name");
+            }
+            return read_decl(l, node);
+
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_MOD:
+        case NODE_EXP:
+        case NODE_BIT_AND:
+        case NODE_BIT_OR:
+        case NODE_BIT_XOR:
+        case NODE_SHL:
+        case NODE_SHR:
+        case NODE_EQ:
+        case NODE_NEQ:
+        case NODE_LT:
+        case NODE_LTE:
+        case NODE_GT:
+        case NODE_GTE: {
+            IrInst *left = lower_expr(l, node->left);
+            IrInst *right = lower_expr(l, node->right);
+            return binary(l, node->kind, node->type, left, right,
+                          node->token);
+        }
+
+        case NODE_AND:
+        case NODE_OR:
+            return lower_bool(l, node);
+
+        case NODE_NEG:
+        case NODE_BIT_NOT:
+        case NODE_NOT:
+        case NODE_LEN:
+            return unary(l, node->kind, node->type,
+                         lower_expr(l, node->left), node->token);
+
+        case NODE_TAGOF:
+            return unary(l, node->kind, type_int, lower_expr(l, node->left),
+                         node->token);
+
+        case NODE_INC:
+        case NODE_DEC:
+        case NODE_ASSIGN:
+        case NODE_ASSIGN_ADD:
+        case NODE_ASSIGN_SUB:
+        case NODE_ASSIGN_MUL:
+        case NODE_ASSIGN_DIV:
+        case NODE_ASSIGN_MOD:
+        case NODE_ASSIGN_BIT_AND:
+        case NODE_ASSIGN_BIT_OR:
+        case NODE_ASSIGN_BIT_XOR:
+        case NODE_ASSIGN_SHL:
+        case NODE_ASSIGN_SHR:
+            return lower_assign(l, node);
+
+        case NODE_CONS: {
+            IrInst *head = lower_expr(l, node->left);
+            IrInst *tail = lower_expr(l, node->right);
+            IrInst *inst = append(l, IR_CONS, node->type, node->token);
+            add_arg(l, inst, head);
+            add_arg(l, inst, tail);
+            return inst;
+        }
+
+        case NODE_HD:
+        case NODE_TL: {
+            IrInst *list = lower_expr(l, node->left);
+            IrInst *inst = append(l, node->kind == NODE_HD ? IR_HEAD : IR_TAIL,
+                                  node->type, node->token);
+            add_arg(l, inst, list);
+            return inst;
+        }
+
+        case NODE_CAST: {
+            IrInst *value = lower_expr(l, node->left);
+            if (node->type == node->left->type) {
+                return value;
+            }
+            IrInst *inst = append(l, IR_CONVERT, node->type, node->token);
+            add_arg(l, inst, value);
+            return inst;
+        }
+
+        case NODE_INDEX:
+        case NODE_DOT: {
+            if (node->kind == NODE_DOT && node->left->type
+                && node->left->type->kind == TModule) {
+                return unsupported(l, node, "this member");
+            }
+            LValue lv = {.node = node};
+            if (node->kind == NODE_INDEX) {
+                lv.base = lower_expr(l, node->left);
+                lv.index = lower_expr(l, node->right);
+                IrInst *inst = append(l, IR_INDEX, node->type, node->token);
+                add_arg(l, inst, lv.base);
+                add_arg(l, inst, lv.index);
+                return inst;
+            }
+            lv.member = member_of(node, &lv.member_index);
+            if (lv.member == NULL) {
+                return unsupported(l, node, "this member");
+            }
+            IrInst *value = lower_expr(l, node->left);
+            if (node->left->type->kind == TRef) {
+                lv.base = value;
+                return lvalue_load(l, &lv);
+            }
+            return field(l, value, lv.member_index, node->token);
+        }
+
+        case NODE_TUPLE: {
+            IrInst *inst = IrFunction_inst(l->function, IR_MAKE, node->type,
+                                           node->token);
+            for (Node *elem = node->body; elem; elem = elem->next) {
+                add_arg(l, inst, lower_expr(l, elem));
+            }
+            IrBlock_append(l->block, inst);
+            return inst;
+        }
+
+        case NODE_FUNCTION_CALL:
+            return lower_call(l, node, false);
+
+        case NODE_REF: {
+            IrInst *value = lower_expr(l, node->left);
+            IrInst *inst = append(l, IR_NEW, node->type, node->token);
+            add_arg(l, inst, value);
+            return inst;
+        }
+
+        case NODE_ARRAY: {
+            IrInst *length = lower_expr(l, node->left);
+            IrInst *inst = append(l, IR_NEW_ARRAY, node->type, node->token);
+            add_arg(l, inst, length);
+            return inst;
+        }
+
+        case NODE_CHAN: {
+            IrInst *buffer = node->left ? lower_expr(l, node->left) : NULL;
+            IrInst *inst = append(l, IR_NEW_CHANNEL, node->type, node->token);
+            if (buffer) {
+                add_arg(l, inst, buffer);
+            }
+            return inst;
+        }
+
+        case NODE_CHAN_TX: {
+            IrInst *channel = lower_expr(l, node->left);
+            if (node->right) {
+                IrInst *value = lower_expr(l, node->right);
+                IrInst *inst = append(l, IR_SEND, NULL, node->token);
+                add_arg(l, inst, channel);
+                add_arg(l, inst, value);
+                return value;
+            }
+            IrInst *inst = append(l, IR_RECV, node->type, node->token);
+            add_arg(l, inst, channel);
+            return inst;
+        }
+
+        case NODE_LOAD: {
+            IrInst *path = lower_expr(l, node->left);
+            IrInst *inst = append(l, IR_LOAD, node->type, node->token);
+            add_arg(l, inst, path);
+            return inst;
+        }
+
+        default:
+            return unsupported(l, node, "this expression");
+    }
+}
+
+// Statements
+
+static void lower_decl(Lower *l, Node *node) {
+    uptr n = 0;
+    for (Node *name = node->left; name; name = name->next) {
+        n++;
+    }
+    if (node->right == NULL) {
+        for (Node *name = node->left; name; name = name->next) {
+            if (name->decl) {
+                write_var(l->block, name->decl,
+                          zero(l->function, l->block, name->decl->type));
+            }
+        }
+        return;
+    }
+    IrInst *value = lower_expr(l, node->right);
+    if (node->kind == NODE_DECL_EXP && n > 1) {
+        unpack(l, node->left, value);
+        return;
+    }
+    for (Node *name = node->left; name; name = name->next) {
+        if (name->decl) {
+            write_var(l->block, name->decl, value);
+        }
+    }
+}
+
+static void lower_if(Lower *l, Node *node) {
+    IrBlock *then = new_block(l);
+    IrBlock *else_ = node->else_ ? new_block(l) : NULL;
+    IrBlock *end = new_block(l);
+    lower_cond(l, node->cond, then, else_ ? else_ : end);
+
+    seal(then);
+    l->block = then;
+    lower_stmts(l, node->then);
+    IrBlock_jump(l->block, end);
+    if (else_) {
+        seal(else_);
+        l->block = else_;
+        lower_stmts(l, node->else_);
+        IrBlock_jump(l->block, end);
+    }
+    seal(end);
+    l->block = end;
+}
+
+static void lower_loop(Lower *l, Node *node) {
+    // The condition is tested before entering the loop and again after the
+    // body, so each iteration takes a single branch.
+    if (node->kind == NODE_FOR) {
+        lower_stmts(l, node->init);
+    }
+    IrBlock *body = new_block(l), *next = new_block(l), *exit = new_block(l);
+    if (node->kind == NODE_DO || node->cond == NULL) {
+        IrBlock_jump(l->block, body);
+    } else {
+        lower_cond(l, node->cond, body, exit);
+    }
+
+    Breakable loop = {l->breakable, exit, next};
+    l->breakable = &loop;
+    l->block = body;
+    lower_stmts(l, node->body);
+    IrBlock_jump(l->block, next);
+    seal(next);
+    l->block = next;
+    if (node->kind == NODE_FOR && node->inc) {
+        lower_expr(l, node->inc);
+    }
+    if (node->cond) {
+        lower_cond(l, node->cond, body, exit);
+    } else {
+        IrBlock_jump(l->block, body);
+    }
+    l->breakable = loop.outer;
+    seal(body);
+    seal(exit);
+    l->block = exit;
+}
+
+/// A `case` label whose value is a constant, with the arm it selects.
+typedef struct CaseLabel {
+    /// For integers, the range of values, inclusive. For strings, a scratch
+    /// key to sort by.
+    i64 low, high;
+    /// For strings, the label and its characters.
+    Node *node;
+    u32 *chars;
+    uptr n_chars;
+    uptr arm;
+} CaseLabel;
+
+static int compare_lows(const void *a, const void *b) {
+    const CaseLabel *x = a, *y = b;
+    return (x->low > y->low) - (x->low < y->low);
+}
+
+static int compare_strings(const void *a, const void *b) {
+    const CaseLabel *x = a, *y = b;
+    if (x->n_chars != y->n_chars) {
+        return (x->n_chars > y->n_chars) - (x->n_chars < y->n_chars);
+    }
+    for (uptr i = 0; i < x->n_chars; i++) {
+        if (x->chars[i] != y->chars[i]) {
+            return (x->chars[i] > y->chars[i]) - (x->chars[i] < y->chars[i]);
+        }
+    }
+    return 0;
+}
+
+/// Decode a string literal into characters. An invalid byte reads as the
+/// replacement character, as it does once the string is loaded.
+static u32 *decode(Allocator *allocator, Node *node, uptr *count) {
+    u32 *chars = ALLOC(allocator, (node->string_length + 1) * sizeof(u32));
+    const char *p = node->string_value, *end = p + node->string_length;
+    *count = 0;
+    while (p < end) {
+        const char *next;
+        u32 c = utf8_decode(p, &next);
+        if (c == 0 && *p != '\0') {
+            c = 0xFFFD;
+            next = p + 1;
+        }
+        chars[(*count)++] = c;
+        p = next;
+    }
+    return chars;
+}
+
+/// Collect the labels of a `case`, if they are all constants that a switch
+/// can dispatch on: integers, or strings without ranges, none of which
+/// overlap.
+/// \return Whether the labels can be dispatched on, after which `labels`
+/// must be freed.
+static bool case_labels(Lower *l, Node *node, CaseLabel **labels,
+                        uptr *n_labels) {
+    Allocator *a = l->function->allocator;
+    Type *type = node->cond->type;
+    bool is_string = type->kind == TString;
+    if (type->kind != TInt && type->kind != TByte && !is_string) {
+        return false;
+    }
+
+    uptr capacity = 0, arm_index = 0;
+    bool ok = true;
+    *labels = NULL;
+    *n_labels = 0;
+    for (Node *arm = node->body; arm && ok; arm = arm->next, arm_index++) {
+        for (Node *label = arm->left; label && ok; label = label->next) {
+            if (label->kind == NODE_NOP) {
+                continue;
+            }
+            Node *low = label->kind == NODE_TO ? label->left : label;
+            Node *high = label->kind == NODE_TO ? label->right : label;
+            if (!is_constant(low) || !is_constant(high)
+                || (is_string && label->kind == NODE_TO)) {
+                ok = false;
+                break;
+            }
+            CaseLabel item = {.node = label, .arm = arm_index};
+            if (is_string) {
+                item.chars = decode(a, label, &item.n_chars);
+            } else if (low->int_value > high->int_value) {
+                // An empty range never matches.
+                continue;
+            } else {
+                item.low = low->int_value;
+                item.high = high->int_value;
+            }
+            GROW(a, *labels, *n_labels, capacity);
+            (*labels)[(*n_labels)++] = item;
+        }
+    }
+
+    if (ok && is_string) {
+        qsort(*labels, *n_labels, sizeof(CaseLabel), compare_strings);
+        for (uptr i = 1; i < *n_labels && ok; i++) {
+            ok = compare_strings(&(*labels)[i - 1], &(*labels)[i]) != 0;
+        }
+    } else if (ok) {
+        qsort(*labels, *n_labels, sizeof(CaseLabel), compare_lows);
+        for (uptr i = 1; i < *n_labels && ok; i++) {
+            ok = (*labels)[i - 1].high < (*labels)[i].low;
+        }
+    }
+    if (!ok) {
+        for (uptr i = 0; i < *n_labels; i++) {
+            FREE(a, (*labels)[i].chars);
+        }
+        FREE(a, *labels);
+    }
+    return ok;
+}
+
+/// Lower a `case` as a chain of comparisons against each label in turn.
+static void case_chain(Lower *l, Node *node, IrInst *value, IrBlock **arms,
+                       IrBlock *default_arm) {
+    uptr i = 0;
+    for (Node *arm = node->body; arm; arm = arm->next, i++) {
+        for (Node *label = arm->left; label; label = label->next) {
+            if (label->kind == NODE_NOP) {
+                continue;
+            }
+            IrBlock *next = new_block(l);
+            if (label->kind == NODE_TO) {
+                IrInst *low = lower_expr(l, label->left);
+                IrInst *high = lower_expr(l, label->right);
+                IrBlock *upper = new_block(l);
+                IrBlock_branch(l->block, binary(l, NODE_GTE, type_int, value,
+                                                low, label->token),
+                               upper, next);
+                seal(upper);
+                l->block = upper;
+                IrBlock_branch(l->block, binary(l, NODE_LTE, type_int, value,
+                                                high, label->token),
+                               arms[i], next);
+            } else {
+                IrInst *match = lower_expr(l, label);
+                IrBlock_branch(l->block, binary(l, NODE_EQ, type_int, value,
+                                                match, label->token),
+                               arms[i], next);
+            }
+            seal(next);
+            l->block = next;
+        }
+    }
+    IrBlock_jump(l->block, default_arm);
+}
+
+/// Lower a `case` on an integer as a switch, merging adjacent labels of the
+/// same arm into one range.
+static void case_switch(Lower *l, IrInst *value, CaseLabel *labels,
+                        uptr n_labels, IrBlock **arms, IrBlock *default_arm) {
+    if (value->type->kind == TByte) {
+        IrInst *widened = append(l, IR_CONVERT, type_int, value->token);
+        add_arg(l, widened, value);
+        value = widened;
+    }
+    IrBlock_switch(l->block, value, default_arm);
+    for (uptr i = 0; i < n_labels;) {
+        uptr end = i + 1;
+        while (end < n_labels && labels[end].arm == labels[i].arm
+               && labels[end].low == labels[end - 1].high + 1) {
+            end++;
+        }
+        IrBlock_add_case(l->block, labels[i].low, labels[end - 1].high,
+                         arms[labels[i].arm]);
+        i = end;
+    }
+}
+
+/// Compare a string against each of a few labels in turn.
+static void compare_each(Lower *l, IrInst *value, CaseLabel *labels,
+                         uptr n_labels, IrBlock **arms,
+                         IrBlock *default_arm) {
+    for (uptr i = 0; i < n_labels; i++) {
+        IrBlock *next = i + 1 < n_labels ? new_block(l) : default_arm;
+        Node *label = labels[i].node;
+        IrInst *match = lower_literal(l, label, type_string);
+        IrBlock_branch(l->block, binary(l, NODE_EQ, type_int, value, match,
+                                        label->token),
+                       arms[labels[i].arm], next);
+        if (next != default_arm) {
+            seal(next);
+            l->block = next;
+        }
+    }
+}
+
+/// Dispatch among string labels of the same length. Only a few are compared
+/// whole; more are first told apart by the character at the position where
+/// they differ most.
+static void dispatch_strings(Lower *l, IrInst *value, CaseLabel *labels,
+                             uptr n_labels, IrBlock **arms,
+                             IrBlock *default_arm) {
+    uptr length = labels[0].n_chars;
+    if (length == 0) {
+        // The only string of this length is the empty string.
+        IrBlock_jump(l->block, arms[labels[0].arm]);
+        return;
+    }
+    if (n_labels <= 3) {
+        compare_each(l, value, labels, n_labels, arms, default_arm);
+        return;
+    }
+
+    uptr best = 0, best_count = 0;
+    for (uptr k = 0; k < length; k++) {
+        for (uptr i = 0; i < n_labels; i++) {
+            labels[i].low = labels[i].high = labels[i].chars[k];
+        }
+        qsort(labels, n_labels, sizeof(CaseLabel), compare_lows);
+        uptr count = 1;
+        for (uptr i = 1; i < n_labels; i++) {
+            count += labels[i].low != labels[i - 1].low;
+        }
+        if (count > best_count) {
+            best = k;
+            best_count = count;
+        }
+    }
+    for (uptr i = 0; i < n_labels; i++) {
+        labels[i].low = labels[i].high = labels[i].chars[best];
+    }
+    qsort(labels, n_labels, sizeof(CaseLabel), compare_lows);
+
+    IrInst *index = int_constant(l, type_int, (i64) best);
+    IrInst *c = append(l, IR_INDEX, type_int, value->token);
+    add_arg(l, c, value);
+    add_arg(l, c, index);
+    IrBlock *dispatch = l->block;
+    IrBlock_switch(dispatch, c, default_arm);
+    for (uptr i = 0; i < n_labels;) {
+        uptr end = i + 1;
+        while (end < n_labels && labels[end].low == labels[i].low) {
+            end++;
+        }
+        IrBlock *bucket = new_block(l);
+        IrBlock_add_case(dispatch, labels[i].low, labels[i].low, bucket);
+        seal(bucket);
+        l->block = bucket;
+        compare_each(l, value, labels + i, end - i, arms, default_arm);
+        i = end;
+    }
+}
+
+/// Lower a `case` on a string as a switch on its length, then a dispatch
+/// among the labels of that length. Dis has no instruction to hash a
+/// string, so the length and a single character stand in for a hash.
+static void case_strings(Lower *l, IrInst *value, CaseLabel *labels,
+                         uptr n_labels, IrBlock **arms,
+                         IrBlock *default_arm) {
+    IrInst *length = unary(l, NODE_LEN, type_int, value, value->token);
+    IrBlock *dispatch = l->block;
+    IrBlock_switch(dispatch, length, default_arm);
+    for (uptr i = 0; i < n_labels;) {
+        uptr end = i + 1;
+        while (end < n_labels && labels[end].n_chars == labels[i].n_chars) {
+            end++;
+        }
+        IrBlock *bucket = new_block(l);
+        IrBlock_add_case(dispatch, (i64) labels[i].n_chars,
+                         (i64) labels[i].n_chars, bucket);
+        seal(bucket);
+        l->block = bucket;
+        dispatch_strings(l, value, labels + i, end - i, arms, default_arm);
+        i = end;
+    }
+}
+
+/// Lower a `case`. When every label is a constant, the scrutinee is
+/// dispatched on with switches, which the backend turns into jump tables or
+/// binary searches; otherwise it is compared against each label in turn.
+static void lower_case(Lower *l, Node *node) {
+    IrInst *value = lower_expr(l, node->cond);
+
+    uptr n_arms = 0;
+    for (Node *arm = node->body; arm; arm = arm->next) {
+        n_arms++;
+    }
+    IrBlock *arms[n_arms ? n_arms : 1];
+    for (uptr i = 0; i < n_arms; i++) {
+        arms[i] = new_block(l);
+    }
+    IrBlock *end = new_block(l), *default_arm = end;
+    uptr i = 0;
+    for (Node *arm = node->body; arm; arm = arm->next, i++) {
+        for (Node *label = arm->left; label; label = label->next) {
+            if (label->kind == NODE_NOP) {
+                default_arm = arms[i];
+            }
+        }
+    }
+
+    CaseLabel *labels;
+    uptr n_labels;
+    if (!case_labels(l, node, &labels, &n_labels)) {
+        case_chain(l, node, value, arms, default_arm);
+    } else {
+        if (value->type->kind == TString) {
+            case_strings(l, value, labels, n_labels, arms, default_arm);
+        } else {
+            case_switch(l, value, labels, n_labels, arms, default_arm);
+        }
+        for (uptr k = 0; k < n_labels; k++) {
+            FREE(l->function->allocator, labels[k].chars);
+        }
+        FREE(l->function->allocator, labels);
+    }
+
+    Breakable breakable = {l->breakable, end, NULL};
+    l->breakable = &breakable;
+    i = 0;
+    for (Node *arm = node->body; arm; arm = arm->next, i++) {
+        seal(arms[i]);
+        l->block = arms[i];
+        lower_stmts(l, arm->body);
+        IrBlock_jump(l->block, end);
+    }
+    l->breakable = breakable.outer;
+    seal(end);
+    l->block = end;
+}
+
+/// The send or receive of an `alt` label.
+static Node *alt_transfer(Node *label) {
+    return label->kind == NODE_CHAN_TX ? label : label->right;
+}
+
+/// Declare or assign the value received by an `alt` label.
+static void store_received(Lower *l, Node *label, IrInst *value) {
+    if (label->left->kind == NODE_TUPLE) {
+        unpack(l, label->left->body, value);
+        return;
+    }
+    if (label->kind == NODE_DECL_EXP && label->left->next) {
+        unpack(l, label->left, value);
+        return;
+    }
+    if (label->kind == NODE_DECL_EXP) {
+        if (label->left->decl) {
+            write_var(l->block, label->left->decl, value);
+        }
+        return;
+    }
+    LValue lv;
+    if (lvalue(l, label->left, &lv)) {
+        lvalue_store(l, &lv, value);
+    }
+}
+
+/// Lower an `alt` as a single instruction that does one of its sends and
+/// receives, then a switch on the index of the one done. Each alternative
+/// has a block of its own that stores the value received, if it is assigned
+/// to anything, before continuing at its arm.
+static void lower_alt(Lower *l, Node *node) {
+    Type *type = node->type;
+    uptr n_sends = 0, n = type->n_members - 1;
+    for (Node *arm = node->body; arm; arm = arm->next) {
+        for (Node *label = arm->left; label; label = label->next) {
+            n_sends += label->kind != NODE_NOP
+                       && alt_transfer(label)->right != NULL;
+        }
+    }
+
+    // Channels and values are evaluated in the order they are written, but
+    // the instruction takes the sends first.
+    IrInst *channels[n ? n : 1], *values[n ? n : 1];
+    Node *labels[n ? n : 1];
+    IrBlock *arm_blocks[n ? n : 1];
+    uptr n_arms = 0;
+    for (Node *arm = node->body; arm; arm = arm->next) {
+        n_arms++;
+    }
+    IrBlock *arms[n_arms ? n_arms : 1];
+    IrBlock *end = new_block(l), *default_arm = NULL;
+    uptr next_send = 0, next_receive = n_sends, i = 0;
+    for (Node *arm = node->body; arm; arm = arm->next, i++) {
+        arms[i] = new_block(l);
+        for (Node *label = arm->left; label; label = label->next) {
+            if (label->kind == NODE_NOP) {
+                default_arm = arms[i];
+                continue;
+            }
+            Node *transfer = alt_transfer(label);
+            uptr k = transfer->right ? next_send++ : next_receive++;
+            channels[k] = lower_expr(l, transfer->left);
+            values[k] = transfer->right ? lower_expr(l, transfer->right)
+                                        : NULL;
+            labels[k] = label;
+            arm_blocks[k] = arms[i];
+        }
+    }
+
+    IrInst *inst = IrFunction_inst(l->function,
+                                   default_arm ? IR_NBALT : IR_ALT, type,
+                                   node->token);
+    inst->index = n_sends;
+    for (uptr k = 0; k < n; k++) {
+        add_arg(l, inst, channels[k]);
+        if (k < n_sends) {
+            add_arg(l, inst, values[k]);
+        }
+    }
+    IrBlock_append(l->block, inst);
+
+    IrInst *index = field(l, inst, 0, node->token);
+    IrBlock *dispatch = l->block;
+    IrBlock_switch(dispatch, index, default_arm ? default_arm : end);
+    for (uptr k = 0; k < n; k++) {
+        IrBlock *block = new_block(l);
+        IrBlock_add_case(dispatch, (i64) k, (i64) k, block);
+        seal(block);
+        l->block = block;
+        if (labels[k]->kind != NODE_CHAN_TX) {
+            store_received(l, labels[k],
+                           field(l, inst, 1 + k, labels[k]->token));
+        }
+        IrBlock_jump(l->block, arm_blocks[k]);
+    }
+
+    Breakable breakable = {l->breakable, end, NULL};
+    l->breakable = &breakable;
+    i = 0;
+    for (Node *arm = node->body; arm; arm = arm->next, i++) {
+        seal(arms[i]);
+        l->block = arms[i];
+        lower_stmts(l, arm->body);
+        IrBlock_jump(l->block, end);
+    }
+    l->breakable = breakable.outer;
+    seal(end);
+    l->block = end;
+}
+
+static void lower_stmts(Lower *l, Node *node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case NODE_NOP:
+                break;
+
+            case NODE_BLOCK:
+                lower_stmts(l, node->body);
+                break;
+
+            case NODE_DECL:
+            case NODE_DECL_EXP:
+                lower_decl(l, node);
+                break;
+
+            case NODE_IF:
+                lower_if(l, node);
+                break;
+
+            case NODE_WHILE:
+            case NODE_DO:
+            case NODE_FOR:
+                lower_loop(l, node);
+                break;
+
+            case NODE_CASE:
+                lower_case(l, node);
+                break;
+
+            case NODE_BREAK:
+            case NODE_CONTINUE: {
+                Breakable *target = l->breakable;
+                while (target && node->kind == NODE_CONTINUE
+                       && target->continue_to == NULL) {
+                    target = target->outer;
+                }
+                if (target == NULL) {
+                    diag_error(l->diagnostics, node->token,
+                               "%s outside of a loop",
+                               node->kind == NODE_BREAK ? "break"
+                                                        : "continue");
+                    break;
+                }
+                IrBlock_jump(l->block, node->kind == NODE_BREAK
+                                       ? target->break_to
+                                       : target->continue_to);
+                dead_block(l);
+                break;
+            }
+
+            case NODE_RETURN: {
+                IrInst *value = node->left ? lower_expr(l, node->left) : NULL;
+                IrInst *inst = append(l, IR_RETURN, NULL, node->token);
+                if (value) {
+                    add_arg(l, inst, value);
+                }
+                dead_block(l);
+                break;
+            }
+
+            case NODE_EXIT:
+                append(l, IR_EXIT, NULL, node->token);
+                dead_block(l);
+                break;
+
+            case NODE_SPAWN:
+                lower_call(l, node->left, true);
+                break;
+
+            case NODE_ALT:
+                lower_alt(l, node);
+                break;
+
+            default:
+                lower_expr(l, node);
+                break;
+        }
+    }
+}
+
+IrFunction *lower_function(Allocator *allocator, Node *function,
+                           Diagnostics *diagnostics) {
+    Lower l = {
+        .function = IrFunction_new(allocator, function),
+        .diagnostics = diagnostics,
+    };
+    l.block = l.function->entry;
+
+    uptr i = 0;
+    for (Node *param = function->left; param; param = param->next, i++) {
+        if (param->decl == NULL) {
+            continue;
+        }
+        IrInst *inst = append(&l, IR_PARAM, param->decl->type, param->token);
+        inst->index = i;
+        write_var(l.block, param->decl, inst);
+    }
+
+    lower_stmts(&l, function->body);
+    append(&l, IR_RETURN, NULL, NULL);
+    IrFunction_remove_unreachable(l.function);
+    return l.function;
+}
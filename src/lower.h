@@ -0,0 +1,23 @@
+#ifndef LIMBO_LOWER_H
+#define LIMBO_LOWER_H
+
+#include "alloc.h"
+#include "error.h"
+#include "ir.h"
+#include "parser.h"
+
+/// Lower a function to SSA form.
+/// Local variables become SSA values, with phis placed as the function is
+/// built, so no separate pass is needed to find them. Module-level variables
+/// are read and written with `IR_GLOBAL` and `IR_SET_GLOBAL`.
+/// \param allocator The allocator to allocate the function's arena from.
+/// \param function The `NODE_FUNCTION` to lower.
+/// \param diagnostics The list to record errors in, such as constructs that
+/// cannot be lowered yet.
+/// \return The function. Blocks that cannot be reached have been removed.
+/// \remark The function must be type checked and folded, and every adt it
+/// uses must already be laid out.
+IrFunction *lower_function(Allocator *allocator, Node *function,
+                           Diagnostics *diagnostics);
+
+#endif //LIMBO_LOWER_H
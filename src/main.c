@@ -1,50 +1,57 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "alloc.h"
+#include "driver.h"
+#include "error.h"
 #include "lexer.h"
 
-void print_token(Token* token) {
-    char *kind;
-    char buffer[100] = { 0 };
-    switch (token->kind) {
-        case TOKEN_IDENTIFIER:
-            strncpy(buffer, token->location, token->length);
-            buffer[token->length] = '\0';
-            kind = "IDENTIFIER";
-            break;
-        case TOKEN_PUNCTUATOR:
-            strncpy(buffer, token->location, token->length);
-            buffer[token->length] = '\0';
-            kind = "PUNCTUATOR";
-            break;
-        case TOKEN_KEYWORD:
-            strncpy(buffer, token->location, token->length);
-            buffer[token->length] = '\0';
-            kind = "KEYWORD";
-            break;
-        case TOKEN_STRING:
-            sprintf(buffer, "\"%s\"", token->string_value);
-            buffer[token->length + 2] = '\0';
-            kind = "STRING";
-            break;
-        case TOKEN_INTEGRAL:
-            sprintf(buffer, "%ld", token->int_value);
-            kind = "INTEGRAL";
-            break;
-        case TOKEN_REAL:
-            sprintf(buffer, "%f", token->real_value);
-            kind = "REAL";
-            break;
-        case TOKEN_EOF:
-            kind = "EOF";
-            break;
+/// Compile the files named on the command line, or serve or send compile
+/// requests.
+static int drive(Allocator *allocator, int argc, char **argv) {
+    SourceCache cache;
+    SourceCache_init(&cache, allocator);
+    const char *server = NULL, *client = NULL;
+    bool scan = false;
+    DepsFormat format = DEPS_MAKE;
+    bool ok = true;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+            SourceCache_include(&cache, argv[++i]);
+        } else if (strcmp(argv[i], "-M") == 0) {
+            scan = true;
+            format = DEPS_MAKE;
+        } else if (strcmp(argv[i], "-MJ") == 0) {
+            scan = true;
+            format = DEPS_JSON;
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            client = argv[++i];
+        } else {
+            error("usage: limbo [-I dir] [-M | -MJ | --server socket | "
+                  "--client socket] [file ...]\n");
+        }
     }
-
-    printf("%s at (%lu, %lu): %s\n", kind,
-           token->source_file_line, token->source_file_column, buffer);
+    if (server != NULL) {
+        cache.isolate = true;
+        ok = driver_serve(&cache, server);
+    }
+    for (; server == NULL && i < argc; i++) {
+        if (scan) {
+            ok = driver_deps(&cache, argv[i], format, stdout, stderr) && ok;
+        } else if (client != NULL) {
+            ok = driver_request(client, argv[i]) && ok;
+        } else {
+            ok = driver_compile(&cache, argv[i], stdout, stderr) && ok;
+        }
+    }
+    SourceCache_free(&cache);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int main() {
+int main(int argc, char **argv) {
     char *program =
             "implement Command;\n"
             "include \"sys.m\";\n"
@@ -67,14 +74,36 @@ int main() {
         .contents = program,
         .file_number = 1
     };
-    Token *head = lex(&file), *current = head;
 
-    while (current != NULL) {
-        print_token(current);
-        current = current->next;
+    // The allocator backend can be swapped without rebuilding, so that
+    // allocation strategies can be compared and leaks tracked down.
+    const char *allocator_name = getenv("LIMBO_ALLOCATOR");
+    Allocator *allocator = Allocator_from_name(
+            allocator_name ? allocator_name : "system");
+    if (allocator == NULL) {
+        error("unknown allocator '%s'\n", allocator_name);
+    }
+
+    int status = EXIT_SUCCESS;
+    if (argc > 1) {
+        status = drive(allocator, argc, argv);
+    } else {
+        Allocator_set_phase(allocator, "lex");
+        Token *head = lex(&file, allocator), *current = head;
+
+        while (current != NULL) {
+            print_token(current, stdout);
+            current = current->next;
+        }
+
+        Token_free(head, allocator);
     }
 
-    Token_free(head);
+    uptr leaks = 0;
+    if (strcmp(allocator->name, "debug") == 0) {
+        leaks = DebugAllocator_report(allocator, stderr);
+    }
+    Allocator_destroy(allocator);
 
-    return EXIT_SUCCESS;
+    return leaks ? EXIT_FAILURE : status;
 }
@@ -0,0 +1,2004 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "error.h"
+#include "fold.h"
+#include "lower.h"
+#include "opt.h"
+
+void PassManager_init(PassManager *self, Allocator *allocator) {
+    *self = (PassManager) {.allocator = allocator, .max_iterations = 4};
+    if (mtx_init(&self->lock, mtx_plain) != thrd_success) {
+        error("failed to initialise the pass manager lock\n");
+    }
+}
+
+void PassManager_free(PassManager *self) {
+    FREE(self->allocator, self->passes);
+    mtx_destroy(&self->lock);
+}
+
+void PassManager_add(PassManager *self, const char *name, IrPassFn run) {
+    GROW(self->allocator, self->passes, self->n_passes,
+         self->passes_capacity);
+    self->passes[self->n_passes++] = (IrPass) {.name = name, .run = run};
+}
+
+void PassManager_set_hook(PassManager *self, PassHook hook, void *data) {
+    self->hook = hook;
+    self->hook_data = data;
+}
+
+static f64 seconds_between(const struct timespec *start,
+                           const struct timespec *end) {
+    return (f64) (end->tv_sec - start->tv_sec)
+           + (f64) (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void PassManager_run(PassManager *self, IrFunction *function) {
+    for (uptr iteration = 0; iteration < self->max_iterations; iteration++) {
+        bool changed = false;
+        for (uptr i = 0; i < self->n_passes; i++) {
+            IrPass *pass = &self->passes[i];
+            struct timespec start, end;
+            timespec_get(&start, TIME_UTC);
+            bool pass_changed = pass->run(function);
+            timespec_get(&end, TIME_UTC);
+            f64 seconds = seconds_between(&start, &end);
+
+            mtx_lock(&self->lock);
+            pass->seconds += seconds;
+            pass->runs++;
+            pass->changes += pass_changed;
+            mtx_unlock(&self->lock);
+            if (self->hook) {
+                self->hook(self->hook_data, pass->name, function, seconds,
+                           pass_changed);
+            }
+            changed |= pass_changed;
+        }
+        if (!changed) {
+            break;
+        }
+    }
+}
+
+void PassManager_report(PassManager *self, FILE *out) {
+    mtx_lock(&self->lock);
+    fprintf(out, "%-12s %8s %8s %12s\n", "pass", "runs", "changed",
+            "time (ms)");
+    f64 total = 0;
+    for (uptr i = 0; i < self->n_passes; i++) {
+        const IrPass *pass = &self->passes[i];
+        fprintf(out, "%-12s %8lu %8lu %12.3f\n", pass->name, pass->runs,
+                pass->changes, pass->seconds * 1e3);
+        total += pass->seconds;
+    }
+    fprintf(out, "%-12s %8s %8s %12.3f\n", "total", "", "", total * 1e3);
+    mtx_unlock(&self->lock);
+}
+
+void opt_default_pipeline(PassManager *self) {
+    PassManager_add(self, "inline", opt_inline);
+    PassManager_add(self, "tailcall", opt_tail_calls);
+    PassManager_add(self, "sccp", opt_sccp);
+    PassManager_add(self, "copyprop", opt_copy_propagation);
+    PassManager_add(self, "gvn", opt_gvn);
+    PassManager_add(self, "bounds", opt_bounds);
+    PassManager_add(self, "escape", opt_escape);
+    PassManager_add(self, "concat", opt_concat);
+    PassManager_add(self, "lists", opt_lists);
+    PassManager_add(self, "simplifycfg", opt_simplify_cfg);
+    PassManager_add(self, "dce", opt_dce);
+}
+
+// Helpers
+
+/// The value that an instruction has been replaced by, if any.
+static IrInst *value_of(IrInst *inst) {
+    while (inst->forward) {
+        inst = inst->forward;
+    }
+    return inst;
+}
+
+static bool same_constant(const IrInst *a, const IrInst *b) {
+    if (a->type != b->type) {
+        return false;
+    }
+    switch (a->type->kind) {
+        case TReal:
+            return memcmp(&a->real_value, &b->real_value, sizeof(f64)) == 0;
+        case TString:
+            return a->string_length == b->string_length
+                   && (a->string_length == 0
+                       || memcmp(a->string_value, b->string_value,
+                                 a->string_length) == 0);
+        default:
+            return a->int_value == b->int_value;
+    }
+}
+
+/// The instructions that use each value, indexed by value number.
+typedef struct Uses {
+    /// The uses of value `id` are `users[start[id]]` up to
+    /// `users[start[id + 1]]`.
+    u32 *start;
+    IrInst **users;
+} Uses;
+
+static Uses find_uses(IrFunction *function) {
+    Allocator *a = function->allocator;
+    u32 n = function->next_value;
+    Uses uses = {ALLOC(a, (n + 2) * sizeof(u32)), NULL};
+    uptr total = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            for (u32 i = 0; i < inst->n_args; i++) {
+                uses.start[inst->args[i]->id + 2]++;
+                total++;
+            }
+        }
+    }
+    for (u32 id = 2; id < n + 2; id++) {
+        uses.start[id] += uses.start[id - 1];
+    }
+    // start[id + 1] is the cursor for value id while filling.
+    uses.users = ALLOC(a, (total ? total : 1) * sizeof(IrInst *));
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            for (u32 i = 0; i < inst->n_args; i++) {
+                uses.users[uses.start[inst->args[i]->id + 1]++] = inst;
+            }
+        }
+    }
+    return uses;
+}
+
+static void free_uses(IrFunction *function, Uses *uses) {
+    FREE(function->allocator, uses->start);
+    FREE(function->allocator, uses->users);
+}
+
+/// Which of a block's successors the edge from predecessor `k` is, since a
+/// block that branches to the same place twice is listed twice.
+static int edge_index(const IrBlock *block, u32 k) {
+    const IrBlock *pred = block->preds[k];
+    u32 occurrence = 0;
+    for (u32 j = 0; j < k; j++) {
+        occurrence += block->preds[j] == pred;
+    }
+    IrBlock **succs;
+    u32 n_succs = IrBlock_succs(pred, &succs);
+    for (u32 i = 0; i < n_succs; i++) {
+        if (succs[i] == block && occurrence-- == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/// Turn a branch or switch into a jump to one of its targets, dropping the
+/// edges to the others.
+/// \remark The targets must be distinct.
+static void branch_to(IrInst *branch, u32 taken) {
+    IrBlock *block = branch->block;
+    IrBlock *target = branch->targets[taken];
+    for (u32 i = 0; i < branch->n_targets; i++) {
+        if (i != taken) {
+            IrBlock_remove_pred(branch->targets[i], block);
+        }
+    }
+    branch->op = IR_JUMP;
+    branch->n_args = 0;
+    branch->n_cases = 0;
+    branch->targets[0] = target;
+    branch->n_targets = 1;
+}
+
+/// The target that a switch takes for a value.
+static u32 switch_target(const IrInst *inst, i64 value) {
+    for (uptr i = 0; i < inst->n_cases; i++) {
+        if (inst->cases[i].low <= value && value <= inst->cases[i].high) {
+            return inst->cases[i].target;
+        }
+    }
+    return 0;
+}
+
+// Sparse conditional constant propagation
+
+typedef enum Level {
+    /// Not known to be anything yet.
+    LEVEL_TOP,
+    LEVEL_CONSTANT,
+    /// Known to vary.
+    LEVEL_BOTTOM,
+} Level;
+
+typedef struct Sccp {
+    IrFunction *function;
+    Uses uses;
+    /// By value number.
+    u8 *levels;
+    IrInst **constants;
+    /// By block number: whether the block can run, and where its outgoing
+    /// edges start in `edges`, which holds whether each can be taken.
+    bool *reachable;
+    u32 *edge_base;
+    bool *edges;
+    IrInst **values;
+    uptr n_values, values_capacity;
+    IrBlock **blocks;
+    uptr n_blocks, blocks_capacity;
+    /// Errors found while folding are left for the program to raise.
+    Diagnostics scratch;
+} Sccp;
+
+static void set_level(Sccp *s, IrInst *inst, Level level, IrInst *constant) {
+    Level old = s->levels[inst->id];
+    if (old == LEVEL_CONSTANT && level == LEVEL_CONSTANT
+        && !same_constant(s->constants[inst->id], constant)) {
+        level = LEVEL_BOTTOM;
+    }
+    if (level <= old) {
+        return;
+    }
+    s->levels[inst->id] = level;
+    s->constants[inst->id] = constant;
+    GROW(s->function->allocator, s->values, s->n_values, s->values_capacity);
+    s->values[s->n_values++] = inst;
+}
+
+static void visit(Sccp *s, IrInst *inst);
+
+static void mark_edge(Sccp *s, IrBlock *block, u32 index) {
+    bool *edge = &s->edges[s->edge_base[block->id] + index];
+    if (*edge) {
+        return;
+    }
+    *edge = true;
+    IrBlock *target = IrBlock_terminator(block)->targets[index];
+    if (!s->reachable[target->id]) {
+        s->reachable[target->id] = true;
+        GROW(s->function->allocator, s->blocks, s->n_blocks,
+             s->blocks_capacity);
+        s->blocks[s->n_blocks++] = target;
+        return;
+    }
+    // The phis have a new argument to consider.
+    for (IrInst *phi = target->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+        visit(s, phi);
+    }
+}
+
+static bool edge_reachable(const Sccp *s, const IrBlock *block, u32 k) {
+    const IrBlock *pred = block->preds[k];
+    int index = edge_index(block, k);
+    return s->reachable[pred->id] && index >= 0
+           && s->edges[s->edge_base[pred->id] + (u32) index];
+}
+
+static bool to_literal(const IrInst *constant, Node *node) {
+    *node = (Node) {.type = constant->type, .token = constant->token};
+    switch (constant->type->kind) {
+        case TInt:
+        case TBig:
+        case TByte:
+            node->kind = NODE_INTEGRAL;
+            node->int_value = constant->int_value;
+            return true;
+        case TReal:
+            node->kind = NODE_REAL;
+            node->real_value = constant->real_value;
+            return true;
+        case TString:
+            node->kind = NODE_STRING;
+            node->string_value = constant->string_value
+                                 ? constant->string_value : "";
+            node->string_length = constant->string_length;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Evaluate an instruction whose arguments are all constants, using the
+/// same arithmetic as the constant folder.
+static IrInst *evaluate(Sccp *s, IrInst *inst) {
+    Node args[2], node = {.type = inst->type, .token = inst->token};
+    if (inst->n_args > 2) {
+        return NULL;
+    }
+    for (u32 i = 0; i < inst->n_args; i++) {
+        if (!to_literal(s->constants[inst->args[i]->id], &args[i])) {
+            return NULL;
+        }
+    }
+    node.left = &args[0];
+    node.right = inst->n_args > 1 ? &args[1] : NULL;
+    switch (inst->op) {
+        case IR_BINARY:
+        case IR_UNARY:
+            node.kind = inst->operator;
+            break;
+        case IR_CONVERT:
+            node.kind = NODE_CAST;
+            break;
+        case IR_INDEX:
+            node.kind = NODE_INDEX;
+            break;
+        default:
+            return NULL;
+    }
+    if (!fold_expr(s->function->allocator, &node, &s->scratch)) {
+        return NULL;
+    }
+
+    IrInst *constant = IrFunction_inst(s->function, IR_CONST, inst->type,
+                                       inst->token);
+    switch (node.kind) {
+        case NODE_INTEGRAL:
+            constant->int_value = node.int_value;
+            constant->real_value = (f64) node.int_value;
+            break;
+        case NODE_REAL:
+            constant->real_value = node.real_value;
+            constant->int_value = (i64) node.real_value;
+            break;
+        default:
+            constant->string_value = node.string_value;
+            constant->string_length = node.string_length;
+            break;
+    }
+    return constant;
+}
+
+static void visit(Sccp *s, IrInst *inst) {
+    switch (inst->op) {
+        case IR_CONST:
+            set_level(s, inst, LEVEL_CONSTANT, inst);
+            return;
+
+        case IR_COPY: {
+            IrInst *arg = inst->args[0];
+            set_level(s, inst, s->levels[arg->id], s->constants[arg->id]);
+            return;
+        }
+
+        case IR_PHI: {
+            Level level = LEVEL_TOP;
+            IrInst *constant = NULL;
+            for (u32 k = 0; k < inst->n_args && level != LEVEL_BOTTOM; k++) {
+                if (!edge_reachable(s, inst->block, k)) {
+                    continue;
+                }
+                IrInst *arg = inst->args[k];
+                switch (s->levels[arg->id]) {
+                    case LEVEL_TOP:
+                        break;
+                    case LEVEL_CONSTANT:
+                        if (level == LEVEL_TOP) {
+                            level = LEVEL_CONSTANT;
+                            constant = s->constants[arg->id];
+                        } else if (!same_constant(constant,
+                                                  s->constants[arg->id])) {
+                            level = LEVEL_BOTTOM;
+                        }
+                        break;
+                    default:
+                        level = LEVEL_BOTTOM;
+                        break;
+                }
+            }
+            set_level(s, inst, level, constant);
+            return;
+        }
+
+        case IR_JUMP:
+            mark_edge(s, inst->block, 0);
+            return;
+
+        case IR_BRANCH: {
+            IrInst *cond = inst->args[0];
+            switch (s->levels[cond->id]) {
+                case LEVEL_TOP:
+                    break;
+                case LEVEL_CONSTANT:
+                    mark_edge(s, inst->block,
+                              s->constants[cond->id]->int_value ? 0 : 1);
+                    break;
+                default:
+                    mark_edge(s, inst->block, 0);
+                    mark_edge(s, inst->block, 1);
+                    break;
+            }
+            return;
+        }
+
+        case IR_SWITCH: {
+            IrInst *value = inst->args[0];
+            switch (s->levels[value->id]) {
+                case LEVEL_TOP:
+                    break;
+                case LEVEL_CONSTANT:
+                    mark_edge(s, inst->block,
+                              switch_target(inst, s->constants[value->id]
+                                                  ->int_value));
+                    break;
+                default:
+                    for (u32 i = 0; i < inst->n_targets; i++) {
+                        mark_edge(s, inst->block, i);
+                    }
+                    break;
+            }
+            return;
+        }
+
+        case IR_BINARY:
+        case IR_UNARY:
+        case IR_CONVERT:
+        case IR_INDEX: {
+            if (inst->op == IR_INDEX && inst->args[0]->type->kind != TString) {
+                break;
+            }
+            for (u32 i = 0; i < inst->n_args; i++) {
+                Level level = s->levels[inst->args[i]->id];
+                if (level == LEVEL_BOTTOM) {
+                    set_level(s, inst, LEVEL_BOTTOM, NULL);
+                    return;
+                }
+                if (level == LEVEL_TOP) {
+                    return;
+                }
+            }
+            IrInst *constant = evaluate(s, inst);
+            set_level(s, inst, constant ? LEVEL_CONSTANT : LEVEL_BOTTOM,
+                      constant);
+            return;
+        }
+
+        default:
+            break;
+    }
+    if (inst->type != type_none) {
+        set_level(s, inst, LEVEL_BOTTOM, NULL);
+    }
+}
+
+bool opt_sccp(IrFunction *function) {
+    Allocator *a = function->allocator;
+    Sccp s = {
+        .function = function,
+        .uses = find_uses(function),
+        .levels = ALLOC(a, function->next_value + 1),
+        .constants = ALLOC(a, (function->next_value + 1) * sizeof(IrInst *)),
+        .reachable = ALLOC(a, function->next_block + 1),
+        .edge_base = ALLOC(a, (function->next_block + 1) * sizeof(u32)),
+    };
+    Diagnostics_init(&s.scratch, a);
+    u32 n_edges = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        IrInst *terminator = IrBlock_terminator(block);
+        s.edge_base[block->id] = n_edges;
+        n_edges += terminator ? terminator->n_targets : 0;
+    }
+    s.edges = ALLOC(a, n_edges ? n_edges : 1);
+
+    s.reachable[function->entry->id] = true;
+    GROW(a, s.blocks, s.n_blocks, s.blocks_capacity);
+    s.blocks[s.n_blocks++] = function->entry;
+    while (s.n_blocks > 0 || s.n_values > 0) {
+        if (s.n_blocks > 0) {
+            IrBlock *block = s.blocks[--s.n_blocks];
+            for (IrInst *inst = block->first; inst; inst = inst->next) {
+                visit(&s, inst);
+            }
+            continue;
+        }
+        IrInst *value = s.values[--s.n_values];
+        for (u32 i = s.uses.start[value->id];
+             i < s.uses.start[value->id + 1]; i++) {
+            IrInst *user = s.uses.users[i];
+            if (s.reachable[user->block->id]) {
+                visit(&s, user);
+            }
+        }
+    }
+
+    bool changed = false;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        if (!s.reachable[block->id]) {
+            continue;
+        }
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            if (inst->op == IR_CONST
+                || s.levels[inst->id] != LEVEL_CONSTANT
+                || IrInst_has_effects(inst)) {
+                continue;
+            }
+            // The constant found may be defined somewhere that does not
+            // dominate this instruction, so place a copy of it here.
+            IrInst *found = s.constants[inst->id];
+            IrInst *constant = IrFunction_inst(function, IR_CONST,
+                                               inst->type, inst->token);
+            constant->int_value = found->int_value;
+            constant->real_value = found->real_value;
+            constant->string_value = found->string_value;
+            constant->string_length = found->string_length;
+            if (inst->op == IR_PHI) {
+                IrBlock_prepend(block, constant);
+            } else {
+                IrBlock_insert_before(inst, constant);
+            }
+            inst->forward = constant;
+            changed = true;
+        }
+
+        IrInst *terminator = IrBlock_terminator(block);
+        if (terminator && terminator->op == IR_BRANCH
+            && terminator->targets[0] != terminator->targets[1]
+            && s.levels[terminator->args[0]->id] == LEVEL_CONSTANT) {
+            branch_to(terminator,
+                      s.constants[terminator->args[0]->id]->int_value ? 0 : 1);
+            changed = true;
+        } else if (terminator && terminator->op == IR_SWITCH
+                   && s.levels[terminator->args[0]->id] == LEVEL_CONSTANT) {
+            IrInst *value = s.constants[terminator->args[0]->id];
+            branch_to(terminator, switch_target(terminator, value->int_value));
+            changed = true;
+        }
+    }
+
+    IrFunction_apply_forwards(function);
+    IrFunction_remove_unreachable(function);
+    Diagnostics_free(&s.scratch);
+    free_uses(function, &s.uses);
+    FREE(a, s.levels);
+    FREE(a, s.constants);
+    FREE(a, s.reachable);
+    FREE(a, s.edge_base);
+    FREE(a, s.edges);
+    FREE(a, s.values);
+    FREE(a, s.blocks);
+    return changed;
+}
+
+// Copy propagation
+
+/// The value that an instruction always produces, if it is just another
+/// value under a different name.
+static IrInst *copy_of(IrInst *inst, bool *progress) {
+    switch (inst->op) {
+        case IR_COPY:
+            return value_of(inst->args[0]);
+
+        case IR_PHI: {
+            IrInst *value = NULL;
+            for (u32 k = 0; k < inst->n_args; k++) {
+                IrInst *arg = value_of(inst->args[k]);
+                if (arg == inst || arg == value) {
+                    continue;
+                }
+                if (value) {
+                    return NULL;
+                }
+                value = arg;
+            }
+            return value;
+        }
+
+        case IR_FIELD: {
+            IrInst *aggregate = value_of(inst->args[0]);
+            while (aggregate->op == IR_INSERT
+                   && aggregate->index != inst->index) {
+                // Other members of the aggregate were changed, not this one.
+                aggregate = value_of(aggregate->args[0]);
+                inst->args[0] = aggregate;
+                *progress = true;
+            }
+            if (aggregate->op == IR_INSERT) {
+                return value_of(aggregate->args[1]);
+            }
+            if (aggregate->op == IR_MAKE && inst->index < aggregate->n_args) {
+                return value_of(aggregate->args[inst->index]);
+            }
+            return NULL;
+        }
+
+        default:
+            return NULL;
+    }
+}
+
+bool opt_copy_propagation(IrFunction *function) {
+    bool changed = false, progress = true;
+    while (progress) {
+        progress = false;
+        for (IrBlock *block = function->entry; block; block = block->next) {
+            for (IrInst *inst = block->first; inst; inst = inst->next) {
+                if (inst->forward) {
+                    continue;
+                }
+                IrInst *value = copy_of(inst, &progress);
+                if (value && value != inst) {
+                    inst->forward = value;
+                    progress = changed = true;
+                }
+            }
+        }
+    }
+    IrFunction_apply_forwards(function);
+    return changed;
+}
+
+// Global value numbering
+
+typedef struct GvnEntry {
+    IrInst *inst;
+    u64 hash;
+    /// The entry that was first in the bucket before this one, plus one.
+    u32 next;
+} GvnEntry;
+
+typedef struct Gvn {
+    IrFunction *function;
+    /// The first entry of each bucket, plus one, so that zero is empty.
+    u32 *buckets;
+    uptr mask;
+    /// Entries are pushed as blocks are entered and popped as they are left,
+    /// so that only values from dominating blocks are visible.
+    GvnEntry *entries;
+    uptr n_entries, entries_capacity;
+    /// The dominator tree, by block number.
+    IrBlock **first_child, **next_sibling;
+    bool changed;
+} Gvn;
+
+static bool is_commutative(const IrInst *inst) {
+    if (inst->op != IR_BINARY) {
+        return false;
+    }
+    switch (inst->operator) {
+        case NODE_ADD:
+            // Concatenation is not commutative.
+            return inst->type->kind != TString;
+        case NODE_MUL:
+        case NODE_BIT_AND:
+        case NODE_BIT_OR:
+        case NODE_BIT_XOR:
+        case NODE_EQ:
+        case NODE_NEQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// The arguments of an instruction, in a canonical order.
+static void canonical_args(const IrInst *inst, IrInst **args) {
+    for (u32 i = 0; i < inst->n_args; i++) {
+        args[i] = inst->args[i];
+    }
+    if (is_commutative(inst) && args[0]->id > args[1]->id) {
+        IrInst *t = args[0];
+        args[0] = args[1];
+        args[1] = t;
+    }
+}
+
+static void hash_u64(u64 *hash, u64 value) {
+    *hash = (*hash ^ value) * 0x100000001B3ull;
+}
+
+static u64 value_hash(const IrInst *inst) {
+    u64 hash = 0xCBF29CE484222325ull;
+    hash_u64(&hash, inst->op);
+    hash_u64(&hash, inst->operator);
+    hash_u64(&hash, inst->index);
+    hash_u64(&hash, (u64) (uptr) inst->type);
+    if (inst->op == IR_CONST) {
+        if (inst->type->kind == TString) {
+            for (uptr i = 0; i < inst->string_length; i++) {
+                hash_u64(&hash, (u8) inst->string_value[i]);
+            }
+        } else if (inst->type->kind == TReal) {
+            u64 bits;
+            memcpy(&bits, &inst->real_value, sizeof bits);
+            hash_u64(&hash, bits);
+        } else {
+            hash_u64(&hash, (u64) inst->int_value);
+        }
+        return hash;
+    }
+    IrInst *args[inst->n_args ? inst->n_args : 1];
+    canonical_args(inst, args);
+    for (u32 i = 0; i < inst->n_args; i++) {
+        hash_u64(&hash, args[i]->id);
+    }
+    return hash;
+}
+
+static bool same_value(const IrInst *a, const IrInst *b) {
+    if (a->op != b->op || a->operator != b->operator || a->index != b->index
+        || a->type != b->type || a->n_args != b->n_args) {
+        return false;
+    }
+    if (a->op == IR_CONST) {
+        return same_constant(a, b);
+    }
+    IrInst *a_args[a->n_args ? a->n_args : 1];
+    IrInst *b_args[b->n_args ? b->n_args : 1];
+    canonical_args(a, a_args);
+    canonical_args(b, b_args);
+    return memcmp(a_args, b_args, a->n_args * sizeof(IrInst *)) == 0;
+}
+
+static void gvn_block(Gvn *g, IrBlock *block) {
+    uptr scope = g->n_entries;
+    for (IrInst *inst = block->first; inst; inst = inst->next) {
+        for (u32 i = 0; i < inst->n_args; i++) {
+            inst->args[i] = value_of(inst->args[i]);
+        }
+        if (inst->op != IR_CONST && !IrInst_is_pure(inst)) {
+            continue;
+        }
+
+        u64 hash = value_hash(inst);
+        u32 *bucket = &g->buckets[hash & g->mask];
+        IrInst *found = NULL;
+        for (u32 e = *bucket; e; e = g->entries[e - 1].next) {
+            const GvnEntry *entry = &g->entries[e - 1];
+            if (entry->hash == hash && same_value(entry->inst, inst)) {
+                found = entry->inst;
+                break;
+            }
+        }
+        if (found) {
+            inst->forward = found;
+            g->changed = true;
+            continue;
+        }
+        GROW(g->function->allocator, g->entries, g->n_entries,
+             g->entries_capacity);
+        g->entries[g->n_entries++] = (GvnEntry) {inst, hash, *bucket};
+        *bucket = (u32) g->n_entries;
+    }
+
+    for (IrBlock *child = g->first_child[block->id]; child;
+         child = g->next_sibling[child->id]) {
+        gvn_block(g, child);
+    }
+
+    while (g->n_entries > scope) {
+        const GvnEntry *entry = &g->entries[--g->n_entries];
+        g->buckets[entry->hash & g->mask] = entry->next;
+    }
+}
+
+bool opt_gvn(IrFunction *function) {
+    Allocator *a = function->allocator;
+    uptr count;
+    IrBlock **order = IrFunction_dominators(function, &count);
+
+    uptr n_buckets = 16;
+    while (n_buckets < 2 * (uptr) function->next_value) {
+        n_buckets *= 2;
+    }
+    Gvn g = {
+        .function = function,
+        .buckets = ALLOC(a, n_buckets * sizeof(u32)),
+        .mask = n_buckets - 1,
+        .first_child = ALLOC(a, (function->next_block + 1)
+                                * sizeof(IrBlock *)),
+        .next_sibling = ALLOC(a, (function->next_block + 1)
+                                 * sizeof(IrBlock *)),
+    };
+    // Link children in reverse, so that they are visited in reverse
+    // postorder.
+    for (uptr i = count; i-- > 1;) {
+        IrBlock *block = order[i];
+        g.next_sibling[block->id] = g.first_child[block->idom->id];
+        g.first_child[block->idom->id] = block;
+    }
+    gvn_block(&g, function->entry);
+    IrFunction_apply_forwards(function);
+
+    FREE(a, order);
+    FREE(a, g.buckets);
+    FREE(a, g.entries);
+    FREE(a, g.first_child);
+    FREE(a, g.next_sibling);
+    return g.changed;
+}
+
+// Bounds check elimination
+
+/// A fact about an index that a comparison can establish.
+typedef enum Fact {
+    /// The index is at least zero.
+    FACT_NON_NEGATIVE,
+    /// The index is less than the length of the array.
+    FACT_BELOW,
+    /// The index is at most the length of the array.
+    FACT_AT_MOST,
+} Fact;
+
+/// What is known about a phi as an index into `array`.
+typedef struct PhiRange {
+    IrInst *array;
+    /// 0 if unknown, 1 while it is being proven, 2 if the phi is always in
+    /// bounds, and 3 if it may not be.
+    u8 state;
+} PhiRange;
+
+typedef struct Bounds {
+    /// By value number.
+    PhiRange *phis;
+} Bounds;
+
+static bool phi_in_bounds(Bounds *b, IrInst *phi, IrInst *array);
+
+static bool is_int_constant(const IrInst *inst, i64 *value) {
+    if (inst->op != IR_CONST || inst->type->kind != TInt) {
+        return false;
+    }
+    *value = inst->int_value;
+    return true;
+}
+
+/// Whether `inst` is `len array`, or the length `array` was created with.
+static bool is_length(const IrInst *inst, const IrInst *array) {
+    if (array->op == IR_NEW_ARRAY && value_of(array->args[0]) == inst) {
+        return true;
+    }
+    return inst->op == IR_UNARY && inst->operator == NODE_LEN
+           && value_of(inst->args[0]) == array;
+}
+
+/// Whether `inst` is `value + delta` or `value - -delta`, for a constant
+/// `delta`.
+static bool is_offset(const IrInst *inst, const IrInst *value, i64 *delta) {
+    if (inst->op != IR_BINARY || inst->type->kind != TInt) {
+        return false;
+    }
+    IrInst *left = value_of(inst->args[0]), *right = value_of(inst->args[1]);
+    i64 c;
+    if (inst->operator == NODE_ADD) {
+        if (left == value && is_int_constant(right, &c)) {
+            *delta = c;
+            return true;
+        }
+        if (right == value && is_int_constant(left, &c)) {
+            *delta = c;
+            return true;
+        }
+    } else if (inst->operator == NODE_SUB && left == value
+               && is_int_constant(right, &c)) {
+        *delta = -c;
+        return true;
+    }
+    return false;
+}
+
+/// Whether a value is never negative, whatever the control flow.
+static bool is_non_negative(Bounds *b, IrInst *value) {
+    i64 c;
+    switch (value->op) {
+        case IR_CONST:
+            return is_int_constant(value, &c) && c >= 0;
+        case IR_UNARY:
+            return value->operator == NODE_LEN;
+        case IR_CONVERT:
+            return value_of(value->args[0])->type->kind == TByte;
+        case IR_BINARY:
+            return value->operator == NODE_BIT_AND
+                   && (is_non_negative(b, value_of(value->args[0]))
+                       || is_non_negative(b, value_of(value->args[1])));
+        case IR_PHI:
+            // A phi is non-negative if it is in bounds of an array whose
+            // length limits it.
+            for (u32 k = 0; k < value->block->n_preds; k++) {
+                IrInst *terminator = IrBlock_terminator(value->block->preds[k]);
+                if (terminator == NULL || terminator->op != IR_BRANCH) {
+                    continue;
+                }
+                IrInst *cond = value_of(terminator->args[0]);
+                if (cond->op != IR_BINARY) {
+                    continue;
+                }
+                for (u32 i = 0; i < 2; i++) {
+                    IrInst *length = value_of(cond->args[i]);
+                    if (length->op == IR_UNARY && length->operator == NODE_LEN
+                        && phi_in_bounds(b, value,
+                                         value_of(length->args[0]))) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+/// Whether a comparison, when it is `taken`, establishes a fact about
+/// `value`.
+static bool implies(Bounds *b, IrInst *cond, bool taken, IrInst *value,
+                    Fact fact, IrInst *array, IrBlock *at);
+
+/// Whether a fact about `value` holds on entry to a block, because every
+/// path to it passes along an edge where a comparison establishes it.
+static bool holds_at(Bounds *b, IrBlock *block, IrInst *value, Fact fact,
+                     IrInst *array);
+
+/// Whether a fact about `value` holds along the edge from `pred` to
+/// `target`.
+static bool holds_on_edge(Bounds *b, IrBlock *pred, IrBlock *target,
+                          IrInst *value, Fact fact, IrInst *array) {
+    IrInst *terminator = IrBlock_terminator(pred);
+    if (terminator && terminator->op == IR_BRANCH
+        && terminator->targets[0] != terminator->targets[1]
+        && implies(b, value_of(terminator->args[0]),
+                   terminator->targets[0] == target, value, fact, array,
+                   pred)) {
+        return true;
+    }
+    return holds_at(b, pred, value, fact, array);
+}
+
+static bool holds_at(Bounds *b, IrBlock *block, IrInst *value, Fact fact,
+                     IrInst *array) {
+    for (IrBlock *d = block; d; d = d->idom) {
+        if (d->n_preds != 1) {
+            continue;
+        }
+        IrInst *terminator = IrBlock_terminator(d->preds[0]);
+        if (terminator && terminator->op == IR_BRANCH
+            && terminator->targets[0] != terminator->targets[1]
+            && implies(b, value_of(terminator->args[0]),
+                       terminator->targets[0] == d, value, fact, array,
+                       d->preds[0])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static NodeKind swap_comparison(NodeKind kind) {
+    switch (kind) {
+        case NODE_LT: return NODE_GT;
+        case NODE_LTE: return NODE_GTE;
+        case NODE_GT: return NODE_LT;
+        case NODE_GTE: return NODE_LTE;
+        default: return kind;
+    }
+}
+
+static NodeKind negate_comparison(NodeKind kind) {
+    switch (kind) {
+        case NODE_LT: return NODE_GTE;
+        case NODE_LTE: return NODE_GT;
+        case NODE_GT: return NODE_LTE;
+        case NODE_GTE: return NODE_LT;
+        case NODE_EQ: return NODE_NEQ;
+        case NODE_NEQ: return NODE_EQ;
+        default: return kind;
+    }
+}
+
+static bool implies(Bounds *b, IrInst *cond, bool taken, IrInst *value,
+                    Fact fact, IrInst *array, IrBlock *at) {
+    if (cond->op != IR_BINARY || value_of(cond->args[0])->type->kind != TInt) {
+        return false;
+    }
+    // Put the comparison in the form `value kind other`.
+    NodeKind kind = cond->operator;
+    IrInst *other;
+    if (value_of(cond->args[0]) == value) {
+        other = value_of(cond->args[1]);
+    } else if (value_of(cond->args[1]) == value) {
+        other = value_of(cond->args[0]);
+        kind = swap_comparison(kind);
+    } else {
+        return false;
+    }
+    if (!taken) {
+        kind = negate_comparison(kind);
+    }
+
+    i64 c;
+    switch (fact) {
+        case FACT_NON_NEGATIVE:
+            if (!is_int_constant(other, &c)) {
+                return (kind == NODE_GTE || kind == NODE_GT)
+                       && is_non_negative(b, other);
+            }
+            return (kind == NODE_GTE && c >= 0) || (kind == NODE_GT && c >= -1)
+                   || (kind == NODE_EQ && c >= 0);
+        case FACT_BELOW:
+            // `value < other <= len array`.
+            return kind == NODE_LT
+                   && (is_length(other, array)
+                       || holds_at(b, at, other, FACT_AT_MOST, array));
+        case FACT_AT_MOST:
+            return (kind == NODE_LT || kind == NODE_LTE)
+                   && is_length(other, array);
+    }
+    return false;
+}
+
+/// Whether an argument of a phi is in bounds along the edge from `pred`,
+/// assuming that the phi itself is.
+static bool step_in_bounds(Bounds *b, IrInst *phi, IrInst *arg, IrBlock *pred,
+                           IrInst *array) {
+    IrBlock *block = phi->block;
+    i64 delta;
+    bool step = is_offset(arg, phi, &delta);
+    // Stepping up by one from within bounds cannot overflow, and stepping
+    // down cannot pass the length.
+    bool non_negative = (step && (delta == 0 || delta == 1))
+                        || is_non_negative(b, arg)
+                        || holds_on_edge(b, pred, block, arg,
+                                         FACT_NON_NEGATIVE, array);
+    bool below = (step && delta <= 0 && delta > INT32_MIN)
+                 || holds_on_edge(b, pred, block, arg, FACT_BELOW, array);
+    if (!below && arg->op == IR_BINARY && arg->operator == NODE_SUB
+        && is_length(value_of(arg->args[0]), array)) {
+        // `len array - c` for a positive constant `c`.
+        i64 c;
+        below = is_int_constant(value_of(arg->args[1]), &c) && c > 0
+                && c <= INT32_MAX;
+    }
+    return non_negative && below;
+}
+
+/// Whether a phi is always a valid index into `array`, by induction: every
+/// value it takes is in bounds, given that its earlier values were.
+static bool phi_in_bounds(Bounds *b, IrInst *phi, IrInst *array) {
+    PhiRange *range = &b->phis[phi->id];
+    if (range->array == array && range->state != 0) {
+        return range->state == 2;
+    }
+    if (range->state == 1) {
+        // Another array's proof is in progress.
+        return false;
+    }
+    range->array = array;
+    range->state = 1;
+    bool in_bounds = true;
+    for (u32 k = 0; k < phi->n_args && in_bounds; k++) {
+        in_bounds = step_in_bounds(b, phi, value_of(phi->args[k]),
+                                   phi->block->preds[k], array);
+    }
+    range->state = in_bounds ? 2 : 3;
+    return in_bounds;
+}
+
+/// Whether an index into an array or string is in bounds where `at` is.
+static bool index_in_bounds(Bounds *b, IrInst *at, IrInst *array,
+                            IrInst *index) {
+    if (index->op == IR_PHI && phi_in_bounds(b, index, array)) {
+        return true;
+    }
+    i64 c, length;
+    if (array->op == IR_NEW_ARRAY && is_int_constant(index, &c)
+        && is_int_constant(value_of(array->args[0]), &length)) {
+        return c >= 0 && c < length;
+    }
+    IrBlock *block = at->block;
+    return (is_non_negative(b, index)
+            || holds_at(b, block, index, FACT_NON_NEGATIVE, array))
+           && holds_at(b, block, index, FACT_BELOW, array);
+}
+
+bool opt_bounds(IrFunction *function) {
+    Allocator *a = function->allocator;
+    uptr count;
+    IrBlock **order = IrFunction_dominators(function, &count);
+    Bounds b = {ALLOC(a, (function->next_value + 1) * sizeof(PhiRange))};
+
+    bool changed = false;
+    for (uptr i = 0; i < count; i++) {
+        for (IrInst *inst = order[i]->first; inst; inst = inst->next) {
+            if ((inst->op != IR_INDEX && inst->op != IR_SET_INDEX
+                 && inst->op != IR_SET_CHAR)
+                || inst->in_bounds) {
+                continue;
+            }
+            if (index_in_bounds(&b, inst, value_of(inst->args[0]),
+                                value_of(inst->args[1]))) {
+                inst->in_bounds = true;
+                changed = true;
+            }
+        }
+    }
+
+    FREE(a, order);
+    FREE(a, b.phis);
+    return changed;
+}
+
+// Escape analysis
+
+/// Whether every use of a reference only reads or writes a member through
+/// it, so that it cannot outlive the function or be seen by anyone else.
+static bool never_escapes(const Uses *uses, const IrInst *ref) {
+    for (u32 i = uses->start[ref->id]; i < uses->start[ref->id + 1]; i++) {
+        const IrInst *user = uses->users[i];
+        switch (user->op) {
+            case IR_LOAD_FIELD:
+                break;
+            case IR_STORE_FIELD:
+                // Storing the reference itself publishes it.
+                if (user->args[1] == ref) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+bool opt_escape(IrFunction *function) {
+    Uses uses = find_uses(function);
+    bool changed = false;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            if (inst->op != IR_NEW) {
+                continue;
+            }
+            bool in_frame = never_escapes(&uses, inst);
+            changed |= in_frame != inst->in_frame;
+            inst->in_frame = in_frame;
+        }
+    }
+    free_uses(function, &uses);
+    return changed;
+}
+
+// String concatenation
+
+/// The strings a chain of concatenations joins, with adjacent constants
+/// merged.
+typedef struct Pieces {
+    IrFunction *function;
+    const Uses *uses;
+    IrInst **items;
+    u32 count;
+    uptr capacity;
+} Pieces;
+
+static bool is_concat(const IrInst *inst) {
+    return inst->op == IR_CONCAT
+           || (inst->op == IR_BINARY && inst->operator == NODE_ADD
+               && inst->type->kind == TString);
+}
+
+/// Whether a concatenation is only used by `user`, in the same block, so
+/// that `user` can do its work instead. Values from other blocks are left
+/// alone, so that a concatenation is never moved into a loop.
+static bool only_feeds(const Uses *uses, const IrInst *inst,
+                       const IrInst *user) {
+    return is_concat(inst) && inst->block == user->block
+           && uses->start[inst->id + 1] - uses->start[inst->id] == 1;
+}
+
+static void add_piece(Pieces *p, IrInst *piece) {
+    IrInst *last = p->count ? p->items[p->count - 1] : NULL;
+    if (piece->op == IR_CONST && piece->string_length == 0) {
+        return;
+    }
+    if (piece->op == IR_CONST && last && last->op == IR_CONST) {
+        // A merged constant has no block until it is placed.
+        IrInst *merged = IrFunction_inst(p->function, IR_CONST, last->type,
+                                         last->token);
+        uptr length = last->string_length + piece->string_length;
+        char *value = ALLOC(p->function->allocator, length + 1);
+        memcpy(value, last->string_value, last->string_length);
+        memcpy(value + last->string_length, piece->string_value,
+               piece->string_length);
+        value[length] = '\0';
+        merged->string_value = value;
+        merged->string_length = length;
+        p->items[p->count - 1] = merged;
+        return;
+    }
+    GROW(p->function->allocator, p->items, p->count, p->capacity);
+    p->items[p->count++] = piece;
+}
+
+static void collect_pieces(Pieces *p, IrInst *inst) {
+    for (u32 i = 0; i < inst->n_args; i++) {
+        IrInst *arg = inst->args[i];
+        if (only_feeds(p->uses, arg, inst)) {
+            collect_pieces(p, arg);
+        } else {
+            add_piece(p, arg);
+        }
+    }
+}
+
+/// Rewrite a chain of concatenations that ends at `inst` as one.
+/// \return Whether anything changed.
+static bool fuse_concat(IrFunction *function, const Uses *uses, IrInst *inst) {
+    Pieces p = {.function = function, .uses = uses};
+    collect_pieces(&p, inst);
+    if (p.count == 0) {
+        // Every string was empty.
+        IrInst *empty = IrFunction_inst(function, IR_CONST, inst->type,
+                                        inst->token);
+        empty->string_value = "";
+        GROW(function->allocator, p.items, p.count, p.capacity);
+        p.items[p.count++] = empty;
+    }
+    if (p.count == inst->n_args
+        && memcmp(p.items, inst->args, p.count * sizeof(IrInst *)) == 0) {
+        FREE(function->allocator, p.items);
+        return false;
+    }
+    for (u32 i = 0; i < p.count; i++) {
+        if (p.items[i]->block == NULL) {
+            IrBlock_insert_before(inst, p.items[i]);
+        }
+    }
+    if (p.count == 1) {
+        inst->forward = p.items[0];
+    } else {
+        inst->op = p.count == 2 ? IR_BINARY : IR_CONCAT;
+        inst->operator = NODE_ADD;
+        inst->n_args = 0;
+        for (u32 i = 0; i < p.count; i++) {
+            IrInst_add_arg(inst, function, p.items[i]);
+        }
+    }
+    FREE(function->allocator, p.items);
+    return true;
+}
+
+bool opt_concat(IrFunction *function) {
+    Uses uses = find_uses(function);
+    bool changed = false;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            if (!is_concat(inst)) {
+                continue;
+            }
+            // The last concatenation of a chain does the work of the rest.
+            u32 first_use = uses.start[inst->id];
+            if (uses.start[inst->id + 1] - first_use == 1
+                && is_concat(uses.users[first_use])
+                && only_feeds(&uses, inst, uses.users[first_use])) {
+                continue;
+            }
+            changed |= fuse_concat(function, &uses, inst);
+        }
+    }
+    free_uses(function, &uses);
+    IrFunction_apply_forwards(function);
+    return changed;
+}
+
+// List operations
+
+static bool is_nil(const IrInst *inst) {
+    return inst->op == IR_CONST && inst->type->is_ptr
+           && inst->type->kind != TString;
+}
+
+/// Whether a branch condition is `list != nil`, or `list == nil` when it is
+/// not `taken`.
+static bool tests_non_empty(const IrInst *cond, bool taken,
+                            const IrInst *list) {
+    if (cond->op != IR_BINARY
+        || (cond->operator != NODE_EQ && cond->operator != NODE_NEQ)) {
+        return false;
+    }
+    IrInst *left = value_of(cond->args[0]), *right = value_of(cond->args[1]);
+    if (!(left == list && is_nil(right)) && !(right == list && is_nil(left))) {
+        return false;
+    }
+    return (cond->operator == NODE_NEQ) == taken;
+}
+
+static bool non_empty_at(IrBlock *block, const IrInst *list, bool phis);
+
+/// Whether a list is known not to be empty along the edge from `pred` to
+/// `target`.
+static bool non_empty_on_edge(IrBlock *pred, IrBlock *target,
+                              const IrInst *list) {
+    IrInst *terminator = IrBlock_terminator(pred);
+    if (terminator && terminator->op == IR_BRANCH
+        && terminator->targets[0] != terminator->targets[1]
+        && tests_non_empty(value_of(terminator->args[0]),
+                           terminator->targets[0] == target, list)) {
+        return true;
+    }
+    return non_empty_at(pred, list, false);
+}
+
+/// Whether a list is known not to be empty on entry to `block`: it was just
+/// built with `::`, or every path to the block tests it against `nil`. A
+/// loop such as `for (; l != nil; l = tl l)` tests each value of the phi
+/// for `l` on the edge it comes in along, unless `phis` is false.
+static bool non_empty_at(IrBlock *block, const IrInst *list, bool phis) {
+    if (list->op == IR_CONS) {
+        return true;
+    }
+    if (phis && list->op == IR_PHI) {
+        bool all = true;
+        for (u32 k = 0; k < list->n_args && all; k++) {
+            all = non_empty_on_edge(list->block->preds[k], list->block,
+                                    value_of(list->args[k]));
+        }
+        if (all) {
+            return true;
+        }
+    }
+    for (IrBlock *d = block; d; d = d->idom) {
+        if (d->n_preds != 1) {
+            continue;
+        }
+        IrInst *terminator = IrBlock_terminator(d->preds[0]);
+        if (terminator && terminator->op == IR_BRANCH
+            && terminator->targets[0] != terminator->targets[1]
+            && tests_non_empty(value_of(terminator->args[0]),
+                               terminator->targets[0] == d, list)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool opt_lists(IrFunction *function) {
+    Allocator *a = function->allocator;
+    uptr count;
+    IrBlock **order = IrFunction_dominators(function, &count);
+
+    bool changed = false;
+    for (uptr i = 0; i < count; i++) {
+        for (IrInst *inst = order[i]->first; inst; inst = inst->next) {
+            switch (inst->op) {
+                case IR_HEAD:
+                case IR_TAIL: {
+                    IrInst *list = value_of(inst->args[0]);
+                    if (list->op == IR_CONS) {
+                        // `hd (x :: l)` is `x` and `tl (x :: l)` is `l`.
+                        inst->forward = value_of(
+                            list->args[inst->op == IR_HEAD ? 0 : 1]);
+                        changed = true;
+                    } else if (!inst->in_bounds
+                               && non_empty_at(inst->block, list, true)) {
+                        inst->in_bounds = true;
+                        changed = true;
+                    }
+                    break;
+                }
+                case IR_BINARY: {
+                    if (inst->operator != NODE_EQ
+                        && inst->operator != NODE_NEQ) {
+                        break;
+                    }
+                    IrInst *left = value_of(inst->args[0]);
+                    IrInst *right = value_of(inst->args[1]);
+                    if ((left->op == IR_CONS && is_nil(right))
+                        || (right->op == IR_CONS && is_nil(left))) {
+                        // A list built with `::` is never `nil`.
+                        IrInst *constant = IrFunction_inst(
+                            function, IR_CONST, inst->type, inst->token);
+                        constant->int_value = inst->operator == NODE_NEQ;
+                        constant->real_value = (f64) constant->int_value;
+                        IrBlock_insert_before(inst, constant);
+                        inst->forward = constant;
+                        changed = true;
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    FREE(a, order);
+    IrFunction_apply_forwards(function);
+    return changed;
+}
+
+// Tail calls
+
+/// Whether the value of a call is returned as it is, either directly or
+/// through a block that only returns a phi of it, as inlining leaves.
+static bool in_tail_position(const IrInst *call) {
+    const IrInst *next = call->next;
+    if (next->op == IR_RETURN) {
+        return next->n_args == 0 || value_of(next->args[0]) == call;
+    }
+    if (next->op != IR_JUMP) {
+        return false;
+    }
+    const IrBlock *target = next->targets[0];
+    const IrInst *first = target->first;
+    if (first->op == IR_RETURN) {
+        return first->n_args == 0;
+    }
+    if (first->op != IR_PHI || first->next->op != IR_RETURN
+        || first->next->n_args == 0
+        || value_of(first->next->args[0]) != first) {
+        return false;
+    }
+    for (u32 k = 0; k < target->n_preds; k++) {
+        if (target->preds[k] == call->block) {
+            return value_of(first->args[k]) == call;
+        }
+    }
+    return false;
+}
+
+/// Replace a call in tail position with a jump to `loop`, passing the
+/// arguments for `params` to their `phis`.
+static void loop_back(IrInst *call, IrBlock *loop, IrInst **params,
+                      IrInst **phis, uptr n_params) {
+    IrFunction *function = call->block->function;
+    IrBlock *block = call->block;
+    IrInst *next = call->next;
+    if (next->op == IR_JUMP) {
+        IrBlock *target = next->targets[0];
+        for (u32 k = 0; k < target->n_preds; k++) {
+            if (target->preds[k] != block) {
+                continue;
+            }
+            for (IrInst *phi = target->first; phi && phi->op == IR_PHI;
+                 phi = phi->next) {
+                IrInst_remove_arg(phi, k);
+            }
+            break;
+        }
+        IrBlock_remove_pred(target, block);
+    }
+    IrBlock_remove(next);
+    IrBlock_remove(call);
+    IrBlock_jump(block, loop);
+    for (uptr i = 0; i < n_params; i++) {
+        IrInst_add_arg(phis[i], function,
+                       value_of(call->args[params[i]->index]));
+    }
+}
+
+bool opt_tail_calls(IrFunction *function) {
+    Allocator *a = function->allocator;
+    IrBlock *entry = function->entry;
+    if (function->decl == NULL) {
+        return false;
+    }
+
+    // Find the calls first, since making the loop moves instructions.
+    IrInst **calls = NULL;
+    uptr n_calls = 0, calls_capacity = 0;
+    for (IrBlock *block = entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            if (inst->op == IR_CALL && inst->decl == function->decl
+                && in_tail_position(inst)) {
+                GROW(a, calls, n_calls, calls_capacity);
+                calls[n_calls++] = inst;
+            }
+        }
+    }
+    uptr n_params = 0;
+    for (IrInst *inst = entry->first; inst; inst = inst->next) {
+        n_params += inst->op == IR_PARAM;
+    }
+    if (n_calls == 0 || n_params == 0) {
+        FREE(a, calls);
+        return false;
+    }
+
+    // Move the parameters to the front of the entry block and make the rest
+    // of the function a loop, with a phi for each parameter.
+    IrInst **params = ALLOC(a, n_params * sizeof(IrInst *));
+    IrInst **phis = ALLOC(a, n_params * sizeof(IrInst *));
+    uptr n = 0;
+    for (IrInst *inst = entry->first, *next; inst; inst = next) {
+        next = inst->next;
+        if (inst->op == IR_PARAM) {
+            IrBlock_remove(inst);
+            params[n++] = inst;
+        }
+    }
+    for (uptr i = n_params; i-- > 0;) {
+        IrBlock_prepend(entry, params[i]);
+    }
+    IrBlock *loop = IrBlock_split(params[n_params - 1]);
+    IrBlock_jump(entry, loop);
+    for (uptr i = 0; i < n_params; i++) {
+        phis[i] = IrFunction_inst(function, IR_PHI, params[i]->type,
+                                  params[i]->token);
+    }
+    for (IrBlock *block = entry->next; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            for (u32 j = 0; j < inst->n_args; j++) {
+                for (uptr i = 0; i < n_params; i++) {
+                    if (inst->args[j] == params[i]) {
+                        inst->args[j] = phis[i];
+                    }
+                }
+            }
+        }
+    }
+    for (uptr i = n_params; i-- > 0;) {
+        IrInst_add_arg(phis[i], function, params[i]);
+        IrBlock_prepend(loop, phis[i]);
+    }
+    for (uptr i = 0; i < n_calls; i++) {
+        loop_back(calls[i], loop, params, phis, n_params);
+    }
+
+    FREE(a, calls);
+    FREE(a, params);
+    FREE(a, phis);
+    return true;
+}
+
+// CFG simplification
+
+static bool is_pred(const IrBlock *block, const IrBlock *pred) {
+    for (u32 k = 0; k < block->n_preds; k++) {
+        if (block->preds[k] == pred) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Whether a branch with both targets the same block passes the same
+/// arguments to its phis along both edges.
+static bool same_phi_args(const IrBlock *target, const IrBlock *block) {
+    u32 first = UINT32_MAX, second = UINT32_MAX;
+    for (u32 k = 0; k < target->n_preds; k++) {
+        if (target->preds[k] != block) {
+            continue;
+        }
+        if (first == UINT32_MAX) {
+            first = k;
+        } else {
+            second = k;
+        }
+    }
+    if (second == UINT32_MAX) {
+        return false;
+    }
+    for (IrInst *phi = target->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+        if (value_of(phi->args[first]) != value_of(phi->args[second])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Send the edges into a block that only jumps straight to its target.
+static bool thread_jump(IrFunction *function, IrInst *terminator, u32 i) {
+    IrBlock *block = terminator->block, *through = terminator->targets[i];
+    if (through == function->entry || through->first != through->last
+        || through->first == NULL || through->first->op != IR_JUMP) {
+        return false;
+    }
+    IrBlock *target = through->first->targets[0];
+    bool has_phis = target->first && target->first->op == IR_PHI;
+    // The targets of a switch must stay distinct.
+    bool duplicate = is_pred(target, block)
+                     && (has_phis || terminator->op == IR_SWITCH);
+    if (target == through || duplicate
+        || (has_phis && through->n_preds != 1)) {
+        return false;
+    }
+
+    terminator->targets[i] = target;
+    if (has_phis) {
+        // The edge takes over from the block it skips, with the same
+        // arguments.
+        for (u32 k = 0; k < target->n_preds; k++) {
+            if (target->preds[k] == through) {
+                target->preds[k] = block;
+                break;
+            }
+        }
+        through->n_preds = 0;
+    } else {
+        IrBlock_remove_pred(through, block);
+        IrBlock_add_pred(target, block);
+    }
+    return true;
+}
+
+/// Append a block to its only predecessor, which jumps to it.
+static void merge_blocks(IrBlock *block, IrBlock *next) {
+    IrBlock_remove(block->last);
+    for (IrInst *inst = next->first, *following; inst; inst = following) {
+        following = inst->next;
+        IrBlock_remove(inst);
+        if (inst->op == IR_PHI) {
+            inst->forward = inst->args[0];
+            continue;
+        }
+        IrBlock_append(block, inst);
+    }
+    IrBlock **succs;
+    u32 n_succs = IrBlock_succs(block, &succs);
+    for (u32 i = 0; i < n_succs; i++) {
+        for (u32 k = 0; k < succs[i]->n_preds; k++) {
+            if (succs[i]->preds[k] == next) {
+                succs[i]->preds[k] = block;
+            }
+        }
+    }
+    next->n_preds = 0;
+}
+
+bool opt_simplify_cfg(IrFunction *function) {
+    bool changed = false, progress = true;
+    while (progress) {
+        progress = false;
+        for (IrBlock *block = function->entry; block; block = block->next) {
+            IrInst *terminator = IrBlock_terminator(block);
+            // Blocks left without predecessors are removed at the end of
+            // each round.
+            if (terminator == NULL
+                || (block->n_preds == 0 && block != function->entry)) {
+                continue;
+            }
+
+            if (terminator->op == IR_BRANCH) {
+                IrInst *cond = value_of(terminator->args[0]);
+                bool same = terminator->targets[0] == terminator->targets[1];
+                if (same && same_phi_args(terminator->targets[0], block)) {
+                    IrBlock_remove_pred(terminator->targets[0], block);
+                    terminator->op = IR_JUMP;
+                    terminator->n_args = 0;
+                    progress = true;
+                } else if (!same && cond->op == IR_CONST) {
+                    branch_to(terminator, cond->int_value ? 0 : 1);
+                    progress = true;
+                }
+            } else if (terminator->op == IR_SWITCH) {
+                IrInst *value = value_of(terminator->args[0]);
+                if (value->op == IR_CONST) {
+                    branch_to(terminator,
+                              switch_target(terminator, value->int_value));
+                    progress = true;
+                }
+            }
+
+            for (u32 i = 0; i < terminator->n_targets; i++) {
+                progress |= thread_jump(function, terminator, i);
+            }
+
+            if (terminator->op == IR_JUMP) {
+                IrBlock *next = terminator->targets[0];
+                if (next != block && next != function->entry
+                    && next->n_preds == 1) {
+                    merge_blocks(block, next);
+                    progress = true;
+                }
+            }
+        }
+        if (progress) {
+            changed = true;
+            IrFunction_remove_unreachable(function);
+        }
+    }
+    IrFunction_apply_forwards(function);
+    return changed;
+}
+
+// Inlining
+
+/// Callees whose cost is at most this are always inlined.
+#define INLINE_ALWAYS 12
+/// Callees whose cost is more than this are never inlined.
+#define INLINE_MAX 60
+/// The least that inlining may grow a function by, however small it was.
+#define INLINE_MIN_GROWTH 100
+
+/// A call that could be inlined.
+typedef struct CallSite {
+    IrInst *call;
+    /// The lowered and cleaned up callee, shared by calls to the same
+    /// function.
+    IrFunction *callee;
+    uptr cost;
+    /// The estimated number of times the call runs for each time the caller
+    /// does.
+    uptr frequency;
+} CallSite;
+
+/// The number of instructions that a function will generate code for once
+/// inlined: parameters, constants, phis, jumps and returns mostly vanish.
+static uptr inline_cost(const IrFunction *function) {
+    uptr cost = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            switch (inst->op) {
+                case IR_PARAM:
+                case IR_CONST:
+                case IR_PHI:
+                case IR_COPY:
+                case IR_JUMP:
+                case IR_RETURN:
+                    break;
+                default:
+                    cost++;
+                    break;
+            }
+        }
+    }
+    return cost;
+}
+
+/// Lower a function to inline its body, and clean it up so that its cost is
+/// known.
+static IrFunction *lower_callee(IrFunction *caller, Decl *decl) {
+    Node *node = decl->value;
+    if (node == NULL || node->kind != NODE_FUNCTION || node->body == NULL) {
+        return NULL;
+    }
+    // Errors are reported when the callee itself is generated.
+    Diagnostics scratch;
+    Diagnostics_init(&scratch, caller->parent);
+    IrFunction *callee = lower_function(caller->parent, node, &scratch);
+    bool failed = scratch.errors > 0;
+    Diagnostics_free(&scratch);
+    if (failed || callee->entry->n_preds > 0) {
+        IrFunction_free(callee);
+        return NULL;
+    }
+    opt_tail_calls(callee);
+    for (int i = 0; i < 4; i++) {
+        bool changed = opt_sccp(callee);
+        changed |= opt_copy_propagation(callee);
+        changed |= opt_simplify_cfg(callee);
+        changed |= opt_dce(callee);
+        if (!changed) {
+            break;
+        }
+    }
+    return callee;
+}
+
+static IrInst *clone_of(IrInst **values, IrInst *call, IrInst *inst) {
+    return inst->op == IR_PARAM ? call->args[inst->index] : values[inst->id];
+}
+
+/// Replace a call with a copy of the callee's body.
+static void inline_call(IrFunction *function, IrInst *call,
+                        IrFunction *callee) {
+    Allocator *a = function->allocator;
+    IrBlock *block = call->block;
+    IrBlock *after = IrBlock_split(call);
+    IrBlock **blocks = ALLOC(a, (callee->next_block + 1) * sizeof(IrBlock *));
+    IrInst **values = ALLOC(a, (callee->next_value + 1) * sizeof(IrInst *));
+
+    for (IrBlock *b = callee->entry; b; b = b->next) {
+        blocks[b->id] = IrFunction_block(function);
+        blocks[b->id]->sealed = true;
+    }
+    // Create every instruction first, since phis refer to later values.
+    for (IrBlock *b = callee->entry; b; b = b->next) {
+        for (IrInst *inst = b->first; inst; inst = inst->next) {
+            if (inst->op == IR_PARAM || inst->op == IR_RETURN) {
+                continue;
+            }
+            IrInst *copy = IrFunction_inst(function, inst->op, inst->type,
+                                           inst->token);
+            copy->operator = inst->operator;
+            copy->index = inst->index;
+            copy->in_bounds = inst->in_bounds;
+            copy->decl = inst->decl;
+            copy->int_value = inst->int_value;
+            copy->real_value = inst->real_value;
+            copy->string_value = inst->string_value;
+            copy->string_length = inst->string_length;
+            values[inst->id] = copy;
+        }
+    }
+
+    IrInst *phi = NULL;
+    if (call->type != type_none) {
+        phi = IrFunction_inst(function, IR_PHI, call->type, call->token);
+    }
+    for (IrBlock *b = callee->entry; b; b = b->next) {
+        IrBlock *copy = blocks[b->id];
+        for (u32 k = 0; k < b->n_preds; k++) {
+            IrBlock_add_pred(copy, blocks[b->preds[k]->id]);
+        }
+        for (IrInst *inst = b->first; inst; inst = inst->next) {
+            if (inst->op == IR_PARAM) {
+                continue;
+            }
+            if (inst->op == IR_RETURN) {
+                // Jump to the rest of the caller, passing the result.
+                if (phi) {
+                    IrInst *result;
+                    if (inst->n_args > 0) {
+                        result = clone_of(values, call, inst->args[0]);
+                    } else {
+                        result = IrFunction_inst(function, IR_CONST,
+                                                 call->type, NULL);
+                        IrBlock_append(copy, result);
+                    }
+                    IrInst_add_arg(phi, function, result);
+                }
+                IrBlock_jump(copy, after);
+                continue;
+            }
+            IrInst *clone = values[inst->id];
+            for (u32 i = 0; i < inst->n_args; i++) {
+                IrInst_add_arg(clone, function,
+                               clone_of(values, call, inst->args[i]));
+            }
+            for (u32 i = 0; i < inst->n_targets; i++) {
+                IrInst_add_target(clone, function,
+                                  blocks[inst->targets[i]->id]);
+            }
+            for (uptr i = 0; i < inst->n_cases; i++) {
+                GROW(a, clone->cases, clone->n_cases, clone->cases_capacity);
+                clone->cases[clone->n_cases++] = inst->cases[i];
+            }
+            IrBlock_append(copy, clone);
+        }
+    }
+
+    IrBlock_remove(call);
+    IrBlock_jump(block, blocks[callee->entry->id]);
+    if (phi) {
+        if (after->n_preds == 0) {
+            // The callee never returns, so the rest of the caller is dead.
+            phi->op = IR_CONST;
+        }
+        IrBlock_prepend(after, phi);
+        call->forward = phi;
+    }
+    FREE(a, blocks);
+    FREE(a, values);
+}
+
+static int compare_call_sites(const void *a, const void *b) {
+    const CallSite *x = a, *y = b;
+    if (x->frequency != y->frequency) {
+        return (x->frequency < y->frequency) - (x->frequency > y->frequency);
+    }
+    return (x->cost > y->cost) - (x->cost < y->cost);
+}
+
+bool opt_inline(IrFunction *function) {
+    if (function->node == NULL) {
+        return false;
+    }
+    Allocator *a = function->allocator;
+    uptr size = IrFunction_size(function);
+    if (function->original_size == 0) {
+        function->original_size = size;
+    }
+    uptr limit = function->original_size
+                 + (function->original_size > INLINE_MIN_GROWTH
+                        ? function->original_size : INLINE_MIN_GROWTH);
+    uptr count;
+    FREE(a, IrFunction_dominators(function, &count));
+
+    CallSite *sites = NULL;
+    uptr n_sites = 0, capacity = 0;
+    Decl **decls = NULL;
+    IrFunction **callees = NULL;
+    uptr n_callees = 0, callees_capacity = 0, decls_capacity = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            if (inst->op != IR_CALL || inst->decl == function->decl) {
+                continue;
+            }
+            uptr i = 0;
+            while (i < n_callees && decls[i] != inst->decl) {
+                i++;
+            }
+            if (i == n_callees) {
+                GROW(a, decls, n_callees, decls_capacity);
+                GROW(a, callees, n_callees, callees_capacity);
+                decls[i] = inst->decl;
+                callees[i] = lower_callee(function, inst->decl);
+                n_callees++;
+            }
+            IrFunction *callee = callees[i];
+            Type *fn = inst->decl->type;
+            if (callee == NULL || fn == NULL || fn->kind != TFn
+                || fn->n_params != inst->n_args) {
+                continue;
+            }
+
+            // The call sequence saves a `frame`, a move per argument, the
+            // `call` and the `ret`, and constant arguments fold.
+            uptr cost = inline_cost(callee), benefit = 3;
+            for (u32 k = 0; k < inst->n_args; k++) {
+                benefit += inst->args[k]->op == IR_CONST ? 3 : 1;
+            }
+            uptr depth = block->loop_depth < 3 ? block->loop_depth : 3;
+            uptr frequency = (uptr) 1 << (3 * depth);
+            if (cost <= INLINE_ALWAYS
+                || (cost <= INLINE_MAX && cost <= benefit * frequency)) {
+                GROW(a, sites, n_sites, capacity);
+                sites[n_sites++] = (CallSite) {inst, callee, cost, frequency};
+            }
+        }
+    }
+
+    // Spend the budget on the most frequent and cheapest calls first.
+    if (n_sites > 0) {
+        qsort(sites, n_sites, sizeof(CallSite), compare_call_sites);
+    }
+    bool changed = false;
+    for (uptr i = 0; i < n_sites; i++) {
+        uptr growth = IrFunction_size(sites[i].callee);
+        if (size + growth > limit) {
+            continue;
+        }
+        inline_call(function, sites[i].call, sites[i].callee);
+        size += growth;
+        changed = true;
+    }
+    if (changed) {
+        IrFunction_apply_forwards(function);
+        IrFunction_remove_unreachable(function);
+    }
+
+    for (uptr i = 0; i < n_callees; i++) {
+        if (callees[i]) {
+            IrFunction_free(callees[i]);
+        }
+    }
+    FREE(a, sites);
+    FREE(a, decls);
+    FREE(a, callees);
+    return changed;
+}
+
+// Dead code elimination
+
+bool opt_dce(IrFunction *function) {
+    Allocator *a = function->allocator;
+    IrInst **stack = NULL;
+    uptr depth = 0, capacity = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            inst->mark = IrInst_has_effects(inst);
+            if (inst->mark) {
+                GROW(a, stack, depth, capacity);
+                stack[depth++] = inst;
+            }
+        }
+    }
+    while (depth > 0) {
+        IrInst *inst = stack[--depth];
+        for (u32 i = 0; i < inst->n_args; i++) {
+            IrInst *arg = inst->args[i];
+            if (!arg->mark) {
+                arg->mark = true;
+                GROW(a, stack, depth, capacity);
+                stack[depth++] = arg;
+            }
+        }
+    }
+    FREE(a, stack);
+
+    bool changed = false;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first, *next; inst; inst = next) {
+            next = inst->next;
+            if (!inst->mark) {
+                IrBlock_remove(inst);
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
@@ -0,0 +1,173 @@
+#ifndef LIMBO_OPT_H
+#define LIMBO_OPT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <threads.h>
+#include "alloc.h"
+#include "ir.h"
+
+/// A transformation of a function in SSA form.
+/// \param function The function to transform.
+/// \return Whether the function changed.
+typedef bool (*IrPassFn)(IrFunction *function);
+
+/// Called after each run of a pass, e.g. to trace or profile a pipeline.
+/// \param data The data given to `PassManager_set_hook`.
+/// \param pass The name of the pass.
+/// \param function The function the pass ran on.
+/// \param seconds How long the pass took.
+/// \param changed Whether the pass changed the function.
+/// \remark Passes may run on several functions at once, so the hook must be
+/// safe to call from multiple threads.
+typedef void (*PassHook)(void *data, const char *pass,
+                         const IrFunction *function, f64 seconds,
+                         bool changed);
+
+/// A pass in a pipeline, with its running totals.
+typedef struct IrPass {
+    const char *name;
+    IrPassFn run;
+    /// The total time spent in the pass.
+    f64 seconds;
+    /// The number of times the pass ran, and how many of those changed the
+    /// function.
+    uptr runs, changes;
+} IrPass;
+
+/// A pipeline of passes, run in order until none of them changes the
+/// function.
+/// \remark The same pass manager can run on several functions at once.
+typedef struct PassManager {
+    Allocator *allocator;
+    IrPass *passes;
+    uptr n_passes, passes_capacity;
+    PassHook hook;
+    void *hook_data;
+    /// The most times the pipeline is repeated on one function.
+    uptr max_iterations;
+    /// Guards the totals of every pass.
+    mtx_t lock;
+} PassManager;
+
+/// Initialise an empty pipeline.
+/// \param self The pass manager.
+/// \param allocator The allocator to allocate the pipeline from.
+void PassManager_init(PassManager *self, Allocator *allocator);
+
+/// Free a pipeline.
+/// \param self The pass manager.
+void PassManager_free(PassManager *self);
+
+/// Append a pass to a pipeline.
+/// \param self The pass manager.
+/// \param name The name of the pass, for hooks and reports.
+/// \param run The pass.
+void PassManager_add(PassManager *self, const char *name, IrPassFn run);
+
+/// Set the function called after each run of a pass.
+/// \param self The pass manager.
+/// \param hook The hook, or `NULL` to remove it.
+/// \param data The data passed to the hook.
+void PassManager_set_hook(PassManager *self, PassHook hook, void *data);
+
+/// Run a pipeline on a function.
+/// \param self The pass manager.
+/// \param function The function.
+void PassManager_run(PassManager *self, IrFunction *function);
+
+/// Print the number of runs, changes and the time spent in each pass.
+/// \param self The pass manager.
+/// \param out The stream to print to.
+void PassManager_report(PassManager *self, FILE *out);
+
+/// Append the standard optimisation passes to a pipeline, in this order:
+/// `inline`, `tailcall`, `sccp`, `copyprop`, `gvn`, `bounds`, `escape`,
+/// `concat`, `lists`, `simplifycfg` and `dce`.
+/// \param self The pass manager.
+void opt_default_pipeline(PassManager *self);
+
+/// Replace calls to functions of the same module with copies of their
+/// bodies, where a cost model finds it worthwhile. The cost of a callee is
+/// the code its body generates once cleaned up; the benefit of a call is
+/// the call sequence it saves, weighted by how often the call runs, which is
+/// estimated as 8 times per enclosing loop. Small callees are always
+/// inlined, and a function may grow by at most its original size, or 100
+/// instructions if that is more.
+/// \remark Recursive calls are not inlined into themselves, and calls to
+/// other modules are not inlined, since their bodies are not known until
+/// they are loaded.
+bool opt_inline(IrFunction *function);
+
+/// Sparse conditional constant propagation, following Wegman and Zadeck.
+/// Values are only assumed to vary once they are shown to, and only blocks
+/// that can be reached with the constants found so far are considered, so
+/// this finds constants that folding each instruction alone would miss,
+/// such as a variable that a loop never changes. Constant branches and
+/// switches become jumps.
+bool opt_sccp(IrFunction *function);
+
+/// Replace copies, phis whose arguments are all the same value, and members
+/// read from aggregates that were just built or updated, with the values
+/// they stand for.
+bool opt_copy_propagation(IrFunction *function);
+
+/// Global value numbering: replace a pure instruction with an earlier one
+/// that computes the same value from the same arguments and dominates it.
+bool opt_gvn(IrFunction *function);
+
+/// Bounds check elimination: mark the array and string accesses whose index
+/// is known to be in bounds, so that they cannot raise an exception and are
+/// free to be removed or combined with their uses. An index is in bounds if
+/// comparisons on every path to the access show that it is at least zero
+/// and less than the length, or less than a value that is at most the
+/// length. A loop counter, as in `for (i := 0; i < len a; i++)`, is proven
+/// by induction over the values it takes. The length of an array created in
+/// the function is the size it was created with.
+/// \remark Dis has no unchecked form of `indx` or `indc`, so the VM still
+/// checks every access; what this pass saves is the instructions around
+/// the access, not the check itself.
+bool opt_bounds(IrFunction *function);
+
+/// Escape analysis: mark the `ref` expressions whose reference is only ever
+/// used to read and write members, so that the adt can live in the frame
+/// instead of being allocated on the heap. A reference escapes if it is
+/// passed to a function or process, returned, stored, sent, compared or
+/// merged with another value; each evaluation of the `ref` then needs an
+/// object of its own.
+/// \remark Every use of a value sees its latest evaluation, so a single
+/// slot serves a `ref` that is evaluated over and over in a loop.
+bool opt_escape(IrFunction *function);
+
+/// Rewrite each chain of string additions, such as `a + ":" + b + "\n"` or
+/// a run of `s += x` in the same block, as a single `IR_CONCAT` of the
+/// strings it joins, merging adjacent constants and dropping empty ones.
+/// Only intermediate results that nothing else uses are fused.
+bool opt_concat(IrFunction *function);
+
+/// Simplify list operations: `hd` and `tl` of a list just built with `::`
+/// become the values it was built from, and comparing such a list with
+/// `nil` becomes a constant. `hd` and `tl` of a list that was just built or
+/// that every path tests against `nil` are marked as unable to raise an
+/// exception, so that they are free to be removed when unused.
+bool opt_lists(IrFunction *function);
+
+/// Turn self-recursion into a loop: a call of the function itself whose
+/// value is returned as it is, such as `return f(tl l)`, becomes a jump
+/// back to the start with the arguments as the new parameters. The
+/// recursion then needs one frame rather than one per call.
+/// \remark Calls to other functions in tail position are not changed, since
+/// Dis can only run a function in a frame of its own type. A sibling that
+/// is inlined becomes part of the caller, so mutual recursion between small
+/// functions still becomes a loop.
+bool opt_tail_calls(IrFunction *function);
+
+/// Fold constant switches and constant and redundant branches, skip blocks
+/// that only jump, and merge blocks into their only predecessor.
+bool opt_simplify_cfg(IrFunction *function);
+
+/// Dead code elimination: remove instructions without effects whose values
+/// are never used.
+bool opt_dce(IrFunction *function);
+
+#endif //LIMBO_OPT_H
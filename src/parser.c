@@ -1 +1,87 @@
 #include "parser.h"
+#include "error.h"
+
+ParserContext ParserContext_from(Allocator *allocator, Interner *interner,
+                                 SymbolMap *globals) {
+    ParserContext context = {
+            .allocator = allocator,
+            .interner = interner,
+            .globals = globals,
+            .current_case = NULL,
+    };
+    ScopeStack_init(&context.locals, allocator);
+    return context;
+}
+
+void ParserContext_free(ParserContext *context) {
+    ScopeStack_free(&context->locals);
+}
+
+Node *Node_new(ParserContext *context, NodeKind kind, Token *token) {
+    Node *node = ALLOC(context->allocator, sizeof(Node));
+    node->kind = kind;
+    node->token = token;
+    // Literals carry their own value, so that later passes can create and
+    // rewrite them without a token.
+    if (token != NULL) {
+        node->int_value = token->int_value;
+        node->real_value = token->real_value;
+        if (token->kind == TOKEN_STRING) {
+            node->string_value = token->string_value;
+            node->string_length = token->length;
+        }
+    }
+    return node;
+}
+
+Symbol intern_token(ParserContext *context, const Token *token) {
+    return Interner_intern(context->interner, token->location, token->length);
+}
+
+void enter_scope(ParserContext *context) {
+    ScopeStack_enter(&context->locals);
+}
+
+void leave_scope(ParserContext *context) {
+    ScopeStack_leave(&context->locals);
+}
+
+Decl *declare(ParserContext *context, Token *name, DeclKind kind, Type *type) {
+    Decl *decl = ALLOC(context->allocator, sizeof(Decl));
+    decl->kind = kind;
+    decl->name = intern_token(context, name);
+    decl->token = name;
+    decl->type = type;
+
+    Decl *existing;
+    if (context->locals.depth == 0) {
+        existing = SymbolMap_get(context->globals, decl->name);
+        if (existing == NULL) {
+            SymbolMap_set(context->globals, decl->name, decl);
+        }
+    } else {
+        existing = ScopeStack_declare(&context->locals, decl);
+    }
+
+    if (existing != NULL) {
+        warn_token(existing->token, "previous declaration of '%.*s'",
+                   (int) name->length, name->location);
+        error_token(name, "redeclaration of '%.*s'",
+                    (int) name->length, name->location);
+    }
+    return decl;
+}
+
+Decl *resolve(ParserContext *context, Node *node) {
+    Symbol name = intern_token(context, node->token);
+    Decl *decl = ScopeStack_lookup(&context->locals, name);
+    if (decl == NULL) {
+        decl = SymbolMap_get(context->globals, name);
+    }
+    if (decl == NULL) {
+        error_token(node->token, "undeclared name '%.*s'",
+                    (int) node->token->length, node->token->location);
+    }
+    node->decl = decl;
+    return decl;
+}
@@ -1,7 +1,11 @@
 #ifndef LIMBO_PARSER_H
 #define LIMBO_PARSER_H
 
+#include "alloc.h"
+#include "intern.h"
 #include "lexer.h"
+#include "scope.h"
+#include "type.h"
 
 typedef enum NodeKind {
     NODE_NOP,     // no operation
@@ -58,6 +62,7 @@ typedef enum NodeKind {
 
     NODE_ADT,      // abstract data type
     NODE_ALT,      // control transfer
+    NODE_ARRAY,    // array creation
     NODE_BREAK,    // break
     NODE_CASE,     // case statement
     NODE_CAST,     // cast to a different type
@@ -102,9 +107,47 @@ typedef enum NodeKind {
     NODE_BLOCK,         // block of statements { ... }
     NODE_FUNCTION_CALL, // function call
     NODE_FUNCTION,      // function definition
+    NODE_IDENTIFIER,    // reference to a declared name
+    NODE_INDEX,         // array or string index
+    NODE_DOT,           // adt member or module member access
+    NODE_TUPLE,         // tuple expression
+    NODE_CASE_ARM,      // one arm of a case or alt statement
+    NODE_LOAD,          // load a module
 
 } NodeKind;
 
+/// A node in the abstract syntax tree.
+/// Operands are stored as follows:
+/// - Binary and assignment operators: `left` and `right`.
+/// - Unary operators, `hd`, `tl`, `len`, `ref`, `tagof` and casts: `left`.
+/// - `NODE_CHAN_TX`: the channel in `left`, and for a send, the value in
+///   `right`.
+/// - `NODE_DECL`: the declared names in `left`, linked by `next`, and an
+///   optional initialiser in `right`. `NODE_DECL_EXP` is the same, with the
+///   type taken from the initialiser.
+/// - `NODE_FUNCTION_CALL`: the callee in `left`, and the arguments in
+///   `right`, linked by `next`.
+/// - `NODE_FUNCTION`: the parameters in `left`, linked by `next`, the body in
+///   `body`, and the function's declaration in `decl`.
+/// - `NODE_INDEX`: the indexed value in `left` and the index in `right`.
+/// - `NODE_DOT`: the value in `left` and the member name in `token`.
+/// - `NODE_TUPLE`, `NODE_BLOCK`: the elements or statements in `body`,
+///   linked by `next`.
+/// - `NODE_CASE`, `NODE_ALT`: the scrutinee of a `case` in `cond`, and the
+///   arms in `body`, linked by `next`. Each label of an `alt` is a
+///   `NODE_CHAN_TX`, or a `NODE_DECL_EXP` or `NODE_ASSIGN` of a receive.
+///   Once checked, the type of an `alt` is a tuple of the index of the
+///   alternative done and a value for each alternative, sends first.
+/// - `NODE_CASE_ARM`: the labels in `left`, linked by `next`, and the
+///   statements in `body`. A `NODE_TO` label has its bounds in `left` and
+///   `right`; a `NODE_NOP` label is the default arm `*`.
+/// - `NODE_ARRAY`: the length in `left`; the array type is `type`.
+/// - `NODE_CHAN`: the buffer size, if any, in `left`; the channel type is
+///   `type`.
+/// - `NODE_RETURN`, `NODE_SPAWN`: the returned value or spawned call in
+///   `left`.
+/// - `NODE_LOAD`: the path of the implementation in `left`; the module type
+///   is `type`.
 typedef struct Node Node;
 struct Node {
     NodeKind kind;
@@ -126,14 +169,82 @@ struct Node {
     // Block or statement
     Node *body;
 
+    // For NODE_IDENTIFIER, the declaration the name resolves to
+    Decl *decl;
 
+    // For NODE_INTEGRAL, NODE_REAL and NODE_STRING, the value of the literal
+    i64 int_value;
+    f64 real_value;
+    const char *string_value;
+    uptr string_length;
 };
 
 typedef struct ParserContext {
-    // locals
-    // globals
-    // current scope
-    // switch scope
+    /// The allocator that nodes and declarations are allocated from.
+    Allocator *allocator;
+    /// The interner that names are interned in.
+    Interner *interner;
+    /// Module-level names.
+    /// \remark Once frozen, the same map can be shared by the contexts of
+    /// every thread working on the module.
+    SymbolMap *globals;
+    /// Names declared within the function being parsed.
+    ScopeStack locals;
+    /// The innermost enclosing `case` or `alt` statement, if any.
+    Node *current_case;
 } ParserContext;
 
+/// Create a parser context.
+/// \param allocator The allocator to allocate nodes and declarations from.
+/// \param interner The interner to intern names in.
+/// \param globals The module-level names.
+/// \return The parser context.
+ParserContext ParserContext_from(Allocator *allocator, Interner *interner,
+                                 SymbolMap *globals);
+
+/// Release the scopes owned by a parser context.
+/// \param context The parser context.
+/// \remark Nodes and declarations are not freed, as they outlive parsing.
+void ParserContext_free(ParserContext *context);
+
+/// Allocate a new node.
+/// \param context The parser context.
+/// \param kind The kind of node.
+/// \param token The token the node was parsed from.
+/// \return The new node.
+Node *Node_new(ParserContext *context, NodeKind kind, Token *token);
+
+/// Intern the text of a token.
+/// \param context The parser context.
+/// \param token The token.
+/// \return The symbol for the token's text.
+Symbol intern_token(ParserContext *context, const Token *token);
+
+/// Open a new local scope, e.g. for a block or function body.
+/// \param context The parser context.
+void enter_scope(ParserContext *context);
+
+/// Close the innermost local scope.
+/// \param context The parser context.
+void leave_scope(ParserContext *context);
+
+/// Declare a name in the innermost scope.
+/// Outside of any local scope, the name is declared at module level.
+/// \param context The parser context.
+/// \param name The token naming the declaration.
+/// \param kind The kind of declaration.
+/// \param type The type of the declaration, if known.
+/// \return The new declaration.
+/// \remark This function will exit the program if the name is already
+/// declared in the same scope.
+Decl *declare(ParserContext *context, Token *name, DeclKind kind, Type *type);
+
+/// Resolve an identifier to its declaration.
+/// Local scopes are searched innermost first, then module-level names.
+/// \param context The parser context.
+/// \param node The `NODE_IDENTIFIER` node to resolve.
+/// \return The declaration, which is also stored in `node->decl`.
+/// \remark This function will exit the program if the name is undeclared.
+Decl *resolve(ParserContext *context, Node *node);
+
 #endif //LIMBO_PARSER_H
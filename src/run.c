@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "alloc.h"
+#include "error.h"
+#include "vm.h"
+
+static f64 seconds(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return (f64) t.tv_sec + (f64) t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int first = 1;
+    bool stats = false, jit = true;
+    uptr workers = 1;
+    for (; first < argc; first++) {
+        if (strcmp(argv[first], "-s") == 0) {
+            stats = true;
+        } else if (strcmp(argv[first], "-i") == 0) {
+            jit = false;
+        } else if (strcmp(argv[first], "-w") == 0 && first + 1 < argc) {
+            // 0 starts one worker per processor.
+            workers = strtoul(argv[++first], NULL, 10);
+        } else {
+            break;
+        }
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: limbo-run [-s] [-i] [-w workers] file.dis "
+                        "[args ...]\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *allocator_name = getenv("LIMBO_ALLOCATOR");
+    Allocator *allocator = Allocator_from_name(
+            allocator_name ? allocator_name : "system");
+    if (allocator == NULL) {
+        error("unknown allocator '%s'\n", allocator_name);
+    }
+
+    Vm *vm = Vm_new(allocator, stdout);
+    vm->jit = vm->jit && jit;
+    vm->n_workers = workers;
+    VmModule *module = Vm_load(vm, argv[first]);
+    if (module == NULL) {
+        error("cannot load '%s'\n", argv[first]);
+    }
+    if (!Vm_start(vm, module, argc - first, argv + first)) {
+        error("'%s' has no entry point\n", argv[first]);
+    }
+
+    f64 start = seconds();
+    bool ok = Vm_run(vm);
+    f64 elapsed = seconds() - start;
+    if (stats) {
+        fprintf(stderr, "%lu instructions in %.3fs (%.1fM/s), "
+                        "%u functions compiled\n",
+                vm->executed, elapsed,
+                elapsed > 0 ? (f64) vm->executed / elapsed / 1e6 : 0.0,
+                vm->compiled);
+    }
+    Vm_free(vm);
+
+    uptr leaks = 0;
+    if (strcmp(allocator->name, "debug") == 0) {
+        leaks = DebugAllocator_report(allocator, stderr);
+    }
+    Allocator_destroy(allocator);
+
+    return ok && !leaks ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,167 @@
+#include "scope.h"
+#include "error.h"
+
+/// The initial number of slots in a symbol map.
+static const uptr SYMBOL_MAP_CAPACITY = 16;
+
+/// Fibonacci hashing spreads the densely allocated symbols across the table.
+static uptr hash_symbol(Symbol key) {
+    return (uptr) (key * 2654435769u);
+}
+
+void SymbolMap_init(SymbolMap *self, Allocator *allocator) {
+    self->allocator = allocator;
+    self->capacity = SYMBOL_MAP_CAPACITY;
+    self->slots = ALLOC(allocator, self->capacity * sizeof(SymbolSlot));
+    self->count = 0;
+    self->frozen = false;
+}
+
+void SymbolMap_free(SymbolMap *self) {
+    FREE(self->allocator, self->slots);
+    self->slots = NULL;
+    self->capacity = self->count = 0;
+}
+
+Decl *SymbolMap_get(const SymbolMap *self, Symbol key) {
+    uptr mask = self->capacity - 1;
+    for (uptr i = hash_symbol(key) & mask;; i = (i + 1) & mask) {
+        if (self->slots[i].key == key) {
+            return self->slots[i].decl;
+        }
+        if (self->slots[i].key == 0) {
+            return NULL;
+        }
+    }
+}
+
+static void grow(SymbolMap *self) {
+    SymbolSlot *old = self->slots;
+    uptr old_capacity = self->capacity;
+
+    self->capacity *= 2;
+    self->slots = ALLOC(self->allocator, self->capacity * sizeof(SymbolSlot));
+
+    uptr mask = self->capacity - 1;
+    for (uptr i = 0; i < old_capacity; i++) {
+        if (old[i].key == 0) {
+            continue;
+        }
+        uptr j = hash_symbol(old[i].key) & mask;
+        while (self->slots[j].key != 0) {
+            j = (j + 1) & mask;
+        }
+        self->slots[j] = old[i];
+    }
+    FREE(self->allocator, old);
+}
+
+/// Remove the entry in slot `i`, shifting later entries of the same probe
+/// sequence back so that no tombstone is needed.
+static void remove_slot(SymbolMap *self, uptr i) {
+    uptr mask = self->capacity - 1;
+    uptr hole = i;
+    for (uptr j = (i + 1) & mask; self->slots[j].key != 0; j = (j + 1) & mask) {
+        uptr home = hash_symbol(self->slots[j].key) & mask;
+        // Move the entry into the hole unless its home lies cyclically
+        // within (hole, j], in which case it is already reachable.
+        bool reachable = hole <= j ? hole < home && home <= j
+                                   : hole < home || home <= j;
+        if (!reachable) {
+            self->slots[hole] = self->slots[j];
+            hole = j;
+        }
+    }
+    self->slots[hole] = (SymbolSlot) { 0, NULL };
+    self->count--;
+}
+
+Decl *SymbolMap_set(SymbolMap *self, Symbol key, Decl *decl) {
+    if (self->frozen) {
+        error("internal compiler error: modifying a frozen symbol map\n");
+    }
+    if (decl != NULL && (self->count + 1) * 4 > self->capacity * 3) {
+        grow(self);
+    }
+
+    uptr mask = self->capacity - 1;
+    uptr i = hash_symbol(key) & mask;
+    while (self->slots[i].key != 0 && self->slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+
+    Decl *previous = self->slots[i].decl;
+    if (decl == NULL) {
+        if (self->slots[i].key != 0) {
+            remove_slot(self, i);
+        }
+    } else {
+        if (self->slots[i].key == 0) {
+            self->count++;
+        }
+        self->slots[i] = (SymbolSlot) { key, decl };
+    }
+    return previous;
+}
+
+void SymbolMap_freeze(SymbolMap *self) {
+    self->frozen = true;
+}
+
+void ScopeStack_init(ScopeStack *self, Allocator *allocator) {
+    self->allocator = allocator;
+    SymbolMap_init(&self->visible, allocator);
+    self->undo_capacity = 64;
+    self->undo = ALLOC(allocator, self->undo_capacity * sizeof(ScopeUndo));
+    self->undo_length = 0;
+    self->marks_capacity = 16;
+    self->marks = ALLOC(allocator, self->marks_capacity * sizeof(uptr));
+    self->depth = 0;
+}
+
+void ScopeStack_free(ScopeStack *self) {
+    SymbolMap_free(&self->visible);
+    FREE(self->allocator, self->undo);
+    FREE(self->allocator, self->marks);
+}
+
+void ScopeStack_enter(ScopeStack *self) {
+    if (self->depth == self->marks_capacity) {
+        self->marks_capacity *= 2;
+        self->marks = REALLOC(self->allocator, self->marks,
+                              self->marks_capacity * sizeof(uptr));
+    }
+    self->marks[self->depth++] = self->undo_length;
+}
+
+void ScopeStack_leave(ScopeStack *self) {
+    if (self->depth == 0) {
+        error("internal compiler error: leaving a scope that was not entered\n");
+    }
+    uptr mark = self->marks[--self->depth];
+    while (self->undo_length > mark) {
+        ScopeUndo *entry = &self->undo[--self->undo_length];
+        SymbolMap_set(&self->visible, entry->name, entry->shadowed);
+    }
+}
+
+Decl *ScopeStack_declare(ScopeStack *self, Decl *decl) {
+    Decl *existing = SymbolMap_get(&self->visible, decl->name);
+    if (existing != NULL && existing->depth == self->depth) {
+        return existing;
+    }
+
+    if (self->undo_length == self->undo_capacity) {
+        self->undo_capacity *= 2;
+        self->undo = REALLOC(self->allocator, self->undo,
+                             self->undo_capacity * sizeof(ScopeUndo));
+    }
+    decl->depth = self->depth;
+    self->undo[self->undo_length++] = (ScopeUndo) { decl->name, existing };
+    SymbolMap_set(&self->visible, decl->name, decl);
+    return NULL;
+}
+
+Decl *ScopeStack_lookup(const ScopeStack *self, Symbol name) {
+    return SymbolMap_get(&self->visible, name);
+}
@@ -0,0 +1,162 @@
+#ifndef LIMBO_SCOPE_H
+#define LIMBO_SCOPE_H
+
+#include <stdbool.h>
+#include "alloc.h"
+#include "intern.h"
+#include "lexer.h"
+#include "type.h"
+
+typedef struct Node Node;
+
+/// An enum representing the different kinds of declarations.
+typedef enum DeclKind {
+    /// A variable, including function parameters.
+    DECL_VAR,
+    /// A constant declared with `con`.
+    DECL_CON,
+    /// A function.
+    DECL_FN,
+    /// A type, such as an `adt` or a `type` alias.
+    DECL_TYPE,
+    /// A module.
+    DECL_MODULE,
+    /// A name imported from a module with `import`.
+    DECL_IMPORT,
+    /// A label on a loop, `case` or `alt` statement.
+    DECL_LABEL,
+} DeclKind;
+
+typedef struct Decl Decl;
+/// A struct containing metadata about a declared name.
+struct Decl {
+    /// The kind of the declaration.
+    DeclKind kind;
+    /// The name being declared.
+    Symbol name;
+    /// The token that declared the name.
+    Token *token;
+    /// The type of the name, if known.
+    Type *type;
+    /// The nesting depth of the scope the name was declared in.
+    /// \remark Module-level names have depth 0.
+    uptr depth;
+    /// The value of the declaration, for `con` declarations and functions.
+    Node *value;
+    /// Assigned by the code generator: the frame or module data offset of a
+    /// variable, or the index of a function within its module.
+    i32 offset;
+};
+
+/// A slot in a `SymbolMap`.
+typedef struct SymbolSlot {
+    /// The key, or zero if the slot is empty.
+    Symbol key;
+    /// The declaration the key is bound to.
+    Decl *decl;
+} SymbolSlot;
+
+/// An open-addressing hash map from symbols to declarations.
+/// Keys are probed linearly, and deletions shift entries back rather than
+/// leaving tombstones, so lookups stay short however many names are
+/// declared and removed.
+typedef struct SymbolMap {
+    /// The allocator that the slots are allocated from.
+    Allocator *allocator;
+    /// The slots; the capacity is always a power of two.
+    SymbolSlot *slots;
+    uptr capacity;
+    /// The number of occupied slots.
+    uptr count;
+    /// Whether the map has been frozen.
+    /// \see SymbolMap_freeze
+    bool frozen;
+} SymbolMap;
+
+/// Initialise an empty symbol map.
+/// \param self The map to initialise.
+/// \param allocator The allocator to allocate slots from.
+void SymbolMap_init(SymbolMap *self, Allocator *allocator);
+
+/// Release the slots of a symbol map.
+/// \param self The map.
+/// \remark The declarations themselves are not freed.
+void SymbolMap_free(SymbolMap *self);
+
+/// Look up the declaration bound to a symbol.
+/// \param self The map.
+/// \param key The symbol.
+/// \return The declaration, or `NULL` if the symbol is unbound.
+/// \remark Once the map is frozen, this is safe to call from any number of
+/// threads at once.
+Decl *SymbolMap_get(const SymbolMap *self, Symbol key);
+
+/// Bind a symbol to a declaration, replacing any existing binding.
+/// \param self The map.
+/// \param key The symbol.
+/// \param decl The declaration, or `NULL` to remove the binding.
+/// \return The previous binding, or `NULL` if there was none.
+Decl *SymbolMap_set(SymbolMap *self, Symbol key, Decl *decl);
+
+/// Forbid further changes to the map, so that it can be shared between
+/// threads without locking.
+/// \param self The map.
+void SymbolMap_freeze(SymbolMap *self);
+
+/// An entry in a scope stack's undo log.
+typedef struct ScopeUndo {
+    /// The symbol that was bound.
+    Symbol name;
+    /// The binding it replaced, or `NULL` if it was unbound.
+    Decl *shadowed;
+} ScopeUndo;
+
+/// A stack of nested scopes.
+/// Every visible name lives in a single flat map; declaring a name records
+/// the binding it shadows in an undo log, and leaving a scope replays the log
+/// back to the mark taken on entry. Entering a scope is O(1), and leaving one
+/// is O(1) per name it declared.
+typedef struct ScopeStack {
+    /// The allocator used for the log and marks.
+    Allocator *allocator;
+    /// The names visible in the innermost scope.
+    SymbolMap visible;
+    /// The undo log.
+    ScopeUndo *undo;
+    uptr undo_length, undo_capacity;
+    /// The length of the undo log when each open scope was entered.
+    uptr *marks;
+    uptr depth, marks_capacity;
+} ScopeStack;
+
+/// Initialise an empty scope stack.
+/// \param self The stack to initialise.
+/// \param allocator The allocator to use.
+void ScopeStack_init(ScopeStack *self, Allocator *allocator);
+
+/// Release the memory used by a scope stack.
+/// \param self The stack.
+void ScopeStack_free(ScopeStack *self);
+
+/// Open a new innermost scope.
+/// \param self The stack.
+void ScopeStack_enter(ScopeStack *self);
+
+/// Close the innermost scope, restoring any names it shadowed.
+/// \param self The stack.
+void ScopeStack_leave(ScopeStack *self);
+
+/// Declare a name in the innermost scope.
+/// \param self The stack.
+/// \param decl The declaration.
+/// \return The declaration of the same name already in the innermost scope,
+/// or `NULL` if the name was declared successfully.
+Decl *ScopeStack_declare(ScopeStack *self, Decl *decl);
+
+/// Look up a name in the open scopes.
+/// \param self The stack.
+/// \param name The name to look up.
+/// \return The innermost declaration of the name, or `NULL`.
+Decl *ScopeStack_lookup(const ScopeStack *self, Symbol name);
+
+#endif //LIMBO_SCOPE_H
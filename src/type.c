@@ -1,5 +1,8 @@
 #include <stdalign.h>
+#include <string.h>
 #include "type.h"
+#include "error.h"
+#include "layout.h"
 
 Type *type_none = &(Type) {
     .kind = TNone,
@@ -50,5 +53,261 @@ Type *type_real = &(Type) {
 };
 
 Type *type_string = &(Type) {
+    .kind = TString,
+    .size = sizeof(void *),
+    .align = alignof(void *),
+    .is_ptr = true,
+    .can_ref = false,
+    .can_con = true,
+    .big = false,
+    .visible = true,
+};
 
+/// The type of `nil`, which can be assigned to any pointer type.
+Type *type_nil = &(Type) {
+    .kind = TAny,
+    .size = sizeof(void *),
+    .align = alignof(void *),
+    .is_ptr = true,
+    .can_ref = false,
+    .can_con = false,
+    .big = false,
+    .visible = false,
 };
+
+TypeTable *TypeTable_new(Allocator *allocator) {
+    TypeTable *self = ALLOC(allocator, sizeof(TypeTable));
+    self->allocator = allocator;
+    if (mtx_init(&self->lock, mtx_plain) != thrd_success) {
+        error("internal compiler error: could not create type table lock\n");
+    }
+    self->capacity = 64;
+    self->slots = ALLOC(allocator, self->capacity * sizeof(TypeSlot));
+    self->count = 0;
+    return self;
+}
+
+static void Type_free(Allocator *allocator, Type *type) {
+    FREE(allocator, type->members);
+    FREE(allocator, type->params);
+    FREE(allocator, type);
+}
+
+void TypeTable_free(TypeTable *self) {
+    for (uptr i = 0; i < self->capacity; i++) {
+        if (self->slots[i].hash) {
+            Type_free(self->allocator, self->slots[i].type);
+        }
+    }
+    FREE(self->allocator, self->slots);
+    mtx_destroy(&self->lock);
+    FREE(self->allocator, self);
+}
+
+static u64 hash_combine(u64 hash, u64 value) {
+    hash ^= value + 0x9e3779b97f4a7c15u + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+/// Hash the structure of a composite type. Component types are already
+/// interned, so they are hashed by address.
+static u64 hash_type(const Type *type) {
+    u64 hash = hash_combine(0, type->kind);
+    hash = hash_combine(hash, (uptr) type->elem);
+    hash = hash_combine(hash, (uptr) type->return_type);
+    for (uptr i = 0; i < type->n_params; i++) {
+        hash = hash_combine(hash, (uptr) type->params[i]);
+    }
+    for (uptr i = 0; i < type->n_members; i++) {
+        hash = hash_combine(hash, (uptr) type->members[i].type);
+    }
+    return hash ? hash : 1;
+}
+
+static bool equal_types(const Type *a, const Type *b) {
+    if (a->kind != b->kind || a->elem != b->elem
+        || a->return_type != b->return_type
+        || a->n_params != b->n_params || a->n_members != b->n_members) {
+        return false;
+    }
+    for (uptr i = 0; i < a->n_params; i++) {
+        if (a->params[i] != b->params[i]) {
+            return false;
+        }
+    }
+    for (uptr i = 0; i < a->n_members; i++) {
+        if (a->members[i].type != b->members[i].type) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void grow(TypeTable *self) {
+    TypeSlot *old = self->slots;
+    uptr old_capacity = self->capacity;
+
+    self->capacity *= 2;
+    self->slots = ALLOC(self->allocator, self->capacity * sizeof(TypeSlot));
+
+    uptr mask = self->capacity - 1;
+    for (uptr i = 0; i < old_capacity; i++) {
+        if (old[i].hash == 0) {
+            continue;
+        }
+        uptr j = old[i].hash & mask;
+        while (self->slots[j].hash != 0) {
+            j = (j + 1) & mask;
+        }
+        self->slots[j] = old[i];
+    }
+    FREE(self->allocator, old);
+}
+
+/// Find the interned copy of `proto`, interning a copy if there is none.
+/// \remark `proto` and its arrays are owned by the caller.
+static Type *intern(TypeTable *self, const Type *proto) {
+    u64 hash = hash_type(proto);
+
+    mtx_lock(&self->lock);
+    uptr mask = self->capacity - 1;
+    uptr i = hash & mask;
+    while (self->slots[i].hash != 0) {
+        if (self->slots[i].hash == hash
+            && equal_types(self->slots[i].type, proto)) {
+            Type *type = self->slots[i].type;
+            mtx_unlock(&self->lock);
+            return type;
+        }
+        i = (i + 1) & mask;
+    }
+
+    Type *type = ALLOC(self->allocator, sizeof(Type));
+    *type = *proto;
+    if (proto->n_params) {
+        type->params = ALLOC(self->allocator, proto->n_params * sizeof(Type *));
+        memcpy(type->params, proto->params, proto->n_params * sizeof(Type *));
+    }
+    if (proto->n_members) {
+        type->members = ALLOC(self->allocator,
+                              proto->n_members * sizeof(Member));
+        memcpy(type->members, proto->members,
+               proto->n_members * sizeof(Member));
+    }
+
+    self->slots[i] = (TypeSlot) { hash, type };
+    if (++self->count * 4 > self->capacity * 3) {
+        grow(self);
+    }
+    mtx_unlock(&self->lock);
+    return type;
+}
+
+/// Intern a type that is represented by a pointer to its element type.
+static Type *intern_pointer(TypeTable *self, TypeKind kind, Type *elem) {
+    Type proto = {
+        .kind = kind,
+        .size = sizeof(void *),
+        .align = alignof(void *),
+        .is_ptr = true,
+        .can_ref = false,
+        .can_con = false,
+        .big = false,
+        .visible = true,
+        .elem = elem,
+    };
+    return intern(self, &proto);
+}
+
+Type *TypeTable_list(TypeTable *self, Type *elem) {
+    return intern_pointer(self, TList, elem);
+}
+
+Type *TypeTable_array(TypeTable *self, Type *elem) {
+    return intern_pointer(self, TArray, elem);
+}
+
+Type *TypeTable_chan(TypeTable *self, Type *elem) {
+    return intern_pointer(self, TChan, elem);
+}
+
+Type *TypeTable_ref(TypeTable *self, Type *elem) {
+    return intern_pointer(self, TRef, elem);
+}
+
+Type *TypeTable_tuple(TypeTable *self, uptr n, Type **elems) {
+    Member members[n ? n : 1];
+    for (uptr i = 0; i < n; i++) {
+        members[i] = (Member) { .type = elems[i], .index = i };
+    }
+    Type proto = {
+        .kind = TTuple,
+        .can_ref = true,
+        .visible = true,
+        .n_members = n,
+        .members = members,
+    };
+    // Tuples keep their declared layout, so that every structurally equal
+    // tuple has the same layout. Their elements were laid out when they were
+    // created, so this only writes to the prototype.
+    layout_type(&proto, false);
+    return intern(self, &proto);
+}
+
+Type *TypeTable_fn(TypeTable *self, Type *return_type, uptr n_params,
+                   Type **params) {
+    Type proto = {
+        .kind = TFn,
+        .visible = true,
+        .return_type = return_type,
+        .n_params = n_params,
+        .params = params,
+    };
+    return intern(self, &proto);
+}
+
+bool Type_assignable(const Type *to, const Type *from) {
+    if (to == from) {
+        return true;
+    }
+    // nil can be assigned to anything represented by a pointer, other than
+    // strings, which use the empty string instead.
+    if (from == type_nil) {
+        return to->is_ptr && to->kind != TString;
+    }
+    return false;
+}
+
+const char *Type_describe(const Type *type) {
+    switch (type->kind) {
+        case TNone: return "no value";
+        case TAdt: return "adt";
+        case TAdtPick: return "pick adt";
+        case TArray: return "array";
+        case TBig: return "big";
+        case TByte: return "byte";
+        case TChan: return "chan";
+        case TReal: return "real";
+        case TFn: return "fn";
+        case TInt: return "int";
+        case TList: return "list";
+        case TModule: return "module";
+        case TRef: return "ref";
+        case TString: return "string";
+        case TTuple: return "tuple";
+        case TAny: return "nil";
+        default: return "type";
+    }
+}
+
+Member *Type_member(Type *type, const Token *name) {
+    for (uptr i = 0; i < type->n_members; i++) {
+        Member *member = &type->members[i];
+        if (member->name && member->name->length == name->length
+            && strncmp(member->name->location, name->location,
+                       name->length) == 0) {
+            return member;
+        }
+    }
+    return NULL;
+}
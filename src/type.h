@@ -1,6 +1,8 @@
 #ifndef LIMBO_TYPE_H
 #define LIMBO_TYPE_H
 
+#include <threads.h>
+#include "alloc.h"
 #include "lexer.h"
 
 typedef enum TypeKind TypeKind;
@@ -67,18 +69,104 @@ struct Type {
     // Composite types
     uptr n_members;
     Member *members;
+    // Adts and tuples: whether the members were reordered when laid out
+    bool reordered;
+
+    // Pick adts: the members of each variant, excluding the common members
+    uptr n_variants;
+    Type **variants;
+
+    // Lists, arrays, channels and refs: the element type
+    // Pick adt variants: the pick adt that the variant belongs to
+    Type *elem;
 
     // Functions
     Type *return_type;
     uptr n_params;
-    Type *params;
+    Type **params;
 };
 
+/// A slot in a `TypeTable`.
+typedef struct TypeSlot {
+    /// The structural hash of the type, or zero if the slot is empty.
+    u64 hash;
+    Type *type;
+} TypeSlot;
+
+/// A table of interned composite types.
+/// Structurally equal types are interned to the same `Type`, so types can be
+/// compared by pointer.
+/// \remark The table is safe to use from multiple threads.
+typedef struct TypeTable {
+    /// The allocator that types are allocated from.
+    Allocator *allocator;
+    /// Guards everything below.
+    mtx_t lock;
+    TypeSlot *slots;
+    uptr capacity;
+    uptr count;
+} TypeTable;
+
 extern Type *type_none;
 extern Type *type_big;
 extern Type *type_byte;
 extern Type *type_int;
 extern Type *type_real;
 extern Type *type_string;
+extern Type *type_nil;
+
+/// Create an empty type table.
+/// \param allocator The allocator to allocate types from.
+/// \return The new type table.
+TypeTable *TypeTable_new(Allocator *allocator);
+
+/// Free a type table and every type interned in it.
+/// \param self The type table.
+void TypeTable_free(TypeTable *self);
+
+/// Intern the type `list of elem`.
+Type *TypeTable_list(TypeTable *self, Type *elem);
+
+/// Intern the type `array of elem`.
+Type *TypeTable_array(TypeTable *self, Type *elem);
+
+/// Intern the type `chan of elem`.
+Type *TypeTable_chan(TypeTable *self, Type *elem);
+
+/// Intern the type `ref elem`.
+Type *TypeTable_ref(TypeTable *self, Type *elem);
+
+/// Intern a tuple type.
+/// \param self The type table.
+/// \param n The number of elements.
+/// \param elems The type of each element.
+/// \return The tuple type.
+Type *TypeTable_tuple(TypeTable *self, uptr n, Type **elems);
+
+/// Intern a function type.
+/// \param self The type table.
+/// \param return_type The return type, or `type_none`.
+/// \param n_params The number of parameters.
+/// \param params The type of each parameter.
+/// \return The function type.
+Type *TypeTable_fn(TypeTable *self, Type *return_type, uptr n_params,
+                   Type **params);
+
+/// Whether a value of type `from` can be assigned to a location of type `to`.
+/// \param to The type of the location.
+/// \param from The type of the value.
+/// \return Whether the assignment is allowed.
+bool Type_assignable(const Type *to, const Type *from);
+
+/// Find a member of an adt, pick adt or module by name.
+/// \param type The type.
+/// \param name The token naming the member.
+/// \return The member, or `NULL` if there is none with that name.
+Member *Type_member(Type *type, const Token *name);
+
+/// The name of a type kind, for diagnostics.
+/// \param type The type.
+/// \return A description such as `"list"`.
+const char *Type_describe(const Type *type);
 
 #endif //LIMBO_TYPE_H
@@ -0,0 +1,2317 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include "error.h"
+#include "jit.h"
+#include "unicode.h"
+#include "vm.h"
+
+#if defined(__GNUC__)
+/// Dispatch with computed gotos: each handler ends by jumping straight to the
+/// next instruction's handler, so every handler gets its own indirect branch
+/// to predict rather than all sharing the one at the top of a switch.
+#define VM_THREADED 1
+#endif
+
+#if defined(VM_THREADED) && defined(JIT_SUPPORTED)
+/// Compile hot functions, entering native code through a handler of its own.
+#define VM_JIT 1
+#endif
+
+/// A register of a frame header.
+#define REG(fp, reg) (((void **) (fp))[reg])
+
+#define B(a) (*(u8 *) (a))
+#define W(a) (*(i32 *) (a))
+#define L(a) (*(i64 *) (a))
+#define F(a) (*(f64 *) (a))
+#define P(a) (*(void **) (a))
+
+static const void *const *handlers;
+
+// Frames and processes
+
+static uptr frame_size(const DisType *type) {
+    uptr size = type->size > DIS_NREG * sizeof(void *)
+                ? type->size : DIS_NREG * sizeof(void *);
+    return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+/// Allocate a zeroed frame on the top of a process's stack.
+static u8 *push_frame(VmProcess *p, const DisType *type) {
+    uptr size = frame_size(type);
+    if (p->stack == NULL || (uptr) (p->stack->limit - p->sp) < size) {
+        uptr capacity = size > VM_STACK_CHUNK ? size : VM_STACK_CHUNK;
+        VmStack *chunk = ALLOC(p->vm->allocator, sizeof(VmStack) + capacity);
+        chunk->prev = p->stack;
+        chunk->saved_sp = p->sp;
+        chunk->limit = chunk->data + capacity;
+        p->stack = chunk;
+        p->sp = chunk->data;
+    }
+    u8 *fp = p->sp;
+    p->sp += size;
+    memset(fp, 0, size);
+    REG(fp, DIS_REGTYP) = (void *) type;
+    return fp;
+}
+
+/// Pop the frame on the top of a process's stack.
+/// \param release Whether to drop the references the frame holds, rather
+/// than leaving them to whatever the frame was copied to.
+static void pop_frame(VmProcess *p, u8 *fp, bool release) {
+    if (release) {
+        heap_unref_map(p->vm->allocator, fp, REG(fp, DIS_REGTYP));
+    }
+    p->sp = fp;
+    if (fp == p->stack->data && p->stack->prev != NULL) {
+        VmStack *chunk = p->stack;
+        p->stack = chunk->prev;
+        p->sp = chunk->saved_sp;
+        FREE(p->vm->allocator, chunk);
+    }
+}
+
+static VmProcess *new_process(Vm *vm, ModuleLink *link) {
+    VmProcess *p = ALLOC(vm->allocator, sizeof(VmProcess));
+    p->vm = vm;
+    p->link = link;
+    heap_ref(link);
+    mtx_lock(&vm->lock);
+    p->pid = ++vm->next_pid;
+    p->all_next = vm->all;
+    if (vm->all != NULL) {
+        vm->all->all_prev = p;
+    }
+    vm->all = p;
+    mtx_unlock(&vm->lock);
+    return p;
+}
+
+static void destroy_process(VmProcess *p) {
+    Vm *vm = p->vm;
+    // Walk every frame on the stack, including any that have been made for a
+    // call but not yet entered.
+    while (p->stack != NULL) {
+        VmStack *chunk = p->stack;
+        for (u8 *fp = chunk->data; fp < p->sp;) {
+            const DisType *type = REG(fp, DIS_REGTYP);
+            heap_unref_map(vm->allocator, fp, type);
+            heap_unref(vm->allocator, REG(fp, DIS_REGMOD));
+            fp += frame_size(type);
+        }
+        p->stack = chunk->prev;
+        p->sp = chunk->saved_sp;
+        FREE(vm->allocator, chunk);
+    }
+    FREE(vm->allocator, p->alt_waiters);
+    FREE(vm->allocator, p->alt_channels);
+    FREE(vm->allocator, p->alt_order);
+    heap_unref(vm->allocator, p->link);
+    mtx_lock(&vm->lock);
+    if (p->all_prev != NULL) {
+        p->all_prev->all_next = p->all_next;
+    } else {
+        vm->all = p->all_next;
+    }
+    if (p->all_next != NULL) {
+        p->all_next->all_prev = p->all_prev;
+    }
+    mtx_unlock(&vm->lock);
+    FREE(vm->allocator, p);
+}
+
+// Scheduling
+
+/// The worker running on this thread, if any.
+static thread_local VmWorker *worker;
+
+/// Wake a worker waiting for work, if there is one.
+static void notify(Vm *vm) {
+    // Pairs with the increment of `idle` in wait_for_work: either this sees
+    // the worker waiting, or the worker sees the work.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&vm->idle, memory_order_relaxed) > 0) {
+        mtx_lock(&vm->queue_lock);
+        cnd_signal(&vm->work);
+        mtx_unlock(&vm->queue_lock);
+    }
+}
+
+static void push_shared(Vm *vm, VmProcess *p) {
+    mtx_lock(&vm->queue_lock);
+    p->next = NULL;
+    if (vm->queue_tail != NULL) {
+        vm->queue_tail->next = p;
+    } else {
+        vm->queue_head = p;
+    }
+    vm->queue_tail = p;
+    atomic_fetch_add(&vm->queued, 1);
+    mtx_unlock(&vm->queue_lock);
+}
+
+static VmProcess *pop_shared(Vm *vm) {
+    if (atomic_load_explicit(&vm->queued, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+    mtx_lock(&vm->queue_lock);
+    VmProcess *p = vm->queue_head;
+    if (p != NULL) {
+        vm->queue_head = p->next;
+        if (vm->queue_head == NULL) {
+            vm->queue_tail = NULL;
+        }
+        atomic_fetch_sub(&vm->queued, 1);
+    }
+    mtx_unlock(&vm->queue_lock);
+    return p;
+}
+
+/// Add a process to the back of a worker's queue, or of the shared queue
+/// if that is full.
+static void push(VmWorker *w, VmProcess *p) {
+    u32 tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    u32 head = atomic_load_explicit(&w->head, memory_order_acquire);
+    if (tail - head < VM_RUN_QUEUE) {
+        atomic_store_explicit(&w->queue[tail % VM_RUN_QUEUE], p,
+                              memory_order_relaxed);
+        atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+    } else {
+        push_shared(w->vm, p);
+    }
+    notify(w->vm);
+}
+
+/// Take the process at the front of a worker's own queue.
+static VmProcess *pop(VmWorker *w) {
+    u32 head = atomic_load_explicit(&w->head, memory_order_acquire);
+    while (head != atomic_load_explicit(&w->tail, memory_order_relaxed)) {
+        VmProcess *p = atomic_load_explicit(&w->queue[head % VM_RUN_QUEUE],
+                                            memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(
+                &w->head, &head, head + 1, memory_order_release,
+                memory_order_acquire)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/// Move half of another worker's queue to this worker's, which is empty,
+/// and take one of the processes.
+static VmProcess *steal(VmWorker *w, VmWorker *victim) {
+    u32 tail = atomic_load_explicit(&w->tail, memory_order_relaxed), n;
+    for (;;) {
+        u32 head = atomic_load_explicit(&victim->head, memory_order_acquire);
+        u32 end = atomic_load_explicit(&victim->tail, memory_order_acquire);
+        n = end - head;
+        n -= n / 2;
+        if (n == 0) {
+            return NULL;
+        }
+        if (n > VM_RUN_QUEUE / 2) {
+            // The victim moved on between reading head and tail.
+            continue;
+        }
+        for (u32 i = 0; i < n; i++) {
+            VmProcess *p = atomic_load_explicit(
+                    &victim->queue[(head + i) % VM_RUN_QUEUE],
+                    memory_order_relaxed);
+            atomic_store_explicit(&w->queue[(tail + i) % VM_RUN_QUEUE], p,
+                                  memory_order_relaxed);
+        }
+        if (atomic_compare_exchange_weak_explicit(
+                &victim->head, &head, head + n, memory_order_acq_rel,
+                memory_order_relaxed)) {
+            break;
+        }
+    }
+    VmProcess *p = atomic_load_explicit(
+            &w->queue[(tail + n - 1) % VM_RUN_QUEUE], memory_order_relaxed);
+    if (n > 1) {
+        atomic_store_explicit(&w->tail, tail + n - 1, memory_order_release);
+    }
+    return p;
+}
+
+/// A pseudo-random number for this worker.
+/// \param n The bound.
+/// \return A number below `n`.
+static u32 random_below(u32 n) {
+    worker->seed = worker->seed * 1103515245 + 12345;
+    return (worker->seed >> 16) % n;
+}
+
+/// Steal from the other workers, starting from a random one.
+static VmProcess *steal_any(VmWorker *w) {
+    Vm *vm = w->vm;
+    uptr start = random_below((u32) vm->n_workers);
+    for (uptr i = 0; i < vm->n_workers; i++) {
+        VmWorker *victim = &vm->workers[(start + i) % vm->n_workers];
+        VmProcess *p = victim != w ? steal(w, victim) : NULL;
+        if (p != NULL) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/// Whether any process is queued for any worker to take.
+static bool has_work(Vm *vm) {
+    if (atomic_load(&vm->queued) > 0) {
+        return true;
+    }
+    for (uptr i = 0; i < vm->n_workers; i++) {
+        VmWorker *w = &vm->workers[i];
+        if (atomic_load(&w->head) != atomic_load(&w->tail)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Wait until there is work, or no more work can come.
+/// \return Whether there may be work.
+static bool wait_for_work(Vm *vm) {
+    mtx_lock(&vm->queue_lock);
+    atomic_fetch_add(&vm->idle, 1);
+    while (atomic_load(&vm->active) > 0 && !has_work(vm)) {
+        cnd_wait(&vm->work, &vm->queue_lock);
+    }
+    atomic_fetch_sub(&vm->idle, 1);
+    mtx_unlock(&vm->queue_lock);
+    return atomic_load(&vm->active) > 0;
+}
+
+/// Find a process for a worker to run.
+/// \return The process, or `NULL` once no process can be ready again.
+static VmProcess *find_work(VmWorker *w) {
+    Vm *vm = w->vm;
+    for (;;) {
+        VmProcess *p = NULL;
+        // Now and then, look at the shared queue first, so that it is not
+        // starved by processes that keep this worker busy.
+        if (++w->runs % 61 == 0) {
+            p = pop_shared(vm);
+        }
+        if (p == NULL && w->next != NULL && w->streak < VM_RUN_NEXT) {
+            p = w->next;
+            w->next = NULL;
+            w->streak++;
+            return p;
+        }
+        w->streak = 0;
+        if (p == NULL) {
+            p = pop(w);
+        }
+        if (p == NULL && w->next != NULL) {
+            p = w->next;
+            w->next = NULL;
+        }
+        if (p == NULL) {
+            p = pop_shared(vm);
+        }
+        if (p == NULL) {
+            p = steal_any(w);
+        }
+        if (p != NULL) {
+            return p;
+        }
+        if (!wait_for_work(vm)) {
+            return NULL;
+        }
+    }
+}
+
+/// Queue a new process to run.
+static void start(Vm *vm, VmProcess *p) {
+    p->state = VM_READY;
+    atomic_fetch_add(&vm->active, 1);
+    if (worker != NULL) {
+        push(worker, p);
+    } else {
+        push_shared(vm, p);
+        notify(vm);
+    }
+}
+
+/// Make a blocked process ready, to run next on this worker.
+static void wake(Vm *vm, VmProcess *p) {
+    p->state = VM_READY;
+    atomic_fetch_add(&vm->active, 1);
+    if (worker == NULL) {
+        push_shared(vm, p);
+        notify(vm);
+        return;
+    }
+    VmProcess *bumped = worker->next;
+    worker->next = p;
+    if (bumped != NULL) {
+        push(worker, bumped);
+    }
+}
+
+/// Let other workers have the process this one was going to run next, as
+/// this one is about to block its thread.
+static void hand_off(void) {
+    if (worker != NULL && worker->next != NULL) {
+        push(worker, worker->next);
+        worker->next = NULL;
+    }
+}
+
+/// Note that a process has stopped running without being queued again.
+static void retire(Vm *vm) {
+    if (atomic_fetch_sub(&vm->active, 1) == 1) {
+        mtx_lock(&vm->queue_lock);
+        cnd_broadcast(&vm->work);
+        mtx_unlock(&vm->queue_lock);
+    }
+}
+
+/// Wait until no worker is collecting cycles, then note that this one may
+/// touch the heap.
+static void enter_heap(Vm *vm) {
+    if (worker == NULL) {
+        return;
+    }
+    for (;;) {
+        // Pairs with collect_cycles: either the collector sees this worker
+        // running, or this worker sees it stopping.
+        atomic_fetch_add(&vm->running, 1);
+        if (!atomic_load(&vm->stopping)) {
+            return;
+        }
+        atomic_fetch_sub(&vm->running, 1);
+        mtx_lock(&vm->stop_lock);
+        while (atomic_load(&vm->stopping)) {
+            cnd_wait(&vm->resumed, &vm->stop_lock);
+        }
+        mtx_unlock(&vm->stop_lock);
+    }
+}
+
+static void leave_heap(Vm *vm) {
+    if (worker != NULL) {
+        atomic_fetch_sub(&vm->running, 1);
+    }
+}
+
+/// Look for garbage cycles among the possible roots every worker has
+/// recorded, once the other workers have left the heap. The calling worker
+/// must be outside it too.
+static void collect_cycles(Vm *vm) {
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&vm->stopping, &expected, true)) {
+        // Another worker is collecting already.
+        return;
+    }
+    while (atomic_load(&vm->running) > 0) {
+        thrd_yield();
+    }
+    HeapLocal **locals = ALLOC(vm->allocator,
+                               vm->n_workers * sizeof(HeapLocal *));
+    for (uptr i = 0; i < vm->n_workers; i++) {
+        locals[i] = &vm->workers[i].heap;
+    }
+    heap_collect_cycles(locals, vm->n_workers);
+    FREE(vm->allocator, locals);
+    mtx_lock(&vm->stop_lock);
+    atomic_store(&vm->stopping, false);
+    cnd_broadcast(&vm->resumed);
+    mtx_unlock(&vm->stop_lock);
+}
+
+/// Start a process running a function, with a copy of a frame the parent
+/// has filled in. The references the frame holds move to the child.
+static void spawn(VmProcess *parent, u8 *frame, ModuleLink *link,
+                  const VmInst *pc) {
+    Vm *vm = parent->vm;
+    VmProcess *child = new_process(vm, link);
+    const DisType *type = REG(frame, DIS_REGTYP);
+    u8 *fp = push_frame(child, type);
+    memcpy(fp, frame, frame_size(type));
+    REG(fp, DIS_REGLINK) = NULL;
+    REG(fp, DIS_REGFP) = NULL;
+    REG(fp, DIS_REGMOD) = NULL;
+    REG(fp, DIS_REGRET) = NULL;
+    child->fp = fp;
+    child->pc = pc;
+    pop_frame(parent, frame, false);
+    start(vm, child);
+}
+
+// Channels
+
+static void enqueue(VmWaiter *w, Channel *c, ChannelQueue *queue) {
+    w->channel = c;
+    w->queue = queue;
+    w->prev = queue->last;
+    w->next = NULL;
+    if (queue->last != NULL) {
+        queue->last->next = w;
+    } else {
+        queue->first = w;
+    }
+    queue->last = w;
+    atomic_fetch_add(&c->waiting, 1);
+}
+
+static void unqueue(VmWaiter *w) {
+    ChannelQueue *queue = w->queue;
+    if (w->prev != NULL) {
+        w->prev->next = w->next;
+    } else {
+        queue->first = w->next;
+    }
+    if (w->next != NULL) {
+        w->next->prev = w->prev;
+    } else {
+        queue->last = w->prev;
+    }
+    w->queue = NULL;
+    atomic_fetch_sub(&w->channel->waiting, 1);
+}
+
+/// Reserve a waiter's process for an exchange, unless one has completed it
+/// through another of its waiters.
+static bool claim(VmWaiter *w) {
+    for (;;) {
+        i32 expected = VM_WAITING;
+        if (atomic_compare_exchange_weak(&w->process->chosen, &expected,
+                                         VM_CLAIMING)) {
+            return true;
+        }
+        if (expected >= 0) {
+            return false;
+        }
+        if (expected == VM_CLAIMING) {
+            // Whoever holds it needs no lock this thread holds to finish.
+            thrd_yield();
+        }
+    }
+}
+
+/// Find the first waiter on a queue whose process can be claimed, dropping
+/// those of processes already completed through another channel.
+/// \param self A process whose waiters to pass over, as it cannot exchange
+/// with itself, or `NULL`.
+static VmWaiter *claim_first(ChannelQueue *queue, VmProcess *self) {
+    for (VmWaiter *w = queue->first, *next; w != NULL; w = next) {
+        next = w->next;
+        if (w->process == self) {
+            continue;
+        }
+        if (claim(w)) {
+            return w;
+        }
+        unqueue(w);
+    }
+    return NULL;
+}
+
+/// Finish an exchange with a claimed waiter, and wake its process.
+static void complete(Vm *vm, VmWaiter *w) {
+    unqueue(w);
+    atomic_store_explicit(&w->process->chosen, w->index,
+                          memory_order_release);
+    wake(vm, w->process);
+}
+
+/// Give back a claimed waiter that no exchange could be made with.
+static void release_claim(VmWaiter *w) {
+    atomic_store_explicit(&w->process->chosen, VM_WAITING,
+                          memory_order_release);
+}
+
+/// Move values between a channel's buffer and its blocked processes, which
+/// values moving through the buffer without the lock may have left behind.
+/// The channel is locked.
+/// \param self A process whose waiters to pass over, or `NULL`.
+static void settle(Vm *vm, Channel *c, VmProcess *self) {
+    for (bool moved = true; moved;) {
+        moved = false;
+        VmWaiter *w = claim_first(&c->receivers, self);
+        if (w != NULL) {
+            if (Channel_take(vm->allocator, c, w->value)) {
+                complete(vm, w);
+                moved = true;
+            } else {
+                release_claim(w);
+            }
+        }
+        w = claim_first(&c->senders, self);
+        if (w != NULL) {
+            if (Channel_put(c, w->value)) {
+                complete(vm, w);
+                moved = true;
+            } else {
+                release_claim(w);
+            }
+        }
+    }
+}
+
+/// After a value has moved through a channel's buffer without the lock,
+/// settle any process that blocked meanwhile.
+static void check_waiting(Vm *vm, Channel *c) {
+    // Pairs with the increment of `waiting` by a process about to block:
+    // either this sees the count, or that process sees the buffer change.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&c->waiting, memory_order_relaxed) > 0) {
+        mtx_lock(&c->lock);
+        settle(vm, c, NULL);
+        mtx_unlock(&c->lock);
+    }
+}
+
+/// Send a value to a blocked receiver, or into the buffer, if either can
+/// take it. The channel is locked.
+static bool offer(Vm *vm, VmProcess *p, Channel *c, u8 *value) {
+    VmWaiter *receiver = claim_first(&c->receivers, p);
+    if (receiver != NULL) {
+        heap_copy(vm->allocator, receiver->value, value, c->size, c->type);
+        complete(vm, receiver);
+        return true;
+    }
+    return Channel_put(c, value);
+}
+
+/// Receive a value from the buffer, or from a blocked sender, if either has
+/// one. The channel is locked.
+static bool accept(Vm *vm, VmProcess *p, Channel *c, u8 *value) {
+    if (Channel_take(vm->allocator, c, value)) {
+        // Make room for a blocked sender.
+        settle(vm, c, p);
+        return true;
+    }
+    VmWaiter *sender = claim_first(&c->senders, p);
+    if (sender != NULL) {
+        heap_copy(vm->allocator, value, sender->value, c->size, c->type);
+        complete(vm, sender);
+        return true;
+    }
+    return false;
+}
+
+/// Queue a process to send or receive on a channel. The channel is locked.
+static void wait_on(VmProcess *p, Channel *c, ChannelQueue *queue,
+                    u8 *value) {
+    p->wait.process = p;
+    p->wait.value = value;
+    p->wait.index = 0;
+    atomic_store_explicit(&p->chosen, VM_WAITING, memory_order_relaxed);
+    enqueue(&p->wait, c, queue);
+}
+
+/// Send a value, or queue the process to block until it is taken.
+/// \param p The sending process, whose registers have been saved.
+/// \return Whether the value was sent. If not, another worker may be
+/// running the process already.
+static bool send(Vm *vm, VmProcess *p, Channel *c, u8 *value) {
+    if (atomic_load_explicit(&c->waiting, memory_order_acquire) == 0
+        && Channel_put(c, value)) {
+        check_waiting(vm, c);
+        return true;
+    }
+    mtx_lock(&c->lock);
+    bool sent = offer(vm, p, c, value);
+    if (!sent) {
+        // A receiver that empties a cell after this is queued settles.
+        wait_on(p, c, &c->senders, value);
+        sent = Channel_put(c, value);
+        if (sent) {
+            unqueue(&p->wait);
+        } else {
+            p->state = VM_BLOCKED;
+        }
+    }
+    mtx_unlock(&c->lock);
+    return sent;
+}
+
+/// Receive a value, or queue the process to block until one is sent.
+/// \param p The receiving process, whose registers have been saved.
+/// \return Whether a value was received. If not, another worker may be
+/// running the process already.
+static bool receive(Vm *vm, VmProcess *p, Channel *c, u8 *value) {
+    if (atomic_load_explicit(&c->waiting, memory_order_acquire) == 0
+        && Channel_take(vm->allocator, c, value)) {
+        check_waiting(vm, c);
+        return true;
+    }
+    mtx_lock(&c->lock);
+    bool received = accept(vm, p, c, value);
+    if (!received) {
+        // A sender that fills a cell after this is queued settles.
+        wait_on(p, c, &c->receivers, value);
+        received = Channel_take(vm->allocator, c, value);
+        if (received) {
+            unqueue(&p->wait);
+        } else {
+            p->state = VM_BLOCKED;
+        }
+    }
+    mtx_unlock(&c->lock);
+    return received;
+}
+
+// Alt
+
+/// The channel of an alternative in an `alt` table: a word each for the
+/// numbers of sends and receives, then a channel and a value pointer for
+/// each send and then each receive.
+static Channel *alt_channel(u8 *table, uptr i) {
+    return P(table + 2 * sizeof(i32) + i * 2 * sizeof(void *));
+}
+
+static u8 *alt_value(u8 *table, uptr i) {
+    return P(table + 2 * sizeof(i32) + (i * 2 + 1) * sizeof(void *));
+}
+
+/// Whether a send or receive on a channel might go ahead, from a look at it
+/// without the lock.
+static bool maybe_ready(Channel *c, bool sending) {
+    if (atomic_load_explicit(&c->waiting, memory_order_relaxed) > 0) {
+        return true;
+    }
+    uptr head = atomic_load_explicit(&c->head, memory_order_relaxed);
+    uptr tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+    return sending ? tail - head < c->capacity : tail != head;
+}
+
+static int compare_channels(const void *a, const void *b) {
+    uptr x = (uptr) *(Channel *const *) a, y = (uptr) *(Channel *const *) b;
+    return (x > y) - (x < y);
+}
+
+/// Do one of the sends and receives of an `alt` that can go ahead, chosen
+/// at random, or queue the process on all of their channels.
+/// The alternatives are first tried one channel lock at a time. If none can
+/// go ahead, the channels are all locked, in order of address, so that no
+/// other exchange can complete the process until it is queued on all of
+/// them, and tried again as it is queued. Nil channels are never ready.
+/// \param p The process, whose registers have been saved with its pc at
+/// the `alt`, for it to finish there when it is woken.
+/// \param table The `alt` table.
+/// \param n_send, n_recv The numbers of sends and receives.
+/// \param block Whether to block if none can go ahead, rather than return.
+/// \return The index of the alternative done, `n_send + n_recv` if none
+/// could go ahead and `block` is false, or -1 if the process is queued.
+/// If it is, another worker may be running it already.
+static i32 alt(Vm *vm, VmProcess *p, u8 *table, uptr n_send, uptr n_recv,
+               bool block) {
+    uptr n = n_send + n_recv, n_locked = 0, queued = 0;
+    if (n > p->alt_capacity) {
+        p->alt_capacity = n;
+        p->alt_waiters = REALLOC(vm->allocator, p->alt_waiters,
+                                 n * sizeof(VmWaiter));
+        p->alt_channels = REALLOC(vm->allocator, p->alt_channels,
+                                  n * sizeof(Channel *));
+        p->alt_order = REALLOC(vm->allocator, p->alt_order, n * sizeof(u32));
+    }
+    Channel **locked = p->alt_channels;
+    u32 *order = p->alt_order;
+    for (uptr i = 0; i < n; i++) {
+        // Shuffle as the order is filled in, so that no alternative is
+        // favoured.
+        uptr j = random_below((u32) i + 1);
+        if (j != i) {
+            order[i] = order[j];
+        }
+        order[j] = (u32) i;
+    }
+    for (uptr k = 0; k < n; k++) {
+        uptr i = order[k];
+        Channel *c = alt_channel(table, i);
+        if (c == NULL || !maybe_ready(c, i < n_send)) {
+            continue;
+        }
+        mtx_lock(&c->lock);
+        bool ready = i < n_send ? offer(vm, p, c, alt_value(table, i))
+                                : accept(vm, p, c, alt_value(table, i));
+        mtx_unlock(&c->lock);
+        if (ready) {
+            return (i32) i;
+        }
+    }
+    if (!block) {
+        return (i32) n;
+    }
+
+    for (uptr i = 0; i < n; i++) {
+        if (alt_channel(table, i) != NULL) {
+            locked[n_locked++] = alt_channel(table, i);
+        }
+    }
+    qsort(locked, n_locked, sizeof *locked, compare_channels);
+    uptr n_distinct = 0;
+    for (uptr i = 0; i < n_locked; i++) {
+        if (n_distinct == 0 || locked[i] != locked[n_distinct - 1]) {
+            locked[n_distinct++] = locked[i];
+            mtx_lock(&locked[i]->lock);
+        }
+    }
+    atomic_store_explicit(&p->chosen, VM_WAITING, memory_order_relaxed);
+
+    i32 done = -1;
+    for (uptr k = 0; k < n && done < 0; k++) {
+        uptr i = order[k];
+        Channel *c = alt_channel(table, i);
+        u8 *value = alt_value(table, i);
+        if (c == NULL) {
+            continue;
+        }
+        // Queue first: a lock-free move through the buffer after this sees
+        // the count and settles.
+        VmWaiter *w = &p->alt_waiters[queued++];
+        w->process = p;
+        w->value = value;
+        w->index = (i32) i;
+        enqueue(w, c, i < n_send ? &c->senders : &c->receivers);
+        if (i < n_send ? offer(vm, p, c, value) : accept(vm, p, c, value)) {
+            done = (i32) i;
+        }
+    }
+    if (done >= 0) {
+        for (uptr i = 0; i < queued; i++) {
+            unqueue(&p->alt_waiters[i]);
+        }
+    } else {
+        p->alt_queued = queued;
+        p->state = VM_BLOCKED;
+    }
+    for (uptr i = 0; i < n_distinct; i++) {
+        mtx_unlock(&locked[i]->lock);
+    }
+    return done;
+}
+
+/// Take a process woken in an `alt` off the queues it is still on.
+/// \return The index of the alternative done.
+static i32 finish_alt(VmProcess *p) {
+    for (uptr i = 0; i < p->alt_queued; i++) {
+        VmWaiter *w = &p->alt_waiters[i];
+        mtx_lock(&w->channel->lock);
+        if (w->queue != NULL) {
+            unqueue(w);
+        }
+        mtx_unlock(&w->channel->lock);
+    }
+    p->alt_queued = 0;
+    return atomic_load_explicit(&p->chosen, memory_order_acquire);
+}
+
+// Conversions
+
+static i32 round_word(f64 value) {
+    if (isnan(value)) {
+        return 0;
+    }
+    value = value < 0 ? value - 0.5 : value + 0.5;
+    if (value >= 2147483647.0) {
+        return INT32_MAX;
+    }
+    if (value <= -2147483648.0) {
+        return INT32_MIN;
+    }
+    return (i32) value;
+}
+
+static i64 round_big(f64 value) {
+    if (isnan(value)) {
+        return 0;
+    }
+    value = value < 0 ? value - 0.5 : value + 0.5;
+    if (value >= 9223372036854775807.0) {
+        return INT64_MAX;
+    }
+    if (value <= -9223372036854775808.0) {
+        return INT64_MIN;
+    }
+    return (i64) value;
+}
+
+static i64 power(i64 base, i64 exponent) {
+    if (exponent < 0) {
+        // Only 1 and -1 have integral reciprocals.
+        if (base == 1 || base == -1) {
+            return exponent % 2 ? base : 1;
+        }
+        return 0;
+    }
+    u64 result = 1, b = (u64) base;
+    for (u64 e = (u64) exponent; e; e >>= 1) {
+        if (e & 1) {
+            result *= b;
+        }
+        b *= b;
+    }
+    return (i64) result;
+}
+
+/// A string as NUL-terminated UTF-8, allocated from the VM's allocator.
+static char *c_string(Vm *vm, const String *s) {
+    uptr length = String_utf8(s, NULL);
+    char *text = ALLOC(vm->allocator, length + 1);
+    String_utf8(s, text);
+    return text;
+}
+
+/// Take the lock for the pointer at an address.
+/// \return The lock, or `NULL` if only one worker runs and none is needed.
+static atomic_bool *lock_pointer(Vm *vm, const u8 *a) {
+    if (vm->n_workers <= 1) {
+        return NULL;
+    }
+    atomic_bool *lock = &vm->pointer_locks[(uptr) a / sizeof(void *)
+                                           % VM_POINTER_LOCKS];
+    while (atomic_exchange_explicit(lock, true, memory_order_acquire)) {
+        while (atomic_load_explicit(lock, memory_order_relaxed)) {
+        }
+    }
+    return lock;
+}
+
+static void unlock_pointer(atomic_bool *lock) {
+    if (lock != NULL) {
+        atomic_store_explicit(lock, false, memory_order_release);
+    }
+}
+
+/// Store a pointer the caller owns, dropping the one it replaces. The store
+/// is an exchange, so that two workers storing to the same word each drop a
+/// different pointer.
+static void set_pointer(Vm *vm, u8 *d, void *value) {
+    atomic_bool *lock = lock_pointer(vm, d);
+    void *old = atomic_exchange_explicit((void *_Atomic *) d, value,
+                                         memory_order_acq_rel);
+    unlock_pointer(lock);
+    heap_unref(vm->allocator, old);
+}
+
+/// Load a pointer and take a reference to it, with no store to the word in
+/// between that could drop the last reference first.
+static void *copy_pointer(Vm *vm, u8 *s) {
+    atomic_bool *lock = lock_pointer(vm, s);
+    void *value = atomic_load_explicit((void *_Atomic *) s,
+                                       memory_order_acquire);
+    heap_ref(value);
+    unlock_pointer(lock);
+    return value;
+}
+
+static void set_string(Vm *vm, u8 *d, const char *text) {
+    set_pointer(vm, d, String_from_utf8(vm->allocator, text, strlen(text)));
+}
+
+// Loading
+
+static void init_data(Vm *vm, const VmModule *module, u8 *mp) {
+    const DisModule *dis = module->dis;
+    for (uptr i = 0; i < dis->n_data; i++) {
+        const DisData *data = &dis->data[i];
+        u8 *a = mp + data->offset;
+        for (uptr j = 0; data->kind != DIS_DEFS && j < data->count; j++) {
+            switch (data->kind) {
+                case DIS_DEFB:
+                    B(a + j) = (u8) data->int_value;
+                    break;
+                case DIS_DEFW:
+                    W(a + j * 4) = (i32) data->int_value;
+                    break;
+                case DIS_DEFL:
+                    L(a + j * 8) = data->int_value;
+                    break;
+                case DIS_DEFF:
+                    F(a + j * 8) = data->real_value;
+                    break;
+            }
+        }
+        if (data->kind == DIS_DEFS) {
+            heap_ref(module->literals[i]);
+            set_pointer(vm, a, module->literals[i]);
+        }
+    }
+}
+
+/// Make a new instance of a module, resolving the functions of one of the
+/// loader's import tables.
+/// \return The instance, or `NULL` if a function is missing.
+static ModuleLink *new_link(Vm *vm, VmModule *module,
+                            const DisImport *import) {
+    ModuleLink *link = heap_alloc(vm->allocator, HEAP_MODULE, NULL,
+                                  sizeof(ModuleLink));
+    link->module = module;
+    DisModule *dis = module->dis;
+    if (dis != NULL) {
+        link->mp = ALLOC(vm->allocator, dis->data_size);
+        // Descriptor 0 describes module data.
+        link->data_type = dis->n_types > 0 ? &dis->types[0] : NULL;
+        init_data(vm, module, link->mp);
+    }
+    if (import == NULL) {
+        return link;
+    }
+    link->n_entries = import->n_fns;
+    link->entries = ALLOC(vm->allocator,
+                          import->n_fns * sizeof(VmLinkEntry));
+    for (uptr i = 0; i < import->n_fns; i++) {
+        const DisImportFn *fn = &import->fns[i];
+        VmLinkEntry *entry = &link->entries[i];
+        for (uptr j = 0; dis != NULL && j < dis->n_links; j++) {
+            const DisLink *l = &dis->links[j];
+            if (l->signature == fn->signature && strcmp(l->name, fn->name) == 0
+                && l->type >= 0 && (uptr) l->type < dis->n_types) {
+                *entry = (VmLinkEntry) {
+                    module->code + l->pc, NULL, &dis->types[l->type]};
+            }
+        }
+        // Builtin functions are matched by name alone.
+        for (uptr j = 0; j < module->n_builtins; j++) {
+            const VmBuiltin *builtin = &module->builtins[j];
+            if (strcmp(builtin->name, fn->name) == 0) {
+                *entry = (VmLinkEntry) {NULL, builtin->fn, &builtin->frame};
+            }
+        }
+        if (entry->frame == NULL) {
+            heap_unref(vm->allocator, link);
+            return NULL;
+        }
+    }
+    return link;
+}
+
+/// Load the module a `load` instruction names, trying the path as given and
+/// then relative to the loading module.
+static ModuleLink *load(Vm *vm, ModuleLink *loader, const String *path,
+                        i32 import) {
+    const DisModule *dis = loader->module->dis;
+    if (import < 0 || (uptr) import >= dis->n_imports) {
+        return NULL;
+    }
+    char *text = c_string(vm, path);
+    VmModule *module = Vm_load(vm, text);
+    const char *slash = strrchr(loader->module->path, '/');
+    if (module == NULL && text[0] != '/' && text[0] != '$' && slash) {
+        uptr length = (uptr) (slash - loader->module->path) + 1;
+        char *relative = ALLOC(vm->allocator, length + strlen(text) + 1);
+        memcpy(relative, loader->module->path, length);
+        strcpy(relative + length, text);
+        module = Vm_load(vm, relative);
+        FREE(vm->allocator, relative);
+    }
+    FREE(vm->allocator, text);
+    return module ? new_link(vm, module, &dis->imports[import]) : NULL;
+}
+
+// The interpreter
+
+/// The address of an operand.
+/// \param nil Set if the operand is indirect through `nil`.
+static inline u8 *address(const DisOperand *operand, u8 *fp, u8 *mp,
+                          bool *nil) {
+    u8 *base;
+    switch (operand->mode) {
+        case DIS_FP:
+            return fp + operand->offset;
+        case DIS_MP:
+            return mp + operand->offset;
+        case DIS_IMM:
+            return (u8 *) &operand->offset;
+        case DIS_IND_FP:
+            base = P(fp + operand->offset);
+            break;
+        case DIS_IND_MP:
+            base = P(mp + operand->offset);
+            break;
+        default:
+            return NULL;
+    }
+    if (base == NULL) {
+        *nil = true;
+        return NULL;
+    }
+    return base + operand->index;
+}
+
+/// Fetch the next instruction and the addresses of its operands, unless the
+/// process has used up its quantum.
+#define FETCH() \
+    do { \
+        if (budget-- <= 0) { \
+            goto yield; \
+        } \
+        inst = pc++; \
+        bool nil = false; \
+        s = address(&inst->src, fp, mp, &nil); \
+        m = address(&inst->mid, fp, mp, &nil); \
+        d = address(&inst->dst, fp, mp, &nil); \
+        if (nil) { \
+            goto nil_dereference; \
+        } \
+    } while (0)
+
+#ifdef VM_THREADED
+#define CASE(op) L_##op:
+#define NEXT() \
+    do { \
+        FETCH(); \
+        goto *inst->handler; \
+    } while (0)
+#else
+#define CASE(op) case op:
+#define NEXT() continue
+#endif
+
+#define RAISE(text) \
+    do { \
+        message = (text); \
+        goto raise; \
+    } while (0)
+
+#ifdef VM_JIT
+/// Count a call or a loop going round, compiling the function when it has
+/// got hot. Counts from workers racing each other may be lost, which only
+/// puts compilation off.
+#define HOT(module, target) \
+    do { \
+        u32 *count_ = &((VmInst *) (target))->count; \
+        u32 hits_ = __atomic_load_n(count_, __ATOMIC_RELAXED) + 1; \
+        __atomic_store_n(count_, hits_, __ATOMIC_RELAXED); \
+        if (hits_ == VM_JIT_THRESHOLD) { \
+            compile(vm, (module), (target)); \
+        } \
+    } while (0)
+#else
+#define HOT(module, target) ((void) 0)
+#endif
+
+#define JUMP_IF(condition) \
+    do { \
+        if (condition) { \
+            if (inst->target <= inst) { \
+                HOT(link->module, inst->target); \
+            } \
+            pc = inst->target; \
+        } \
+        NEXT(); \
+    } while (0)
+
+/// The instructions the interpreter implements.
+#define VM_OPS(X) \
+    X(INOP) X(IALT) X(INBALT) X(IGOTO) X(ICALL) X(IFRAME) X(ISPAWN) \
+    X(ILOAD) X(IMCALL) X(IMSPAWN) X(IMFRAME) X(IRET) X(IJMP) X(ICASE) \
+    X(IEXIT) X(INEW) \
+    X(INEWA) X(INEWAZ) X(INEWCB) X(INEWCW) X(INEWCF) X(INEWCP) X(INEWCM) \
+    X(INEWCMP) X(INEWCL) X(ISEND) X(IRECV) X(ICONSB) X(ICONSW) X(ICONSP) \
+    X(ICONSF) X(ICONSM) X(ICONSMP) X(ICONSL) X(IHEADB) X(IHEADW) X(IHEADP) \
+    X(IHEADF) X(IHEADM) X(IHEADMP) X(IHEADL) X(ITAIL) X(ILEA) X(IINDX) \
+    X(IINDW) X(IINDF) X(IINDB) X(IINDL) X(IMOVP) X(IMOVM) X(IMOVMP) \
+    X(IMOVB) X(IMOVW) X(IMOVF) X(IMOVL) X(ICVTBW) X(ICVTWB) X(ICVTFW) \
+    X(ICVTWF) X(ICVTCA) X(ICVTAC) X(ICVTWC) X(ICVTCW) X(ICVTFC) X(ICVTCF) \
+    X(ICVTLF) X(ICVTFL) X(ICVTLW) X(ICVTWL) X(ICVTLC) X(ICVTCL) \
+    X(IADDB) X(IADDW) X(IADDF) X(IADDL) X(ISUBB) X(ISUBW) X(ISUBF) \
+    X(ISUBL) X(IMULB) X(IMULW) X(IMULF) X(IMULL) X(IDIVB) X(IDIVW) \
+    X(IDIVF) X(IDIVL) X(IMODB) X(IMODW) X(IMODL) X(IANDB) X(IANDW) \
+    X(IANDL) X(IORB) X(IORW) X(IORL) X(IXORB) X(IXORW) X(IXORL) X(ISHLB) \
+    X(ISHLW) X(ISHLL) X(ISHRB) X(ISHRW) X(ISHRL) X(ILSRW) X(ILSRL) \
+    X(IEXPW) X(IEXPL) X(IEXPF) X(INEGF) X(IINSC) X(IINDC) X(IADDC) \
+    X(ISLICEC) X(ILENC) X(ILENA) X(ILENL) \
+    X(IBEQB) X(IBNEB) X(IBLTB) X(IBLEB) X(IBGTB) X(IBGEB) \
+    X(IBEQW) X(IBNEW) X(IBLTW) X(IBLEW) X(IBGTW) X(IBGEW) \
+    X(IBEQL) X(IBNEL) X(IBLTL) X(IBLEL) X(IBGTL) X(IBGEL) \
+    X(IBEQF) X(IBNEF) X(IBLTF) X(IBLEF) X(IBGTF) X(IBGEF) \
+    X(IBEQC) X(IBNEC) X(IBLTC) X(IBLEC) X(IBGTC) X(IBGEC)
+
+#ifdef VM_JIT
+/// Compile the function an instruction belongs to, if it has not been, and
+/// have the interpreter enter the native code.
+static void compile(Vm *vm, VmModule *module, const VmInst *pc) {
+    if (!vm->jit || module->n_functions == 0) {
+        return;
+    }
+    uptr i = (uptr) (pc - module->code), low = 0,
+         high = module->n_functions;
+    while (high - low > 1) {
+        uptr middle = low + (high - low) / 2;
+        if (module->functions[middle] <= i) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    mtx_lock(&vm->lock);
+    if (!module->compiled[low]) {
+        module->compiled[low] = true;
+        if (jit_compile(vm->allocator, module, low)) {
+            vm->compiled++;
+            uptr end = low + 1 < module->n_functions
+                       ? module->functions[low + 1] : module->dis->n_code;
+            // Other workers may be interpreting the function: they see
+            // either handler, and the native code is complete before the
+            // new one.
+            for (uptr j = module->functions[low]; j < end; j++) {
+                if (module->code[j].native != NULL) {
+                    __atomic_store_n(&module->code[j].handler,
+                                     handlers[DIS_MAXOP + 1],
+                                     __ATOMIC_RELEASE);
+                }
+            }
+        }
+    }
+    mtx_unlock(&vm->lock);
+}
+#endif
+
+/// Run a process until it blocks, exits, or uses up its quantum.
+/// A process that blocks may be woken and run by another worker before this
+/// returns, so the caller must not touch it unless it is still ready or has
+/// exited.
+/// \param p The process, or `NULL` to only set `handlers`.
+/// \return The state the process was left in.
+static VmProcessState interpret(VmProcess *p) {
+#ifdef VM_THREADED
+#define HANDLER(op) [op] = &&L_##op,
+    static const void *const table[DIS_MAXOP + 2] = {
+        VM_OPS(HANDLER)
+        [DIS_MAXOP] = &&unsupported,
+#ifdef VM_JIT
+        [DIS_MAXOP + 1] = &&native,
+#else
+        [DIS_MAXOP + 1] = &&unsupported,
+#endif
+    };
+#undef HANDLER
+    if (p == NULL) {
+        handlers = table;
+        return VM_EXITED;
+    }
+#else
+    if (p == NULL) {
+        return VM_EXITED;
+    }
+#endif
+
+    Vm *vm = p->vm;
+    Allocator *a = vm->allocator;
+    const VmInst *pc = p->pc, *inst = NULL;
+    u8 *fp = p->fp;
+    ModuleLink *link = p->link;
+    u8 *mp = link->mp;
+    u8 *s, *m, *d;
+    i64 budget = VM_QUANTUM;
+    const char *message = NULL;
+    VmProcessState state;
+
+#ifdef VM_THREADED
+    NEXT();
+#else
+    for (;;) {
+        FETCH();
+        switch (inst->op) {
+#endif
+
+    CASE(INOP) NEXT();
+
+    // Moves and conversions
+
+    CASE(IMOVB) B(d) = B(s); NEXT();
+    CASE(IMOVW) W(d) = W(s); NEXT();
+    CASE(IMOVL) L(d) = L(s); NEXT();
+    CASE(IMOVF) F(d) = F(s); NEXT();
+    CASE(IMOVP) set_pointer(vm, d, copy_pointer(vm, s)); NEXT();
+    CASE(IMOVM) memmove(d, s, (uptr) W(m)); NEXT();
+    CASE(IMOVMP) heap_copy(a, d, s, inst->type->size, inst->type); NEXT();
+    CASE(ILEA) P(d) = s; NEXT();
+
+    CASE(ICVTBW) W(d) = B(s); NEXT();
+    CASE(ICVTWB) B(d) = (u8) W(s); NEXT();
+    CASE(ICVTWL) L(d) = W(s); NEXT();
+    CASE(ICVTLW) W(d) = (i32) L(s); NEXT();
+    CASE(ICVTWF) F(d) = W(s); NEXT();
+    CASE(ICVTFW) W(d) = round_word(F(s)); NEXT();
+    CASE(ICVTLF) F(d) = (f64) L(s); NEXT();
+    CASE(ICVTFL) L(d) = round_big(F(s)); NEXT();
+    CASE(ICVTWC) {
+        char text[16];
+        snprintf(text, sizeof text, "%d", W(s));
+        set_string(vm, d, text);
+        NEXT();
+    }
+    CASE(ICVTLC) {
+        char text[24];
+        snprintf(text, sizeof text, "%ld", L(s));
+        set_string(vm, d, text);
+        NEXT();
+    }
+    CASE(ICVTFC) {
+        char text[32];
+        snprintf(text, sizeof text, "%g", F(s));
+        set_string(vm, d, text);
+        NEXT();
+    }
+    CASE(ICVTCW) {
+        char *text = c_string(vm, P(s));
+        W(d) = (i32) strtol(text, NULL, 10);
+        FREE(a, text);
+        NEXT();
+    }
+    CASE(ICVTCL) {
+        char *text = c_string(vm, P(s));
+        L(d) = strtoll(text, NULL, 10);
+        FREE(a, text);
+        NEXT();
+    }
+    CASE(ICVTCF) {
+        char *text = c_string(vm, P(s));
+        F(d) = strtod(text, NULL);
+        FREE(a, text);
+        NEXT();
+    }
+    CASE(ICVTCA) {
+        String *string = P(s);
+        Array *array = Array_new(a, String_utf8(string, NULL), 1, NULL);
+        String_utf8(string, (char *) array->data);
+        set_pointer(vm, d, array);
+        NEXT();
+    }
+    CASE(ICVTAC) {
+        Array *array = P(s);
+        set_pointer(vm, d, array ? String_from_utf8(a, (char *) array->data,
+                                                    array->length)
+                                 : NULL);
+        NEXT();
+    }
+
+    // Arithmetic: the destination is the middle operand combined with the
+    // source.
+
+    CASE(IADDB) B(d) = (u8) (B(m) + B(s)); NEXT();
+    CASE(ISUBB) B(d) = (u8) (B(m) - B(s)); NEXT();
+    CASE(IMULB) B(d) = (u8) (B(m) * B(s)); NEXT();
+    CASE(IDIVB) {
+        if (B(s) == 0) {
+            RAISE("zero divide");
+        }
+        B(d) = B(m) / B(s);
+        NEXT();
+    }
+    CASE(IMODB) {
+        if (B(s) == 0) {
+            RAISE("zero divide");
+        }
+        B(d) = B(m) % B(s);
+        NEXT();
+    }
+    CASE(IANDB) B(d) = B(m) & B(s); NEXT();
+    CASE(IORB) B(d) = B(m) | B(s); NEXT();
+    CASE(IXORB) B(d) = B(m) ^ B(s); NEXT();
+    CASE(ISHLB) B(d) = (u8) (B(m) << (W(s) & 7)); NEXT();
+    CASE(ISHRB) B(d) = (u8) (B(m) >> (W(s) & 7)); NEXT();
+
+    CASE(IADDW) W(d) = (i32) ((u32) W(m) + (u32) W(s)); NEXT();
+    CASE(ISUBW) W(d) = (i32) ((u32) W(m) - (u32) W(s)); NEXT();
+    CASE(IMULW) W(d) = (i32) ((u32) W(m) * (u32) W(s)); NEXT();
+    CASE(IDIVW) {
+        if (W(s) == 0) {
+            RAISE("zero divide");
+        }
+        W(d) = (i32) ((i64) W(m) / W(s));
+        NEXT();
+    }
+    CASE(IMODW) {
+        if (W(s) == 0) {
+            RAISE("zero divide");
+        }
+        W(d) = (i32) ((i64) W(m) % W(s));
+        NEXT();
+    }
+    CASE(IANDW) W(d) = W(m) & W(s); NEXT();
+    CASE(IORW) W(d) = W(m) | W(s); NEXT();
+    CASE(IXORW) W(d) = W(m) ^ W(s); NEXT();
+    CASE(ISHLW) W(d) = (i32) ((u32) W(m) << (W(s) & 31)); NEXT();
+    CASE(ISHRW) W(d) = W(m) >> (W(s) & 31); NEXT();
+    CASE(ILSRW) W(d) = (i32) ((u32) W(m) >> (W(s) & 31)); NEXT();
+    CASE(IEXPW) W(d) = (i32) power(W(m), W(s)); NEXT();
+
+    CASE(IADDL) L(d) = (i64) ((u64) L(m) + (u64) L(s)); NEXT();
+    CASE(ISUBL) L(d) = (i64) ((u64) L(m) - (u64) L(s)); NEXT();
+    CASE(IMULL) L(d) = (i64) ((u64) L(m) * (u64) L(s)); NEXT();
+    CASE(IDIVL) {
+        if (L(s) == 0) {
+            RAISE("zero divide");
+        }
+        L(d) = L(s) == -1 ? (i64) (0 - (u64) L(m)) : L(m) / L(s);
+        NEXT();
+    }
+    CASE(IMODL) {
+        if (L(s) == 0) {
+            RAISE("zero divide");
+        }
+        L(d) = L(s) == -1 ? 0 : L(m) % L(s);
+        NEXT();
+    }
+    CASE(IANDL) L(d) = L(m) & L(s); NEXT();
+    CASE(IORL) L(d) = L(m) | L(s); NEXT();
+    CASE(IXORL) L(d) = L(m) ^ L(s); NEXT();
+    CASE(ISHLL) L(d) = (i64) ((u64) L(m) << (W(s) & 63)); NEXT();
+    CASE(ISHRL) L(d) = L(m) >> (W(s) & 63); NEXT();
+    CASE(ILSRL) L(d) = (i64) ((u64) L(m) >> (W(s) & 63)); NEXT();
+    CASE(IEXPL) L(d) = power(L(m), L(s)); NEXT();
+
+    CASE(IADDF) F(d) = F(m) + F(s); NEXT();
+    CASE(ISUBF) F(d) = F(m) - F(s); NEXT();
+    CASE(IMULF) F(d) = F(m) * F(s); NEXT();
+    CASE(IDIVF) F(d) = F(m) / F(s); NEXT();
+    CASE(INEGF) F(d) = -F(s); NEXT();
+    CASE(IEXPF) F(d) = pow(F(m), F(s)); NEXT();
+
+    // Branches: taken when the source compares with the middle operand.
+
+    CASE(IBEQB) JUMP_IF(B(s) == B(m));
+    CASE(IBNEB) JUMP_IF(B(s) != B(m));
+    CASE(IBLTB) JUMP_IF(B(s) < B(m));
+    CASE(IBLEB) JUMP_IF(B(s) <= B(m));
+    CASE(IBGTB) JUMP_IF(B(s) > B(m));
+    CASE(IBGEB) JUMP_IF(B(s) >= B(m));
+    CASE(IBEQW) JUMP_IF(W(s) == W(m));
+    CASE(IBNEW) JUMP_IF(W(s) != W(m));
+    CASE(IBLTW) JUMP_IF(W(s) < W(m));
+    CASE(IBLEW) JUMP_IF(W(s) <= W(m));
+    CASE(IBGTW) JUMP_IF(W(s) > W(m));
+    CASE(IBGEW) JUMP_IF(W(s) >= W(m));
+    CASE(IBEQL) JUMP_IF(L(s) == L(m));
+    CASE(IBNEL) JUMP_IF(L(s) != L(m));
+    CASE(IBLTL) JUMP_IF(L(s) < L(m));
+    CASE(IBLEL) JUMP_IF(L(s) <= L(m));
+    CASE(IBGTL) JUMP_IF(L(s) > L(m));
+    CASE(IBGEL) JUMP_IF(L(s) >= L(m));
+    CASE(IBEQF) JUMP_IF(F(s) == F(m));
+    CASE(IBNEF) JUMP_IF(F(s) != F(m));
+    CASE(IBLTF) JUMP_IF(F(s) < F(m));
+    CASE(IBLEF) JUMP_IF(F(s) <= F(m));
+    CASE(IBGTF) JUMP_IF(F(s) > F(m));
+    CASE(IBGEF) JUMP_IF(F(s) >= F(m));
+    CASE(IBEQC) JUMP_IF(String_compare(P(s), P(m)) == 0);
+    CASE(IBNEC) JUMP_IF(String_compare(P(s), P(m)) != 0);
+    CASE(IBLTC) JUMP_IF(String_compare(P(s), P(m)) < 0);
+    CASE(IBLEC) JUMP_IF(String_compare(P(s), P(m)) <= 0);
+    CASE(IBGTC) JUMP_IF(String_compare(P(s), P(m)) > 0);
+    CASE(IBGEC) JUMP_IF(String_compare(P(s), P(m)) >= 0);
+
+    CASE(IJMP) {
+        if (inst->target <= inst) {
+            HOT(link->module, inst->target);
+        }
+        pc = inst->target;
+        NEXT();
+    }
+    CASE(IGOTO) {
+        i32 target = ((i32 *) d)[W(s)];
+        if (target < 0 || (uptr) target >= link->module->dis->n_code) {
+            RAISE("goto out of range");
+        }
+        pc = link->module->code + target;
+        NEXT();
+    }
+    CASE(ICASE) {
+        // n, then n (low, high, pc) ranges in order, then the default pc.
+        const i32 *table = (const i32 *) d;
+        i32 value = W(s), low = 0, high = table[0];
+        i32 target = table[1 + 3 * high];
+        while (low < high) {
+            i32 middle = low + (high - low) / 2;
+            const i32 *range = table + 1 + 3 * middle;
+            if (value < range[0]) {
+                high = middle;
+            } else if (value >= range[1]) {
+                low = middle + 1;
+            } else {
+                target = range[2];
+                break;
+            }
+        }
+        if (target < 0 || (uptr) target >= link->module->dis->n_code) {
+            RAISE("case out of range");
+        }
+        pc = link->module->code + target;
+        NEXT();
+    }
+
+    // Calls
+
+    CASE(IFRAME) P(d) = push_frame(p, inst->type); NEXT();
+    CASE(ICALL) {
+        u8 *frame = P(s);
+        REG(frame, DIS_REGLINK) = (void *) pc;
+        REG(frame, DIS_REGFP) = fp;
+        REG(frame, DIS_REGMOD) = NULL;
+        HOT(link->module, inst->target);
+        fp = frame;
+        pc = inst->target;
+        NEXT();
+    }
+    CASE(IMFRAME) {
+        ModuleLink *target = P(s);
+        if (target == NULL) {
+            RAISE("nil dereference");
+        }
+        if ((uptr) W(m) >= target->n_entries) {
+            RAISE("module function out of range");
+        }
+        P(d) = push_frame(p, target->entries[W(m)].frame);
+        NEXT();
+    }
+    CASE(IMCALL) {
+        ModuleLink *target = P(d);
+        if (target == NULL) {
+            RAISE("nil dereference");
+        }
+        if ((uptr) W(m) >= target->n_entries) {
+            RAISE("module function out of range");
+        }
+        const VmLinkEntry *entry = &target->entries[W(m)];
+        u8 *frame = P(s);
+        if (entry->builtin != NULL) {
+            entry->builtin(p, frame);
+            pop_frame(p, frame, true);
+            NEXT();
+        }
+        REG(frame, DIS_REGLINK) = (void *) pc;
+        REG(frame, DIS_REGFP) = fp;
+        REG(frame, DIS_REGMOD) = link;
+        HOT(target->module, entry->pc);
+        heap_ref(target);
+        link = target;
+        mp = link->mp;
+        fp = frame;
+        pc = entry->pc;
+        NEXT();
+    }
+    CASE(IRET) {
+        u8 *frame = fp;
+        const VmInst *back = REG(frame, DIS_REGLINK);
+        u8 *caller = REG(frame, DIS_REGFP);
+        ModuleLink *saved = REG(frame, DIS_REGMOD);
+        pop_frame(p, frame, true);
+        if (saved != NULL) {
+            heap_unref(a, link);
+            link = saved;
+            mp = link->mp;
+        }
+        if (back == NULL) {
+            goto finished;
+        }
+        pc = back;
+        fp = caller;
+        NEXT();
+    }
+    CASE(ISPAWN) spawn(p, P(s), link, inst->target); NEXT();
+    CASE(IMSPAWN) {
+        ModuleLink *target = P(d);
+        if (target == NULL) {
+            RAISE("nil dereference");
+        }
+        if ((uptr) W(m) >= target->n_entries) {
+            RAISE("module function out of range");
+        }
+        const VmLinkEntry *entry = &target->entries[W(m)];
+        u8 *frame = P(s);
+        if (entry->builtin != NULL) {
+            entry->builtin(p, frame);
+            pop_frame(p, frame, true);
+        } else {
+            spawn(p, frame, target, entry->pc);
+        }
+        NEXT();
+    }
+    CASE(IEXIT) goto finished;
+    CASE(ILOAD) set_pointer(vm, d, load(vm, link, P(s), W(m))); NEXT();
+
+    // Allocation
+
+    CASE(INEW) {
+        set_pointer(vm, d, heap_alloc(a, HEAP_RECORD, inst->type,
+                                      inst->type->size));
+        NEXT();
+    }
+    CASE(INEWA)
+    CASE(INEWAZ) {
+        if (W(s) < 0) {
+            RAISE("negative array size");
+        }
+        set_pointer(vm, d, Array_new(a, (uptr) W(s), inst->type->size,
+                                     inst->type));
+        NEXT();
+    }
+
+    // Channels: a middle operand, if there is one, is the buffer size.
+
+    {
+        uptr size;
+        const DisType *type;
+    CASE(INEWCB) size = 1, type = NULL; goto new_channel;
+    CASE(INEWCW) size = 4, type = NULL; goto new_channel;
+    CASE(INEWCF)
+    CASE(INEWCL) size = 8, type = NULL; goto new_channel;
+    CASE(INEWCP) size = 8, type = &heap_type_pointer; goto new_channel;
+    CASE(INEWCM) size = (uptr) W(s), type = NULL; goto new_channel;
+    CASE(INEWCMP) size = inst->type->size, type = inst->type;
+    new_channel:
+        if (m != d && W(m) < 0) {
+            RAISE("negative buffer size");
+        }
+        set_pointer(vm, d, Channel_new(a, size, type,
+                                       m != d ? (uptr) W(m) : 0));
+        NEXT();
+    }
+    CASE(ISEND) {
+        Channel *c = P(d);
+        if (c == NULL) {
+            RAISE("nil dereference");
+        }
+        // Once the process is queued, it may be woken and run elsewhere.
+        p->pc = pc;
+        p->fp = fp;
+        p->link = link;
+        if (!send(vm, p, c, s)) {
+            state = VM_BLOCKED;
+            goto parked;
+        }
+        NEXT();
+    }
+    CASE(IRECV) {
+        Channel *c = P(s);
+        if (c == NULL) {
+            RAISE("nil dereference");
+        }
+        p->pc = pc;
+        p->fp = fp;
+        p->link = link;
+        if (!receive(vm, p, c, d)) {
+            state = VM_BLOCKED;
+            goto parked;
+        }
+        NEXT();
+    }
+
+    // The table names the alternatives; the destination gets the index of
+    // the one done.
+    {
+        bool block;
+    CASE(IALT) block = true;
+        if (p->alt_queued > 0) {
+            // Woken by one of the alternatives.
+            W(d) = finish_alt(p);
+            NEXT();
+        }
+        goto alt;
+    CASE(INBALT) block = false;
+    alt:
+        if (W(s) < 0 || W(s + sizeof(i32)) < 0) {
+            RAISE("negative alt count");
+        }
+        p->pc = inst;
+        p->fp = fp;
+        p->link = link;
+        i32 done = alt(vm, p, s, (uptr) W(s), (uptr) W(s + sizeof(i32)),
+                       block);
+        if (done < 0) {
+            state = VM_BLOCKED;
+            goto parked;
+        }
+        W(d) = done;
+        NEXT();
+    }
+
+    // Lists: a middle operand gives the size or descriptor of an element.
+
+    {
+        uptr size;
+        const DisType *type;
+    CASE(ICONSB) size = 1, type = NULL; goto cons;
+    CASE(ICONSW) size = 4, type = NULL; goto cons;
+    CASE(ICONSF)
+    CASE(ICONSL) size = 8, type = NULL; goto cons;
+    CASE(ICONSP) size = 8, type = &heap_type_pointer; goto cons;
+    CASE(ICONSM) size = (uptr) W(m), type = NULL; goto cons;
+    CASE(ICONSMP) size = inst->type->size, type = inst->type;
+    cons: {
+            // The new cell takes over the reference to the old list.
+            List *list = List_cons(a, P(d), size, type);
+            heap_ref_map(s, type);
+            memcpy(list->data, s, size);
+            P(d) = list;
+            NEXT();
+        }
+    }
+    {
+        List *list;
+    CASE(IHEADB) CASE(IHEADW) CASE(IHEADF) CASE(IHEADL) CASE(IHEADP)
+    CASE(IHEADM) CASE(IHEADMP) CASE(ITAIL)
+        list = P(s);
+        if (list == NULL) {
+            RAISE("nil dereference");
+        }
+        switch (inst->op) {
+            case IHEADB:
+                B(d) = B(list->data);
+                break;
+            case IHEADW:
+                W(d) = W(list->data);
+                break;
+            case IHEADF:
+                F(d) = F(list->data);
+                break;
+            case IHEADL:
+                L(d) = L(list->data);
+                break;
+            case IHEADP:
+                heap_ref(P(list->data));
+                set_pointer(vm, d, P(list->data));
+                break;
+            case IHEADM:
+                memmove(d, list->data, (uptr) W(m));
+                break;
+            case IHEADMP:
+                heap_copy(a, d, list->data, inst->type->size, inst->type);
+                break;
+            default:
+                heap_ref(list->tail);
+                set_pointer(vm, d, list->tail);
+                break;
+        }
+        NEXT();
+    }
+    CASE(ILENL) {
+        i32 length = 0;
+        for (List *list = P(s); list != NULL; list = list->tail) {
+            length++;
+        }
+        W(d) = length;
+        NEXT();
+    }
+
+    // Arrays and strings
+
+    CASE(IINDX) CASE(IINDW) CASE(IINDF) CASE(IINDB) CASE(IINDL) {
+        Array *array = P(s);
+        if (array == NULL || W(d) < 0 || (uptr) W(d) >= array->length) {
+            RAISE("array bounds error");
+        }
+        P(m) = array->data + (uptr) W(d) * array->size;
+        NEXT();
+    }
+    CASE(ILENA) {
+        Array *array = P(s);
+        W(d) = array ? (i32) array->length : 0;
+        NEXT();
+    }
+    CASE(ILENC) {
+        String *string = P(s);
+        W(d) = string ? (i32) string->length : 0;
+        NEXT();
+    }
+    CASE(IINDC) {
+        String *string = P(s);
+        if (string == NULL || W(m) < 0 || (uptr) W(m) >= string->length) {
+            RAISE("string index out of range");
+        }
+        W(d) = (i32) String_at(string, (uptr) W(m));
+        NEXT();
+    }
+    CASE(IINSC) {
+        String *string = P(d);
+        uptr length = string ? string->length : 0;
+        if (W(m) < 0 || (uptr) W(m) > length) {
+            RAISE("string index out of range");
+        }
+        P(d) = String_set(a, string, (uptr) W(m), (u32) W(s));
+        NEXT();
+    }
+    CASE(IADDC) {
+        set_pointer(vm, d, String_concat(a, P(m), P(s)));
+        NEXT();
+    }
+    CASE(ISLICEC) {
+        String *string = P(d);
+        uptr length = string ? string->length : 0;
+        if (W(s) < 0 || W(m) < W(s) || (uptr) W(m) > length) {
+            RAISE("string slice out of range");
+        }
+        set_pointer(vm, d, String_slice(a, string, (uptr) W(s), (uptr) W(m)));
+        NEXT();
+    }
+
+#ifndef VM_THREADED
+        default:
+            goto unsupported;
+        }
+    }
+#endif
+
+#ifdef VM_JIT
+native:
+    // The operands were fetched for nothing, but a nil dereference among
+    // them would have been raised by the instruction anyway.
+    pc = ((JitEntry) inst->native)(fp, mp, &budget);
+    // Native code returns at an instruction it cannot run, which may be
+    // one it can be entered at, such as an index out of bounds: interpret
+    // that one.
+    FETCH();
+    goto *(inst->native ? handlers[inst->op] : inst->handler);
+#endif
+
+unsupported:
+    message = dis_op_name(inst->op);
+    fflush(vm->out);
+    fprintf(stderr, "%s %u: unsupported instruction %s\n",
+            link->module->path, p->pid, message);
+    goto killed;
+
+nil_dereference:
+    message = "nil dereference";
+
+raise:
+    fflush(vm->out);
+    fprintf(stderr, "%s %u: %s at pc %ld\n", link->module->path, p->pid,
+            message, (long) (inst - link->module->code));
+
+killed:
+    vm->failed = true;
+
+finished:
+    state = VM_EXITED;
+    goto save;
+
+yield:
+    state = VM_READY;
+
+save:
+    p->state = state;
+    p->pc = pc;
+    p->fp = fp;
+    p->link = link;
+
+parked:
+    worker->executed += (u64) (VM_QUANTUM - (budget < 0 ? 0 : budget));
+    return state;
+}
+
+// The Sys module
+
+/// Append formatted text to the output of `Sys->print`.
+static void put(char **text, uptr *length, uptr *capacity, Allocator *a,
+                const char *bytes, uptr n) {
+    while (*length + n > *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *text = REALLOC(a, *text, *capacity);
+    }
+    memcpy(*text + *length, bytes, n);
+    *length += n;
+}
+
+/// The next argument of a variadic call, after aligning to its size.
+static u8 *next_arg(u8 *fp, uptr *offset, uptr size, u8 *zero) {
+    const DisType *type = REG(fp, DIS_REGTYP);
+    *offset = (*offset + size - 1) & ~(size - 1);
+    if (*offset + size > type->size) {
+        return zero;
+    }
+    u8 *arg = fp + *offset;
+    *offset += size;
+    return arg;
+}
+
+/// Format a string as `Sys->print` does, with the arguments that follow the
+/// format in the frame.
+static void format(Vm *vm, u8 *fp, char **text, uptr *length,
+                   uptr *capacity) {
+    Allocator *a = vm->allocator;
+    const String *fmt = P(fp + DIS_NREG * sizeof(void *));
+    uptr offset = (DIS_NREG + 1) * sizeof(void *);
+    u8 zero[8] = {0};
+    for (uptr i = 0; fmt != NULL && i < fmt->length; i++) {
+        u32 c = String_at(fmt, i);
+        if (c != '%' || i + 1 == fmt->length) {
+            char bytes[4];
+            put(text, length, capacity, a, bytes, utf8_encode(c, bytes));
+            continue;
+        }
+        // Gather the flags, width and precision into a C conversion.
+        char spec[32] = "%";
+        uptr n = 1;
+        bool big = false;
+        for (i++; i < fmt->length && n < sizeof spec - 4; i++) {
+            c = String_at(fmt, i);
+            if (c == '*') {
+                n += (uptr) snprintf(spec + n, sizeof spec - n, "%d",
+                                     W(next_arg(fp, &offset, 4, zero)));
+            } else if (c == 'b') {
+                big = true;
+            } else if (c < 0x80 && strchr("-+ #0123456789.", (int) c)) {
+                spec[n++] = (char) c;
+            } else {
+                break;
+            }
+        }
+        char buffer[512];
+        int written = 0;
+        switch (c) {
+            case 'd':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'u':
+                if (big) {
+                    spec[n++] = 'l';
+                    spec[n++] = (char) c;
+                    written = snprintf(buffer, sizeof buffer, spec,
+                                       L(next_arg(fp, &offset, 8, zero)));
+                } else {
+                    spec[n++] = (char) c;
+                    written = snprintf(buffer, sizeof buffer, spec,
+                                       W(next_arg(fp, &offset, 4, zero)));
+                }
+                break;
+            case 'e':
+            case 'f':
+            case 'g':
+            case 'E':
+            case 'G':
+                spec[n++] = (char) c;
+                written = snprintf(buffer, sizeof buffer, spec,
+                                   F(next_arg(fp, &offset, 8, zero)));
+                break;
+            case 'c': {
+                u32 rune = (u32) W(next_arg(fp, &offset, 4, zero));
+                written = (int) utf8_encode(rune, buffer);
+                break;
+            }
+            case 's':
+            case 'q': {
+                char *string = c_string(vm, P(next_arg(fp, &offset, 8,
+                                                       zero)));
+                spec[n++] = 's';
+                int size = snprintf(NULL, 0, spec, string);
+                char *out = ALLOC(a, (uptr) size + 1);
+                snprintf(out, (uptr) size + 1, spec, string);
+                put(text, length, capacity, a, out, (uptr) size);
+                FREE(a, out);
+                FREE(a, string);
+                break;
+            }
+            case 'r':
+                // There is no error string yet.
+                break;
+            case '%':
+                buffer[0] = '%';
+                written = 1;
+                break;
+            default: {
+                // Print an unknown conversion as it was written.
+                put(text, length, capacity, a, spec, n);
+                written = (int) utf8_encode(c, buffer);
+                break;
+            }
+        }
+        if (written > (int) sizeof buffer - 1) {
+            written = sizeof buffer - 1;
+        }
+        put(text, length, capacity, a, buffer, (uptr) (written > 0
+                                                          ? written : 0));
+    }
+}
+
+static void set_result(u8 *fp, i32 value) {
+    i32 *result = REG(fp, DIS_REGRET);
+    if (result != NULL) {
+        *result = value;
+    }
+}
+
+/// print: fn(s: string, *): int
+static void sys_print(VmProcess *p, u8 *fp) {
+    char *text = NULL;
+    uptr length = 0, capacity = 0;
+    format(p->vm, fp, &text, &length, &capacity);
+    fwrite(text, 1, length, p->vm->out);
+    FREE(p->vm->allocator, text);
+    set_result(fp, (i32) length);
+}
+
+/// sleep: fn(period: int): int
+static void sys_sleep(VmProcess *p, u8 *fp) {
+    i32 period = W(fp + DIS_NREG * sizeof(void *));
+    fflush(p->vm->out);
+    if (period > 0) {
+        hand_off();
+        leave_heap(p->vm);
+        struct timespec t = {period / 1000, (long) (period % 1000) * 1000000};
+        thrd_sleep(&t, NULL);
+        enter_heap(p->vm);
+    }
+    set_result(fp, 0);
+}
+
+/// millisec: fn(): int
+static void sys_millisec(VmProcess *p, u8 *fp) {
+    (void) p;
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    set_result(fp, (i32) ((i64) t.tv_sec * 1000 + t.tv_nsec / 1000000));
+}
+
+/// The format string is the only pointer `print` is known to be passed.
+static u8 print_map[] = {0x80 >> DIS_NREG};
+
+/// Room for the variadic arguments of `print`.
+#define PRINT_ARGS 32
+
+static const VmBuiltin sys_builtins[] = {
+    {"print", sys_print, {(DIS_NREG + 1 + PRINT_ARGS) * sizeof(void *),
+                          sizeof print_map, print_map}},
+    {"sleep", sys_sleep, {(DIS_NREG + 1) * sizeof(void *), 0, NULL}},
+    {"millisec", sys_millisec, {DIS_NREG * sizeof(void *), 0, NULL}},
+};
+
+// The virtual machine
+
+Vm *Vm_new(Allocator *allocator, FILE *out) {
+    interpret(NULL);
+    Vm *self = ALLOC(allocator, sizeof(Vm));
+    self->allocator = allocator;
+    self->out = out;
+    if (mtx_init(&self->lock, mtx_plain) != thrd_success
+        || mtx_init(&self->queue_lock, mtx_plain) != thrd_success
+        || cnd_init(&self->work) != thrd_success
+        || mtx_init(&self->stop_lock, mtx_plain) != thrd_success
+        || cnd_init(&self->resumed) != thrd_success) {
+        error("cannot create the scheduler's locks\n");
+    }
+    self->n_workers = 1;
+#ifdef VM_JIT
+    self->jit = true;
+#endif
+    return self;
+}
+
+void Vm_free(Vm *self) {
+    while (self->all != NULL) {
+        destroy_process(self->all);
+    }
+    for (uptr i = 0; i < self->n_modules; i++) {
+        VmModule *module = self->modules[i];
+        if (module->dis != NULL) {
+            for (uptr j = 0; j < module->dis->n_data; j++) {
+                heap_unref(self->allocator, module->literals[j]);
+            }
+            DisModule_free(module->dis);
+        }
+        FREE(self->allocator, module->literals);
+        jit_free(self->allocator, module);
+        FREE(self->allocator, module->functions);
+        FREE(self->allocator, module->compiled);
+        FREE(self->allocator, module->code);
+        FREE(self->allocator, (char *) module->path);
+        FREE(self->allocator, module);
+    }
+    FREE(self->allocator, self->modules);
+    cnd_destroy(&self->work);
+    mtx_destroy(&self->queue_lock);
+    cnd_destroy(&self->resumed);
+    mtx_destroy(&self->stop_lock);
+    mtx_destroy(&self->lock);
+    FREE(self->allocator, self);
+}
+
+static bool branches(DisOp op) {
+    return (op >= IBEQB && op <= IBGEC) || (op >= IBNEL && op <= IBEQL);
+}
+
+static bool valid_type(const DisModule *dis, const DisOperand *operand) {
+    return operand->mode == DIS_IMM && operand->offset >= 0
+           && (uptr) operand->offset < dis->n_types;
+}
+
+#ifdef VM_JIT
+/// Find where a module's functions start, for the JIT to compile them one at
+/// a time. A module that asks not to be compiled is left without any.
+static void find_functions(Vm *vm, VmModule *module) {
+    DisModule *dis = module->dis;
+    if (dis->flags & DIS_DONTCOMPILE || dis->n_code == 0) {
+        return;
+    }
+    bool *starts = ALLOC(vm->allocator, dis->n_code);
+    starts[0] = true;
+    if (dis->entry_pc >= 0 && (uptr) dis->entry_pc < dis->n_code) {
+        starts[dis->entry_pc] = true;
+    }
+    for (uptr i = 0; i < dis->n_links; i++) {
+        i32 pc = dis->links[i].pc;
+        if (pc >= 0 && (uptr) pc < dis->n_code) {
+            starts[pc] = true;
+        }
+    }
+    for (uptr i = 0; i < dis->n_code; i++) {
+        const VmInst *inst = &module->code[i];
+        if (inst->op == ICALL || inst->op == ISPAWN) {
+            starts[inst->target - module->code] = true;
+        }
+    }
+    for (uptr i = 0; i < dis->n_code; i++) {
+        module->n_functions += starts[i];
+    }
+    module->functions = ALLOC(vm->allocator,
+                              module->n_functions * sizeof(uptr));
+    module->compiled = ALLOC(vm->allocator,
+                             module->n_functions * sizeof(bool));
+    for (uptr i = 0, n = 0; i < dis->n_code; i++) {
+        if (starts[i]) {
+            module->functions[n++] = i;
+        }
+    }
+    FREE(vm->allocator, starts);
+}
+#endif
+
+/// Decode a module's code for the interpreter, checking that the targets
+/// and descriptors it names exist.
+static bool decode(Vm *vm, VmModule *module) {
+    DisModule *dis = module->dis;
+    module->code = ALLOC(vm->allocator, (dis->n_code + 1) * sizeof(VmInst));
+    for (uptr i = 0; i < dis->n_code; i++) {
+        const DisInst *from = &dis->code[i];
+        VmInst *inst = &module->code[i];
+        inst->op = from->op;
+        inst->src = from->src;
+        inst->mid = from->mid.mode == DIS_NONE ? from->dst : from->mid;
+        inst->dst = from->dst;
+        if (handlers != NULL) {
+            inst->handler = handlers[from->op] ? handlers[from->op]
+                                               : handlers[DIS_MAXOP];
+        }
+        switch (from->op) {
+            case IJMP:
+            case ICALL:
+            case ISPAWN:
+                break;
+            case IFRAME:
+            case INEW:
+            case INEWCMP:
+                if (!valid_type(dis, &from->src)) {
+                    return false;
+                }
+                inst->type = &dis->types[from->src.offset];
+                continue;
+            case IMOVMP:
+            case ICONSMP:
+            case IHEADMP:
+            case INEWA:
+            case INEWAZ:
+                if (!valid_type(dis, &from->mid)) {
+                    return false;
+                }
+                inst->type = &dis->types[from->mid.offset];
+                continue;
+            default:
+                if (branches(from->op)) {
+                    break;
+                }
+                continue;
+        }
+        if (from->dst.mode != DIS_IMM || from->dst.offset < 0
+            || (uptr) from->dst.offset >= dis->n_code) {
+            return false;
+        }
+        inst->target = &module->code[from->dst.offset];
+    }
+    // Running off the end of the code exits the process.
+    module->code[dis->n_code].op = IEXIT;
+    if (handlers != NULL) {
+        module->code[dis->n_code].handler = handlers[IEXIT];
+    }
+    module->code[dis->n_code].mid.mode = DIS_NONE;
+#ifdef VM_JIT
+    find_functions(vm, module);
+#endif
+    return true;
+}
+
+static VmModule *load_module(Vm *self, const char *path) {
+    for (uptr i = 0; i < self->n_modules; i++) {
+        if (strcmp(self->modules[i]->path, path) == 0) {
+            return self->modules[i];
+        }
+    }
+    VmModule *module = ALLOC(self->allocator, sizeof(VmModule));
+    if (strcmp(path, "$Sys") == 0) {
+        module->builtins = sys_builtins;
+        module->n_builtins = sizeof sys_builtins / sizeof *sys_builtins;
+    } else {
+        module->dis = dis_read_file(self->allocator, path);
+        if (module->dis == NULL || !decode(self, module)) {
+            if (module->dis != NULL) {
+                DisModule_free(module->dis);
+            }
+            FREE(self->allocator, module->code);
+            FREE(self->allocator, module);
+            return NULL;
+        }
+        // Each string literal is decoded, and its encoding chosen, once,
+        // and every instance of the module shares it.
+        DisModule *dis = module->dis;
+        module->literals = ALLOC(self->allocator,
+                                 dis->n_data * sizeof(String *));
+        for (uptr i = 0; i < dis->n_data; i++) {
+            if (dis->data[i].kind == DIS_DEFS) {
+                module->literals[i] = String_from_utf8(
+                        self->allocator, dis->data[i].string_value,
+                        dis->data[i].count);
+            }
+        }
+    }
+    uptr length = strlen(path);
+    char *copy = ALLOC(self->allocator, length + 1);
+    memcpy(copy, path, length);
+    module->path = copy;
+    GROW(self->allocator, self->modules, self->n_modules,
+         self->modules_capacity);
+    self->modules[self->n_modules++] = module;
+    return module;
+}
+
+VmModule *Vm_load(Vm *self, const char *path) {
+    mtx_lock(&self->lock);
+    VmModule *module = load_module(self, path);
+    mtx_unlock(&self->lock);
+#ifdef VM_JIT
+    // A module may ask to be compiled up front. Functions already compiled
+    // are skipped.
+    for (uptr i = 0; module != NULL && module->dis != NULL
+                     && module->dis->flags & DIS_MUSTCOMPILE
+                     && i < module->n_functions; i++) {
+        compile(self, module, module->code + module->functions[i]);
+    }
+#endif
+    return module;
+}
+
+bool Vm_start(Vm *self, VmModule *module, int argc, char **argv) {
+    DisModule *dis = module->dis;
+    if (dis == NULL || dis->entry_pc < 0 || (uptr) dis->entry_pc >= dis->n_code
+        || dis->entry_type < 0 || (uptr) dis->entry_type >= dis->n_types) {
+        return false;
+    }
+    ModuleLink *link = new_link(self, module, NULL);
+    VmProcess *p = new_process(self, link);
+    heap_unref(self->allocator, link);
+
+    // init(ctxt: ref Draw->Context, argv: list of string)
+    const DisType *type = &dis->types[dis->entry_type];
+    u8 *fp = push_frame(p, type);
+    uptr word = DIS_NREG + 1;
+    if (word / 8 < type->map_length
+        && type->map[word / 8] & (0x80 >> word % 8)) {
+        List *args = NULL;
+        for (int i = argc; i-- > 0;) {
+            args = List_cons(self->allocator, args, sizeof(void *),
+                             &heap_type_pointer);
+            P(args->data) = String_from_utf8(self->allocator, argv[i],
+                                             strlen(argv[i]));
+        }
+        P(fp + word * sizeof(void *)) = args;
+    }
+    p->fp = fp;
+    p->pc = module->code + dis->entry_pc;
+    start(self, p);
+    return true;
+}
+
+static int run_worker(void *arg) {
+    worker = arg;
+    Vm *vm = worker->vm;
+    heap_attach(&worker->heap);
+    VmProcess *p;
+    while ((p = find_work(worker)) != NULL) {
+        enter_heap(vm);
+        switch (interpret(p)) {
+            case VM_READY:
+                push(worker, p);
+                break;
+            case VM_EXITED:
+                destroy_process(p);
+                retire(vm);
+                break;
+            case VM_BLOCKED:
+                retire(vm);
+                break;
+        }
+        heap_release(VM_RELEASE_BUDGET);
+        leave_heap(vm);
+        if (worker->heap.n_roots >= VM_CYCLE_ROOTS) {
+            collect_cycles(vm);
+        }
+    }
+    enter_heap(vm);
+    heap_release(UINTPTR_MAX);
+    leave_heap(vm);
+    heap_attach(NULL);
+    worker = NULL;
+    return 0;
+}
+
+bool Vm_run(Vm *self) {
+    uptr n = self->n_workers;
+    if (n == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n = online > 0 ? (uptr) online : 1;
+    }
+    self->n_workers = n;
+    self->workers = ALLOC(self->allocator, n * sizeof(VmWorker));
+    for (uptr i = 0; i < n; i++) {
+        self->workers[i].vm = self;
+        self->workers[i].seed = (u32) i + 1;
+        self->workers[i].heap.allocator = self->allocator;
+    }
+    // This thread is the first worker.
+    thrd_t *threads = ALLOC(self->allocator, n * sizeof(thrd_t));
+    uptr started = 1;
+    for (; started < n; started++) {
+        if (thrd_create(&threads[started], run_worker,
+                        &self->workers[started]) != thrd_success) {
+            break;
+        }
+    }
+    run_worker(&self->workers[0]);
+    for (uptr i = 1; i < started; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    for (uptr i = 0; i < n; i++) {
+        self->executed += self->workers[i].executed;
+    }
+    FREE(self->allocator, threads);
+    // Anything left is blocked on a channel that nothing can reach any more.
+    // The first worker's share of the heap work takes what that releases,
+    // and then every garbage cycle left is collected.
+    heap_attach(&self->workers[0].heap);
+    while (self->all != NULL) {
+        destroy_process(self->all);
+    }
+    heap_release(UINTPTR_MAX);
+    collect_cycles(self);
+    heap_release(UINTPTR_MAX);
+    heap_attach(NULL);
+    for (uptr i = 0; i < n; i++) {
+        HeapLocal_free(&self->workers[i].heap);
+    }
+    FREE(self->allocator, self->workers);
+    self->workers = NULL;
+    fflush(self->out);
+    return !self->failed;
+}
@@ -0,0 +1,310 @@
+#ifndef LIMBO_VM_H
+#define LIMBO_VM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <threads.h>
+#include "alloc.h"
+#include "dis.h"
+#include "heap.h"
+#include "num.h"
+
+/// The number of instructions a process runs before the scheduler moves on
+/// to the next one.
+#define VM_QUANTUM 2048
+
+/// The number of processes a worker's run queue holds. Any more go on the
+/// queue that all workers share.
+#define VM_RUN_QUEUE 256
+
+/// The number of times in a row a worker runs the process it woke last,
+/// before it turns to the rest of its queue.
+#define VM_RUN_NEXT 16
+
+/// The size of each chunk of a process's stack. Frames are carved out of the
+/// current chunk, and a new chunk is chained on when one does not fit.
+#define VM_STACK_CHUNK (32 * 1024)
+
+/// The number of calls to a function, or trips round one of its loops, after
+/// which it is compiled to native code.
+#define VM_JIT_THRESHOLD 1000
+
+/// The most objects a worker releases after running a process, so that
+/// dropping a large structure does not stall the processes behind it.
+#define VM_RELEASE_BUDGET 1024
+
+/// The number of possible roots of garbage cycles a worker records before
+/// it stops the other workers to look for cycles.
+#define VM_CYCLE_ROOTS 10000
+
+/// The number of locks that pointer stores and copies take, chosen by the
+/// address of the pointer, while more than one worker runs.
+#define VM_POINTER_LOCKS 64
+
+typedef struct Vm Vm;
+typedef struct VmProcess VmProcess;
+
+/// An instruction decoded for the interpreter.
+/// Operands are kept as the `.dis` file encodes them, and their addresses are
+/// computed as the instruction runs. Everything that can be resolved when
+/// the module is loaded is resolved then.
+typedef struct VmInst {
+    /// With threaded dispatch, the address of the instruction's handler.
+    const void *handler;
+    DisOp op;
+    /// The operands. A missing middle operand is the destination, as the
+    /// instruction set defines.
+    DisOperand src, mid, dst;
+    union {
+        /// For jumps, branches, calls and spawns, the target.
+        const struct VmInst *target;
+        /// For instructions whose immediate operand names a type descriptor,
+        /// the descriptor.
+        const DisType *type;
+    };
+    /// Native code to run from this instruction on, once its function has
+    /// been compiled, or `NULL`.
+    const void *native;
+    /// For call and loop targets, the number of times they have been reached.
+    u32 count;
+} VmInst;
+
+/// A function implemented in C, for builtin modules such as `$Sys`.
+/// \param process The calling process.
+/// \param fp The function's frame, holding its arguments.
+typedef void (*VmBuiltinFn)(VmProcess *process, u8 *fp);
+
+/// A function of a builtin module.
+typedef struct VmBuiltin {
+    const char *name;
+    VmBuiltinFn fn;
+    /// The descriptor of the function's frame.
+    DisType frame;
+} VmBuiltin;
+
+/// A module whose code has been loaded.
+/// Each `load` of it makes a new `ModuleLink` with its own module data.
+typedef struct VmModule {
+    /// The path the module was loaded from, e.g. `"$Sys"`.
+    const char *path;
+    /// The module, or `NULL` for a builtin module.
+    DisModule *dis;
+    /// The decoded code.
+    VmInst *code;
+    /// For a builtin module, its functions.
+    const VmBuiltin *builtins;
+    uptr n_builtins;
+    /// The first instruction of each function, in order: the entry point,
+    /// exported functions, and the targets of calls and spawns.
+    uptr *functions;
+    uptr n_functions;
+    /// Whether each function has been handed to the JIT.
+    bool *compiled;
+    /// For each item of module data that is a string, the string, which
+    /// every instance of the module shares.
+    String **literals;
+    /// The native code made for the module.
+    struct JitCode *native;
+} VmModule;
+
+/// A function that a module link resolves to.
+typedef struct VmLinkEntry {
+    /// The entry point, for a function in Dis.
+    const VmInst *pc;
+    /// The function, for a builtin function.
+    VmBuiltinFn builtin;
+    /// The descriptor of the function's frame.
+    const DisType *frame;
+} VmLinkEntry;
+
+/// The state of a process.
+typedef enum VmProcessState {
+    /// Running, or on a run queue.
+    VM_READY,
+    /// Blocked sending to or receiving from a channel, or in an `alt`.
+    VM_BLOCKED,
+    /// Finished, normally or by an exception.
+    VM_EXITED,
+} VmProcessState;
+
+/// `VmProcess.chosen` while no exchange has completed a blocked process.
+#define VM_WAITING (-1)
+
+/// `VmProcess.chosen` while a process holding a channel's lock is trying an
+/// exchange with the blocked process.
+#define VM_CLAIMING (-2)
+
+/// A place on a channel's queue of senders or receivers. A process blocked
+/// in an `alt` waits on several queues at once.
+typedef struct VmWaiter {
+    VmProcess *process;
+    /// The value to send, or where to put the value received.
+    u8 *value;
+    /// For an `alt`, the index of the alternative; otherwise 0.
+    i32 index;
+    /// The channel, and the queue the waiter is on, or `NULL` once it has
+    /// been taken off.
+    Channel *channel;
+    ChannelQueue *queue;
+    struct VmWaiter *prev, *next;
+} VmWaiter;
+
+/// A chunk of a process's stack.
+typedef struct VmStack {
+    /// The chunk below this one, or `NULL`.
+    struct VmStack *prev;
+    /// The top of the chunk below when this one was chained on.
+    u8 *saved_sp;
+    /// The end of `data`.
+    u8 *limit;
+    u8 data[];
+} VmStack;
+
+/// A Dis process: a thread of execution with its own stack.
+struct VmProcess {
+    Vm *vm;
+    u32 pid;
+    VmProcessState state;
+    /// The registers, while the process is not running.
+    const VmInst *pc;
+    u8 *fp;
+    /// The module instance that is running, to which the process holds a
+    /// reference.
+    ModuleLink *link;
+    /// The chunk that frames are allocated from, and the top of it.
+    VmStack *stack;
+    u8 *sp;
+    /// While blocked sending or receiving, its place on the channel's queue.
+    VmWaiter wait;
+    /// Room for an `alt`: its places on queues, the channels it locks, and
+    /// the order it tries its alternatives in.
+    VmWaiter *alt_waiters;
+    Channel **alt_channels;
+    u32 *alt_order;
+    uptr alt_capacity;
+    /// The number of places on queues an `alt` blocked with, or 0.
+    uptr alt_queued;
+    /// While blocked, the index of the waiter an exchange completed the
+    /// process through, `VM_WAITING` or `VM_CLAIMING`.
+    _Atomic i32 chosen;
+    /// The next process on the shared run queue.
+    VmProcess *next;
+    /// The neighbours of the process in the list of every process.
+    VmProcess *all_prev, *all_next;
+};
+
+/// An OS thread running processes.
+/// Each worker has a run queue of its own, which other workers steal half
+/// of when they run out.
+typedef struct VmWorker {
+    Vm *vm;
+    /// The process this worker woke last, to run next, so that processes
+    /// talking over a channel stay on one thread.
+    VmProcess *next;
+    /// How many times in a row `next` has been run.
+    u32 streak;
+    /// The run queue: a ring that only the worker adds to, at `tail`, and
+    /// that it and thieves take from, at `head`.
+    _Atomic u32 head, tail;
+    _Atomic(VmProcess *) queue[VM_RUN_QUEUE];
+    /// The objects this worker has still to release, and the possible
+    /// roots of garbage cycles it has recorded.
+    HeapLocal heap;
+    /// For picking workers to steal from.
+    u32 seed;
+    /// The number of processes run, and of instructions executed.
+    u64 runs, executed;
+} VmWorker;
+
+/// The virtual machine: loaded modules and the processes running them.
+struct Vm {
+    Allocator *allocator;
+    /// Where `Sys->print` writes.
+    FILE *out;
+    /// Guards the modules, the list of processes, and the JIT.
+    mtx_t lock;
+    /// Every module loaded so far, by path.
+    VmModule **modules;
+    uptr n_modules, modules_capacity;
+    /// Every process that has not been destroyed, running or not.
+    VmProcess *all;
+    u32 next_pid;
+    /// The number of workers `Vm_run` starts, or 0 for one per processor.
+    uptr n_workers;
+    VmWorker *workers;
+    /// Guards the shared run queue, which holds processes started before
+    /// `Vm_run` and those that overflow a worker's queue.
+    mtx_t queue_lock;
+    VmProcess *queue_head, *queue_tail;
+    _Atomic uptr queued;
+    /// Signalled when there is work for idle workers, or no more work.
+    cnd_t work;
+    /// The number of workers waiting on `work`.
+    _Atomic u32 idle;
+    /// The number of processes running or ready to. Once it falls to 0,
+    /// nothing is left that can wake a blocked process.
+    _Atomic uptr active;
+    /// Set while a worker collects garbage cycles, which other workers wait
+    /// on `resumed` for before they touch the heap.
+    atomic_bool stopping;
+    mtx_t stop_lock;
+    cnd_t resumed;
+    /// The number of workers that may be touching the heap.
+    _Atomic u32 running;
+    /// Spin locks that keep a store to a pointer from coming between the
+    /// load of the pointer and the reference taken to it by a copy.
+    atomic_bool pointer_locks[VM_POINTER_LOCKS];
+    /// The number of instructions executed. Native code counts the
+    /// instructions of a loop each time it goes round.
+    u64 executed;
+    /// Whether to compile hot functions to native code, where the JIT is
+    /// supported.
+    bool jit;
+    /// The number of functions compiled.
+    u32 compiled;
+    /// Whether any process was killed by an exception.
+    atomic_bool failed;
+};
+
+/// Create a virtual machine.
+/// \param allocator The allocator for modules, processes and the heap.
+/// \param out Where `Sys->print` writes.
+/// \return The virtual machine.
+Vm *Vm_new(Allocator *allocator, FILE *out);
+
+/// Release a virtual machine, its modules, and any processes left.
+/// \param self The virtual machine.
+void Vm_free(Vm *self);
+
+/// Load a module, or find it if it has been loaded already.
+/// \param self The virtual machine.
+/// \param path The path of a `.dis` file, or the name of a builtin module
+/// such as `"$Sys"`.
+/// \return The module, or `NULL` if it cannot be read or is malformed.
+VmModule *Vm_load(Vm *self, const char *path);
+
+/// Start a process running a module's `init` function, as a command.
+/// \param self The virtual machine.
+/// \param module The module.
+/// \param argc The number of arguments.
+/// \param argv The arguments, including the command name, which are passed
+/// as a `list of string`.
+/// \return Whether the module has an entry point to start.
+bool Vm_start(Vm *self, VmModule *module, int argc, char **argv);
+
+/// Run processes until none can make progress, on `n_workers` threads.
+/// \param self The virtual machine.
+/// \return Whether no process was killed by an exception.
+/// \remark Processes blocked forever on channels are discarded.
+/// \remark A pointer store is an atomic exchange, and `movp` loads a pointer
+/// and takes a reference to it as one step. Processes on different workers
+/// that race on a pointer in module data or an adt therefore copy either
+/// the old pointer or the new one, and never one that has been released.
+/// Other instructions that read through a pointer in shared memory without
+/// copying it first, and copies of whole adts and tuples, are not atomic
+/// with respect to a store. Processes must synchronise over channels before
+/// using a value in those ways.
+bool Vm_run(Vm *self);
+
+#endif //LIMBO_VM_H
@@ -0,0 +1,179 @@
+#include <string.h>
+#include "check.h"
+#include "fixture.h"
+
+static TypeTable *types;
+
+/// Check a function with the given body, returning its diagnostics.
+static Diagnostics check(Type *return_type, Node *body) {
+    Type *type = fn_type(types, return_type, 0, NULL);
+    Node *fn = function(global("f", type, DECL_FN), NULL, block(body));
+    Diagnostics diagnostics;
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    check_function(types, fn, &diagnostics);
+    return diagnostics;
+}
+
+/// Check a function that should have exactly one error, and return its
+/// message.
+static const char *error_of(Type *return_type, Node *body) {
+    Diagnostics diagnostics = check(return_type, body);
+    if (!EXPECT(diagnostics.errors == 1)) {
+        Diagnostics_print(&diagnostics);
+        return NULL;
+    }
+    return diagnostics.head->message;
+}
+
+static void test_types(void) {
+    Decl *x = local("x", NULL), *l = local("l", NULL), *s = local("s", NULL);
+    Node *sum = op(NODE_ADD, lit_int(1), lit_int(2));
+    Node *cons = op(NODE_CONS, name(x), nil());
+    Node *index = op(NODE_INDEX, name(s), lit_int(0));
+    Node *body = SEQ(define(x, sum), define(l, cons),
+                     define(s, lit_string("abc")),
+                     op(NODE_RETURN, op(NODE_ADD, op(NODE_HD, name(l), NULL),
+                                        index), NULL));
+    Diagnostics diagnostics = check(type_int, body);
+    EXPECT(diagnostics.errors == 0);
+    EXPECT(sum->type == type_int);
+    EXPECT(x->type == type_int);
+    EXPECT(l->type == TypeTable_list(types, type_int));
+    EXPECT(cons->type == l->type);
+    EXPECT(index->type == type_int);
+
+    Node *big = lit_int(1LL << 40);
+    diagnostics = check(type_big, op(NODE_RETURN, big, NULL));
+    EXPECT(diagnostics.errors == 0);
+    EXPECT(big->type == type_big);
+}
+
+static void test_errors(void) {
+    EXPECT_STR(error_of(type_int, op(NODE_RETURN,
+                                     op(NODE_ADD, lit_int(1),
+                                        lit_string("a")), NULL)),
+               "operands have different types, int and string");
+    EXPECT_STR(error_of(NULL, op(NODE_RETURN, lit_int(1), NULL)),
+               "function does not return a value");
+    EXPECT_STR(error_of(type_int, op(NODE_RETURN, NULL, NULL)),
+               "function must return a value");
+    EXPECT_STR(error_of(type_string, op(NODE_RETURN, lit_int(1), NULL)),
+               "return value must be string, not int");
+    EXPECT_STR(error_of(NULL, op(NODE_ASSIGN, lit_int(1), lit_int(2))),
+               "left side cannot be assigned to");
+    EXPECT_STR(error_of(NULL, op(NODE_HD, lit_int(1), NULL)),
+               "operand must be a list, not int");
+    EXPECT_STR(error_of(NULL, op(NODE_INDEX, lit_real(1), lit_int(0))),
+               "cannot index real");
+    EXPECT_STR(error_of(NULL, op(NODE_SUB, lit_string("a"),
+                                 lit_string("b"))),
+               "operator cannot be applied to string");
+    EXPECT_STR(error_of(NULL, op(NODE_SHL, lit_int(1), lit_string("2"))),
+               "shift count must be int, not string");
+    EXPECT_STR(error_of(NULL, new_array(types, lit_string("3"), type_int)),
+               "array size must be int, not string");
+    EXPECT_STR(error_of(NULL, case_stmt(NODE_ALT, NULL,
+                                        arm(lit_int(1), NULL))),
+               "alt label must send or receive on a channel");
+    Node *pair = op(NODE_DECL, SEQ(name(local("a", type_int)),
+                                   name(local("b", type_int))),
+                    lit_string("x"));
+    EXPECT_STR(error_of(NULL, pair), "initialiser must be int, not string");
+    EXPECT_STR(error_of(NULL, define(local("x", NULL), nil())),
+               "cannot infer a type from nil");
+
+    Type *twice = fn_type(types, type_int, 1, (Type *[]) {type_int});
+    Decl *f = global("twice", twice, DECL_FN);
+    EXPECT_STR(error_of(NULL, call(name(f), SEQ(lit_int(1), lit_int(2)))),
+               "expected 1 arguments, but got 2");
+    EXPECT_STR(error_of(NULL, call(name(f), lit_string("1"))),
+               "argument must be int, not string");
+    EXPECT_STR(error_of(NULL, op(NODE_SPAWN, name(f), NULL)),
+               "spawn needs a function call");
+
+    // An error is reported once, not again by every enclosing expression.
+    Node *bad = op(NODE_ADD, lit_int(1), lit_string("a"));
+    Diagnostics diagnostics = check(type_int,
+                                    op(NODE_RETURN, op(NODE_MUL, bad,
+                                                       lit_int(2)), NULL));
+    EXPECT(diagnostics.errors == 1);
+}
+
+static void test_parallel(void) {
+    // Diagnostics come out in the order the functions were given, however
+    // many threads check them.
+    enum { COUNT = 64 };
+    const char *expected[COUNT];
+    Node *functions[COUNT];
+    for (uptr i = 0; i < COUNT; i++) {
+        Type *type = fn_type(types, type_int, 0, NULL);
+        Decl *x = local("x", NULL);
+        Node *value = i % 3 == 0 ? lit_string("a") : lit_int((i64) i);
+        Node *body = SEQ(define(x, value), op(NODE_RETURN, name(x), NULL));
+        functions[i] = function(global("f", type, DECL_FN), NULL,
+                                block(body));
+        expected[i] = i % 3 == 0 ? "return value must be int, not string"
+                                 : NULL;
+    }
+    for (uptr threads = 1; threads <= 8; threads *= 2) {
+        Diagnostics diagnostics;
+        Diagnostics_init(&diagnostics, fixture_allocator);
+        uptr errors = check_functions(types, functions, COUNT, threads,
+                                      &diagnostics);
+        EXPECT(errors == (COUNT + 2) / 3);
+        const Diagnostic *d = diagnostics.head;
+        for (uptr i = 0; i < COUNT; i++) {
+            if (expected[i] == NULL) {
+                continue;
+            }
+            if (!EXPECT(d != NULL)) {
+                break;
+            }
+            EXPECT_STR(d->message, expected[i]);
+            EXPECT(d->token == functions[i]->body->body->next->left->token);
+            d = d->next;
+        }
+        EXPECT(d == NULL);
+    }
+}
+
+static void test_parallel_tuples(void) {
+    // Tuples holding an adt by value are interned from every thread at once
+    // without laying the adt out again.
+    enum { COUNT = 64 };
+    Type *point = adt_type(2, (const char *[]) {"x", "name"},
+                           (Type *[]) {type_int, type_string});
+    Decl *tuples[COUNT];
+    Node *functions[COUNT];
+    for (uptr i = 0; i < COUNT; i++) {
+        Type *type = fn_type(types, type_none, 0, NULL);
+        Decl *p = local("p", point);
+        tuples[i] = local("t", NULL);
+        Node *tuple = op(NODE_TUPLE, NULL, NULL);
+        tuple->body = SEQ(name(p), lit_int((i64) i));
+        functions[i] = function(global("f", type, DECL_FN), NULL,
+                                block(SEQ(declare_var(p),
+                                          define(tuples[i], tuple))));
+    }
+    Diagnostics diagnostics;
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    EXPECT(check_functions(types, functions, COUNT, 8, &diagnostics) == 0);
+    Type *pair = tuples[0]->type;
+    if (EXPECT(pair != NULL && pair->kind == TTuple)) {
+        EXPECT(pair->size == 24 && pair->members[1].offset == 16);
+    }
+    for (uptr i = 1; i < COUNT; i++) {
+        EXPECT(tuples[i]->type == pair);
+    }
+    EXPECT(point->size == 16 && point->members[1].offset == 8);
+}
+
+int main(int argc, char **argv) {
+    fixture_init(argc, argv);
+    types = TypeTable_new(fixture_allocator);
+    test_types();
+    test_errors();
+    test_parallel();
+    test_parallel_tuples();
+    return fixture_finish();
+}
@@ -0,0 +1,291 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "driver.h"
+#include "fixture.h"
+
+/// The directory the test files are written in.
+static char dir[] = "/tmp/limbo-driver-XXXXXX";
+
+/// The path of a file in `dir`.
+/// \return The path, allocated from `fixture_allocator`.
+static char *path_of(const char *file) {
+    uptr length = sizeof dir + strlen(file) + 1;
+    char *path = ALLOC(fixture_allocator, length);
+    snprintf(path, length, "%s/%s", dir, file);
+    return path;
+}
+
+/// Write a file in `dir`, and set its modification time, so that every
+/// version of a file has a different one however coarse the clock.
+/// \return The path of the file.
+static char *write_source(const char *file, const char *text, time_t mtime) {
+    char *path = path_of(file);
+    FILE *out = fopen(path, "w");
+    if (EXPECT(out != NULL)) {
+        fputs(text, out);
+        fclose(out);
+    }
+    struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+    EXPECT(utimensat(AT_FDCWD, path, times, 0) == 0);
+    return path;
+}
+
+/// Read the whole of a file.
+/// \return The contents, allocated from `fixture_allocator`, or `NULL`.
+static char *read_text(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return NULL;
+    }
+    char *text = NULL;
+    uptr length = 0, capacity = 0;
+    for (int c; (c = fgetc(in)) != EOF;) {
+        GROW(fixture_allocator, text, length + 1, capacity);
+        text[length++] = (char) c;
+    }
+    GROW(fixture_allocator, text, length + 1, capacity);
+    text[length] = '\0';
+    fclose(in);
+    return text;
+}
+
+/// Compile a file with a cache.
+/// \return The token dump, allocated with `malloc`.
+static char *compile(SourceCache *cache, const char *path) {
+    char *output = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&output, &length);
+    EXPECT(driver_compile(cache, path, out, stderr));
+    fclose(out);
+    return output;
+}
+
+static void test_cache(void) {
+    SourceCache cache;
+    SourceCache_init(&cache, fixture_allocator);
+    char *path = write_source("cached.b", "x := 1;\n", 1000);
+    CachedSource *source = SourceCache_get(&cache, path, stderr);
+    if (!EXPECT(source != NULL)) {
+        SourceCache_free(&cache);
+        return;
+    }
+    Token *tokens = source->tokens;
+    EXPECT(cache.lexed == 1 && cache.hits == 0);
+
+    // An unchanged file is not read again.
+    EXPECT(SourceCache_get(&cache, path, stderr) == source);
+    EXPECT(cache.lexed == 1 && cache.hits == 1);
+
+    // Nor is one that was touched, though its contents are hashed.
+    write_source("cached.b", "x := 1;\n", 2000);
+    EXPECT(SourceCache_get(&cache, path, stderr) == source);
+    EXPECT(cache.lexed == 1 && cache.hits == 2);
+    EXPECT(source->tokens == tokens && source->mtime.tv_sec == 2000);
+
+    // Contents of the same size that differ are lexed again.
+    write_source("cached.b", "x := 2;\n", 3000);
+    EXPECT(SourceCache_get(&cache, path, stderr) == source);
+    EXPECT(cache.lexed == 2 && cache.hits == 2);
+    EXPECT_STR(source->file.contents, "x := 2;\n");
+    char *output = compile(&cache, path);
+    EXPECT(output && strstr(output, "INTEGRAL at (1, 6): 2\n") != NULL);
+    free(output);
+    SourceCache_free(&cache);
+}
+
+/// Wait for a server to listen on a socket.
+/// \return Whether it did within a few seconds.
+static bool wait_for(const char *socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, socket_path, sizeof address.sun_path - 1);
+    for (int tries = 0; tries < 500; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool connected = fd >= 0
+                         && connect(fd, (struct sockaddr *) &address,
+                                    sizeof address) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (connected) {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+/// Send a compile request to a server.
+/// \return What the server sent to standard output, allocated from
+/// `fixture_allocator`, or `NULL` if the request failed.
+static char *request(const char *socket_path, const char *path) {
+    char *reply = path_of("reply");
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int fd = open(reply, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (!EXPECT(saved >= 0 && fd >= 0)) {
+        return NULL;
+    }
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    bool ok = driver_request(socket_path, path);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return ok ? read_text(reply) : NULL;
+}
+
+static void test_server(void) {
+    char *socket_path = path_of("socket");
+    char *stats = path_of("stats");
+    char *path = write_source("served.b", "y := 1;\n", 1000);
+    pid_t server = fork();
+    if (server == 0) {
+        // The server reports what its cache did once it is stopped.
+        SourceCache cache;
+        SourceCache_init(&cache, fixture_allocator);
+        cache.isolate = true;
+        bool served = driver_serve(&cache, socket_path);
+        FILE *out = fopen(stats, "w");
+        if (out != NULL) {
+            fprintf(out, "%lu %lu", cache.hits, cache.lexed);
+            fclose(out);
+        }
+        SourceCache_free(&cache);
+        _exit(served ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (!EXPECT(server > 0)) {
+        return;
+    }
+
+    if (EXPECT(wait_for(socket_path))) {
+        char *first = request(socket_path, path);
+        EXPECT(first && strstr(first, "INTEGRAL at (1, 6): 1\n") != NULL);
+        EXPECT_STR(request(socket_path, path), first ? first : "");
+
+        // The file is rewritten with different contents of the same size,
+        // then touched.
+        write_source("served.b", "y := 7;\n", 2000);
+        char *changed = request(socket_path, path);
+        EXPECT(changed
+               && strstr(changed, "INTEGRAL at (1, 6): 7\n") != NULL);
+        write_source("served.b", "y := 7;\n", 3000);
+        EXPECT_STR(request(socket_path, path), changed ? changed : "");
+    }
+
+    kill(server, SIGTERM);
+    int status = 0;
+    waitpid(server, &status, 0);
+    EXPECT(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    // Only the first and the changed file were lexed.
+    EXPECT_STR(read_text(stats), "2 2");
+}
+
+/// Find what a file depends on.
+/// \return The dependencies, allocated with `malloc`.
+static char *deps_of(SourceCache *cache, const char *path,
+                     DepsFormat format) {
+    char *output = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&output, &length);
+    EXPECT(driver_deps(cache, path, format, out, stderr));
+    fclose(out);
+    return output;
+}
+
+static void test_deps(void) {
+    // sys.m is found in the include directory, and draw.m beside it. It is
+    // included twice but listed once, and the includes in the comment and
+    // the string are not includes at all.
+    char *inc = path_of("inc");
+    EXPECT(mkdir(inc, 0700) == 0);
+    char *main_path = write_source("main.b",
+        "implement Command;\n"
+        "include \"sys.m\";\n"
+        "include \"local.m\";\n"
+        "# include \"commented.m\";\n"
+        "init()\n"
+        "{\n"
+        "    s := `include \"quoted.m\"`;\n"
+        "    sys = load Sys Sys->PATH;\n"
+        "    tool := load Tool \"/dis/tool.dis\";\n"
+        "    other := load Other where;\n"
+        "}\n", 1000);
+    write_source("inc/sys.m",
+        "include \"draw.m\";\n"
+        "Sys: module\n"
+        "{\n"
+        "    PATH: con \"$Sys\";\n"
+        "};\n", 1000);
+    write_source("inc/draw.m", "Draw: module { PATH: con \"/dis/draw\"; };\n",
+                 1000);
+    write_source("local.m", "include \"sys.m\";\n", 1000);
+
+    SourceCache cache;
+    SourceCache_init(&cache, fixture_allocator);
+    SourceCache_include(&cache, inc);
+    char expected[2048];
+    snprintf(expected, sizeof expected,
+             "%s/main.dis: %s/main.b %s/inc/sys.m %s/local.m %s/inc/draw.m\n"
+             "\n%s/inc/sys.m:\n\n%s/local.m:\n\n%s/inc/draw.m:\n",
+             dir, dir, dir, dir, dir, dir, dir, dir);
+    char *make = deps_of(&cache, main_path, DEPS_MAKE);
+    EXPECT_STR(make, expected);
+    free(make);
+
+    // A load names its path as a string, or by a constant of a module.
+    snprintf(expected, sizeof expected,
+             "{\"source\": \"%s/main.b\", \"target\": \"%s/main.dis\", "
+             "\"implements\": [\"Command\"], "
+             "\"includes\": [\"%s/inc/sys.m\", \"%s/local.m\", "
+             "\"%s/inc/draw.m\"], "
+             "\"loads\": [{\"module\": \"Sys\", \"path\": \"$Sys\"}, "
+             "{\"module\": \"Tool\", \"path\": \"/dis/tool.dis\"}, "
+             "{\"module\": \"Other\", \"path\": null}]}\n",
+             dir, dir, dir, dir, dir);
+    char *json = deps_of(&cache, main_path, DEPS_JSON);
+    EXPECT_STR(json, expected);
+    free(json);
+
+    // Without the include directory, sys.m cannot be found.
+    SourceCache_free(&cache);
+    SourceCache_init(&cache, fixture_allocator);
+    FILE *quiet = fopen("/dev/null", "w");
+    EXPECT(!driver_deps(&cache, main_path, DEPS_MAKE, quiet, quiet));
+    fclose(quiet);
+    SourceCache_free(&cache);
+
+    unlink(path_of("inc/sys.m"));
+    unlink(path_of("inc/draw.m"));
+    rmdir(inc);
+}
+
+int main(int argc, char **argv) {
+    fixture_init(argc, argv);
+    if (!EXPECT(mkdtemp(dir) != NULL)) {
+        return fixture_finish();
+    }
+    test_cache();
+    test_server();
+    test_deps();
+
+    DIR *entries = opendir(dir);
+    for (struct dirent *e; entries && (e = readdir(entries));) {
+        if (e->d_name[0] != '.') {
+            unlink(path_of(e->d_name));
+        }
+    }
+    if (entries) {
+        closedir(entries);
+    }
+    rmdir(dir);
+    return fixture_finish();
+}
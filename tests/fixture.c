@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "check.h"
+#include "fold.h"
+#include "gen.h"
+#include "layout.h"
+#include "fixture.h"
+
+Allocator *fixture_allocator;
+
+/// The path of `limbo-run`, or `NULL` if programs cannot be run.
+static const char *runner;
+static uptr failures;
+
+// Expectations
+
+void fixture_init(int argc, char **argv) {
+    fixture_allocator = system_allocator;
+    runner = argc > 1 ? argv[1] : NULL;
+}
+
+int fixture_finish(void) {
+    if (failures) {
+        fprintf(stderr, "%lu failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+bool expect_true(bool cond, const char *text, const char *file, int line) {
+    if (!cond) {
+        fprintf(stderr, "%s:%d: expected %s\n", file, line, text);
+        failures++;
+    }
+    return cond;
+}
+
+bool expect_string(const char *actual, const char *expected, const char *file,
+                   int line) {
+    if (actual == NULL || strcmp(actual, expected) != 0) {
+        fprintf(stderr, "%s:%d: expected\n%s\nbut got\n%s\n", file, line,
+                expected, actual ? actual : "(nothing)");
+        failures++;
+        return false;
+    }
+    return true;
+}
+
+// Syntax trees
+
+Token *token(const char *text) {
+    SourceFile *file = ALLOC(fixture_allocator, sizeof(SourceFile));
+    *file = (SourceFile) {.name = "test.b", .contents = text};
+    Token *token = ALLOC(fixture_allocator, sizeof(Token));
+    *token = (Token) {
+        .location = text,
+        .length = strlen(text),
+        .source_file = file,
+        .source_file_name = file->name,
+        .source_file_line = 1,
+    };
+    return token;
+}
+
+Node *op(NodeKind kind, Node *left, Node *right) {
+    Node *node = ALLOC(fixture_allocator, sizeof(Node));
+    *node = (Node) {
+        .kind = kind,
+        .token = token("op"),
+        .left = left,
+        .right = right,
+    };
+    return node;
+}
+
+Node *lit_int(i64 value) {
+    Node *node = op(NODE_INTEGRAL, NULL, NULL);
+    node->int_value = value;
+    return node;
+}
+
+Node *lit_real(f64 value) {
+    Node *node = op(NODE_REAL, NULL, NULL);
+    node->real_value = value;
+    return node;
+}
+
+Node *lit_string(const char *value) {
+    Node *node = op(NODE_STRING, NULL, NULL);
+    node->string_value = value;
+    node->string_length = strlen(value);
+    return node;
+}
+
+Node *nil(void) {
+    return op(NODE_NIL, NULL, NULL);
+}
+
+Decl *local(const char *name, Type *type) {
+    Decl *decl = global(name, type, DECL_VAR);
+    decl->depth = 1;
+    return decl;
+}
+
+Decl *global(const char *name, Type *type, DeclKind kind) {
+    Decl *decl = ALLOC(fixture_allocator, sizeof(Decl));
+    *decl = (Decl) {.kind = kind, .token = token(name), .type = type};
+    return decl;
+}
+
+Node *name(Decl *decl) {
+    Node *node = op(NODE_IDENTIFIER, NULL, NULL);
+    node->decl = decl;
+    node->token = decl->token;
+    return node;
+}
+
+Node *chain(uptr n, Node **nodes) {
+    for (uptr i = 0; i + 1 < n; i++) {
+        nodes[i]->next = nodes[i + 1];
+    }
+    return n ? nodes[0] : NULL;
+}
+
+Node *block(Node *body) {
+    Node *node = op(NODE_BLOCK, NULL, NULL);
+    node->body = body;
+    return node;
+}
+
+Node *define(Decl *decl, Node *value) {
+    return op(NODE_DECL_EXP, name(decl), value);
+}
+
+Node *declare_var(Decl *decl) {
+    return op(NODE_DECL, name(decl), NULL);
+}
+
+Node *if_stmt(Node *cond, Node *then, Node *else_) {
+    Node *node = op(NODE_IF, NULL, NULL);
+    node->cond = cond;
+    node->then = then;
+    node->else_ = else_;
+    return node;
+}
+
+Node *while_stmt(Node *cond, Node *body) {
+    Node *node = op(NODE_WHILE, NULL, NULL);
+    node->cond = cond;
+    node->body = body;
+    return node;
+}
+
+Node *for_stmt(Decl *decl, Node *init, Node *cond, Node *inc, Node *body) {
+    Node *node = op(NODE_FOR, NULL, NULL);
+    node->init = define(decl, init);
+    node->cond = cond;
+    node->inc = inc;
+    node->body = body;
+    return node;
+}
+
+Node *case_stmt(NodeKind kind, Node *cond, Node *arms) {
+    Node *node = op(kind, NULL, NULL);
+    node->cond = cond;
+    node->body = arms;
+    return node;
+}
+
+Node *arm(Node *labels, Node *body) {
+    Node *node = op(NODE_CASE_ARM, labels, NULL);
+    node->body = body;
+    return node;
+}
+
+Node *call(Node *callee, Node *args) {
+    return op(NODE_FUNCTION_CALL, callee, args);
+}
+
+Node *dot(Node *value, const char *member) {
+    Node *node = op(NODE_DOT, value, NULL);
+    node->token = token(member);
+    return node;
+}
+
+Node *cast(Node *value, Type *type) {
+    Node *node = op(NODE_CAST, value, NULL);
+    node->type = type;
+    return node;
+}
+
+Node *new_array(TypeTable *types, Node *length, Type *elem) {
+    Node *node = op(NODE_ARRAY, length, NULL);
+    node->type = TypeTable_array(types, elem);
+    return node;
+}
+
+Node *new_channel(TypeTable *types, Node *buffer, Type *elem) {
+    Node *node = op(NODE_CHAN, buffer, NULL);
+    node->type = TypeTable_chan(types, elem);
+    return node;
+}
+
+Node *function(Decl *decl, Node *params, Node *body) {
+    Node *node = op(NODE_FUNCTION, params, NULL);
+    node->decl = decl;
+    node->body = body;
+    decl->value = node;
+    return node;
+}
+
+Type *adt_type(uptr n, const char **names, Type **types) {
+    Member *members = ALLOC(fixture_allocator, n * sizeof(Member));
+    for (uptr i = 0; i < n; i++) {
+        members[i] = (Member) {
+            .type = types[i],
+            .name = token(names[i]),
+            .index = i,
+        };
+    }
+    Type *type = ALLOC(fixture_allocator, sizeof(Type));
+    *type = (Type) {.kind = TAdt, .n_members = n, .members = members};
+    layout_type(type, false);
+    return type;
+}
+
+Type *fn_type(TypeTable *types, Type *return_type, uptr n_params,
+              Type **params) {
+    return TypeTable_fn(types, return_type, n_params, params);
+}
+
+// Programs
+
+void Program_init(Program *self) {
+    *self = (Program) {.types = TypeTable_new(fixture_allocator)};
+
+    Type *print = fn_type(self->types, type_int, 1, (Type *[]) {type_string});
+    Member *members = ALLOC(fixture_allocator, sizeof(Member));
+    members[0] = (Member) {.type = print, .name = token("print")};
+    Type *sys = ALLOC(fixture_allocator, sizeof(Type));
+    *sys = (Type) {
+        .kind = TModule,
+        .size = sizeof(void *),
+        .align = sizeof(void *),
+        .is_ptr = true,
+        .n_members = 1,
+        .members = members,
+    };
+    self->sys_type = sys;
+    self->sys = Program_global(self, "sys", sys);
+}
+
+Decl *Program_global(Program *self, const char *name, Type *type) {
+    Decl *decl = global(name, type, DECL_VAR);
+    self->globals[self->n_globals++] = decl;
+    return decl;
+}
+
+Decl *Program_function(Program *self, Decl *decl, Node *params, Node *body) {
+    self->functions[self->n_functions++] = function(decl, params, block(body));
+    return decl;
+}
+
+void Program_init_function(Program *self, Node *body) {
+    Node *load = op(NODE_LOAD, lit_string("$Sys"), NULL);
+    load->type = self->sys_type;
+    Node *start = op(NODE_ASSIGN, name(self->sys), load);
+    start->next = body;
+    Type *type = fn_type(self->types, NULL, 0, NULL);
+    Program_function(self, global("init", type, DECL_FN), NULL, start);
+}
+
+Node *print(Program *self, Node *value) {
+    return call(dot(name(self->sys), "print"), value);
+}
+
+Node *print_line(Program *self, Node *value) {
+    return print(self, op(NODE_ADD, cast(value, type_string),
+                          lit_string("\n")));
+}
+
+uptr Program_check(Program *self) {
+    Diagnostics diagnostics;
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    uptr errors = check_functions(self->types, self->functions,
+                                  self->n_functions, 0, &diagnostics);
+    if (errors == 0) {
+        for (uptr i = 0; i < self->n_functions; i++) {
+            fold_function(fixture_allocator, self->functions[i],
+                          &diagnostics);
+        }
+        errors = diagnostics.errors;
+    }
+    Diagnostics_print(&diagnostics);
+    return errors;
+}
+
+/// Read everything from a stream.
+static char *read_all(FILE *in) {
+    char *text = NULL;
+    uptr length = 0, capacity = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        GROW(fixture_allocator, text, length + 1, capacity);
+        text[length++] = (char) c;
+    }
+    GROW(fixture_allocator, text, length + 1, capacity);
+    text[length] = '\0';
+    return text;
+}
+
+DisModule *Program_generate(Program *self, Allocator *allocator,
+                            PassManager *passes) {
+    Diagnostics diagnostics;
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    DisModule *module = gen_module(allocator, "Test", self->globals,
+                                   self->n_globals, self->functions,
+                                   self->n_functions, passes, NULL,
+                                   &diagnostics);
+    Diagnostics_print(&diagnostics);
+    if (diagnostics.errors) {
+        DisModule_free(module);
+        return NULL;
+    }
+    return module;
+}
+
+char *Program_run(Program *self, PassManager *passes, const char *flags) {
+    if (runner == NULL) {
+        fprintf(stderr, "no path to limbo-run was given\n");
+        failures++;
+        return NULL;
+    }
+
+    // Code generation must not leak, whatever the program.
+    Allocator *allocator = DebugAllocator_new(system_allocator);
+    DisModule *module = Program_generate(self, allocator, passes);
+
+    char path[] = "/tmp/limbo-test-XXXXXX";
+    int fd = mkstemp(path);
+    bool written = fd >= 0 && module && dis_write_file(module, path);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (module) {
+        DisModule_free(module);
+    }
+    FILE *quiet = fopen("/dev/null", "w");
+    if (DebugAllocator_report(allocator, quiet ? quiet : stderr) != 0) {
+        DebugAllocator_report(allocator, stderr);
+        fprintf(stderr, "code generation leaked\n");
+        failures++;
+    }
+    if (quiet) {
+        fclose(quiet);
+    }
+    Allocator_destroy(allocator);
+
+    char *output = NULL;
+    if (written) {
+        uptr length = strlen(runner) + strlen(flags) + strlen(path) + 16;
+        char *command = ALLOC(fixture_allocator, length);
+        snprintf(command, length, "'%s' %s %s 2>&1", runner, flags, path);
+        FILE *in = popen(command, "r");
+        if (in) {
+            output = read_all(in);
+            pclose(in);
+        }
+    }
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return output;
+}
+
+bool expect_run(Program *program, PassManager *passes, const char *expected,
+                const char *file, int line) {
+    bool ok = expect_string(Program_run(program, NULL, ""), expected, file,
+                            line);
+    ok &= expect_string(Program_run(program, passes, ""), expected, file,
+                        line);
+    ok &= expect_string(Program_run(program, passes, "-i"), expected, file,
+                        line);
+    return ok;
+}
+
+void default_passes(PassManager *passes) {
+    PassManager_init(passes, fixture_allocator);
+    opt_default_pipeline(passes);
+}
+
+uptr pass_changes(const PassManager *passes, const char *name) {
+    for (uptr i = 0; i < passes->n_passes; i++) {
+        if (strcmp(passes->passes[i].name, name) == 0) {
+            return passes->passes[i].changes;
+        }
+    }
+    return 0;
+}
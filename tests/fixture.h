@@ -0,0 +1,214 @@
+#ifndef LIMBO_FIXTURE_H
+#define LIMBO_FIXTURE_H
+
+#include "alloc.h"
+#include "dis.h"
+#include "error.h"
+#include "opt.h"
+#include "parser.h"
+#include "type.h"
+
+// Expectations
+
+/// Record a failure, without stopping the test, if a condition is false.
+#define EXPECT(cond) expect_true((cond), #cond, __FILE__, __LINE__)
+
+/// Record a failure if two strings differ, showing both.
+#define EXPECT_STR(actual, expected) \
+    expect_string((actual), (expected), __FILE__, __LINE__)
+
+/// Set up a test program.
+/// \param argc The number of command line arguments.
+/// \param argv The command line arguments; the first argument, if any, is
+/// the path of `limbo-run`.
+void fixture_init(int argc, char **argv);
+
+/// Report the number of failures.
+/// \return The exit status of the test program.
+int fixture_finish(void);
+
+/// Record a failure if a condition is false.
+/// \return The condition.
+bool expect_true(bool cond, const char *text, const char *file, int line);
+
+/// Record a failure if two strings differ.
+/// \return Whether the strings are equal.
+bool expect_string(const char *actual, const char *expected, const char *file,
+                   int line);
+
+// Syntax trees
+//
+// Nodes, declarations and types live as long as the test program, and every
+// node gets a token of its own, so diagnostics have somewhere to point.
+
+/// The allocator that nodes, declarations and types are allocated from.
+extern Allocator *fixture_allocator;
+
+/// Create a token whose text is `text`.
+Token *token(const char *text);
+
+/// Create a node of any kind.
+Node *op(NodeKind kind, Node *left, Node *right);
+
+/// Create a `NODE_INTEGRAL`.
+Node *lit_int(i64 value);
+
+/// Create a `NODE_REAL`.
+Node *lit_real(f64 value);
+
+/// Create a `NODE_STRING`.
+Node *lit_string(const char *value);
+
+/// Create a `NODE_NIL`.
+Node *nil(void);
+
+/// Declare a local variable.
+/// \param type The type, or `NULL` for a variable declared with `:=`.
+Decl *local(const char *name, Type *type);
+
+/// Declare a module-level name.
+Decl *global(const char *name, Type *type, DeclKind kind);
+
+/// Create a `NODE_IDENTIFIER` that refers to a declaration.
+Node *name(Decl *decl);
+
+/// Link nodes by `next`.
+/// \return The first node.
+Node *chain(uptr n, Node **nodes);
+
+/// Link the given nodes by `next`.
+#define SEQ(...) \
+    chain(sizeof((Node *[]) {__VA_ARGS__}) / sizeof(Node *), \
+          (Node *[]) {__VA_ARGS__})
+
+/// Create a `NODE_BLOCK`.
+Node *block(Node *body);
+
+/// Create a `NODE_DECL_EXP`, `decl := value`.
+Node *define(Decl *decl, Node *value);
+
+/// Create a `NODE_DECL` without an initialiser, `decl: type`, which sets the
+/// variable to the zero value of its type.
+Node *declare_var(Decl *decl);
+
+/// Create a `NODE_IF`.
+/// \param else_ The statements to run otherwise, or `NULL`.
+Node *if_stmt(Node *cond, Node *then, Node *else_);
+
+/// Create a `NODE_WHILE`.
+Node *while_stmt(Node *cond, Node *body);
+
+/// Create a `NODE_FOR`, `for (decl := init; cond; inc) body`.
+Node *for_stmt(Decl *decl, Node *init, Node *cond, Node *inc, Node *body);
+
+/// Create a `NODE_CASE` or `NODE_ALT` from its arms.
+Node *case_stmt(NodeKind kind, Node *cond, Node *arms);
+
+/// Create a `NODE_CASE_ARM`.
+/// \param labels The labels, linked by `next`; a `NODE_NOP` is `*`.
+Node *arm(Node *labels, Node *body);
+
+/// Create a `NODE_FUNCTION_CALL`.
+Node *call(Node *callee, Node *args);
+
+/// Create a `NODE_DOT`.
+Node *dot(Node *value, const char *member);
+
+/// Create a `NODE_CAST`.
+Node *cast(Node *value, Type *type);
+
+/// Create a `NODE_ARRAY`, `array[length] of elem`.
+Node *new_array(TypeTable *types, Node *length, Type *elem);
+
+/// Create a `NODE_CHAN`, `chan[buffer] of elem`.
+/// \param buffer The buffer size, or `NULL` for an unbuffered channel.
+Node *new_channel(TypeTable *types, Node *buffer, Type *elem);
+
+/// Create a `NODE_FUNCTION` and set it as the value of its declaration.
+Node *function(Decl *decl, Node *params, Node *body);
+
+/// Create an adt and lay it out in declaration order.
+/// \param names The names of the members.
+/// \param types The types of the members.
+Type *adt_type(uptr n, const char **names, Type **types);
+
+/// Create a function type.
+/// \param return_type The return type, or `NULL` if it returns nothing.
+Type *fn_type(TypeTable *types, Type *return_type, uptr n_params,
+              Type **params);
+
+// Programs
+
+/// A module under test, which can print through `Sys`.
+typedef struct Program {
+    TypeTable *types;
+    /// The type of the `Sys` module, with only `print: fn(s: string): int`.
+    Type *sys_type;
+    /// The module-level variable holding `Sys`, which is always the first
+    /// module-level variable.
+    Decl *sys;
+    Decl *globals[16];
+    uptr n_globals;
+    Node *functions[16];
+    uptr n_functions;
+} Program;
+
+/// Create a program with no functions.
+void Program_init(Program *self);
+
+/// Add a module-level variable.
+Decl *Program_global(Program *self, const char *name, Type *type);
+
+/// Add a function.
+/// \param body The statements of the body, which become a block.
+/// \return The function's declaration.
+Decl *Program_function(Program *self, Decl *decl, Node *params, Node *body);
+
+/// Add the entry point, `init()`.
+/// The body starts by loading `Sys`.
+void Program_init_function(Program *self, Node *body);
+
+/// Create the statement `sys->print(value)`.
+Node *print(Program *self, Node *value);
+
+/// Create the statement `sys->print(string value + "\n")`.
+Node *print_line(Program *self, Node *value);
+
+/// Type check and fold every function.
+/// \return The number of errors found, which are printed.
+uptr Program_check(Program *self);
+
+/// Generate the program.
+/// \param allocator The allocator to allocate the module from.
+/// \param passes The passes to optimise with, or `NULL`.
+/// \return The module, or `NULL` if code generation reported errors, which
+/// are printed.
+DisModule *Program_generate(Program *self, Allocator *allocator,
+                            PassManager *passes);
+
+/// Generate the program, run it with `limbo-run`, and return what it
+/// printed. Leaks in code generation are recorded as failures.
+/// \param passes The passes to optimise with, or `NULL`.
+/// \param flags Extra flags for `limbo-run`, such as `-i`.
+/// \return The output, allocated from `fixture_allocator`, or `NULL` if the
+/// program could not be generated or run.
+char *Program_run(Program *self, PassManager *passes, const char *flags);
+
+/// Record a failure unless a program prints `expected` when it is run
+/// without optimising it, optimised, and optimised but interpreted alone.
+#define EXPECT_RUN(program, passes, expected) \
+    expect_run((program), (passes), (expected), __FILE__, __LINE__)
+
+/// Run a program unoptimised and optimised with `passes`, which keeps the
+/// totals of each pass for the caller to inspect.
+/// \return Whether every run printed `expected`.
+bool expect_run(Program *program, PassManager *passes, const char *expected,
+                const char *file, int line);
+
+/// Create a pipeline of the standard passes.
+void default_passes(PassManager *passes);
+
+/// The number of times a pass of a pipeline has changed a function.
+uptr pass_changes(const PassManager *passes, const char *name);
+
+#endif //LIMBO_FIXTURE_H
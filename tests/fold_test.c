@@ -0,0 +1,186 @@
+#include <string.h>
+#include "fold.h"
+#include "fixture.h"
+
+static Diagnostics diagnostics;
+
+/// Fold an expression, returning it.
+static Node *fold(Node *node) {
+    fold_expr(fixture_allocator, node, &diagnostics);
+    return node;
+}
+
+/// Whether a node folded to an integral literal of the given type and value.
+static bool is_int(const Node *node, const Type *type, i64 value) {
+    return node->kind == NODE_INTEGRAL && node->type == type
+           && node->int_value == value;
+}
+
+static void test_expressions(void) {
+    EXPECT(is_int(fold(op(NODE_MUL, lit_int(32), lit_int(4))), type_int,
+                  128));
+    EXPECT(is_int(fold(op(NODE_ADD, lit_int(INT32_MAX), lit_int(1))),
+                  type_int, INT32_MIN));
+    EXPECT(is_int(fold(op(NODE_EXP, lit_int(3), lit_int(4))), type_int, 81));
+    EXPECT(is_int(fold(op(NODE_LT, lit_string("a"), lit_string("b"))),
+                  type_int, 1));
+    EXPECT(is_int(fold(op(NODE_LEN, lit_string("h\xc3\xa9llo"), NULL)),
+                  type_int, 5));
+    EXPECT(is_int(fold(op(NODE_INDEX, lit_string("h\xc3\xa9llo"),
+                          lit_int(1))), type_int, 0xe9));
+    EXPECT(is_int(fold(cast(lit_real(-2.5), type_int)), type_int, -3));
+    EXPECT(is_int(fold(cast(lit_int(300), type_byte)), type_byte, 44));
+
+    Node *joined = fold(op(NODE_ADD, lit_string("a"), lit_string("bc")));
+    EXPECT(joined->kind == NODE_STRING && joined->string_length == 3
+           && memcmp(joined->string_value, "abc", 3) == 0);
+    Node *digits = fold(cast(lit_int(-42), type_string));
+    EXPECT(digits->kind == NODE_STRING && digits->string_length == 3
+           && memcmp(digits->string_value, "-42", 3) == 0);
+    Node *real = fold(op(NODE_MUL, lit_real(2.5), lit_real(4)));
+    EXPECT(real->kind == NODE_REAL && real->real_value == 10);
+
+    // A decided left operand makes the right one dead.
+    Node *call_ = call(lit_int(1), NULL);
+    EXPECT(is_int(fold(op(NODE_AND, lit_int(0), call_)), type_int, 0));
+
+    // Operations that would fail at run time are left to fail there.
+    uptr errors = diagnostics.errors;
+    EXPECT(fold(op(NODE_DIV, lit_int(1), lit_int(0)))->kind == NODE_DIV);
+    EXPECT(diagnostics.errors == errors + 1);
+    EXPECT(fold(op(NODE_INDEX, lit_string("ab"), lit_int(2)))->kind
+           == NODE_INDEX);
+    EXPECT(diagnostics.errors == errors + 2);
+
+    // Identities are removed around values that are not constant.
+    Decl *x = local("x", type_int);
+    Node *sum = op(NODE_ADD, name(x), op(NODE_SUB, lit_int(3), lit_int(3)));
+    sum->type = sum->left->type = type_int;
+    EXPECT(!fold_expr(fixture_allocator, sum, &diagnostics));
+    EXPECT(sum->kind == NODE_IDENTIFIER && sum->decl == x);
+}
+
+static void test_cons(void) {
+    Decl *a = global("a", NULL, DECL_CON), *b = global("b", NULL, DECL_CON);
+    a->value = op(NODE_MUL, name(b), lit_int(2));
+    b->value = op(NODE_ADD, lit_int(16), lit_int(4));
+    EXPECT(fold_con(fixture_allocator, a, &diagnostics));
+    EXPECT(is_int(a->value, type_int, 40) && a->type == type_int);
+    EXPECT(is_int(b->value, type_int, 20) && b->type == type_int);
+
+    Decl *c = global("c", NULL, DECL_CON), *d = global("d", NULL, DECL_CON);
+    c->value = name(d);
+    d->value = op(NODE_ADD, name(c), lit_int(1));
+    uptr errors = diagnostics.errors;
+    EXPECT(!fold_con(fixture_allocator, c, &diagnostics));
+    EXPECT(diagnostics.errors > errors);
+}
+
+static void test_pruning(void) {
+    Decl *a = global("a", type_int, DECL_CON);
+    a->value = lit_int(5);
+    Node *taken = op(NODE_RETURN, lit_int(1), NULL);
+    Node *if_ = if_stmt(op(NODE_GT, name(a), lit_int(3)), block(taken),
+                        block(op(NODE_RETURN, lit_int(2), NULL)));
+    Node *loop = while_stmt(op(NODE_EQ, name(a), lit_int(0)),
+                            block(op(NODE_RETURN, lit_int(3), NULL)));
+    Node *last = op(NODE_RETURN, lit_int(0), NULL);
+    Type *type = fn_type(TypeTable_new(fixture_allocator), type_int, 0, NULL);
+    Node *fn = function(global("f", type, DECL_FN), NULL,
+                        block(SEQ(if_, loop, last)));
+    fold_function(fixture_allocator, fn, &diagnostics);
+    EXPECT(if_->kind == NODE_BLOCK && if_->body->body == taken);
+    EXPECT(loop->kind == NODE_NOP);
+    EXPECT(if_->next == loop && loop->next == last);
+}
+
+/// An operation and its operands, which are evaluated both by the folder
+/// and by the program.
+typedef struct Case {
+    NodeKind kind;
+    Type *type;
+    i64 a, b;
+    const char *expected;
+} Case;
+
+/// A literal of the given type.
+static Node *typed(Type *type, i64 value) {
+    return type == type_int ? lit_int(value) : cast(lit_int(value), type);
+}
+
+/// Folding must give the same results as running the program, or SCCP, which
+/// folds as it propagates, would change what an optimised program prints.
+static void test_agrees_with_vm(void) {
+    const Case cases[] = {
+        {NODE_ADD, type_int, INT32_MAX, 1, "-2147483648"},
+        {NODE_SUB, type_int, INT32_MIN, 1, "2147483647"},
+        {NODE_MUL, type_int, 46341, 46341, "-2147479015"},
+        {NODE_DIV, type_int, -7, 2, "-3"},
+        {NODE_MOD, type_int, -7, 2, "-1"},
+        {NODE_DIV, type_int, INT32_MIN, -1, "-2147483648"},
+        {NODE_MOD, type_int, INT32_MIN, -1, "0"},
+        {NODE_EXP, type_int, 2, 31, "-2147483648"},
+        {NODE_BIT_AND, type_int, 12, 10, "8"},
+        {NODE_BIT_OR, type_int, 12, 10, "14"},
+        {NODE_BIT_XOR, type_int, 12, 10, "6"},
+        {NODE_SHL, type_int, 1, 31, "-2147483648"},
+        {NODE_SHR, type_int, -8, 1, "-4"},
+        {NODE_LT, type_int, -1, 0, "1"},
+        {NODE_ADD, type_byte, 200, 100, "44"},
+        {NODE_SUB, type_byte, 0, 1, "255"},
+        {NODE_SHR, type_byte, 128, 7, "1"},
+        {NODE_ADD, type_big, INT64_MAX, 1, "-9223372036854775808"},
+        {NODE_MUL, type_big, 1LL << 32, 1LL << 32, "0"},
+        {NODE_DIV, type_big, INT64_MIN, -1, "-9223372036854775808"},
+        {NODE_SHL, type_big, 1, 40, "1099511627776"},
+        {NODE_GTE, type_big, 1LL << 40, 1LL << 40, "1"},
+        // Shift counts are taken modulo the width.
+        {NODE_SHL, type_int, 1, 32, "1"},
+        {NODE_SHL, type_int, 1, 33, "2"},
+        {NODE_SHL, type_int, 1, -1, "-2147483648"},
+        {NODE_SHR, type_int, -8, 32, "-8"},
+        {NODE_SHR, type_int, -8, 33, "-4"},
+        {NODE_SHL, type_byte, 1, 8, "1"},
+        {NODE_SHR, type_byte, 128, 9, "64"},
+        {NODE_SHL, type_big, 1, 64, "1"},
+        {NODE_SHR, type_big, -1, 65, "-1"},
+    };
+    Program program;
+    Program_init(&program);
+    Node *body = NULL, **tail = &body;
+    char expected[1024] = "";
+    for (uptr i = 0; i < sizeof(cases) / sizeof(Case); i++) {
+        const Case *c = &cases[i];
+        // Shift counts are always ints.
+        Type *count = c->kind == NODE_SHL || c->kind == NODE_SHR ? type_int
+                                                                 : c->type;
+        Decl *x = local("x", NULL), *y = local("y", NULL);
+        *tail = SEQ(define(x, typed(c->type, c->a)),
+                    define(y, typed(count, c->b)),
+                    print_line(&program, op(c->kind, typed(c->type, c->a),
+                                            typed(count, c->b))),
+                    print_line(&program, op(c->kind, name(x), name(y))));
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        strcat(expected, c->expected);
+        strcat(expected, "\n");
+        strcat(expected, c->expected);
+        strcat(expected, "\n");
+    }
+    Program_init_function(&program, body);
+    EXPECT(Program_check(&program) == 0);
+    PassManager passes;
+    default_passes(&passes);
+    EXPECT_RUN(&program, &passes, expected);
+}
+
+int main(int argc, char **argv) {
+    fixture_init(argc, argv);
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    test_expressions();
+    test_cons();
+    test_pruning();
+    test_agrees_with_vm();
+    return fixture_finish();
+}
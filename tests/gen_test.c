@@ -0,0 +1,740 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "gen.h"
+#include "jit.h"
+#include "layout.h"
+#include "fixture.h"
+
+static PassManager passes;
+
+static void test_functions(void) {
+    Program p;
+    Program_init(&p);
+
+    // fib(n) calls itself twice, so it cannot become a loop or be inlined.
+    Decl *n = local("n", NULL);
+    Decl *fib = global("fib", fn_type(p.types, type_int, 1,
+                                      (Type *[]) {type_int}), DECL_FN);
+    Node *recurse = op(NODE_ADD,
+                       call(name(fib), op(NODE_SUB, name(n), lit_int(1))),
+                       call(name(fib), op(NODE_SUB, name(n), lit_int(2))));
+    Program_function(&p, fib, name(n), SEQ(
+        if_stmt(op(NODE_LT, name(n), lit_int(2)),
+                op(NODE_RETURN, name(n), NULL), NULL),
+        op(NODE_RETURN, recurse, NULL)));
+
+    // count() updates a module-level variable and returns a string.
+    Decl *counter = Program_global(&p, "counter", type_int);
+    Decl *by = local("by", NULL);
+    Decl *count = global("count", fn_type(p.types, type_string, 1,
+                                          (Type *[]) {type_int}), DECL_FN);
+    Program_function(&p, count, name(by), SEQ(
+        op(NODE_ASSIGN_ADD, name(counter), name(by)),
+        op(NODE_RETURN, op(NODE_ADD, lit_string("counter "),
+                           cast(name(counter), type_string)), NULL)));
+
+    Program_init_function(&p, SEQ(
+        print_line(&p, call(name(fib), lit_int(20))),
+        print_line(&p, call(name(count), lit_int(2))),
+        print_line(&p, call(name(count), lit_int(40)))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "6765\ncounter 2\ncounter 42\n");
+#ifdef JIT_SUPPORTED
+    // fib is called often enough to be compiled to native code.
+    char *stats = Program_run(&p, &passes, "-s");
+    EXPECT(stats && strncmp(stats, "6765\n", 5) == 0
+           && strstr(stats, ", 0 functions compiled") == NULL
+           && strstr(stats, "functions compiled") != NULL);
+#endif
+}
+
+static void test_control(void) {
+    Program p;
+    Program_init(&p);
+    Decl *i = local("i", NULL), *j = local("j", NULL), *k = local("k", NULL);
+    Decl *sum = local("sum", NULL);
+
+    // Odd numbers are skipped, and the loop stops at 10.
+    Node *loop = for_stmt(i, lit_int(0), lit_int(1),
+                          op(NODE_INC, name(i), NULL), block(SEQ(
+        if_stmt(op(NODE_EQ, name(i), lit_int(10)),
+                op(NODE_BREAK, NULL, NULL), NULL),
+        if_stmt(op(NODE_MOD, name(i), lit_int(2)),
+                op(NODE_CONTINUE, NULL, NULL), NULL),
+        op(NODE_ASSIGN_ADD, name(sum), name(i)))));
+
+    Node *do_ = op(NODE_DO, NULL, NULL);
+    do_->body = block(op(NODE_ASSIGN_MUL, name(k), lit_int(3)));
+    do_->cond = op(NODE_LT, name(k), lit_int(100));
+
+    Node *sign = if_stmt(op(NODE_LT, name(j), lit_int(0)),
+                         print_line(&p, lit_string("negative")),
+                         if_stmt(op(NODE_EQ, name(j), lit_int(0)),
+                                 print_line(&p, lit_string("zero")),
+                                 print_line(&p, lit_string("positive"))));
+
+    Program_init_function(&p, SEQ(
+        define(sum, lit_int(0)), loop, print_line(&p, name(sum)),
+        define(k, lit_int(1)), do_, print_line(&p, name(k)),
+        define(j, lit_int(-5)),
+        while_stmt(op(NODE_LT, name(j), lit_int(5)), block(SEQ(
+            sign, op(NODE_ASSIGN_ADD, name(j), lit_int(5))))),
+        print_line(&p, name(j))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "20\n243\nnegative\nzero\n5\n");
+}
+
+static void test_strings(void) {
+    Program p;
+    Program_init(&p);
+    Decl *s = local("s", NULL), *i = local("i", NULL), *t = local("t", NULL);
+
+    // Storing at the length of a string appends to it.
+    Node *append = op(NODE_ASSIGN, op(NODE_INDEX, name(s),
+                                      op(NODE_LEN, name(s), NULL)),
+                      op(NODE_ADD, lit_int('a'), name(i)));
+    Program_init_function(&p, SEQ(
+        define(s, lit_string("")),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), lit_int(5)),
+                 op(NODE_INC, name(i), NULL), append),
+        print_line(&p, op(NODE_ADD, op(NODE_ADD, name(s), lit_string(" ")),
+                          cast(op(NODE_LEN, name(s), NULL), type_string))),
+        op(NODE_ASSIGN, op(NODE_INDEX, name(s), lit_int(0)), lit_int(0x3bb)),
+        print_line(&p, name(s)),
+        print_line(&p, op(NODE_INDEX, name(s), lit_int(0))),
+        define(t, op(NODE_ADD, cast(lit_string(" 42"), type_int),
+                     lit_int(1))),
+        print_line(&p, name(t)),
+        print_line(&p, op(NODE_LT, name(s), lit_string("b")))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "abcde 5\n\xce\xbb" "bcde\n955\n43\n0\n");
+}
+
+static void test_lists(void) {
+    Program p;
+    Program_init(&p);
+    Type *ints = TypeTable_list(p.types, type_int);
+    Decl *l = local("l", ints), *i = local("i", NULL), *t = local("t", NULL);
+    Decl *total = local("total", NULL);
+    Program_init_function(&p, SEQ(
+        declare_var(l),
+        op(NODE_ASSIGN, name(l), op(NODE_CONS, lit_int(100), name(l))),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), lit_int(10)),
+                 op(NODE_INC, name(i), NULL),
+                 op(NODE_ASSIGN, name(l), op(NODE_CONS, name(i), name(l)))),
+        define(total, lit_int(0)),
+        for_stmt(t, name(l), op(NODE_NEQ, name(t), nil()),
+                 op(NODE_ASSIGN, name(t), op(NODE_TL, name(t), NULL)),
+                 op(NODE_ASSIGN_ADD, name(total),
+                    op(NODE_HD, name(t), NULL))),
+        print_line(&p, name(total)),
+        print_line(&p, op(NODE_LEN, name(l), NULL)),
+        print_line(&p, op(NODE_HD, op(NODE_TL, name(l), NULL), NULL))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "145\n11\n8\n");
+}
+
+static void test_numbers(void) {
+    Program p;
+    Program_init(&p);
+    Decl *r = local("r", NULL), *b = local("b", NULL), *y = local("y", NULL);
+    Program_init_function(&p, SEQ(
+        define(r, lit_real(2.5)),
+        print_line(&p, op(NODE_MUL, name(r), lit_real(4.25))),
+        print_line(&p, cast(op(NODE_DIV, name(r), lit_real(2)), type_int)),
+        define(b, cast(lit_int(1), type_big)),
+        op(NODE_ASSIGN_SHL, name(b), lit_int(40)),
+        print_line(&p, name(b)),
+        print_line(&p, cast(name(b), type_int)),
+        define(y, cast(lit_int(250), type_byte)),
+        op(NODE_ASSIGN_ADD, name(y), cast(lit_int(10), type_byte)),
+        print_line(&p, name(y)),
+        print_line(&p, cast(name(y), type_real))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "10.625\n1\n1099511627776\n0\n4\n4\n");
+}
+
+static void test_aggregates(void) {
+    Program p;
+    Program_init(&p);
+    Type *point = adt_type(2, (const char *[]) {"x", "name"},
+                           (Type *[]) {type_int, type_string});
+    Type *pair = TypeTable_tuple(p.types, 2,
+                                 (Type *[]) {type_int, type_string});
+
+    // swap(x, s) returns a tuple.
+    Decl *x = local("x", NULL), *s = local("s", NULL);
+    Decl *swap = global("swap", fn_type(p.types, pair, 2,
+                                        (Type *[]) {type_string, type_int}),
+                        DECL_FN);
+    Node *tuple = op(NODE_TUPLE, NULL, NULL);
+    tuple->body = SEQ(name(x), name(s));
+    Program_function(&p, swap, SEQ(name(s), name(x)),
+                     op(NODE_RETURN, tuple, NULL));
+
+    Decl *v = local("v", point), *r = local("r", NULL);
+    Decl *a = local("a", NULL), *c = local("c", NULL);
+    Node *unpack = op(NODE_TUPLE, NULL, NULL);
+    unpack->body = SEQ(name(a), name(c));
+    Program_init_function(&p, SEQ(
+        declare_var(v),
+        op(NODE_ASSIGN, dot(name(v), "x"), lit_int(3)),
+        op(NODE_ASSIGN, dot(name(v), "name"), lit_string("p")),
+        // A ref copies the adt; changing it does not change v.
+        define(r, op(NODE_REF, name(v), NULL)),
+        op(NODE_ASSIGN_ADD, dot(name(r), "x"), lit_int(4)),
+        op(NODE_ASSIGN_ADD, dot(name(r), "name"), lit_string("q")),
+        print_line(&p, op(NODE_ADD, dot(name(r), "name"),
+                          cast(dot(name(r), "x"), type_string))),
+        print_line(&p, op(NODE_ADD, dot(name(v), "name"),
+                          cast(dot(name(v), "x"), type_string))),
+        define(a, lit_int(0)), define(c, lit_string("")),
+        op(NODE_ASSIGN, unpack, call(name(swap), SEQ(lit_string("z"),
+                                                    lit_int(9)))),
+        print_line(&p, op(NODE_ADD, name(c), cast(name(a), type_string)))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "pq7\np3\nz9\n");
+}
+
+static void test_arrays(void) {
+    Program p;
+    Program_init(&p);
+    Decl *words = local("words", NULL), *squares = local("squares", NULL);
+    Decl *i = local("i", NULL);
+    Node *square = op(NODE_INDEX, name(squares), name(i));
+    Program_init_function(&p, SEQ(
+        // Elements start as zero, or nil for strings.
+        define(words, new_array(p.types, lit_int(3), type_string)),
+        op(NODE_ASSIGN, op(NODE_INDEX, name(words), lit_int(0)),
+           lit_string("a")),
+        op(NODE_ASSIGN, op(NODE_INDEX, name(words), lit_int(2)),
+           lit_string("c")),
+        print_line(&p, op(NODE_ADD, op(NODE_ADD,
+            op(NODE_ADD, op(NODE_INDEX, name(words), lit_int(0)),
+               op(NODE_INDEX, name(words), lit_int(1))),
+            op(NODE_INDEX, name(words), lit_int(2))),
+            cast(op(NODE_LEN, name(words), NULL), type_string))),
+        define(squares, new_array(p.types, lit_int(6), type_big)),
+        for_stmt(i, lit_int(1), op(NODE_LT, name(i), op(NODE_LEN,
+                                                         name(squares),
+                                                         NULL)),
+                 op(NODE_INC, name(i), NULL),
+                 op(NODE_ASSIGN, square,
+                    op(NODE_MUL, cast(name(i), type_big),
+                       cast(name(i), type_big)))),
+        print_line(&p, op(NODE_ADD, op(NODE_INDEX, name(squares), lit_int(0)),
+                          op(NODE_INDEX, name(squares), lit_int(5))))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "ac3\n25\n");
+}
+
+/// The size of the frame of a module's first function.
+static uptr frame_size(Program *p, PassManager *passes) {
+    DisModule *module = Program_generate(p, fixture_allocator, passes);
+    if (!EXPECT(module != NULL)) {
+        return 0;
+    }
+    uptr size = module->types[module->links[0].type].size;
+    DisModule_free(module);
+    return size;
+}
+
+static void test_frame_packing(void) {
+    // Each string is dead once printed, so they can share one slot.
+    enum { STRINGS = 12 };
+    Program p;
+    Program_init(&p);
+    Decl *n = local("n", NULL);
+    Decl *f = global("f", fn_type(p.types, NULL, 1, (Type *[]) {type_int}),
+                     DECL_FN);
+    Node *body = NULL, **tail = &body;
+    char *expected = ALLOC(fixture_allocator, STRINGS * 8);
+    expected[0] = '\0';
+    for (int i = 0; i < STRINGS; i++) {
+        Decl *s = local("s", NULL);
+        char *prefix = ALLOC(fixture_allocator, 8);
+        snprintf(prefix, 8, "%c", 'a' + i);
+        *tail = SEQ(define(s, op(NODE_ADD, lit_string(prefix),
+                                 cast(op(NODE_ADD, name(n), lit_int(i)),
+                                      type_string))),
+                    print_line(&p, name(s)));
+        tail = &(*tail)->next->next;
+        snprintf(expected + strlen(expected), 8, "%c%d\n", 'a' + i, i + 1);
+    }
+    Program_function(&p, f, name(n), body);
+    Program_init_function(&p, call(name(f), lit_int(1)));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, expected);
+
+    // The frame holds the registers, n, and far fewer slots than strings.
+    uptr most = (DIS_NREG + STRINGS / 2) * LAYOUT_WORD;
+    EXPECT(frame_size(&p, NULL) <= most);
+    EXPECT(frame_size(&p, &passes) <= most);
+}
+
+/// Whether the code of a module uses an instruction.
+static bool uses(Program *p, PassManager *passes, DisOp op) {
+    DisModule *module = Program_generate(p, fixture_allocator, passes);
+    if (!EXPECT(module != NULL)) {
+        return false;
+    }
+    bool found = false;
+    for (uptr i = 0; i < module->n_code; i++) {
+        found |= module->code[i].op == op;
+    }
+    DisModule_free(module);
+    return found;
+}
+
+/// A case arm that sets `r` to `value`.
+static Node *arm_setting(Decl *r, Node *labels, const char *value) {
+    return arm(labels, op(NODE_ASSIGN, name(r), lit_string(value)));
+}
+
+/// Add `fn(x: type): string`, which returns `r` after a case on `x` whose
+/// arms set it.
+static Decl *case_function(Program *p, const char *fn, Type *type, Decl *r,
+                           Node *arms) {
+    Decl *x = local("x", NULL);
+    Decl *decl = global(fn, fn_type(p->types, type_string, 1,
+                                    (Type *[]) {type}), DECL_FN);
+    return Program_function(p, decl, name(x), SEQ(
+        define(r, lit_string("")),
+        case_stmt(NODE_CASE, name(x), arms),
+        op(NODE_RETURN, name(r), NULL)));
+}
+
+static void test_case(void) {
+    Program p;
+    Program_init(&p);
+
+    // Dense labels jump through a table, sparse ones search a case table,
+    // and strings switch on their length and then a character.
+    Decl *r = local("r", NULL);
+    Decl *dense = case_function(&p, "dense", type_int, r, SEQ(
+        arm_setting(r, lit_int(0), "zero"),
+        arm_setting(r, SEQ(lit_int(1), lit_int(3)), "odd"),
+        arm_setting(r, SEQ(lit_int(2), op(NODE_TO, lit_int(4), lit_int(6))),
+                    "small"),
+        arm_setting(r, lit_int(7), "seven"),
+        arm_setting(r, op(NODE_NOP, NULL, NULL), "other")));
+    Decl *s = local("r", NULL);
+    Decl *sparse = case_function(&p, "sparse", type_int, s, SEQ(
+        arm_setting(s, lit_int(1), "one"),
+        arm_setting(s, lit_int(100), "hundred"),
+        arm_setting(s, op(NODE_TO, lit_int(1000), lit_int(1999)),
+                    "thousands"),
+        arm_setting(s, lit_int(50000), "many"),
+        arm_setting(s, lit_int(1 << 20), "mega"),
+        arm_setting(s, op(NODE_NOP, NULL, NULL), "other")));
+    Decl *t = local("r", NULL);
+    Decl *words = case_function(&p, "words", type_string, t, SEQ(
+        arm_setting(t, SEQ(lit_string("add"), lit_string("sub")), "additive"),
+        arm_setting(t, SEQ(lit_string("mul"), lit_string("div"),
+                           lit_string("mod")), "multiplicative"),
+        arm_setting(t, SEQ(lit_string("and"), lit_string("or"),
+                           lit_string("xor")), "bitwise"),
+        arm_setting(t, op(NODE_NOP, NULL, NULL), "other")));
+
+    Node *body = NULL, **tail = &body;
+    const i64 numbers[] = {-1, 0, 1, 3, 5, 7, 8, 100, 1500, 2000, 50000,
+                           1 << 20};
+    for (uptr i = 0; i < sizeof(numbers) / sizeof(i64); i++) {
+        *tail = print(&p, op(NODE_ADD, call(name(dense), lit_int(numbers[i])),
+                             lit_string(" ")));
+        tail = &(*tail)->next;
+        *tail = print_line(&p, call(name(sparse), lit_int(numbers[i])));
+        tail = &(*tail)->next;
+    }
+    const char *strings[] = {"", "add", "mod", "or", "xor", "zzz", "adds"};
+    for (uptr i = 0; i < sizeof(strings) / sizeof(char *); i++) {
+        *tail = print_line(&p, call(name(words), lit_string(strings[i])));
+        tail = &(*tail)->next;
+    }
+    Program_init_function(&p, body);
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes,
+               "other other\nzero other\nodd one\nodd other\nsmall other\n"
+               "seven other\nother other\nother hundred\n"
+               "other thousands\nother other\nother many\nother mega\n"
+               "other\nadditive\nmultiplicative\nbitwise\nbitwise\n"
+               "other\nother\n");
+    EXPECT(uses(&p, NULL, IGOTO));
+    EXPECT(uses(&p, NULL, ICASE));
+}
+
+/// A send, `channel <-= value`, or a receive, `<-channel` if `value` is
+/// `NULL`.
+static Node *transfer(Decl *channel, Node *value) {
+    return op(NODE_CHAN_TX, name(channel), value);
+}
+
+static void test_channels(void) {
+    Program p;
+    Program_init(&p);
+    Type *ints = TypeTable_chan(p.types, type_int);
+
+    // produce(c, n, by) sends n multiples of by on c.
+    Decl *c = local("c", NULL), *n = local("n", NULL), *by = local("by", NULL);
+    Decl *i = local("i", NULL);
+    Decl *produce = global("produce", fn_type(p.types, NULL, 3, (Type *[]) {
+        ints, type_int, type_int}), DECL_FN);
+    Program_function(&p, produce, SEQ(name(c), name(n), name(by)),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), name(n)),
+                 op(NODE_INC, name(i), NULL),
+                 transfer(c, op(NODE_MUL, name(i), name(by)))));
+
+    // A buffered channel holds values until they are received.
+    Decl *words = local("words", NULL);
+    Node *buffered = SEQ(
+        define(words, new_channel(p.types, lit_int(2), type_string)),
+        transfer(words, lit_string("a")),
+        transfer(words, lit_string("b")),
+        print_line(&p, op(NODE_ADD, transfer(words, NULL),
+                          transfer(words, NULL))));
+
+    // An alt does whichever of its alternatives can go ahead: here, the
+    // send and the receive on a channel with room for one value in turn.
+    Decl *d = local("d", NULL), *j = local("j", NULL), *x = local("x", NULL);
+    Node *alternate = SEQ(
+        define(d, new_channel(p.types, lit_int(1), type_int)),
+        for_stmt(j, lit_int(0), op(NODE_LT, name(j), lit_int(4)),
+                 op(NODE_INC, name(j), NULL),
+                 case_stmt(NODE_ALT, NULL, SEQ(
+                     arm(transfer(d, op(NODE_ADD, name(j), lit_int(10))),
+                         print_line(&p, lit_string("sent"))),
+                     arm(define(x, transfer(d, NULL)),
+                         print_line(&p, name(x)))))));
+
+    // With a default arm, an alt does not block.
+    Decl *e = local("e", NULL), *t = local("t", NULL), *k = local("k", NULL);
+    Node *polling = SEQ(
+        define(e, new_channel(p.types, lit_int(1), type_string)),
+        transfer(e, lit_string("hi")),
+        define(t, lit_string("")),
+        for_stmt(k, lit_int(0), op(NODE_LT, name(k), lit_int(2)),
+                 op(NODE_INC, name(k), NULL),
+                 case_stmt(NODE_ALT, NULL, SEQ(
+                     arm(op(NODE_ASSIGN, name(t), transfer(e, NULL)),
+                         print_line(&p, name(t))),
+                     arm(op(NODE_NOP, NULL, NULL),
+                         print_line(&p, lit_string("none")))))));
+
+    // Two producers feed one consumer through unbuffered channels.
+    Decl *c1 = local("c1", NULL), *c2 = local("c2", NULL);
+    Decl *sum = local("sum", NULL), *m = local("m", NULL);
+    Decl *v1 = local("v", NULL), *v2 = local("v", NULL);
+    Node *spawned = SEQ(
+        define(c1, new_channel(p.types, NULL, type_int)),
+        define(c2, new_channel(p.types, NULL, type_int)),
+        op(NODE_SPAWN, call(name(produce), SEQ(name(c1), lit_int(100),
+                                               lit_int(1))), NULL),
+        op(NODE_SPAWN, call(name(produce), SEQ(name(c2), lit_int(100),
+                                               lit_int(1000))), NULL),
+        define(sum, lit_int(0)),
+        for_stmt(m, lit_int(0), op(NODE_LT, name(m), lit_int(200)),
+                 op(NODE_INC, name(m), NULL),
+                 case_stmt(NODE_ALT, NULL, SEQ(
+                     arm(define(v1, transfer(c1, NULL)),
+                         op(NODE_ASSIGN_ADD, name(sum), name(v1))),
+                     arm(define(v2, transfer(c2, NULL)),
+                         op(NODE_ASSIGN_ADD, name(sum), name(v2)))))),
+        print_line(&p, name(sum)));
+
+    Program_init_function(&p, SEQ(block(buffered), block(alternate),
+                                  block(polling), block(spawned)));
+    EXPECT(Program_check(&p) == 0);
+    const char *expected = "ab\nsent\n10\nsent\n12\nhi\nnone\n4954950\n";
+    EXPECT_RUN(&p, &passes, expected);
+    // Processes run on several workers at once.
+    EXPECT_STR(Program_run(&p, &passes, "-w 4"), expected);
+    EXPECT(uses(&p, NULL, IALT) && uses(&p, NULL, INBALT));
+}
+
+static void test_cycles(void) {
+    Program p;
+    Program_init(&p);
+    // cell: adt { next: ref cell; n: int; }, laid out with a stand-in for
+    // the reference, which is the same size and also a pointer.
+    Type *cell = adt_type(2, (const char *[]) {"next", "n"},
+                          (Type *[]) {type_string, type_int});
+    cell->members[0].type = TypeTable_ref(p.types, cell);
+
+    // Each cell refers to itself, so reference counts alone never release
+    // it. There are enough for cycles to be collected while the program
+    // runs, as well as at the end.
+    Decl *v = local("v", cell), *i = local("i", NULL), *r = local("r", NULL);
+    Decl *total = local("total", NULL);
+    Program_init_function(&p, SEQ(
+        declare_var(v),
+        define(total, lit_int(0)),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), lit_int(30000)),
+                 op(NODE_INC, name(i), NULL), SEQ(
+            op(NODE_ASSIGN, dot(name(v), "n"), name(i)),
+            define(r, op(NODE_REF, name(v), NULL)),
+            op(NODE_ASSIGN, dot(name(r), "next"), name(r)),
+            op(NODE_ASSIGN_ADD, name(total),
+               dot(dot(name(r), "next"), "n")))),
+        print_line(&p, name(total))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT_RUN(&p, &passes, "449985000\n");
+
+    // The runner reports anything that is never released.
+    setenv("LIMBO_ALLOCATOR", "debug", 1);
+    for (int workers = 1; workers <= 4; workers *= 4) {
+        char flags[16];
+        snprintf(flags, sizeof flags, "-w %d", workers);
+        char *output = Program_run(&p, &passes, flags);
+        EXPECT(output && strncmp(output, "449985000\n", 10) == 0
+               && strstr(output, "leak") == NULL);
+    }
+    unsetenv("LIMBO_ALLOCATOR");
+}
+
+/// Add to a program `producers` processes that send `items` values between
+/// them on one channel, and `consumers` processes that share receiving them.
+/// The program prints the sum of everything received.
+static void contention_program(Program *p, i64 producers, i64 consumers,
+                               i64 items, Node *buffer) {
+    Type *ints = TypeTable_chan(p->types, type_int);
+
+    // produce(c, n) sends 0 to n - 1 on c.
+    Decl *c = local("c", NULL), *n = local("n", NULL), *i = local("i", NULL);
+    Decl *produce = global("produce", fn_type(p->types, NULL, 2, (Type *[]) {
+        ints, type_int}), DECL_FN);
+    Program_function(p, produce, SEQ(name(c), name(n)),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), name(n)),
+                 op(NODE_INC, name(i), NULL), transfer(c, name(i))));
+
+    // consume(c, n, done) receives n values on c and sends their sum on done.
+    Decl *from = local("c", NULL), *m = local("n", NULL);
+    Decl *done = local("done", NULL), *j = local("j", NULL);
+    Decl *s = local("s", NULL);
+    Decl *consume = global("consume", fn_type(p->types, NULL, 3, (Type *[]) {
+        ints, type_int, ints}), DECL_FN);
+    Program_function(p, consume, SEQ(name(from), name(m), name(done)), SEQ(
+        define(s, lit_int(0)),
+        for_stmt(j, lit_int(0), op(NODE_LT, name(j), name(m)),
+                 op(NODE_INC, name(j), NULL),
+                 op(NODE_ASSIGN_ADD, name(s), transfer(from, NULL))),
+        transfer(done, name(s))));
+
+    Decl *shared = local("shared", NULL), *sums = local("sums", NULL);
+    Decl *k = local("k", NULL), *l = local("l", NULL), *o = local("o", NULL);
+    Decl *total = local("total", NULL);
+    Program_init_function(p, SEQ(
+        define(shared, new_channel(p->types, buffer, type_int)),
+        define(sums, new_channel(p->types, NULL, type_int)),
+        for_stmt(k, lit_int(0), op(NODE_LT, name(k), lit_int(producers)),
+                 op(NODE_INC, name(k), NULL),
+                 op(NODE_SPAWN, call(name(produce), SEQ(
+                     name(shared), lit_int(items / producers))), NULL)),
+        for_stmt(l, lit_int(0), op(NODE_LT, name(l), lit_int(consumers)),
+                 op(NODE_INC, name(l), NULL),
+                 op(NODE_SPAWN, call(name(consume), SEQ(
+                     name(shared), lit_int(items / consumers), name(sums))),
+                    NULL)),
+        define(total, lit_int(0)),
+        for_stmt(o, lit_int(0), op(NODE_LT, name(o), lit_int(consumers)),
+                 op(NODE_INC, name(o), NULL),
+                 op(NODE_ASSIGN_ADD, name(total), transfer(sums, NULL))),
+        print_line(p, name(total))));
+}
+
+static void test_contention(void) {
+    // One, then several, producers and consumers share a channel, with and
+    // without a buffer. The runner's time for each is printed so that the
+    // number of workers can be compared.
+    enum { ITEMS = 60000 };
+    static const i64 shapes[][2] = {{1, 1}, {4, 1}, {1, 4}, {4, 4}};
+    for (uptr shape = 0; shape < 4; shape++) {
+        for (int buffered = 0; buffered < 2; buffered++) {
+            i64 producers = shapes[shape][0], consumers = shapes[shape][1];
+            Program p;
+            Program_init(&p);
+            contention_program(&p, producers, consumers, ITEMS,
+                               buffered ? lit_int(16) : NULL);
+            if (!EXPECT(Program_check(&p) == 0)) {
+                continue;
+            }
+            i64 each = ITEMS / producers;
+            char expected[32];
+            snprintf(expected, sizeof expected, "%ld\n",
+                     producers * (each * (each - 1) / 2));
+
+            for (uptr w = 0; w < 3; w++) {
+                int workers = (int[]) {1, 4, 8}[w];
+                char flags[16];
+                snprintf(flags, sizeof flags, "-s -w %d", workers);
+                char *output = Program_run(&p, &passes, flags);
+                if (!EXPECT(output && strncmp(output, expected,
+                                              strlen(expected)) == 0)) {
+                    continue;
+                }
+                const char *time = strstr(output, " in ");
+                printf("channel %ld:%ld, %s, %d workers: %.3fs\n",
+                       producers, consumers,
+                       buffered ? "buffered" : "unbuffered", workers,
+                       time ? strtod(time + 4, NULL) : 0.0);
+            }
+        }
+    }
+}
+
+static void test_shared_pointers(void) {
+    Program p;
+    Program_init(&p);
+    Type *ints = TypeTable_chan(p.types, type_int);
+
+    // race(done, n) replaces a string in module data while the other
+    // processes copy it, and reports how many copies were not nil.
+    Decl *shared = Program_global(&p, "shared", type_string);
+    Decl *done = local("done", NULL), *n = local("n", NULL);
+    Decl *i = local("i", NULL), *copy = local("copy", NULL);
+    Decl *seen = local("seen", NULL);
+    Decl *race = global("race", fn_type(p.types, NULL, 2, (Type *[]) {
+        ints, type_int}), DECL_FN);
+    Program_function(&p, race, SEQ(name(done), name(n)), SEQ(
+        define(seen, lit_int(0)),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), name(n)),
+                 op(NODE_INC, name(i), NULL), SEQ(
+            op(NODE_ASSIGN, name(shared),
+               op(NODE_ADD, lit_string("s"), cast(name(i), type_string))),
+            define(copy, name(shared)),
+            if_stmt(op(NODE_GT, op(NODE_LEN, name(copy), NULL), lit_int(0)),
+                    op(NODE_INC, name(seen), NULL), NULL))),
+        transfer(done, name(seen))));
+
+    Decl *c = local("c", NULL), *total = local("total", NULL);
+    Decl *k = local("k", NULL);
+    Node *spawns = NULL, **tail = &spawns;
+    for (uptr w = 0; w < 4; w++) {
+        *tail = op(NODE_SPAWN, call(name(race), SEQ(name(c),
+                                                    lit_int(20000))), NULL);
+        tail = &(*tail)->next;
+    }
+    Program_init_function(&p, SEQ(
+        op(NODE_ASSIGN, name(shared), lit_string("start")),
+        define(c, new_channel(p.types, NULL, type_int)),
+        block(spawns),
+        define(total, lit_int(0)),
+        for_stmt(k, lit_int(0), op(NODE_LT, name(k), lit_int(4)),
+                 op(NODE_INC, name(k), NULL),
+                 op(NODE_ASSIGN_ADD, name(total), transfer(c, NULL))),
+        print_line(&p, name(total))));
+    EXPECT(Program_check(&p) == 0);
+    EXPECT(uses(&p, NULL, IMOVP));
+    EXPECT_STR(Program_run(&p, NULL, "-w 4"), "80000\n");
+    EXPECT_STR(Program_run(&p, &passes, "-w 4"), "80000\n");
+}
+
+/// Generate a program, and encode the module as it would be written out.
+/// \return The encoding, which must be freed with `free`.
+static char *encode(Program *p, GenCache *cache, size_t *length) {
+    Diagnostics diagnostics;
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    DisModule *module = gen_module(fixture_allocator, "Test", p->globals,
+                                   p->n_globals, p->functions,
+                                   p->n_functions, &passes, cache,
+                                   &diagnostics);
+    EXPECT(diagnostics.errors == 0);
+    char *bytes = NULL;
+    FILE *out = open_memstream(&bytes, length);
+    DisWriter writer;
+    DisWriter_init(&writer, out);
+    EXPECT(dis_write_module(module, &writer));
+    fclose(out);
+    DisModule_free(module);
+    return bytes;
+}
+
+/// Record a failure unless a program generates the same module with a cache
+/// as without one, finding `hits` of its functions in the cache.
+static void expect_cached(Program *p, GenCache *cache, uptr hits) {
+    size_t length, expected_length;
+    char *expected = encode(p, NULL, &expected_length);
+    cache->hits = cache->misses = 0;
+    char *bytes = encode(p, cache, &length);
+    EXPECT(length == expected_length
+           && memcmp(bytes, expected, length) == 0);
+    EXPECT(cache->hits == hits);
+    EXPECT(cache->hits + cache->misses == p->n_functions);
+    free(bytes);
+    free(expected);
+}
+
+static void test_cache(void) {
+    Program p;
+    Program_init(&p);
+    Decl *n = local("n", NULL);
+    Decl *fib = global("fib", fn_type(p.types, type_int, 1,
+                                      (Type *[]) {type_int}), DECL_FN);
+    Program_function(&p, fib, name(n), SEQ(
+        if_stmt(op(NODE_LT, name(n), lit_int(2)),
+                op(NODE_RETURN, name(n), NULL), NULL),
+        op(NODE_RETURN, op(NODE_ADD,
+                           call(name(fib), op(NODE_SUB, name(n), lit_int(1))),
+                           call(name(fib), op(NODE_SUB, name(n), lit_int(2)))),
+           NULL)));
+    Decl *r = local("r", NULL);
+    Decl *dense = case_function(&p, "dense", type_int, r, SEQ(
+        arm_setting(r, lit_int(0), "zero"),
+        arm_setting(r, SEQ(lit_int(1), lit_int(3)), "odd"),
+        arm_setting(r, op(NODE_NOP, NULL, NULL), "other")));
+    Node *greeting = lit_string("fib ");
+    Program_init_function(&p, SEQ(
+        print_line(&p, op(NODE_ADD, greeting,
+                          cast(call(name(fib), lit_int(10)), type_string))),
+        print_line(&p, call(name(dense), lit_int(3)))));
+    EXPECT(Program_check(&p) == 0);
+
+    char dir[] = "/tmp/limbo-cache-XXXXXX";
+    if (!EXPECT(mkdtemp(dir) != NULL)) {
+        return;
+    }
+    GenCache cache = {.dir = dir};
+    expect_cached(&p, &cache, 0);
+    expect_cached(&p, &cache, p.n_functions);
+
+    // Only the function that changed is generated again.
+    greeting->string_value = "fib(10) = ";
+    greeting->string_length = strlen(greeting->string_value);
+    expect_cached(&p, &cache, p.n_functions - 1);
+    EXPECT_RUN(&p, &passes, "fib(10) = 55\nodd\n");
+
+    DIR *entries = opendir(dir);
+    for (struct dirent *e; entries && (e = readdir(entries));) {
+        if (e->d_name[0] != '.') {
+            char path[sizeof dir + 256];
+            snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+    }
+    if (entries) {
+        closedir(entries);
+    }
+    rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+    fixture_init(argc, argv);
+    default_passes(&passes);
+    test_functions();
+    test_control();
+    test_strings();
+    test_lists();
+    test_numbers();
+    test_aggregates();
+    test_arrays();
+    test_frame_packing();
+    test_case();
+    test_channels();
+    test_contention();
+    test_shared_pointers();
+    test_cycles();
+    test_cache();
+    return fixture_finish();
+}
@@ -0,0 +1,157 @@
+#include "layout.h"
+#include "fixture.h"
+
+/// Create an adt or tuple with members of the given types.
+static Type *aggregate(TypeKind kind, uptr n, Type **types) {
+    Member *members = ALLOC(fixture_allocator, n * sizeof(Member));
+    for (uptr i = 0; i < n; i++) {
+        members[i] = (Member) {.type = types[i], .index = i};
+    }
+    Type *type = ALLOC(fixture_allocator, sizeof(Type));
+    *type = (Type) {.kind = kind, .n_members = n, .members = members};
+    return type;
+}
+
+#define ADT(...) \
+    aggregate(TAdt, sizeof((Type *[]) {__VA_ARGS__}) / sizeof(Type *), \
+              (Type *[]) {__VA_ARGS__})
+
+/// Record a failure unless the members of a type are at the given offsets.
+static void expect_offsets(const Type *type, const uptr *offsets) {
+    for (uptr i = 0; i < type->n_members; i++) {
+        EXPECT(type->members[i].offset == offsets[i]);
+    }
+}
+
+/// The first two bytes of the pointer map of a type, as one number.
+static uptr map_of(const Type *type, uptr *pointers) {
+    u8 map[4] = {0};
+    EXPECT(layout_map_length(type) <= sizeof(map));
+    *pointers = layout_pointer_map(type, map);
+    return (uptr) map[0] << 8 | map[1];
+}
+
+static void test_declaration_order(void) {
+    Type *adt = ADT(type_byte, type_string, type_big, type_int, type_string,
+                    type_byte);
+    layout_type(adt, false);
+    EXPECT(adt->size == 48 && adt->align == 8);
+    expect_offsets(adt, (uptr[]) {0, 8, 16, 24, 32, 40});
+    uptr pointers;
+    EXPECT(map_of(adt, &pointers) == 0x4800);
+    EXPECT(pointers == 2);
+    EXPECT(layout_map_length(adt) == 1);
+}
+
+static void test_reorder(void) {
+    // Pointers come first, then the rest by decreasing alignment.
+    Type *adt = ADT(type_byte, type_string, type_big, type_int, type_string,
+                    type_byte);
+    layout_type(adt, true);
+    EXPECT(adt->size == 32 && adt->align == 8);
+    expect_offsets(adt, (uptr[]) {28, 0, 16, 24, 8, 29});
+    uptr pointers;
+    EXPECT(map_of(adt, &pointers) == 0xc000);
+    EXPECT(pointers == 2);
+
+    // Larger members come first, so none needs padding.
+    Type *gap = ADT(type_int, type_big, type_int);
+    layout_type(gap, true);
+    EXPECT(gap->size == 16);
+    expect_offsets(gap, (uptr[]) {8, 0, 12});
+}
+
+static void test_pick(void) {
+    for (int reorder = 0; reorder < 2; reorder++) {
+        Type *variant = ADT(type_byte, type_string);
+        Type *pick = ADT(type_string, type_int);
+        pick->kind = TAdtPick;
+        pick->n_variants = 1;
+        pick->variants = ALLOC(fixture_allocator, sizeof(Type *));
+        pick->variants[0] = variant;
+        layout_type(pick, reorder);
+
+        // The tag comes first, then the common members, then the variant's
+        // own. When reordering, the int fills the gap after the tag.
+        uptr pointers;
+        EXPECT(variant->elem == pick);
+        if (reorder) {
+            EXPECT(pick->size == 16);
+            expect_offsets(pick, (uptr[]) {8, 4});
+            EXPECT(variant->size == 32);
+            expect_offsets(variant, (uptr[]) {24, 16});
+            EXPECT(map_of(variant, &pointers) == 0x6000);
+        } else {
+            EXPECT(pick->size == 24);
+            expect_offsets(pick, (uptr[]) {8, 16});
+            EXPECT(variant->size == 32);
+            expect_offsets(variant, (uptr[]) {20, 24});
+            EXPECT(map_of(variant, &pointers) == 0x5000);
+        }
+        EXPECT(pointers == 2);
+    }
+}
+
+static void test_nested(void) {
+    // An adt held by value is laid out before the type that holds it, and
+    // its pointers are marked where it is placed.
+    Type *inner = ADT(type_int, type_string);
+    layout_type(inner, false);
+    Type *outer = aggregate(TTuple, 3, (Type *[]) {type_big, inner,
+                                                   type_string});
+    layout_type(outer, false);
+    EXPECT(inner->size == 16);
+    EXPECT(outer->size == 32);
+    expect_offsets(outer, (uptr[]) {0, 8, 24});
+    uptr pointers;
+    EXPECT(map_of(outer, &pointers) == 0x3000);
+    EXPECT(pointers == 2);
+
+    // Maps longer than eight words continue into the next byte.
+    Type *wide = ADT(type_string, type_string, type_string, type_string,
+                     type_string, type_string, type_string, type_string,
+                     type_string, type_int);
+    layout_type(wide, false);
+    EXPECT(layout_map_length(wide) == 2);
+    EXPECT(map_of(wide, &pointers) == 0xff80);
+    EXPECT(pointers == 9);
+}
+
+static void test_policy(void) {
+    // An adt held by value keeps its own layout, whatever the policy of the
+    // type that holds it.
+    Type *plain = ADT(type_byte, type_string, type_int);
+    layout_type(plain, false);
+    Type *outer = ADT(type_byte, plain, type_string);
+    layout_type(outer, true);
+    EXPECT(!plain->reordered && outer->reordered);
+    expect_offsets(plain, (uptr[]) {0, 8, 16});
+    EXPECT(plain->size == 24);
+    expect_offsets(outer, (uptr[]) {32, 8, 0});
+    EXPECT(outer->size == 40);
+    uptr pointers;
+    EXPECT(map_of(outer, &pointers) == 0xa000);
+    EXPECT(pointers == 2);
+
+    // The same the other way round.
+    Type *packed = ADT(type_byte, type_string, type_int);
+    layout_type(packed, true);
+    Type *declared = ADT(type_byte, packed, type_string);
+    layout_type(declared, false);
+    EXPECT(packed->reordered && !declared->reordered);
+    expect_offsets(packed, (uptr[]) {12, 0, 8});
+    EXPECT(packed->size == 16);
+    expect_offsets(declared, (uptr[]) {0, 8, 24});
+    EXPECT(map_of(declared, &pointers) == 0x5000);
+    EXPECT(pointers == 2);
+}
+
+int main(int argc, char **argv) {
+    fixture_init(argc, argv);
+    test_declaration_order();
+    test_reorder();
+    test_pick();
+    test_nested();
+    test_policy();
+    return fixture_finish();
+}
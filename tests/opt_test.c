@@ -0,0 +1,461 @@
+#include "check.h"
+#include "lower.h"
+#include "fixture.h"
+
+/// Lower a function and optimise it.
+/// \param passes The pipeline, or `NULL` to leave the function as lowered.
+static IrFunction *optimise(Decl *decl, PassManager *passes) {
+    Diagnostics diagnostics;
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    IrFunction *function = lower_function(fixture_allocator, decl->value,
+                                          &diagnostics);
+    if (passes) {
+        PassManager_run(passes, function);
+    }
+    return function;
+}
+
+/// Count the instructions with the op `op` in an optimised function.
+static uptr count_ops(Decl *decl, PassManager *passes, IrOp op) {
+    IrFunction *function = optimise(decl, passes);
+    uptr count = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            count += inst->op == op;
+        }
+    }
+    IrFunction_free(function);
+    return count;
+}
+
+/// Count the `ref`s of an optimised function that are held in the frame.
+static uptr count_in_frame(Decl *decl, PassManager *passes) {
+    IrFunction *function = optimise(decl, passes);
+    uptr count = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            count += inst->op == IR_NEW && inst->in_frame;
+        }
+    }
+    IrFunction_free(function);
+    return count;
+}
+
+/// Count the array and string indexes of an optimised function that are
+/// still bounds checked.
+static uptr count_checked(Decl *decl, PassManager *passes) {
+    IrFunction *function = optimise(decl, passes);
+    uptr count = 0;
+    for (IrBlock *block = function->entry; block; block = block->next) {
+        for (IrInst *inst = block->first; inst; inst = inst->next) {
+            count += (inst->op == IR_INDEX || inst->op == IR_SET_INDEX
+                      || inst->op == IR_SET_CHAR) && !inst->in_bounds;
+        }
+    }
+    IrFunction_free(function);
+    return count;
+}
+
+/// Create a pipeline of a single pass.
+static PassManager *only(const char *name, IrPassFn run) {
+    PassManager *passes = ALLOC(fixture_allocator, sizeof(PassManager));
+    PassManager_init(passes, fixture_allocator);
+    PassManager_add(passes, name, run);
+    return passes;
+}
+
+/// Record a failure unless a program prints `expected` unoptimised, with
+/// a pass alone, which must change it, and with every pass.
+static void expect_pass(Program *program, PassManager *pass,
+                        const char *expected) {
+    EXPECT_RUN(program, pass, expected);
+    EXPECT(pass->passes[0].changes > 0);
+    PassManager all;
+    default_passes(&all);
+    EXPECT_RUN(program, &all, expected);
+}
+
+static Type *int_fn(Program *p, uptr n_params) {
+    Type *params[] = {type_int, type_int, type_int};
+    return fn_type(p->types, type_int, n_params, params);
+}
+
+static void test_sccp(void) {
+    // x is never changed, since the branch that changes it is never taken.
+    Program p;
+    Program_init(&p);
+    Decl *n = local("n", NULL), *x = local("x", NULL), *s = local("s", NULL);
+    Decl *i = local("i", NULL);
+    Decl *f = global("f", int_fn(&p, 1), DECL_FN);
+    Node *update = if_stmt(op(NODE_EQ, name(x), lit_int(1)),
+                           op(NODE_ASSIGN_ADD, name(s), name(i)),
+                           block(SEQ(op(NODE_ASSIGN_SUB, name(s), name(i)),
+                                     op(NODE_ASSIGN, name(x), lit_int(2)))));
+    Program_function(&p, f, name(n), SEQ(
+        define(x, lit_int(1)), define(s, lit_int(0)),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), name(n)),
+                 op(NODE_INC, name(i), NULL), update),
+        op(NODE_RETURN, name(s), NULL)));
+    Program_init_function(&p, print_line(&p, call(name(f), lit_int(5))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *sccp = only("sccp", opt_sccp);
+    expect_pass(&p, sccp, "10\n");
+    EXPECT(count_ops(f, sccp, IR_BRANCH) < count_ops(f, NULL, IR_BRANCH));
+}
+
+static void test_copy_propagation(void) {
+    // Both paths give y the same value, so the phi that merges them is a
+    // copy of a.
+    Program p;
+    Program_init(&p);
+    Decl *a = local("a", NULL), *c = local("c", NULL), *y = local("y", NULL);
+    Decl *g = global("g", int_fn(&p, 2), DECL_FN);
+    Program_function(&p, g, SEQ(name(a), name(c)), SEQ(
+        define(y, op(NODE_ADD, name(a), lit_int(0))),
+        if_stmt(name(c), op(NODE_ASSIGN, name(y), name(a)), NULL),
+        op(NODE_RETURN, op(NODE_ADD, name(y), lit_int(1)), NULL)));
+    Program_init_function(&p, SEQ(
+        print_line(&p, call(name(g), SEQ(lit_int(4), lit_int(1)))),
+        print_line(&p, call(name(g), SEQ(lit_int(6), lit_int(0))))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *copyprop = only("copyprop", opt_copy_propagation);
+    expect_pass(&p, copyprop, "5\n7\n");
+    EXPECT(count_ops(g, NULL, IR_PHI) == 1);
+    EXPECT(count_ops(g, copyprop, IR_PHI) == 0);
+}
+
+static void test_gvn(void) {
+    Program p;
+    Program_init(&p);
+    Decl *a = local("a", NULL), *b = local("b", NULL);
+    Decl *f = global("f", int_fn(&p, 2), DECL_FN);
+    Node *product = op(NODE_MUL, name(a), name(b));
+    Program_function(&p, f, SEQ(name(a), name(b)), op(NODE_RETURN,
+        op(NODE_SUB, product, op(NODE_MUL, name(a), name(b))), NULL));
+    Program_init_function(&p, print_line(&p, call(name(f), SEQ(lit_int(3),
+                                                               lit_int(4)))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *gvn = only("gvn", opt_gvn);
+    expect_pass(&p, gvn, "0\n");
+    EXPECT(count_ops(f, NULL, IR_BINARY) == 3);
+    EXPECT(count_ops(f, gvn, IR_BINARY) == 2);
+}
+
+static void test_simplify_cfg(void) {
+    // The empty arm leaves a block that only jumps.
+    Program p;
+    Program_init(&p);
+    Decl *a = local("a", NULL), *r = local("r", NULL);
+    Decl *f = global("f", int_fn(&p, 1), DECL_FN);
+    Program_function(&p, f, name(a), SEQ(
+        define(r, lit_int(0)),
+        if_stmt(op(NODE_GT, name(a), lit_int(0)),
+                block(NULL), op(NODE_ASSIGN, name(r), lit_int(1))),
+        op(NODE_RETURN, name(r), NULL)));
+    Program_init_function(&p, SEQ(
+        print_line(&p, call(name(f), lit_int(1))),
+        print_line(&p, call(name(f), lit_int(-1)))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *cfg = only("simplifycfg", opt_simplify_cfg);
+    expect_pass(&p, cfg, "0\n1\n");
+    EXPECT(count_ops(f, cfg, IR_JUMP) < count_ops(f, NULL, IR_JUMP));
+}
+
+static void test_dce(void) {
+    Program p;
+    Program_init(&p);
+    Decl *a = local("a", NULL), *t = local("t", NULL);
+    Decl *f = global("f", int_fn(&p, 1), DECL_FN);
+    Program_function(&p, f, name(a), SEQ(
+        define(t, op(NODE_MUL, name(a), lit_int(7))),
+        op(NODE_RETURN, name(a), NULL)));
+    Program_init_function(&p, print_line(&p, call(name(f), lit_int(2))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *dce = only("dce", opt_dce);
+    expect_pass(&p, dce, "2\n");
+    EXPECT(count_ops(f, NULL, IR_BINARY) == 1);
+    EXPECT(count_ops(f, dce, IR_BINARY) == 0);
+}
+
+/// Add a function `called(n)` that sums an array of length `n` in a loop of
+/// the form `for (j := start; j compare len bound; j += step) s += a[j]`,
+/// where the bound is the array itself or another of the same length.
+static Decl *summing_loop(Program *p, const char *called, i64 start,
+                          NodeKind compare, bool other_bound, i64 step) {
+    Decl *n = local("n", NULL), *a = local("a", NULL), *b = local("b", NULL);
+    Decl *j = local("j", NULL), *s = local("s", NULL);
+    Decl *f = global(called, int_fn(p, 1), DECL_FN);
+    Node *inc = step == 1 ? op(NODE_INC, name(j), NULL)
+                          : op(NODE_ASSIGN_ADD, name(j), lit_int(step));
+    Program_function(p, f, name(n), SEQ(
+        define(a, new_array(p->types, name(n), type_int)),
+        define(b, new_array(p->types, name(n), type_int)),
+        define(s, lit_int(0)),
+        for_stmt(j, lit_int(start),
+                 op(compare, name(j),
+                    op(NODE_LEN, name(other_bound ? b : a), NULL)),
+                 inc,
+                 op(NODE_ASSIGN_ADD, name(s),
+                    op(NODE_INDEX, name(a), name(j)))),
+        op(NODE_RETURN, name(s), NULL)));
+    return f;
+}
+
+static void test_bounds(void) {
+    Program p;
+    Program_init(&p);
+    Decl *n = local("n", NULL), *a = local("a", NULL), *t = local("t", NULL);
+    Decl *i = local("i", NULL), *j = local("j", NULL), *s = local("s", NULL);
+    Decl *u = local("u", NULL);
+    Decl *f = global("f", int_fn(&p, 1), DECL_FN);
+    Program_function(&p, f, name(n), SEQ(
+        define(a, new_array(p.types, name(n), type_int)),
+        for_stmt(i, lit_int(0), op(NODE_LT, name(i), name(n)),
+                 op(NODE_INC, name(i), NULL),
+                 op(NODE_ASSIGN, op(NODE_INDEX, name(a), name(i)), name(i))),
+        define(s, lit_int(0)),
+        for_stmt(j, lit_int(0), op(NODE_LT, name(j), op(NODE_LEN, name(a),
+                                                          NULL)),
+                 op(NODE_INC, name(j), NULL),
+                 op(NODE_ASSIGN_ADD, name(s),
+                    op(NODE_INDEX, name(a), name(j)))),
+        // t[3] is unused, and once it cannot raise, it can be removed.
+        define(t, new_array(p.types, lit_int(4), type_int)),
+        op(NODE_ASSIGN, op(NODE_INDEX, name(t), lit_int(1)), lit_int(5)),
+        define(u, op(NODE_INDEX, name(t), lit_int(3))),
+        op(NODE_RETURN, op(NODE_ADD, name(s),
+                           op(NODE_INDEX, name(t), lit_int(1))), NULL)));
+    // Loops that may step outside the array keep their checks.
+    Decl *below = summing_loop(&p, "below", 0, NODE_LT, false, 1);
+    Decl *at_most = summing_loop(&p, "at_most", 0, NODE_LTE, false, 1);
+    Decl *other = summing_loop(&p, "other", 0, NODE_LT, true, 1);
+    Decl *negative = summing_loop(&p, "negative", -1, NODE_LT, false, 1);
+    Decl *stride = summing_loop(&p, "stride", 0, NODE_LT, false, 2);
+    Program_init_function(&p, SEQ(
+        print_line(&p, call(name(f), lit_int(5))),
+        print_line(&p, call(name(f), lit_int(0))),
+        print_line(&p, call(name(below), lit_int(3)))));
+    EXPECT(Program_check(&p) == 0);
+
+    // Until copies are propagated, `a` in each loop is a phi rather than
+    // the array that was created.
+    PassManager *without = only("copyprop", opt_copy_propagation);
+    PassManager_add(without, "dce", opt_dce);
+    PassManager *with = only("copyprop", opt_copy_propagation);
+    PassManager_add(with, "bounds", opt_bounds);
+    PassManager_add(with, "dce", opt_dce);
+    EXPECT_RUN(&p, with, "15\n5\n0\n");
+    EXPECT(pass_changes(with, "bounds") > 0);
+    PassManager all;
+    default_passes(&all);
+    EXPECT_RUN(&p, &all, "15\n5\n0\n");
+    EXPECT(count_ops(f, without, IR_INDEX) == 3);
+    EXPECT(count_ops(f, with, IR_INDEX) == 2);
+
+    // Every index in both loops, and t[1], is proven in bounds.
+    EXPECT(count_checked(f, without) == 5);
+    EXPECT(count_checked(f, with) == 0);
+    EXPECT(count_checked(below, without) == 1);
+    EXPECT(count_checked(below, with) == 0);
+    EXPECT(count_checked(at_most, with) == 1);
+    EXPECT(count_checked(other, with) == 1);
+    EXPECT(count_checked(negative, with) == 1);
+    EXPECT(count_checked(stride, with) == 1);
+}
+
+static void test_inline(void) {
+    Program p;
+    Program_init(&p);
+    Decl *x = local("x", NULL), *a = local("a", NULL), *n = local("n", NULL);
+    Decl *square = global("square", int_fn(&p, 1), DECL_FN);
+    Decl *f = global("f", int_fn(&p, 1), DECL_FN);
+    Decl *fib = global("fib", int_fn(&p, 1), DECL_FN);
+    Program_function(&p, square, name(x), op(NODE_RETURN,
+        op(NODE_MUL, name(x), name(x)), NULL));
+    Program_function(&p, f, name(a), op(NODE_RETURN,
+        op(NODE_ADD, call(name(square), name(a)),
+           call(name(square), op(NODE_ADD, name(a), lit_int(1)))), NULL));
+    // fib is not inlined into itself.
+    Program_function(&p, fib, name(n), SEQ(
+        if_stmt(op(NODE_LT, name(n), lit_int(2)),
+                op(NODE_RETURN, name(n), NULL), NULL),
+        op(NODE_RETURN, op(NODE_ADD,
+            call(name(fib), op(NODE_SUB, name(n), lit_int(1))),
+            call(name(fib), op(NODE_SUB, name(n), lit_int(2)))), NULL)));
+    Program_init_function(&p, SEQ(
+        print_line(&p, call(name(f), lit_int(3))),
+        print_line(&p, call(name(fib), lit_int(10)))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *inline_ = only("inline", opt_inline);
+    expect_pass(&p, inline_, "25\n55\n");
+    EXPECT(count_ops(f, NULL, IR_CALL) == 2);
+    EXPECT(count_ops(f, inline_, IR_CALL) == 0);
+    EXPECT(count_ops(fib, inline_, IR_CALL) == 2);
+}
+
+static void test_escape(void) {
+    Program p;
+    Program_init(&p);
+    Type *point = adt_type(2, (const char *[]) {"x", "name"},
+                           (Type *[]) {type_int, type_string});
+    Type *ref = TypeTable_ref(p.types, point);
+
+    // local() only reads and writes through its ref, but shared() passes
+    // its ref to x_of().
+    Decl *r = local("r", NULL);
+    Decl *x_of = global("x_of", fn_type(p.types, type_int, 1,
+                                        (Type *[]) {ref}), DECL_FN);
+    Program_function(&p, x_of, name(r), op(NODE_RETURN,
+        dot(name(r), "x"), NULL));
+    Decl *fns[2] = {global("local", int_fn(&p, 1), DECL_FN),
+                    global("shared", int_fn(&p, 1), DECL_FN)};
+    for (uptr i = 0; i < 2; i++) {
+        Decl *a = local("a", NULL), *v = local("v", point);
+        Decl *s = local("s", NULL);
+        Node *result = i == 0 ? dot(name(s), "x") : call(name(x_of), name(s));
+        Program_function(&p, fns[i], name(a), SEQ(
+            declare_var(v),
+            define(s, op(NODE_REF, name(v), NULL)),
+            op(NODE_ASSIGN, dot(name(s), "x"), name(a)),
+            op(NODE_ASSIGN_MUL, dot(name(s), "x"), lit_int(2)),
+            op(NODE_RETURN, op(NODE_ADD, result, dot(name(v), "x")), NULL)));
+    }
+    Program_init_function(&p, SEQ(
+        print_line(&p, call(name(fns[0]), lit_int(3))),
+        print_line(&p, call(name(fns[1]), lit_int(4)))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *escape = only("escape", opt_escape);
+    expect_pass(&p, escape, "6\n8\n");
+    EXPECT(count_ops(fns[0], escape, IR_NEW) == 1);
+    EXPECT(count_in_frame(fns[0], NULL) == 0);
+    EXPECT(count_in_frame(fns[0], escape) == 1);
+    EXPECT(count_in_frame(fns[1], escape) == 0);
+}
+
+static void test_concat(void) {
+    Program p;
+    Program_init(&p);
+    Type *join_type = fn_type(p.types, type_string, 2,
+                              (Type *[]) {type_string, type_string});
+    Decl *a = local("a", NULL), *b = local("b", NULL), *s = local("s", NULL);
+    Decl *join = global("join", join_type, DECL_FN);
+    Program_function(&p, join, SEQ(name(a), name(b)), SEQ(
+        define(s, op(NODE_ADD, op(NODE_ADD, op(NODE_ADD, name(a),
+                                                lit_string(":")),
+                                      lit_string("")), name(b))),
+        op(NODE_ASSIGN_ADD, name(s), lit_string("/")),
+        op(NODE_ASSIGN_ADD, name(s), name(a)),
+        op(NODE_RETURN, name(s), NULL)));
+    Program_init_function(&p, print_line(&p, call(name(join),
+        SEQ(lit_string("x"), lit_string("y")))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *concat = only("concat", opt_concat);
+    expect_pass(&p, concat, "x:y/x\n");
+    // The partial results are left for DCE to remove.
+    PassManager_add(concat, "dce", opt_dce);
+    EXPECT(count_ops(join, NULL, IR_BINARY) == 5);
+    EXPECT(count_ops(join, concat, IR_BINARY) == 0);
+    EXPECT(count_ops(join, concat, IR_CONCAT) == 1);
+}
+
+static void test_lists(void) {
+    Program p;
+    Program_init(&p);
+    Decl *x = local("x", NULL), *l = local("l", NULL);
+    Decl *f = global("f", int_fn(&p, 1), DECL_FN);
+    Node *second = op(NODE_HD, op(NODE_TL, name(l), NULL), NULL);
+    Program_function(&p, f, name(x), SEQ(
+        define(l, op(NODE_CONS, name(x), op(NODE_CONS,
+            op(NODE_ADD, name(x), lit_int(1)), nil()))),
+        op(NODE_RETURN, op(NODE_ADD, second,
+                           op(NODE_NEQ, name(l), nil())), NULL)));
+    Program_init_function(&p, print_line(&p, call(name(f), lit_int(3))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *lists = only("lists", opt_lists);
+    expect_pass(&p, lists, "5\n");
+    PassManager_add(lists, "dce", opt_dce);
+    EXPECT(count_ops(f, NULL, IR_HEAD) == 1);
+    EXPECT(count_ops(f, lists, IR_HEAD) == 0);
+    EXPECT(count_ops(f, lists, IR_TAIL) == 0);
+    // Nothing reads the list any more, so it is never built.
+    EXPECT(count_ops(f, lists, IR_CONS) == 0);
+}
+
+static void test_tail_calls(void) {
+    Program p;
+    Program_init(&p);
+    Type *list = TypeTable_list(p.types, type_int);
+    Decl *l = local("l", NULL), *acc = local("acc", NULL);
+    Decl *sum = global("sum", fn_type(p.types, type_int, 2,
+                                      (Type *[]) {list, type_int}), DECL_FN);
+    Program_function(&p, sum, SEQ(name(l), name(acc)), SEQ(
+        if_stmt(op(NODE_EQ, name(l), nil()),
+                op(NODE_RETURN, name(acc), NULL), NULL),
+        op(NODE_RETURN, call(name(sum), SEQ(
+            op(NODE_TL, name(l), NULL),
+            op(NODE_ADD, name(acc), op(NODE_HD, name(l), NULL)))), NULL)));
+    Decl *numbers = local("numbers", list), *i = local("i", NULL);
+    Program_init_function(&p, SEQ(
+        declare_var(numbers),
+        for_stmt(i, lit_int(1), op(NODE_LTE, name(i), lit_int(1000)),
+                 op(NODE_INC, name(i), NULL),
+                 op(NODE_ASSIGN, name(numbers),
+                    op(NODE_CONS, name(i), name(numbers)))),
+        print_line(&p, call(name(sum), SEQ(name(numbers), lit_int(0))))));
+    EXPECT(Program_check(&p) == 0);
+
+    PassManager *tailcall = only("tailcall", opt_tail_calls);
+    expect_pass(&p, tailcall, "500500\n");
+    EXPECT(count_ops(sum, NULL, IR_CALL) == 1);
+    EXPECT(count_ops(sum, tailcall, IR_CALL) == 0);
+}
+
+static void test_extra_arguments(void) {
+    // Calls with more arguments than parameters are reported, not dropped.
+    Program p;
+    Program_init(&p);
+    Decl *x = local("x", NULL);
+    Decl *g = global("g", int_fn(&p, 1), DECL_FN);
+    Decl *f = global("f", int_fn(&p, 0), DECL_FN);
+    Program_function(&p, g, name(x), op(NODE_RETURN, name(x), NULL));
+    Program_function(&p, f, NULL, op(NODE_RETURN,
+        call(name(g), SEQ(lit_int(1), lit_int(2))), NULL));
+    Diagnostics diagnostics;
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    check_function(p.types, f->value, &diagnostics);
+    EXPECT(diagnostics.errors == 1);
+
+    Diagnostics_init(&diagnostics, fixture_allocator);
+    IrFunction_free(lower_function(fixture_allocator, f->value,
+                                   &diagnostics));
+    if (EXPECT(diagnostics.errors == 1)) {
+        EXPECT_STR(diagnostics.head->message,
+                   "cannot generate code for variadic calls yet");
+    }
+}
+
+int main(int argc, char **argv) {
+    fixture_init(argc, argv);
+    test_sccp();
+    test_copy_propagation();
+    test_gvn();
+    test_simplify_cfg();
+    test_dce();
+    test_bounds();
+    test_inline();
+    test_escape();
+    test_concat();
+    test_lists();
+    test_tail_calls();
+    test_extra_arguments();
+    return fixture_finish();
+}
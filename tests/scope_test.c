@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include <threads.h>
+#include "scope.h"
+#include "fixture.h"
+
+/// Create a declaration of a symbol.
+static Decl *decl_of(Symbol symbol) {
+    Decl *decl = global("x", NULL, DECL_VAR);
+    decl->name = symbol;
+    return decl;
+}
+
+/// Record a failure unless the slots of a map from `first` on hold the
+/// given keys, wrapping round the end of the table.
+static void expect_keys(const SymbolMap *map, uptr first, uptr n,
+                        const Symbol *keys) {
+    for (uptr i = 0; i < n; i++) {
+        EXPECT(map->slots[(first + i) & (map->capacity - 1)].key == keys[i]);
+    }
+}
+
+static void test_symbol_map(void) {
+    // With 16 slots, 2, 18 and 34 all hash to slot 2, and 11 to slot 3.
+    SymbolMap map;
+    SymbolMap_init(&map, fixture_allocator);
+    Symbol keys[] = {2, 18, 34, 11};
+    Decl *decls[4];
+    for (uptr i = 0; i < 4; i++) {
+        decls[i] = decl_of(keys[i]);
+        EXPECT(SymbolMap_set(&map, keys[i], decls[i]) == NULL);
+    }
+    expect_keys(&map, 2, 5, (Symbol[]) {2, 18, 34, 11, 0});
+
+    // Removing a key from the middle of a probe run shifts the rest of the
+    // run back, leaving no gap for a lookup to stop at.
+    EXPECT(SymbolMap_set(&map, 18, NULL) == decls[1]);
+    EXPECT(map.count == 3);
+    expect_keys(&map, 2, 4, (Symbol[]) {2, 34, 11, 0});
+    EXPECT(SymbolMap_get(&map, 18) == NULL);
+    EXPECT(SymbolMap_get(&map, 34) == decls[2]);
+    EXPECT(SymbolMap_get(&map, 11) == decls[3]);
+    EXPECT(SymbolMap_set(&map, 18, NULL) == NULL);
+    EXPECT(map.count == 3);
+
+    // An entry already at its home slot stays there.
+    EXPECT(SymbolMap_set(&map, 2, NULL) == decls[0]);
+    expect_keys(&map, 2, 3, (Symbol[]) {34, 11, 0});
+    EXPECT(SymbolMap_set(&map, 11, decls[0]) == decls[3]);
+    EXPECT(SymbolMap_get(&map, 11) == decls[0]);
+    SymbolMap_free(&map);
+
+    // A run that wraps round the end of the table: 7, 23 and 39 hash to
+    // slot 15, and 16 to slot 0.
+    SymbolMap_init(&map, fixture_allocator);
+    Symbol wrapped[] = {7, 23, 39, 16};
+    for (uptr i = 0; i < 4; i++) {
+        decls[i] = decl_of(wrapped[i]);
+        SymbolMap_set(&map, wrapped[i], decls[i]);
+    }
+    expect_keys(&map, 15, 4, wrapped);
+    EXPECT(SymbolMap_set(&map, 7, NULL) == decls[0]);
+    expect_keys(&map, 15, 4, (Symbol[]) {23, 39, 16, 0});
+    for (uptr i = 1; i < 4; i++) {
+        EXPECT(SymbolMap_get(&map, wrapped[i]) == decls[i]);
+    }
+    SymbolMap_free(&map);
+
+    // Removing half of many keys, across several growths.
+    SymbolMap_init(&map, fixture_allocator);
+    Decl *many[200];
+    for (Symbol key = 1; key < 200; key++) {
+        many[key] = decl_of(key);
+        SymbolMap_set(&map, key, many[key]);
+    }
+    for (Symbol key = 2; key < 200; key += 2) {
+        EXPECT(SymbolMap_set(&map, key, NULL) == many[key]);
+    }
+    EXPECT(map.count == 100);
+    for (Symbol key = 1; key < 200; key++) {
+        EXPECT(SymbolMap_get(&map, key) == (key % 2 ? many[key] : NULL));
+    }
+    SymbolMap_free(&map);
+}
+
+static void test_scope_stack(void) {
+    ScopeStack scopes;
+    ScopeStack_init(&scopes, fixture_allocator);
+    Decl *outer = decl_of(1), *inner = decl_of(1), *again = decl_of(1);
+    Decl *deepest = decl_of(1), *other = decl_of(2), *later = decl_of(1);
+
+    EXPECT(ScopeStack_declare(&scopes, outer) == NULL);
+    ScopeStack_enter(&scopes);
+    EXPECT(ScopeStack_lookup(&scopes, 1) == outer);
+
+    // A name can shadow one from an enclosing scope, but not one from the
+    // same scope.
+    EXPECT(ScopeStack_declare(&scopes, inner) == NULL);
+    EXPECT(ScopeStack_declare(&scopes, again) == inner);
+    EXPECT(ScopeStack_declare(&scopes, other) == NULL);
+    EXPECT(ScopeStack_lookup(&scopes, 1) == inner);
+    EXPECT(inner->depth == 1 && outer->depth == 0);
+
+    ScopeStack_enter(&scopes);
+    EXPECT(ScopeStack_declare(&scopes, deepest) == NULL);
+    EXPECT(ScopeStack_lookup(&scopes, 1) == deepest);
+    EXPECT(ScopeStack_lookup(&scopes, 2) == other);
+
+    // Leaving each scope brings back what it shadowed, and forgets what it
+    // declared.
+    ScopeStack_leave(&scopes);
+    EXPECT(ScopeStack_lookup(&scopes, 1) == inner);
+    ScopeStack_leave(&scopes);
+    EXPECT(ScopeStack_lookup(&scopes, 1) == outer);
+    EXPECT(ScopeStack_lookup(&scopes, 2) == NULL);
+    EXPECT(scopes.undo_length == 1 && scopes.visible.count == 1);
+
+    // The name resolves afresh in a new scope.
+    ScopeStack_enter(&scopes);
+    EXPECT(ScopeStack_declare(&scopes, later) == NULL);
+    EXPECT(ScopeStack_lookup(&scopes, 1) == later);
+    ScopeStack_leave(&scopes);
+    EXPECT(ScopeStack_lookup(&scopes, 1) == outer);
+    ScopeStack_free(&scopes);
+}
+
+enum { NAMES = 1000, THREADS = 8 };
+
+/// What one thread of `test_interning_threads` does.
+typedef struct InternJob {
+    Interner *interner;
+    uptr start;
+    Symbol symbols[NAMES];
+} InternJob;
+
+static int intern_names(void *arg) {
+    InternJob *job = arg;
+    for (uptr n = 0; n < NAMES; n++) {
+        uptr i = (job->start + n) % NAMES;
+        char text[16];
+        int length = snprintf(text, sizeof text, "name%lu", i);
+        job->symbols[i] = Interner_intern(job->interner, text,
+                                          (uptr) length);
+    }
+    return 0;
+}
+
+static void test_interning_threads(void) {
+    // Threads interning the same names in different orders, while the table
+    // grows, all get the same symbol for each name.
+    Interner *interner = Interner_new(fixture_allocator);
+    static InternJob jobs[THREADS];
+    thrd_t threads[THREADS];
+    for (uptr t = 0; t < THREADS; t++) {
+        jobs[t] = (InternJob) {.interner = interner, .start = t * 127};
+        EXPECT(thrd_create(&threads[t], intern_names, &jobs[t])
+               == thrd_success);
+    }
+    for (uptr t = 0; t < THREADS; t++) {
+        thrd_join(threads[t], NULL);
+    }
+
+    EXPECT(interner->count == NAMES + 1);
+    for (uptr i = 0; i < NAMES; i++) {
+        Symbol symbol = jobs[0].symbols[i];
+        for (uptr t = 1; t < THREADS; t++) {
+            EXPECT(jobs[t].symbols[i] == symbol);
+        }
+        char text[16];
+        snprintf(text, sizeof text, "name%lu", i);
+        EXPECT(symbol != 0);
+        EXPECT_STR(Interner_name(interner, symbol), text);
+    }
+    Interner_free(interner);
+}
+
+int main(int argc, char **argv) {
+    fixture_init(argc, argv);
+    test_symbol_map();
+    test_scope_stack();
+    test_interning_threads();
+    return fixture_finish();
+}